@@ -137,12 +137,24 @@
 #define bardiv     bit_array_divide
 
 #define barsave    bit_array_save
+#define barsave2   bit_array_save_v2
 #define barload    bit_array_load
+#define barsaver   bit_array_save_range
+#define barloadr   bit_array_load_range
+#define barsavez   bit_array_save_compressed
+#define barloadz   bit_array_load_compressed
+#define bardelta   bit_array_delta_encode
+#define barpatch   bit_array_delta_apply
+#define barsaved   bit_array_save_dirty
+#define barloadd   bit_array_load_dirty
 
 #define barhash    bit_array_hash
 
 #define barrand    bit_array_random
+#define barrandr   bit_array_random_r
+#define barrandk   bit_array_random_k
 #define barshfl    bit_array_shuffle
+#define barshflr   bit_array_shuffle_r
 #define barperm    bit_array_next_permutation
 
 #endif /* BAR_HEADER_SEEN */
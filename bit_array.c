@@ -11,6 +11,10 @@
 // Array length can be zero
 // Unused top bits must be zero
 
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE // mremap()
+#endif
+
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -19,11 +23,14 @@
 #include <signal.h> // needed for abort()
 #include <string.h> // memset()
 #include <assert.h>
-#include <time.h> // needed for seeding rand()
-#include <unistd.h>  // need for getpid() for seeding rand number
+#include <unistd.h>  // need for getpid() for seeding random
 #include <ctype.h>  // need for tolower()
 #include <errno.h>  // perror()
 #include <sys/time.h> // for seeding random
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <fcntl.h> // open()
+#include <pthread.h> // bit_array_save_fd(), bit_array_load_fd(), crc32c()
 
 // Windows includes
 #if defined(_WIN32)
@@ -198,21 +205,6 @@ static word_t __inline windows_parity(word_t w)
 #define CLEAR_REGION(arr,start,len)  _set_region((arr),(start),(len),ZERO_REGION)
 #define TOGGLE_REGION(arr,start,len) _set_region((arr),(start),(len),SWAP_REGION)
 
-// Have we initialised with srand() ?
-static char rand_initiated = 0;
-
-static void _seed_rand()
-{
-  if(!rand_initiated)
-  {
-    // Initialise random number generator
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    srand((((time.tv_sec ^ getpid()) * 1000001) + time.tv_usec));
-    rand_initiated = 1;
-  }
-}
-
 //
 // Common internal functions
 //
@@ -260,7 +252,8 @@ void validate_bitarr(BIT_ARRAY *arr, const char *file, int lineno)
   bit_index_t top_bits = bits_in_top_word(arr->num_of_bits);
   int err = 0;
 
-  if(arr->words[tw] > bitmask64(top_bits))
+  // An empty view may have no words at all
+  if(arr->capacity_in_words > 0 && arr->words[tw] > bitmask64(top_bits))
   {
     _print_word(arr->words[tw], stderr);
     fprintf(stderr, "\n[%s:%i] Expected %i bits in top word[%i]\n",
@@ -296,12 +289,47 @@ static inline word_t _reverse_word(word_t word)
   return reverse;
 }
 
+// Call before changing words [first, first+nwords), for snapshots
+static inline void _write_words(BIT_ARRAY* bitarr, word_addr_t first,
+                                word_addr_t nwords)
+{
+  if(bitarr->watch) _bit_array_write_words(bitarr, first, nwords);
+}
+
+// Whole array operations pass blocks of this many words to the write hook:
+// a dirty chunk, and a divisor of the snapshot chunk size
+#define WRITE_BLOCK_WORDS (BIT_ARRAY_DIRTY_CHUNK / sizeof(word_t))
+
+// Set word i to w. On watched arrays, the block holding i is passed to the
+// write hook when a word in it first changes, so whole array operations don't
+// copy or mark untouched chunks. Blocks below *hooked have been passed
+// already: start it at 0 and store words in increasing order
+static inline void _store_word(BIT_ARRAY* bitarr, word_addr_t i, word_t w,
+                               word_addr_t *hooked)
+{
+  if(!bitarr->watch) bitarr->words[i] = w;
+  else if(bitarr->words[i] != w) {
+    if(i >= *hooked) {
+      *hooked = (i / WRITE_BLOCK_WORDS + 1) * WRITE_BLOCK_WORDS;
+      _bit_array_write_words(bitarr, *hooked - WRITE_BLOCK_WORDS,
+                             WRITE_BLOCK_WORDS);
+    }
+    bitarr->words[i] = w;
+  }
+}
+
 static inline void _mask_top_word(BIT_ARRAY* bitarr)
 {
   // Mask top word
   word_addr_t num_of_words = MAX(1, bitarr->num_of_words);
   word_offset_t bits_active = bits_in_top_word(bitarr->num_of_bits);
-  bitarr->words[num_of_words-1] &= bitmask64(bits_active);
+  word_t mask = bitmask64(bits_active);
+  // Skip the write hook when there is nothing to clear. An empty view may
+  // have no words at all
+  if(bitarr->capacity_in_words == 0 ||
+     !(bitarr->words[num_of_words-1] & ~mask)) return;
+  _write_words(bitarr, num_of_words-1, 1);
+  bitarr->words[num_of_words-1] &= mask;
 }
 
 //
@@ -334,6 +362,8 @@ static inline void _set_word(BIT_ARRAY* bitarr, bit_index_t start, word_t word)
   word_addr_t word_index = bitset64_wrd(start);
   word_offset_t word_offset = bitset64_idx(start);
 
+  _write_words(bitarr, word_index, word_offset > 0 ? 2 : 1);
+
   if(word_offset == 0)
   {
     bitarr->words[word_index] = word;
@@ -409,10 +439,138 @@ static inline void _set_word_cyclic(BIT_ARRAY* bitarr,
     word_offset_t bits_remaining = MIN(WORD_SIZE - bits_set, start);
     word_t mask = bitmask64(bits_remaining);
 
+    _write_words(bitarr, 0, 1);
     bitarr->words[0] = bitmask_merge(word, bitarr->words[0], mask);
   }
 }
 
+//
+// Streaming fills (internal use only)
+//
+
+// Fills of at least this many bytes use non-temporal stores, so filling a
+// huge array doesn't evict everything else from the cache.
+// STREAM_DETECT means use the size of the last level cache, 0 means never.
+// Accessed atomically: fills may run on several threads
+#define STREAM_DETECT ((size_t)-1)
+static size_t stream_threshold = STREAM_DETECT;
+
+static size_t _detect_llc_size()
+{
+  long size = -1;
+  #if defined(_SC_LEVEL3_CACHE_SIZE)
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if(size <= 0) size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  #endif
+  return size > 0 ? (size_t)size : (size_t)8 << 20;
+}
+
+void bit_array_set_stream_threshold(size_t nbytes)
+{
+  __atomic_store_n(&stream_threshold, nbytes, __ATOMIC_RELAXED);
+}
+
+size_t bit_array_get_stream_threshold()
+{
+  size_t threshold = __atomic_load_n(&stream_threshold, __ATOMIC_RELAXED);
+  if(threshold == STREAM_DETECT) {
+    // Don't overwrite a value set meanwhile. On failure threshold is updated
+    size_t llc = _detect_llc_size();
+    if(__atomic_compare_exchange_n(&stream_threshold, &threshold, llc, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      threshold = llc;
+  }
+  return threshold;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define HAVE_STREAM_STORES
+
+static inline char _use_stream(word_addr_t nwords)
+{
+  size_t threshold = bit_array_get_stream_threshold();
+  return threshold > 0 && nwords * sizeof(word_t) >= threshold;
+}
+
+// Fill words with `fill`, or xor them with it if toggle is set, using
+// MOVNTDQ a cache line at a time, then sfence so the streamed stores are
+// ordered before anything that follows. Toggles load through the cache:
+// non-temporal loads (MOVNTDQA) only bypass it on write-combining memory, and
+// PREFETCHNTA made large toggles slower without keeping other data cached
+static void _stream_words(word_t *words, word_addr_t nwords, word_t fill,
+                          char toggle)
+{
+  word_addr_t i = 0;
+  __m128i v = _mm_set1_epi64x((long long)fill), *p;
+
+  for(; i < nwords && ((size_t)(words+i) & 15); i++)
+    words[i] = toggle ? words[i] ^ fill : fill;
+
+  if(toggle) {
+    for(; i + 8 <= nwords; i += 8) {
+      p = (__m128i*)(words+i);
+      _mm_stream_si128(p,   _mm_xor_si128(_mm_load_si128(p),   v));
+      _mm_stream_si128(p+1, _mm_xor_si128(_mm_load_si128(p+1), v));
+      _mm_stream_si128(p+2, _mm_xor_si128(_mm_load_si128(p+2), v));
+      _mm_stream_si128(p+3, _mm_xor_si128(_mm_load_si128(p+3), v));
+    }
+  }
+  else {
+    for(; i + 8 <= nwords; i += 8) {
+      p = (__m128i*)(words+i);
+      _mm_stream_si128(p,   v);
+      _mm_stream_si128(p+1, v);
+      _mm_stream_si128(p+2, v);
+      _mm_stream_si128(p+3, v);
+    }
+  }
+
+  _mm_sfence();
+
+  for(; i < nwords; i++) words[i] = toggle ? words[i] ^ fill : fill;
+}
+#endif
+
+// Set nwords words to all 0s or all 1s
+static inline void _fill_words(word_t *words, word_addr_t nwords, word_t fill)
+{
+  #ifdef HAVE_STREAM_STORES
+    if(_use_stream(nwords)) { _stream_words(words, nwords, fill, 0); return; }
+  #endif
+  memset(words, fill ? 0xff : 0, nwords * sizeof(word_t));
+}
+
+static inline void _toggle_words(word_t *words, word_addr_t nwords)
+{
+  #ifdef HAVE_STREAM_STORES
+    if(_use_stream(nwords)) { _stream_words(words, nwords, WORD_MAX, 1); return; }
+  #endif
+  word_addr_t i;
+  for(i = 0; i < nwords; i++) words[i] ^= WORD_MAX;
+}
+
+// Set words [first, first+nwords) to fill, see _store_word()
+static inline void _store_words(BIT_ARRAY* bitarr, word_addr_t first,
+                                word_addr_t nwords, word_t fill)
+{
+  word_addr_t i, hooked = 0;
+  if(!bitarr->watch) { _fill_words(bitarr->words + first, nwords, fill); return; }
+  for(i = first; i < first + nwords; i++) _store_word(bitarr, i, fill, &hooked);
+}
+
+// Copy nwords words from src to words [first, first+nwords), see _store_word()
+static inline void _store_copy(BIT_ARRAY* bitarr, word_addr_t first,
+                               const word_t *src, word_addr_t nwords)
+{
+  word_addr_t i, hooked = 0;
+  if(!bitarr->watch) {
+    memmove(bitarr->words + first, src, nwords * sizeof(word_t));
+    return;
+  }
+  for(i = 0; i < nwords; i++) _store_word(bitarr, first + i, src[i], &hooked);
+}
+
 //
 // Fill a region (internal use only)
 //
@@ -430,6 +588,8 @@ static inline void _set_region(BIT_ARRAY* bitarr, bit_index_t start,
   word_offset_t foffset = bitset64_idx(start);
   word_offset_t loffset = bitset64_idx(start+length-1);
 
+  _write_words(bitarr, first_word, last_word - first_word + 1);
+
   if(first_word == last_word)
   {
     word_t mask = bitmask64(length) << foffset;
@@ -451,23 +611,15 @@ static inline void _set_region(BIT_ARRAY* bitarr, bit_index_t start,
       case SWAP_REGION: bitarr->words[first_word] ^= ~bitmask64(foffset); break;
     }
 
-    word_addr_t i;
+    word_t *words = bitarr->words + first_word + 1;
+    word_addr_t nwords = last_word - first_word - 1;
 
     // Set whole words
     switch(action)
     {
-      case ZERO_REGION:
-        for(i = first_word + 1; i < last_word; i++)
-          bitarr->words[i] = (word_t)0;
-        break;
-      case FILL_REGION:
-        for(i = first_word + 1; i < last_word; i++)
-          bitarr->words[i] = WORD_MAX;
-        break;
-      case SWAP_REGION:
-        for(i = first_word + 1; i < last_word; i++)
-          bitarr->words[i] ^= WORD_MAX;
-        break;
+      case ZERO_REGION: _fill_words(words, nwords, 0); break;
+      case FILL_REGION: _fill_words(words, nwords, WORD_MAX); break;
+      case SWAP_REGION: _toggle_words(words, nwords); break;
     }
 
     // Set last word
@@ -483,2665 +635,6323 @@ static inline void _set_region(BIT_ARRAY* bitarr, bit_index_t start,
 
 
 //
-// Constructor
+// Allocators
 //
 
-// If cannot allocate memory, set errno to ENOMEM, return NULL
-BIT_ARRAY* bit_array_alloc(BIT_ARRAY* bitarr, bit_index_t nbits)
+// Default for new arrays, NULL means use malloc/realloc/free
+static const BIT_ARRAY_ALLOCATOR *default_allocator = NULL;
+
+void bit_array_set_allocator(const BIT_ARRAY_ALLOCATOR *allocator)
 {
-  bitarr->num_of_bits = nbits;
-  bitarr->num_of_words = roundup_bits2words64(nbits);
-  bitarr->capacity_in_words = MAX(8, roundup2pow(bitarr->num_of_words));
-  bitarr->words = (word_t*)calloc(bitarr->capacity_in_words, sizeof(word_t));
-  if(bitarr->words == NULL) {
-    errno = ENOMEM;
-    return NULL;
-  }
-  return bitarr;
+  default_allocator = allocator;
 }
 
-void bit_array_dealloc(BIT_ARRAY* bitarr)
+const BIT_ARRAY_ALLOCATOR* bit_array_get_allocator()
 {
-  free(bitarr->words);
-  memset(bitarr, 0, sizeof(BIT_ARRAY));
+  return default_allocator;
 }
 
-// If cannot allocate memory, set errno to ENOMEM, return NULL
-BIT_ARRAY* bit_array_create(bit_index_t nbits)
+static inline void* _ba_malloc(const BIT_ARRAY_ALLOCATOR *a, size_t size)
 {
-  BIT_ARRAY* bitarr = (BIT_ARRAY*)malloc(sizeof(BIT_ARRAY));
-
-  // error if could not allocate enough memory
-  if(bitarr == NULL || bit_array_alloc(bitarr, nbits) == NULL)
-  {
-    if(bitarr != NULL) free(bitarr);
-    errno = ENOMEM;
-    return NULL;
-  }
-
-  DEBUG_PRINT("Creating BIT_ARRAY (bits: %lu; allocated words: %lu; "
-              "using words: %lu; WORD_SIZE: %i)\n",
-              (unsigned long)nbits, (unsigned long)bitarr->capacity_in_words,
-              (unsigned long)roundup_bits2words64(nbits), (int)WORD_SIZE);
-
-  DEBUG_VALIDATE(bitarr);
-
-  return bitarr;
+  return a == NULL ? malloc(size) : a->alloc(size, a->ctx);
 }
 
-//
-// Destructor
-//
-void bit_array_free(BIT_ARRAY* bitarr)
+static inline void* _ba_calloc(const BIT_ARRAY_ALLOCATOR *a, size_t size)
 {
-  if(bitarr->words != NULL)
-    free(bitarr->words);
-
-  free(bitarr);
+  if(a == NULL) return calloc(size, 1);
+  void *ptr = a->alloc(size, a->ctx);
+  if(ptr != NULL) memset(ptr, 0, size);
+  return ptr;
 }
 
-bit_index_t bit_array_length(const BIT_ARRAY* bit_arr)
+static inline void* _ba_realloc(const BIT_ARRAY_ALLOCATOR *a, void *ptr,
+                                size_t old_size, size_t new_size)
 {
-  return bit_arr->num_of_bits;
+  return a == NULL ? realloc(ptr, new_size)
+                   : a->realloc(ptr, old_size, new_size, a->ctx);
 }
 
-// Change the size of a bit array. Enlarging an array will add zeros
-// to the end of it. Returns 1 on success, 0 on failure (e.g. not enough memory)
-char bit_array_resize(BIT_ARRAY* bitarr, bit_index_t new_num_of_bits)
+static inline void _ba_free(const BIT_ARRAY_ALLOCATOR *a, void *ptr, size_t size)
 {
-  word_addr_t old_num_of_words = bitarr->num_of_words;
-  word_addr_t new_num_of_words = roundup_bits2words64(new_num_of_bits);
-
-  bitarr->num_of_bits = new_num_of_bits;
-  bitarr->num_of_words = new_num_of_words;
+  if(a == NULL) free(ptr);
+  else if(ptr != NULL) a->free(ptr, size, a->ctx);
+}
 
-  DEBUG_PRINT("Resize: old_num_of_words: %i; new_num_of_words: %i capacity: %i\n",
-              (int)old_num_of_words, (int)new_num_of_words,
-              (int)bitarr->capacity_in_words);
+// Words from the default allocator are cache line aligned, so they can be
+// read with aligned vector loads. Custom allocators are used as given
+static inline void* _words_malloc(const BIT_ARRAY_ALLOCATOR *a, size_t size)
+{
+  void *ptr;
+  if(a != NULL) return a->alloc(size, a->ctx);
+  return posix_memalign(&ptr, BIT_ARRAY_ALIGN, size) == 0 ? ptr : NULL;
+}
 
-  if(new_num_of_words > bitarr->capacity_in_words)
-  {
-    // Need to change the amount of memory used
-    word_addr_t old_capacity_in_words = bitarr->capacity_in_words;
-    size_t old_capacity_in_bytes = old_capacity_in_words * sizeof(word_t);
+static inline void* _words_calloc(const BIT_ARRAY_ALLOCATOR *a, size_t size)
+{
+  void *ptr = _words_malloc(a, size);
+  if(ptr != NULL) memset(ptr, 0, size);
+  return ptr;
+}
 
-    bitarr->capacity_in_words = roundup2pow(new_num_of_words);
-    bitarr->capacity_in_words = MAX(8, bitarr->capacity_in_words);
+static inline void* _words_realloc(const BIT_ARRAY_ALLOCATOR *a, void *ptr,
+                                   size_t old_size, size_t new_size)
+{
+  void *aligned;
+  if(a != NULL) return a->realloc(ptr, old_size, new_size, a->ctx);
 
-    size_t new_capacity_in_bytes = bitarr->capacity_in_words * sizeof(word_t);
-    bitarr->words = (word_t*)realloc(bitarr->words, new_capacity_in_bytes);
+  // realloc often keeps the alignment (e.g. growing in place), else copy
+  if((ptr = realloc(ptr, new_size)) == NULL) return NULL;
+  if(((size_t)ptr & (BIT_ARRAY_ALIGN-1)) == 0) return ptr;
+  if((aligned = _words_malloc(NULL, new_size)) != NULL)
+    memcpy(aligned, ptr, new_size);
+  free(ptr);
+  return aligned;
+}
 
-    if(bitarr->words == NULL)
-    {
-      // error - could not allocate enough memory
-      perror("resize realloc");
-      errno = ENOMEM;
-      return 0;
-    }
+//
+// Storage
+//
 
-    // Need to zero new memory
-    size_t num_bytes_to_zero = new_capacity_in_bytes - old_capacity_in_bytes;
-    memset(bitarr->words + old_capacity_in_words, 0, num_bytes_to_zero);
+// Words are usually on the heap, but may be in a memory mapped file
+typedef struct
+{
+  uint8_t *base; // start of the mapping (the file header)
+  size_t length; // bytes mapped
+  int mode; // BIT_ARRAY_MMAP_RDONLY, _PRIVATE or _SHARED
+  int fd; // open file for shared mappings, otherwise -1
+} BitArrayMmap;
 
-    DEBUG_PRINT("zeroing from word %i for %i bytes\n", (int)old_capacity_in_words,
-                (int)num_bytes_to_zero);
-  }
-  else if(new_num_of_words < old_num_of_words)
-  {
-    // Shrunk -- need to zero old memory
-    size_t num_bytes_to_zero = (old_num_of_words - new_num_of_words)*sizeof(word_t);
+#define BIT_ARRAY_MMAP_MODES \
+  (BIT_ARRAY_MMAP_RDONLY | BIT_ARRAY_MMAP_PRIVATE | BIT_ARRAY_MMAP_SHARED)
 
-    memset(bitarr->words + new_num_of_words, 0, num_bytes_to_zero);
-  }
+// store of a wrapped buffer holds the flags passed to bit_array_wrap()
+#define _wrap_flags(bitarr) ((int)(size_t)(bitarr)->store)
 
-  // Mask top word
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
-  return 1;
+static inline char _storage_readonly(const BIT_ARRAY* bitarr)
+{
+  return (bitarr->storage == BIT_ARRAY_MMAP &&
+          ((BitArrayMmap*)bitarr->store)->mode == BIT_ARRAY_MMAP_RDONLY) ||
+         (bitarr->storage == BIT_ARRAY_WRAP &&
+          (_wrap_flags(bitarr) & BIT_ARRAY_WRAP_RDONLY)) ||
+         bitarr->storage == BIT_ARRAY_SNAPSHOT;
 }
 
-void bit_array_resize_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+// Views and read only arrays cannot be resized
+static inline char _fixed_size(const BIT_ARRAY* bitarr)
 {
-  bit_index_t old_num_of_bits = bitarr->num_of_bits;
-
-  if(!bit_array_resize(bitarr, num_of_bits))
-  {
-    fprintf(stderr, "Ran out of memory resizing [%lu -> %lu]",
-            (unsigned long)old_num_of_bits, (unsigned long)num_of_bits);
-    abort();
-  }
+  return _storage_readonly(bitarr) || bitarr->storage == BIT_ARRAY_WRAP;
 }
 
-// If bitarr length < num_bits, resizes to num_bits
-char bit_array_ensure_size(BIT_ARRAY* bitarr, bit_index_t ensure_num_of_bits)
+static inline char _storage_shared(const BIT_ARRAY* bitarr)
 {
-  if(bitarr->num_of_bits < ensure_num_of_bits)
-  {
-    return bit_array_resize(bitarr, ensure_num_of_bits);
-  }
-
-  return 1;
+  return bitarr->storage == BIT_ARRAY_MMAP &&
+         ((BitArrayMmap*)bitarr->store)->mode == BIT_ARRAY_MMAP_SHARED;
 }
 
-void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+// Write the number of bits into the file header (little endian)
+static void _mmap_write_header(const BIT_ARRAY* bitarr)
 {
-  if(num_of_bits > bitarr->num_of_bits)
-  {
-    bit_array_resize_critical(bitarr, num_of_bits);
-  }
+  BitArrayMmap *map = (BitArrayMmap*)bitarr->store;
+  int i;
+  for(i = 0; i < 8; i++) map->base[i] = (uint8_t)(bitarr->num_of_bits >> (8*i));
 }
 
-static inline
-void _bit_array_ensure_nwords(BIT_ARRAY* bitarr, word_addr_t nwords,
-                              const char *file, int lineno, const char *func)
-{
-  size_t newmem, oldmem;
-  if(bitarr->capacity_in_words < nwords) {
-    oldmem = bitarr->capacity_in_words * sizeof(word_t);
-    bitarr->capacity_in_words = roundup2pow(nwords);
-    newmem = bitarr->capacity_in_words * sizeof(word_t);
-    bitarr->words = (word_t*)realloc(bitarr->words, newmem);
+//
+// Anonymous mapped storage (huge pages and lazy zeroing)
+//
 
-    if(bitarr->words == NULL) {
-      fprintf(stderr, "[%s:%i:%s()] Ran out of memory resizing [%zu -> %zu]",
-              file, lineno, func, oldmem, newmem);
-      abort();
-    }
+// Arrays with at least this many bytes of capacity are put in anonymous
+// mappings advised to use huge pages, 0 means never
+static size_t hugepage_threshold = 0;
 
-    DEBUG_PRINT("Ensure nwords realloc %zu -> %zu\n", oldmem, newmem);
-  }
-}
+// Arrays with at least this many bytes of capacity are put in anonymous
+// mappings so new memory is zeroed by the kernel when first touched,
+// 0 means never
+static size_t lazy_zero_threshold = BIT_ARRAY_LAZY_ZERO_DEFAULT;
 
+#define HUGE_PAGE_SIZE ((size_t)1 << 21)
 
-//
-// Get, set, clear, assign and toggle individual bits
-//
+// Don't hand back fewer bytes than this to the kernel when zeroing
+#define LAZY_ZERO_MIN_BYTES ((size_t)1 << 20)
 
-// Get the value of a bit (returns 0 or 1)
-char bit_array_get_bit(const BIT_ARRAY* bitarr, bit_index_t b)
+void bit_array_set_hugepage_threshold(size_t nbytes)
 {
-  assert(b < bitarr->num_of_bits);
-  return bit_array_get(bitarr, b);
+  hugepage_threshold = nbytes;
 }
 
-// set a bit (to 1) at position b
-void bit_array_set_bit(BIT_ARRAY* bitarr, bit_index_t b)
+size_t bit_array_get_hugepage_threshold()
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_set(bitarr,b);
-  DEBUG_VALIDATE(bitarr);
+  return hugepage_threshold;
 }
 
-// clear a bit (to 0) at position b
-void bit_array_clear_bit(BIT_ARRAY* bitarr, bit_index_t b)
+void bit_array_set_lazy_zero_threshold(size_t nbytes)
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_clear(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  lazy_zero_threshold = nbytes;
 }
 
-// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
-void bit_array_toggle_bit(BIT_ARRAY* bitarr, bit_index_t b)
+size_t bit_array_get_lazy_zero_threshold()
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_toggle(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  return lazy_zero_threshold;
 }
 
-// If char c != 0, set bit; otherwise clear bit
-void bit_array_assign_bit(BIT_ARRAY* bitarr, bit_index_t b, char c)
+static inline char _above_threshold(size_t nbytes, size_t threshold)
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_assign(bitarr, b, c ? 1 : 0);
-  DEBUG_VALIDATE(bitarr);
+  return threshold > 0 && nbytes >= threshold;
 }
 
-//
-// Get, set etc with resize
-//
-
-// Get the value of a bit (returns 0 or 1)
-char bit_array_rget(BIT_ARRAY* bitarr, bit_index_t b)
+static inline char _use_anon(const BIT_ARRAY* bitarr, word_addr_t capacity)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  return bit_array_get(bitarr, b);
+  size_t nbytes = capacity * sizeof(word_t);
+  return bitarr->allocator == NULL &&
+         (_above_threshold(nbytes, hugepage_threshold) ||
+          _above_threshold(nbytes, lazy_zero_threshold));
 }
 
-// set a bit (to 1) at position b
-void bit_array_rset(BIT_ARRAY* bitarr, bit_index_t b)
+static void _anon_advise(void *ptr, size_t nbytes)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_set(bitarr,b);
-  DEBUG_VALIDATE(bitarr);
+  #ifdef MADV_HUGEPAGE
+    if(_above_threshold(nbytes, hugepage_threshold))
+      madvise(ptr, nbytes, MADV_HUGEPAGE);
+  #else
+    (void)ptr; (void)nbytes;
+  #endif
 }
 
-// clear a bit (to 0) at position b
-void bit_array_rclear(BIT_ARRAY* bitarr, bit_index_t b)
+// Map zeroed memory for at least *nbytes, rounded up to whole huge pages and
+// aligned to a huge page. Sets *nbytes to the length mapped
+static word_t* _anon_map(size_t *nbytes)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_clear(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  size_t len = (*nbytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  uint8_t *ptr, *start;
+
+  // Over allocate then trim to get an aligned start
+  ptr = (uint8_t*)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(ptr == (uint8_t*)MAP_FAILED) return NULL;
+
+  start = (uint8_t*)(((size_t)ptr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  if(start > ptr) munmap(ptr, start - ptr);
+  munmap(start + len, ptr + HUGE_PAGE_SIZE - start);
+
+  _anon_advise(start, len);
+  *nbytes = len;
+  return (word_t*)start;
 }
 
-// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
-void bit_array_rtoggle(BIT_ARRAY* bitarr, bit_index_t b)
+// Grow an anonymous mapping. The kernel supplies zeroed pages, no memset.
+// If it can't grow in place, its pages are moved (not copied) to a new huge
+// page aligned range
+static char _anon_grow(BIT_ARRAY* bitarr, word_addr_t new_capacity)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_toggle(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  size_t old_len = bitarr->capacity_in_words * sizeof(word_t);
+  size_t new_len = new_capacity * sizeof(word_t);
+  void *ptr;
+
+  new_len = (new_len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+  #ifdef MREMAP_MAYMOVE
+    ptr = mremap(bitarr->words, old_len, new_len, 0);
+    #ifdef MREMAP_FIXED
+      if(ptr == MAP_FAILED) {
+        // Reserve an aligned range and move the pages over it
+        size_t len = new_len;
+        void *dst = _anon_map(&len);
+        if(dst == NULL) return 0;
+        ptr = mremap(bitarr->words, old_len, new_len,
+                     MREMAP_MAYMOVE | MREMAP_FIXED, dst);
+        if(ptr == MAP_FAILED) { munmap(dst, len); return 0; }
+      }
+    #else
+      if(ptr == MAP_FAILED)
+        ptr = mremap(bitarr->words, old_len, new_len, MREMAP_MAYMOVE);
+    #endif
+    if(ptr == MAP_FAILED) return 0;
+    _anon_advise(ptr, new_len);
+  #else
+    if((ptr = _anon_map(&new_len)) == NULL) return 0;
+    memcpy(ptr, bitarr->words, old_len);
+    munmap(bitarr->words, old_len);
+  #endif
+
+  bitarr->words = (word_t*)ptr;
+  bitarr->capacity_in_words = new_len / sizeof(word_t);
+  return 1;
 }
 
-// If char c != 0, set bit; otherwise clear bit
-void bit_array_rassign(BIT_ARRAY* bitarr, bit_index_t b, char c)
+// Zero words [first, first+nwords). Whole pages of anonymous mappings are
+// given back to the kernel, which supplies zero pages when next touched
+static void _zero_words(BIT_ARRAY* bitarr, word_addr_t first, word_addr_t nwords)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_assign(bitarr, b, c ? 1 : 0);
-  DEBUG_VALIDATE(bitarr);
+  uint8_t *start = (uint8_t*)(bitarr->words + first);
+  uint8_t *end = start + nwords * sizeof(word_t), *pstart, *pend;
+  size_t page;
+
+  if(bitarr->watch) { _store_words(bitarr, first, nwords, 0); return; }
+
+  if(bitarr->storage == BIT_ARRAY_ANON &&
+     nwords * sizeof(word_t) >= LAZY_ZERO_MIN_BYTES)
+  {
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    pstart = (uint8_t*)(((size_t)start + page - 1) & ~(page - 1));
+    pend = (uint8_t*)((size_t)end & ~(page - 1));
+
+    if(madvise(pstart, pend - pstart, MADV_DONTNEED) == 0) {
+      memset(start, 0, pstart - start);
+      memset(pend, 0, end - pend);
+      return;
+    }
+  }
+
+  _fill_words(bitarr->words + first, nwords, 0);
 }
 
 //
-// Get, set, clear and toggle several bits at once
+// Copy-on-write storage (snapshots)
 //
 
-// Get the offsets of the set bits (for offsets start<=offset<end)
-// Returns the number of bits set
-// It is assumed that dst is at least of length (end-start)
-bit_index_t bit_array_get_bits(const BIT_ARRAY* bitarr,
-                               bit_index_t start, bit_index_t end,
-                               bit_index_t* dst)
+// An array with snapshots keeps its words in a memfd, mapped shared. Each
+// snapshot maps the same file private, so it sees the file until it writes to
+// a page. Before the array changes a chunk still shared with a snapshot, the
+// snapshot writes a byte of each page of the chunk, and the kernel gives it a
+// private copy. Readers never see a gap, and the snapshot's mapping is not
+// split into one VMA per copied chunk.
+#if defined(MFD_CLOEXEC)
+  #define HAVE_SNAPSHOTS
+#endif
+
+#define COW_CHUNK_BYTES  ((size_t)BIT_ARRAY_SNAPSHOT_CHUNK)
+#define COW_CHUNK_WORDS  (COW_CHUNK_BYTES / sizeof(word_t))
+
+// Bits of BIT_ARRAY.watch
+#define WATCH_COW    1
+#define WATCH_DIRTY  2
+#define WATCH_RDONLY 4 // a BIT_ARRAY_WRAP_RDONLY view or a snapshot
+
+typedef struct BitArraySnap BitArraySnap;
+
+// Shared by an array and its snapshots. Freed with the last of them
+typedef struct
+{
+  int fd; // -1 once the array is freed
+  size_t length; // bytes in the file, all mapped by the array
+  BitArraySnap *snaps;
+  uint32_t *refs; // number of snapshots sharing each chunk
+  size_t nrefs; // length of refs
+  size_t nshared; // chunks with refs > 0
+  const BIT_ARRAY_ALLOCATOR *allocator;
+  pthread_mutex_t lock;
+} BitArrayCow;
+
+// store of a snapshot
+struct BitArraySnap
+{
+  BitArrayCow *cow;
+  uint8_t *base;
+  size_t nchunks; // mapped
+  uint8_t *shared; // 1 if the chunk is still the array's
+  BitArraySnap *next;
+};
+
+static inline size_t _cow_length(word_addr_t nwords)
 {
-  bit_index_t i, n = 0;
-  assert(end <= bitarr->num_of_bits);
-  for(i = start; i < end; i++) {
-    if(bit_array_get(bitarr, i)) {
-      dst[n++] = i;
-    }
-  }
-  return n;
+  size_t n = MAX(1, nwords) * sizeof(word_t);
+  return (n + COW_CHUNK_BYTES - 1) & ~(COW_CHUNK_BYTES - 1);
 }
 
-// Set multiple bits at once.
-// e.g. set bits 1, 20 & 31: bit_array_set_bits(bitarr, 3, 1,20,31);
-void bit_array_set_bits(BIT_ARRAY* bitarr, size_t n, ...)
+static void _cow_destroy(BitArrayCow *cow)
 {
-  size_t i;
-  va_list argptr;
-  va_start(argptr, n);
-
-  for(i = 0; i < n; i++)
-  {
-    unsigned int bit_index = va_arg(argptr, unsigned int);
-    bit_array_set_bit(bitarr, bit_index);
-  }
+  pthread_mutex_destroy(&cow->lock);
+  _ba_free(cow->allocator, cow->refs, cow->nrefs * sizeof(uint32_t));
+  _ba_free(cow->allocator, cow, sizeof(BitArrayCow));
+}
 
-  va_end(argptr);
-  DEBUG_VALIDATE(bitarr);
+// Give snapshot `snap` its own copy of chunk c, which still matches the file.
+// Rewriting a byte of each page through the private mapping makes the kernel
+// copy the page; the value is unchanged for readers on other threads
+static void _cow_copy_chunk(BitArraySnap *snap, size_t c)
+{
+  volatile uint8_t *ptr = snap->base + c * COW_CHUNK_BYTES;
+  size_t i, page = (size_t)sysconf(_SC_PAGESIZE);
+  for(i = 0; i < COW_CHUNK_BYTES; i += page) ptr[i] = ptr[i];
 }
 
-// Clear multiple bits at once.
-// e.g. clear bits 1, 20 & 31: bit_array_clear_bits(bitarr, 3, 1,20,31);
-void bit_array_clear_bits(BIT_ARRAY* bitarr, size_t n, ...)
+// Words [first, first+nwords) of bitarr are about to change.
+// refs only fall on other threads, so a zero read without the lock is final
+static void _cow_write(BIT_ARRAY* bitarr, word_addr_t first, word_addr_t nwords)
 {
-  size_t i;
-  va_list argptr;
-  va_start(argptr, n);
+  BitArrayCow *cow = (BitArrayCow*)bitarr->store;
+  BitArraySnap *snap;
+  size_t c, end;
 
-  for(i = 0; i < n; i++)
+  if(nwords == 0 || __atomic_load_n(&cow->nshared, __ATOMIC_ACQUIRE) == 0)
+    return;
+
+  c = first / COW_CHUNK_WORDS;
+  end = MIN(cow->nrefs, (first + nwords - 1) / COW_CHUNK_WORDS + 1);
+
+  for(; c < end; c++)
   {
-    unsigned int bit_index = va_arg(argptr, unsigned int);
-    bit_array_clear_bit(bitarr, bit_index);
-  }
+    if(__atomic_load_n(&cow->refs[c], __ATOMIC_ACQUIRE) == 0) continue;
 
-  va_end(argptr);
-  DEBUG_VALIDATE(bitarr);
+    pthread_mutex_lock(&cow->lock);
+    if(cow->refs[c] > 0)
+    {
+      for(snap = cow->snaps; snap != NULL; snap = snap->next) {
+        if(c < snap->nchunks && snap->shared[c]) {
+          _cow_copy_chunk(snap, c);
+          snap->shared[c] = 0;
+        }
+      }
+      __atomic_store_n(&cow->refs[c], 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&cow->nshared, cow->nshared - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cow->lock);
+  }
 }
 
-// Toggle multiple bits at once
-// e.g. toggle bits 1, 20 & 31: bit_array_toggle_bits(bitarr, 3, 1,20,31);
-void bit_array_toggle_bits(BIT_ARRAY* bitarr, size_t n, ...)
+static void _release_words(BIT_ARRAY* bitarr);
+static char _dirty_reserve(BIT_ARRAY* bitarr, word_addr_t capacity);
+
+// Move the words of bitarr into a new memfd
+static char _cow_start(BIT_ARRAY* bitarr)
 {
-  size_t i;
-  va_list argptr;
-  va_start(argptr, n);
+  #ifdef HAVE_SNAPSHOTS
+    size_t length = _cow_length(bitarr->capacity_in_words);
+    BitArrayCow *cow;
+    word_t *words;
+    int fd;
 
-  for(i = 0; i < n; i++)
-  {
-    unsigned int bit_index = va_arg(argptr, unsigned int);
-    bit_array_toggle_bit(bitarr, bit_index);
-  }
+    if(!_dirty_reserve(bitarr, length / sizeof(word_t))) return 0;
+    if((fd = memfd_create("bit_array", MFD_CLOEXEC)) < 0) return 0;
 
-  va_end(argptr);
-  DEBUG_VALIDATE(bitarr);
-}
+    if(ftruncate(fd, (off_t)length) != 0 ||
+       (words = (word_t*)mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED,
+                              fd, 0)) == (word_t*)MAP_FAILED) {
+      close(fd);
+      return 0;
+    }
 
+    cow = (BitArrayCow*)_ba_calloc(bitarr->allocator, sizeof(BitArrayCow));
+    if(cow == NULL) {
+      munmap(words, length);
+      close(fd);
+      errno = ENOMEM;
+      return 0;
+    }
 
-//
-// Set, clear and toggle all bits in a region
-//
+    cow->fd = fd;
+    cow->length = length;
+    cow->allocator = bitarr->allocator;
+    pthread_mutex_init(&cow->lock, NULL);
+
+    // Words past num_of_words are zero, as is the new file
+    memcpy(words, bitarr->words, bitarr->num_of_words * sizeof(word_t));
+    _release_words(bitarr);
+    bitarr->words = words;
+    bitarr->capacity_in_words = length / sizeof(word_t);
+    bitarr->storage = BIT_ARRAY_COW;
+    bitarr->store = cow;
+    bitarr->watch |= WATCH_COW;
+    return 1;
+  #else
+    (void)bitarr;
+    errno = ENOTSUP;
+    return 0;
+  #endif
+}
 
-// Set all the bits in a region
-void bit_array_set_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+// Grow the file. New pages read as zero and snapshots keep their mappings
+static char _cow_grow(BIT_ARRAY* bitarr, word_addr_t new_capacity)
 {
-  assert(start + len <= bitarr->num_of_bits);
-  SET_REGION(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
-}
+  BitArrayCow *cow = (BitArrayCow*)bitarr->store;
+  size_t length = _cow_length(new_capacity);
+  void *ptr;
 
+  if(ftruncate(cow->fd, (off_t)length) != 0) return 0;
 
-// Clear all the bits in a region
-void bit_array_clear_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
-{
-  assert(start + len <= bitarr->num_of_bits);
-  CLEAR_REGION(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
+  #ifdef MREMAP_MAYMOVE
+    ptr = mremap(bitarr->words, cow->length, length, MREMAP_MAYMOVE);
+  #else
+    ptr = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, cow->fd, 0);
+    if(ptr != MAP_FAILED) munmap(bitarr->words, cow->length);
+  #endif
+
+  if(ptr == MAP_FAILED) return 0;
+
+  cow->length = length;
+  bitarr->words = (word_t*)ptr;
+  bitarr->capacity_in_words = length / sizeof(word_t);
+  return 1;
 }
 
-// Toggle all the bits in a region
-void bit_array_toggle_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+// Free the words of the array, snapshots keep the file open
+static void _cow_release(BIT_ARRAY* bitarr)
 {
-  assert(start + len <= bitarr->num_of_bits);
-  TOGGLE_REGION(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
-}
+  BitArrayCow *cow = (BitArrayCow*)bitarr->store;
+  char last;
 
+  munmap(bitarr->words, cow->length);
 
-//
-// Set, clear and toggle all bits at once
-//
+  pthread_mutex_lock(&cow->lock);
+  close(cow->fd);
+  cow->fd = -1;
+  last = (cow->snaps == NULL);
+  pthread_mutex_unlock(&cow->lock);
 
-// set all elements of data to one
-void bit_array_set_all(BIT_ARRAY* bitarr)
-{
-  bit_index_t num_of_bytes = bitarr->num_of_words * sizeof(word_t);
-  memset(bitarr->words, 0xFF, num_of_bytes);
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
+  if(last) _cow_destroy(cow);
 }
 
-// set all elements of data to zero
-void bit_array_clear_all(BIT_ARRAY* bitarr)
+static void _snapshot_release(BIT_ARRAY* bitarr)
 {
-  memset(bitarr->words, 0, bitarr->num_of_words * sizeof(word_t));
-  DEBUG_VALIDATE(bitarr);
-}
+  BitArraySnap *snap = (BitArraySnap*)bitarr->store, **ptr;
+  BitArrayCow *cow = snap->cow;
+  size_t c;
+  char last;
 
-// Set all 1 bits to 0, and all 0 bits to 1. AKA flip
-void bit_array_toggle_all(BIT_ARRAY* bitarr)
-{
-  word_addr_t i;
-  for(i = 0; i < bitarr->num_of_words; i++)
-  {
-    bitarr->words[i] ^= WORD_MAX;
+  munmap(snap->base, snap->nchunks * COW_CHUNK_BYTES);
+
+  pthread_mutex_lock(&cow->lock);
+  for(c = 0; c < snap->nchunks; c++) {
+    if(snap->shared[c] && __atomic_sub_fetch(&cow->refs[c], 1, __ATOMIC_RELEASE) == 0)
+      __atomic_store_n(&cow->nshared, cow->nshared - 1, __ATOMIC_RELEASE);
   }
+  for(ptr = &cow->snaps; *ptr != snap; ptr = &(*ptr)->next) {}
+  *ptr = snap->next;
+  last = (cow->fd < 0 && cow->snaps == NULL);
+  pthread_mutex_unlock(&cow->lock);
 
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
+  _ba_free(cow->allocator, snap->shared, snap->nchunks);
+  _ba_free(cow->allocator, snap, sizeof(BitArraySnap));
+  if(last) _cow_destroy(cow);
 }
 
 //
-// Get a word at a time
+// Dirty chunk tracking
 //
 
-uint64_t bit_array_get_word64(const BIT_ARRAY* bitarr, bit_index_t start)
+#define DIRTY_CHUNK_WORDS (BIT_ARRAY_DIRTY_CHUNK / sizeof(word_t))
+
+// Grow the bitmap to cover capacity words. Called whenever the capacity of
+// the array grows, so writes never resize it
+static char _dirty_reserve(BIT_ARRAY* bitarr, word_addr_t capacity)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint64_t)_get_word(bitarr, start);
+  return bitarr->dirty == NULL ||
+         bit_array_ensure_size(bitarr->dirty,
+                               (capacity + DIRTY_CHUNK_WORDS - 1) /
+                               DIRTY_CHUNK_WORDS);
 }
 
-uint32_t bit_array_get_word32(const BIT_ARRAY* bitarr, bit_index_t start)
+// Mark the chunks holding words [first, first+nwords). Bits are set
+// atomically, so threads may change different words at once
+static void _dirty_write(BIT_ARRAY* bitarr, word_addr_t first, word_addr_t nwords)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint32_t)_get_word(bitarr, start);
+  BIT_ARRAY *dirty = bitarr->dirty;
+  bit_index_t c, last;
+  word_addr_t w;
+  word_t mask;
+
+  if(nwords == 0) return;
+
+  c = first / DIRTY_CHUNK_WORDS;
+  last = (first + nwords - 1) / DIRTY_CHUNK_WORDS;
+  assert(last < dirty->num_of_bits);
+
+  for(w = bitset64_wrd(c); w <= bitset64_wrd(last); w++)
+  {
+    mask = WORD_MAX;
+    if(w == bitset64_wrd(c)) mask &= WORD_MAX << bitset64_idx(c);
+    if(w == bitset64_wrd(last)) mask &= WORD_MAX >> (63 - bitset64_idx(last));
+    if((dirty->words[w] & mask) != mask)
+      __atomic_fetch_or(&dirty->words[w], mask, __ATOMIC_RELAXED);
+  }
 }
 
-uint16_t bit_array_get_word16(const BIT_ARRAY* bitarr, bit_index_t start)
+void _bit_array_write_words(BIT_ARRAY* bitarr, word_addr_t first,
+                            word_addr_t nwords)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint16_t)_get_word(bitarr, start);
+  if(bitarr->watch & WATCH_RDONLY) {
+    fprintf(stderr, "Cannot modify a read only array [words %lu-%lu]\n",
+            (unsigned long)first, (unsigned long)(first + nwords - 1));
+    abort();
+  }
+  if(bitarr->watch & WATCH_COW) _cow_write(bitarr, first, nwords);
+  if(bitarr->watch & WATCH_DIRTY) _dirty_write(bitarr, first, nwords);
 }
 
-uint8_t bit_array_get_word8(const BIT_ARRAY* bitarr, bit_index_t start)
+static void _untrack_dirty(BIT_ARRAY* bitarr)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint8_t)_get_word(bitarr, start);
+  if(bitarr->dirty != NULL) bit_array_free(bitarr->dirty);
+  bitarr->dirty = NULL;
+  bitarr->watch &= ~WATCH_DIRTY;
 }
 
-uint64_t bit_array_get_wordn(const BIT_ARRAY* bitarr, bit_index_t start, int n)
+static void _release_words(BIT_ARRAY* bitarr)
 {
-  assert(start < bitarr->num_of_bits);
-  assert(n <= 64);
-  return (uint64_t)(_get_word(bitarr, start) & bitmask64(n));
-}
+  BitArrayMmap *map;
 
-//
-// Set a word at a time
-//
-// Doesn't extend bit array. However it is safe to TRY to set bits beyond the
-// end of the array, as long as: `start` is < `bit_array_length(arr)`
-//
+  switch(bitarr->storage)
+  {
+    case BIT_ARRAY_MMAP:
+      map = (BitArrayMmap*)bitarr->store;
+      if(map->mode == BIT_ARRAY_MMAP_SHARED) {
+        // Leave the file in bit_array_save format, without spare capacity
+        _mmap_write_header(bitarr);
+        munmap(map->base, map->length);
+        if(ftruncate(map->fd, 8 + roundup_bits2bytes(bitarr->num_of_bits)) != 0)
+          perror("bit_array_free ftruncate");
+        close(map->fd);
+      }
+      else munmap(map->base, map->length);
+      _ba_free(bitarr->allocator, map, sizeof(BitArrayMmap));
+      break;
+    case BIT_ARRAY_ANON:
+      munmap(bitarr->words, bitarr->capacity_in_words * sizeof(word_t));
+      break;
+    case BIT_ARRAY_INLINE:
+      break; // freed with the struct
+    case BIT_ARRAY_WRAP:
+      break; // owned by the caller
+    case BIT_ARRAY_COW:
+      _cow_release(bitarr);
+      break;
+    case BIT_ARRAY_SNAPSHOT:
+      _snapshot_release(bitarr);
+      break;
+    default:
+      _ba_free(bitarr->allocator, bitarr->words,
+               bitarr->capacity_in_words * sizeof(word_t));
+  }
 
-void bit_array_set_word64(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word)
-{
-  assert(start < bitarr->num_of_bits);
-  _set_word(bitarr, start, (word_t)word);
+  bitarr->words = NULL;
+  bitarr->store = NULL;
+  bitarr->storage = BIT_ARRAY_HEAP;
+  bitarr->watch &= ~WATCH_COW;
 }
 
-void bit_array_set_word32(BIT_ARRAY* bitarr, bit_index_t start, uint32_t word)
+// Grow or shrink a shared mapping by resizing the file. New pages read as zero.
+static char _mmap_set_capacity(BIT_ARRAY* bitarr, word_addr_t new_capacity)
 {
-  assert(start < bitarr->num_of_bits);
-  word_t w = _get_word(bitarr, start);
-  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffff00000000UL));
-}
+  BitArrayMmap *map = (BitArrayMmap*)bitarr->store;
+  size_t new_length = 8 + new_capacity * sizeof(word_t);
+  void *base;
 
-void bit_array_set_word16(BIT_ARRAY* bitarr, bit_index_t start, uint16_t word)
-{
-  assert(start < bitarr->num_of_bits);
-  word_t w = _get_word(bitarr, start);
-  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffffffff0000UL));
-}
+  if(ftruncate(map->fd, (off_t)new_length) != 0) return 0;
 
-void bit_array_set_word8(BIT_ARRAY* bitarr, bit_index_t start, uint8_t byte)
-{
-  assert(start < bitarr->num_of_bits);
-  _set_byte(bitarr, start, byte);
-}
+  #ifdef MREMAP_MAYMOVE
+    base = mremap(map->base, map->length, new_length, MREMAP_MAYMOVE);
+  #else
+    base = mmap(NULL, new_length, PROT_READ|PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if(base != MAP_FAILED) munmap(map->base, map->length);
+  #endif
 
-void bit_array_set_wordn(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word, int n)
-{
-  assert(start < bitarr->num_of_bits);
-  assert(n <= 64);
-  word_t w = _get_word(bitarr, start), m = bitmask64(n);
-  _set_word(bitarr, start, bitmask_merge(word,w,m));
-}
+  if(base == MAP_FAILED) return 0;
 
-//
-// Number of bits set
-//
+  map->base = (uint8_t*)base;
+  map->length = new_length;
+  bitarr->words = (word_t*)(map->base + 8);
+  bitarr->capacity_in_words = new_capacity;
+  return 1;
+}
 
-// Get the number of bits set (hamming weight)
-bit_index_t bit_array_num_bits_set(const BIT_ARRAY* bitarr)
+// Increase capacity to at least new_capacity words, zeroing the new words.
+// Private mappings and inline words are moved onto the heap, or into an
+// anonymous mapping if above a threshold. Returns 1 on success, 0 on failure
+static char _grow_words(BIT_ARRAY* bitarr, word_addr_t new_capacity)
 {
-  word_addr_t i;
-
-  bit_index_t num_of_bits_set = 0;
+  word_addr_t old_capacity = bitarr->capacity_in_words;
+  size_t nbytes = new_capacity * sizeof(word_t);
+  word_t *words;
 
-  for(i = 0; i < bitarr->num_of_words; i++)
+  if(_storage_shared(bitarr))
+    return _mmap_set_capacity(bitarr, new_capacity);
+  else if(bitarr->storage == BIT_ARRAY_ANON)
+    return _anon_grow(bitarr, new_capacity);
+  else if(bitarr->storage == BIT_ARRAY_COW)
+    return _cow_grow(bitarr, new_capacity);
+  else if(bitarr->storage == BIT_ARRAY_WRAP)
+    return 0;
+  else if(_use_anon(bitarr, new_capacity))
+  {
+    if((words = _anon_map(&nbytes)) == NULL) return 0;
+    memcpy(words, bitarr->words, old_capacity * sizeof(word_t));
+    _release_words(bitarr);
+    bitarr->storage = BIT_ARRAY_ANON;
+    bitarr->words = words;
+    bitarr->capacity_in_words = nbytes / sizeof(word_t);
+    return 1;
+  }
+  else if(bitarr->storage == BIT_ARRAY_HEAP)
   {
-    if(bitarr->words[i] > 0)
-    {
-      num_of_bits_set += POPCOUNT(bitarr->words[i]);
-    }
+    words = (word_t*)_words_realloc(bitarr->allocator, bitarr->words,
+                                    old_capacity * sizeof(word_t), nbytes);
+    if(words == NULL) return 0;
+  }
+  else
+  {
+    words = (word_t*)_words_malloc(bitarr->allocator, nbytes);
+    if(words == NULL) return 0;
+    memcpy(words, bitarr->words, old_capacity * sizeof(word_t));
+    _release_words(bitarr);
   }
 
-  return num_of_bits_set;
+  // Need to zero new memory
+  memset(words + old_capacity, 0, (new_capacity-old_capacity) * sizeof(word_t));
+
+  DEBUG_PRINT("zeroing from word %i for %i words\n", (int)old_capacity,
+              (int)(new_capacity-old_capacity));
+
+  bitarr->words = words;
+  bitarr->capacity_in_words = new_capacity;
+  return 1;
 }
 
-// Get the number of bits not set (1 - hamming weight)
-bit_index_t bit_array_num_bits_cleared(const BIT_ARRAY* bitarr)
+// As _grow_words(), also growing the dirty chunk bitmap
+static char _grow_capacity(BIT_ARRAY* bitarr, word_addr_t new_capacity)
 {
-  return bitarr->num_of_bits - bit_array_num_bits_set(bitarr);
+  return _grow_words(bitarr, new_capacity) &&
+         _dirty_reserve(bitarr, bitarr->capacity_in_words);
 }
 
-
-// Get the number of bits set in on array and not the other.  This is equivalent
-// to hamming weight of the XOR when the two arrays are the same length.
-// e.g. 10101 vs 00111 => hamming distance 2 (XOR is 10010)
-bit_index_t bit_array_hamming_distance(const BIT_ARRAY* arr1,
-                                       const BIT_ARRAY* arr2)
+// Reduce capacity to new_capacity words (at least num_of_words). Arrays in
+// anonymous mappings move back onto the heap when below the huge page
+// threshold. Private file mappings and inline words are left as they are.
+// Returns 1 on success, 0 on failure
+static char _shrink_capacity(BIT_ARRAY* bitarr, word_addr_t new_capacity)
 {
-  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
-  word_addr_t max_words = MAX(arr1->num_of_words, arr2->num_of_words);
-
-  bit_index_t hamming_distance = 0;
-  word_addr_t i;
-
-  for(i = 0; i < min_words; i++)
-  {
-    hamming_distance += POPCOUNT(arr1->words[i] ^ arr2->words[i]);
-  }
+  size_t old_bytes = bitarr->capacity_in_words * sizeof(word_t);
+  size_t nbytes = new_capacity * sizeof(word_t);
+  word_t *words;
 
-  if(min_words != max_words)
+  if(_storage_shared(bitarr))
+    return _mmap_set_capacity(bitarr, new_capacity);
+  else if(bitarr->storage == BIT_ARRAY_ANON)
   {
-    const BIT_ARRAY* long_arr
-      = (arr1->num_of_words > arr2->num_of_words ? arr1 : arr2);
-
-    for(i = min_words; i < max_words; i++)
+    if(_use_anon(bitarr, new_capacity))
     {
-      hamming_distance += POPCOUNT(long_arr->words[i]);
+      nbytes = (nbytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+      if(nbytes < old_bytes) {
+        // Shrinking in place never moves the mapping. Without mremap, unmap
+        // the tail: nbytes is a multiple of the huge page size
+        #ifdef MREMAP_MAYMOVE
+          if(mremap(bitarr->words, old_bytes, nbytes, 0) == MAP_FAILED)
+            return 0;
+        #else
+          if(munmap((uint8_t*)bitarr->words + nbytes, old_bytes - nbytes) != 0)
+            return 0;
+        #endif
+        bitarr->capacity_in_words = nbytes / sizeof(word_t);
+      }
+      return 1;
     }
+    if((words = (word_t*)_words_malloc(NULL, nbytes)) == NULL) return 0;
+    memcpy(words, bitarr->words, nbytes);
+    _release_words(bitarr);
+  }
+  else if(bitarr->storage == BIT_ARRAY_HEAP)
+  {
+    words = (word_t*)_words_realloc(bitarr->allocator, bitarr->words,
+                                    old_bytes, nbytes);
+    if(words == NULL) return 0;
   }
+  else return 1;
 
-  return hamming_distance;
+  bitarr->words = words;
+  bitarr->capacity_in_words = new_capacity;
+  return 1;
 }
 
-// Parity - returns 1 if odd number of bits set, 0 if even
-char bit_array_parity(const BIT_ARRAY* bitarr)
+// Capacity to grow to when nwords words are needed
+static word_addr_t _next_capacity(const BIT_ARRAY* bitarr, word_addr_t nwords)
 {
-  word_addr_t w;
-  unsigned int parity = 0;
+  word_addr_t cap = bitarr->capacity_in_words;
 
-  for(w = 0; w < bitarr->num_of_words; w++)
+  switch(bitarr->growth)
   {
-    parity ^= PARITY(bitarr->words[w]);
+    case BIT_ARRAY_GROW_EXACT:
+      return nwords;
+    case BIT_ARRAY_GROW_1_5X:
+      return MAX(MAX(8, nwords), cap + cap / 2);
+    default:
+      return MAX(8, roundup2pow(nwords));
   }
-
-  return (char)parity;
 }
 
 //
-// Find indices of set/clear bits
+// Constructor
 //
 
-// Find the index of the next bit that is set/clear, at or after `offset`
-// Returns 1 if such a bit is found, otherwise 0
-// Index is stored in the integer pointed to by `result`
-// If no such bit is found, value at `result` is not changed
-#define _next_bit_func_def(FUNC,GET) \
-char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
-{ \
-  assert(offset < bitarr->num_of_bits); \
-  if(bitarr->num_of_bits == 0 || offset >= bitarr->num_of_bits) { return 0; } \
- \
-  /* Find first word that is greater than zero */ \
-  word_addr_t i = bitset64_wrd(offset); \
-  word_t w = GET(bitarr->words[i]) & ~bitmask64(bitset64_idx(offset)); \
- \
-  while(1) { \
-    if(w > 0) { \
-      bit_index_t pos = i * WORD_SIZE + trailing_zeros(w); \
-      if(pos < bitarr->num_of_bits) { *result = pos; return 1; } \
-      else { return 0; } \
-    } \
-    i++; \
-    if(i >= bitarr->num_of_words) break; \
-    w = GET(bitarr->words[i]); \
-  } \
- \
-  return 0; \
-}
+// If cannot allocate memory, set errno to ENOMEM, return NULL
+BIT_ARRAY* bit_array_alloc_with(BIT_ARRAY* bitarr, bit_index_t nbits,
+                                const BIT_ARRAY_ALLOCATOR *allocator)
+{
+  bitarr->num_of_bits = nbits;
+  bitarr->num_of_words = roundup_bits2words64(nbits);
+  bitarr->capacity_in_words = MAX(8, roundup2pow(bitarr->num_of_words));
+  bitarr->storage = BIT_ARRAY_HEAP;
+  bitarr->store = NULL;
+  bitarr->allocator = allocator;
+  bitarr->growth = BIT_ARRAY_GROW_POW2;
+  bitarr->inline_bytes = 0;
+  bitarr->watch = 0;
+  bitarr->dirty = NULL;
+
+  if(_use_anon(bitarr, bitarr->capacity_in_words))
+  {
+    size_t nbytes = bitarr->capacity_in_words * sizeof(word_t);
+    if((bitarr->words = _anon_map(&nbytes)) != NULL) {
+      bitarr->storage = BIT_ARRAY_ANON;
+      bitarr->capacity_in_words = nbytes / sizeof(word_t);
+    }
+  }
+  else
+    bitarr->words = (word_t*)_words_calloc(allocator,
+                                           bitarr->capacity_in_words * sizeof(word_t));
 
-// Find the index of the previous bit that is set/clear, before `offset`.
-// Returns 1 if such a bit is found, otherwise 0
-// Index is stored in the integer pointed to by `result`
-// If no such bit is found, value at `result` is not changed
-#define _prev_bit_func_def(FUNC,GET) \
-char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
-{ \
-  assert(offset <= bitarr->num_of_bits); \
-  if(bitarr->num_of_bits == 0 || offset == 0) { return 0; } \
- \
-  /* Find prev word that is greater than zero */ \
-  word_addr_t i = bitset64_wrd(offset-1); \
-  word_t w = GET(bitarr->words[i]) & bitmask64(bitset64_idx(offset-1)+1); \
- \
-  if(w > 0) { *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; return 1; } \
- \
-  /* i is unsigned so have to use break when i == 0 */ \
-  for(--i; i != BIT_INDEX_MAX; i--) { \
-    w = GET(bitarr->words[i]); \
-    if(w > 0) { \
-      *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; \
-      return 1; \
-    } \
-  } \
- \
-  return 0; \
+  if(bitarr->words == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return bitarr;
 }
 
-#define GET_WORD(x) (x)
-#define NEG_WORD(x) (~(x))
-_next_bit_func_def(bit_array_find_next_set_bit,  GET_WORD);
-_next_bit_func_def(bit_array_find_next_clear_bit,NEG_WORD);
-_prev_bit_func_def(bit_array_find_prev_set_bit,  GET_WORD);
-_prev_bit_func_def(bit_array_find_prev_clear_bit,NEG_WORD);
-
-// Find the index of the first bit that is set.
-// Returns 1 if a bit is set, otherwise 0
-// Index of first set bit is stored in the integer pointed to by result
-// If no bits are set, value at `result` is not changed
-char bit_array_find_first_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+BIT_ARRAY* bit_array_alloc(BIT_ARRAY* bitarr, bit_index_t nbits)
 {
-  return bit_array_find_next_set_bit(bitarr, 0, result);
+  return bit_array_alloc_with(bitarr, nbits, default_allocator);
 }
 
-// same same
-char bit_array_find_first_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+void bit_array_dealloc(BIT_ARRAY* bitarr)
 {
-  return bit_array_find_next_clear_bit(bitarr, 0, result);
+  _untrack_dirty(bitarr);
+  _release_words(bitarr);
+  memset(bitarr, 0, sizeof(BIT_ARRAY));
 }
 
-// Find the index of the last bit that is set.
-// Returns 1 if a bit is set, otherwise 0
-// Index of last set bit is stored in the integer pointed to by `result`
-// If no bits are set, value at `result` is not changed
-char bit_array_find_last_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+// If cannot allocate memory, set errno to ENOMEM, return NULL
+BIT_ARRAY* bit_array_create_with(bit_index_t nbits,
+                                 const BIT_ARRAY_ALLOCATOR *allocator)
 {
-  return bit_array_find_prev_set_bit(bitarr, bitarr->num_of_bits, result);
+  BIT_ARRAY* bitarr = (BIT_ARRAY*)_ba_malloc(allocator, sizeof(BIT_ARRAY));
+
+  // error if could not allocate enough memory
+  if(bitarr == NULL || bit_array_alloc_with(bitarr, nbits, allocator) == NULL)
+  {
+    _ba_free(allocator, bitarr, sizeof(BIT_ARRAY));
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  DEBUG_PRINT("Creating BIT_ARRAY (bits: %lu; allocated words: %lu; "
+              "using words: %lu; WORD_SIZE: %i)\n",
+              (unsigned long)nbits, (unsigned long)bitarr->capacity_in_words,
+              (unsigned long)roundup_bits2words64(nbits), (int)WORD_SIZE);
+
+  DEBUG_VALIDATE(bitarr);
+
+  return bitarr;
 }
 
-// same same
-char bit_array_find_last_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+BIT_ARRAY* bit_array_create(bit_index_t nbits)
 {
-  return bit_array_find_prev_clear_bit(bitarr, bitarr->num_of_bits, result);
+  return bit_array_create_with(nbits, default_allocator);
 }
 
-//
-// "Sorting" bits
-//
-
-// Put all the 0s before all the 1s
-void bit_array_sort_bits(BIT_ARRAY* bitarr)
+// Struct and words in one allocation. Words move to the heap if it grows
+BIT_ARRAY* bit_array_create_compact(bit_index_t nbits)
 {
-  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
-  bit_index_t num_of_bits_cleared = bitarr->num_of_bits - num_of_bits_set;
-  bit_array_set_all(bitarr);
-  CLEAR_REGION(bitarr, 0, num_of_bits_cleared);
+  word_addr_t nwords = roundup_bits2words64(nbits);
+  // Always have at least one word, for _mask_top_word()
+  size_t inline_bytes = MAX(1, nwords) * sizeof(word_t);
+  BIT_ARRAY* bitarr = (BIT_ARRAY*)_ba_malloc(default_allocator,
+                                             sizeof(BIT_ARRAY) + inline_bytes);
+
+  if(bitarr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  bitarr->words = (word_t*)(bitarr + 1);
+  bitarr->num_of_bits = nbits;
+  bitarr->num_of_words = nwords;
+  bitarr->capacity_in_words = inline_bytes / sizeof(word_t);
+  bitarr->storage = BIT_ARRAY_INLINE;
+  bitarr->store = NULL;
+  bitarr->allocator = default_allocator;
+  bitarr->growth = BIT_ARRAY_GROW_POW2;
+  bitarr->inline_bytes = inline_bytes;
+  bitarr->watch = 0;
+  bitarr->dirty = NULL;
+  memset(bitarr->words, 0, inline_bytes);
+
   DEBUG_VALIDATE(bitarr);
+  return bitarr;
 }
 
-// Put all the 1s before all the 0s
-void bit_array_sort_bits_rev(BIT_ARRAY* bitarr)
+// Words in the small buffer if they fit, otherwise on the heap
+BIT_ARRAY* bit_array_alloc_small(BIT_ARRAY_SMALL* sarr, bit_index_t nbits)
 {
-  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
-  bit_array_clear_all(bitarr);
-  SET_REGION(bitarr, 0, num_of_bits_set);
+  BIT_ARRAY* bitarr = &sarr->arr;
+  word_addr_t nwords = roundup_bits2words64(nbits);
+
+  if(nwords > BIT_ARRAY_SMALL_WORDS)
+    return bit_array_alloc_with(bitarr, nbits, default_allocator);
+
+  bitarr->words = sarr->buf;
+  bitarr->num_of_bits = nbits;
+  bitarr->num_of_words = nwords;
+  bitarr->capacity_in_words = BIT_ARRAY_SMALL_WORDS;
+  bitarr->storage = BIT_ARRAY_INLINE;
+  bitarr->store = NULL;
+  bitarr->allocator = default_allocator;
+  bitarr->growth = BIT_ARRAY_GROW_POW2;
+  bitarr->inline_bytes = 0;
+  bitarr->watch = 0;
+  bitarr->dirty = NULL;
+  memset(sarr->buf, 0, sizeof(sarr->buf));
+
   DEBUG_VALIDATE(bitarr);
+  return bitarr;
 }
 
-
 //
-// Strings and printing
+// Destructor
 //
-
-// Construct a BIT_ARRAY from a substring with given on and off characters.
-void bit_array_from_substr(BIT_ARRAY* bitarr, bit_index_t offset,
-                           const char *str, size_t len,
-                           const char *on, const char *off,
-                           char left_to_right)
+void bit_array_free(BIT_ARRAY* bitarr)
 {
-  bit_array_ensure_size(bitarr, offset + len);
-  bit_array_clear_region(bitarr, offset, len);
-
-  // BitArray region is now all 0s -- just set the 1s
-  size_t i;
-  bit_index_t j;
+  const BIT_ARRAY_ALLOCATOR *allocator = bitarr->allocator;
 
-  for(i = 0; i < len; i++)
-  {
-    if(strchr(on, str[i]) != NULL)
-    {
-      j = offset + (left_to_right ? i : len - i - 1);
-      bit_array_set(bitarr, j);
-    }
-    else { assert(strchr(off, str[i]) != NULL); }
+  // We didn't allocate the struct of a view
+  if(bitarr->storage == BIT_ARRAY_WRAP) {
+    errno = EPERM;
+    return;
   }
 
-  DEBUG_VALIDATE(bitarr);
+  size_t size = sizeof(BIT_ARRAY) + bitarr->inline_bytes;
+  _untrack_dirty(bitarr);
+  _release_words(bitarr);
+  _ba_free(allocator, bitarr, size);
 }
 
-// From string method
-void bit_array_from_str(BIT_ARRAY* bitarr, const char* str)
-{
-  bit_array_from_substr(bitarr, 0, str, strlen(str), "1", "0", 1);
-}
+//
+// Pools of same sized arrays
+//
 
-// Takes a char array to write to.  `str` must be bitarr->num_of_bits+1 in length
-// Terminates string with '\0'
-char* bit_array_to_str(const BIT_ARRAY* bitarr, char* str)
+struct BIT_ARRAY_POOL
 {
-  bit_index_t i;
+  bit_index_t nbits;
+  size_t slot_size, per_slab;
+  uint8_t **slabs;
+  size_t nslabs, slabs_cap;
+  size_t nused; // slots handed out at least once, in slab order
+  BIT_ARRAY *free_list; // linked through BIT_ARRAY.store
+  const BIT_ARRAY_ALLOCATOR *allocator;
+};
 
-  for(i = 0; i < bitarr->num_of_bits; i++)
-  {
-    str[i] = bit_array_get(bitarr, i) ? '1' : '0';
-  }
+#define _pool_slot(pool,i) \
+  ((BIT_ARRAY*)((pool)->slabs[(i)/(pool)->per_slab] + \
+                ((i)%(pool)->per_slab)*(pool)->slot_size))
 
-  str[bitarr->num_of_bits] = '\0';
+BIT_ARRAY_POOL* bit_array_pool_create(bit_index_t nbits, size_t per_slab)
+{
+  const BIT_ARRAY_ALLOCATOR *allocator = default_allocator;
+  BIT_ARRAY_POOL *pool;
 
-  return str;
+  pool = (BIT_ARRAY_POOL*)_ba_calloc(allocator, sizeof(BIT_ARRAY_POOL));
+  if(pool == NULL) { errno = ENOMEM; return NULL; }
+
+  // Always room for one word, for _mask_top_word()
+  pool->nbits = nbits;
+  pool->slot_size = sizeof(BIT_ARRAY) +
+                    MAX(1, roundup_bits2words64(nbits)) * sizeof(word_t);
+  pool->per_slab = MAX(1, per_slab);
+  pool->allocator = allocator;
+  return pool;
 }
 
-char* bit_array_to_str_rev(const BIT_ARRAY* bitarr, char* str)
+static char _pool_add_slab(BIT_ARRAY_POOL* pool)
 {
-  bit_index_t i;
+  const BIT_ARRAY_ALLOCATOR *a = pool->allocator;
+  uint8_t *slab, **slabs;
+  size_t cap;
 
-  for(i = 0; i < bitarr->num_of_bits; i++)
+  if(pool->nslabs == pool->slabs_cap)
   {
-    str[i] = bit_array_get(bitarr, bitarr->num_of_bits-i-1) ? '1' : '0';
+    cap = MAX(8, pool->slabs_cap * 2);
+    slabs = pool->slabs == NULL
+            ? (uint8_t**)_ba_malloc(a, cap * sizeof(uint8_t*))
+            : (uint8_t**)_ba_realloc(a, pool->slabs,
+                                     pool->slabs_cap * sizeof(uint8_t*),
+                                     cap * sizeof(uint8_t*));
+    if(slabs == NULL) return 0;
+    pool->slabs = slabs;
+    pool->slabs_cap = cap;
   }
 
-  str[bitarr->num_of_bits] = '\0';
-
-  return str;
+  slab = (uint8_t*)_ba_malloc(a, pool->per_slab * pool->slot_size);
+  if(slab == NULL) return 0;
+  pool->slabs[pool->nslabs++] = slab;
+  return 1;
 }
 
-
-// Get a string representations for a given region, using given on/off characters.
-// Note: does not null-terminate
-void bit_array_to_substr(const BIT_ARRAY* bitarr,
-                         bit_index_t start, bit_index_t length,
-                         char* str, char on, char off,
-                         char left_to_right)
+BIT_ARRAY* bit_array_pool_get(BIT_ARRAY_POOL* pool)
 {
-  assert(start + length <= bitarr->num_of_bits);
-
-  bit_index_t i, j;
-  bit_index_t end = start + length - 1;
+  BIT_ARRAY *bitarr;
 
-  for(i = 0; i < length; i++)
+  if(pool->free_list != NULL)
   {
-    j = (left_to_right ? start + i : end - i);
-    str[i] = bit_array_get(bitarr, j) ? on : off;
+    bitarr = pool->free_list;
+    pool->free_list = (BIT_ARRAY*)bitarr->store;
   }
+  else
+  {
+    if(pool->nused == pool->nslabs * pool->per_slab && !_pool_add_slab(pool)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    bitarr = _pool_slot(pool, pool->nused);
+    pool->nused++;
+  }
+
+  bitarr->words = (word_t*)(bitarr + 1);
+  bitarr->num_of_bits = pool->nbits;
+  bitarr->num_of_words = roundup_bits2words64(pool->nbits);
+  bitarr->capacity_in_words = (pool->slot_size - sizeof(BIT_ARRAY)) / sizeof(word_t);
+  bitarr->storage = BIT_ARRAY_INLINE;
+  bitarr->store = NULL;
+  bitarr->allocator = pool->allocator;
+  bitarr->growth = BIT_ARRAY_GROW_POW2;
+  bitarr->inline_bytes = 0;
+  bitarr->watch = 0;
+  bitarr->dirty = NULL;
+  memset(bitarr->words, 0, bitarr->capacity_in_words * sizeof(word_t));
 
-//  str[length] = '\0';
+  DEBUG_VALIDATE(bitarr);
+  return bitarr;
 }
 
-// Print this array to a file stream.  Prints '0's and '1'.  Doesn't print newline.
-void bit_array_print(const BIT_ARRAY* bitarr, FILE* fout)
+void bit_array_pool_put(BIT_ARRAY_POOL* pool, BIT_ARRAY* bitarr)
 {
-  bit_index_t i;
+  // Free words that outgrew the slot
+  _untrack_dirty(bitarr);
+  if(bitarr->storage != BIT_ARRAY_INLINE) _release_words(bitarr);
+  bitarr->storage = BIT_ARRAY_INLINE;
+  bitarr->store = pool->free_list;
+  pool->free_list = bitarr;
+}
 
-  for(i = 0; i < bitarr->num_of_bits; i++)
-  {
-    fprintf(fout, "%c", bit_array_get(bitarr, i) ? '1' : '0');
+void bit_array_pool_reset(BIT_ARRAY_POOL* pool)
+{
+  BIT_ARRAY *bitarr;
+  size_t i;
+
+  // Free slots are marked inline, only arrays in use may own memory
+  for(i = 0; i < pool->nused; i++) {
+    bitarr = _pool_slot(pool, i);
+    _untrack_dirty(bitarr);
+    if(bitarr->storage != BIT_ARRAY_INLINE) _release_words(bitarr);
   }
+
+  pool->nused = 0;
+  pool->free_list = NULL;
 }
 
-// Print a string representations for a given region, using given on/off characters.
-void bit_array_print_substr(const BIT_ARRAY* bitarr,
-                            bit_index_t start, bit_index_t length,
-                            FILE* fout, char on, char off,
-                            char left_to_right)
+void bit_array_pool_free(BIT_ARRAY_POOL* pool)
 {
-  assert(start + length <= bitarr->num_of_bits);
-
-  bit_index_t i, j;
-  bit_index_t end = start + length - 1;
+  const BIT_ARRAY_ALLOCATOR *a = pool->allocator;
+  size_t i;
 
-  for(i = 0; i < length; i++)
-  {
-    j = (left_to_right ? start + i : end - i);
-    fprintf(fout, "%c", bit_array_get(bitarr, j) ? on : off);
-  }
+  bit_array_pool_reset(pool);
+  for(i = 0; i < pool->nslabs; i++)
+    _ba_free(a, pool->slabs[i], pool->per_slab * pool->slot_size);
+  _ba_free(a, pool->slabs, pool->slabs_cap * sizeof(uint8_t*));
+  _ba_free(a, pool, sizeof(BIT_ARRAY_POOL));
 }
 
 //
-// Decimal
+// Views of external buffers
 //
 
-// Get bit array as decimal str (e.g. 0b1101 -> "13")
-// len is the length of str char array -- will write at most len-1 chars
-// returns the number of characters needed
-// return is the same as strlen(str)
-size_t bit_array_to_decimal(const BIT_ARRAY *bitarr, char *str, size_t len)
+BIT_ARRAY* bit_array_wrap(BIT_ARRAY* bitarr, word_t *buf, bit_index_t nbits,
+                          int flags)
 {
-  size_t i = 0;
+  word_addr_t nwords = roundup_bits2words64(nbits);
 
-  if(bit_array_cmp_uint64(bitarr, 0) == 0)
-  {
-    if(len >= 2)
-    {
-      *str = '0';
-      *(str+1) = '\0';
-    }
+  if(buf == NULL || (flags & ~BIT_ARRAY_WRAP_RDONLY)) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-    return 1;
+  // Bits past the end must be zero. We can't fix a read only buffer
+  if((flags & BIT_ARRAY_WRAP_RDONLY) && nwords > 0 &&
+     (buf[nwords-1] & ~bitmask64(bits_in_top_word(nbits)))) {
+    errno = EINVAL;
+    return NULL;
   }
 
-  BIT_ARRAY *tmp = bit_array_clone(bitarr);
-  uint64_t rem;
+  // With nbits == 0 the view has no words, buf is not touched
+  bitarr->words = buf;
+  bitarr->num_of_bits = nbits;
+  bitarr->num_of_words = nwords;
+  bitarr->capacity_in_words = nwords;
+  bitarr->storage = BIT_ARRAY_WRAP;
+  bitarr->store = (void*)(size_t)flags;
+  bitarr->allocator = default_allocator;
+  bitarr->growth = BIT_ARRAY_GROW_POW2;
+  bitarr->inline_bytes = 0;
+  // Writes to a read only view are caught by the write hook
+  bitarr->watch = (flags & BIT_ARRAY_WRAP_RDONLY) ? WATCH_RDONLY : 0;
+  bitarr->dirty = NULL;
 
-  str[len-1] = '\0';
+  _mask_top_word(bitarr);
 
-  while(bit_array_cmp_uint64(tmp, 0) != 0)
-  {
-    bit_array_div_uint64(tmp, 10, &rem);
+  DEBUG_VALIDATE(bitarr);
+  return bitarr;
+}
 
-    if(i < len-1)
-    {
-      str[len-2-i] = '0' + rem;
-    }
+//
+// Copy-on-write snapshots
+//
 
-    i++;
-  }
+char bit_array_prepare_snapshots(BIT_ARRAY* bitarr)
+{
+  if(bitarr->storage == BIT_ARRAY_COW) return 1;
 
-  if(i < len-1)
-  {
-    // Moves null-terminator as well
-    memmove(str, str+len-i-1, i+1);
+  if(bitarr->storage == BIT_ARRAY_MMAP || bitarr->storage == BIT_ARRAY_WRAP ||
+     bitarr->storage == BIT_ARRAY_SNAPSHOT) {
+    errno = ENOTSUP;
+    return 0;
   }
 
-  bit_array_free(tmp);
-
-  return i;
+  return _cow_start(bitarr);
 }
 
-// Get bit array from decimal str (e.g. "13" -> 0b1101)
-// Returns number of characters used
-size_t bit_array_from_decimal(BIT_ARRAY *bitarr, const char* decimal)
+BIT_ARRAY* bit_array_snapshot(BIT_ARRAY* bitarr)
 {
-  bit_array_clear_all(bitarr);
-  size_t i = 0;
+  const BIT_ARRAY_ALLOCATOR *a = bitarr->allocator;
+  BIT_ARRAY *snaparr = NULL;
+  BitArraySnap *snap = NULL;
+  BitArrayCow *cow;
+  uint32_t *refs;
+  size_t c, nchunks = _cow_length(bitarr->num_of_words) / COW_CHUNK_BYTES;
+  void *base;
 
-  if(decimal[0] == '\0' || decimal[0] < '0' || decimal[0] > '9')
-  {
-    return 0;
-  }
+  if(!bit_array_prepare_snapshots(bitarr)) return NULL;
+  cow = (BitArrayCow*)bitarr->store;
 
-  bit_array_add_uint64(bitarr, decimal[i] - '0');
-  i++;
+  // Writable so that _cow_copy_chunk() can fault in private pages
+  base = mmap(NULL, nchunks * COW_CHUNK_BYTES, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE, cow->fd, 0);
+  if(base == MAP_FAILED) return NULL;
 
-  while(decimal[i] != '\0' && decimal[i] >= '0' && decimal[i] <= '9')
-  {
-    bit_array_mul_uint64(bitarr, 10);
-    bit_array_add_uint64(bitarr, decimal[i] - '0');
-    i++;
-  }
+  if((snaparr = (BIT_ARRAY*)_ba_malloc(a, sizeof(BIT_ARRAY))) == NULL ||
+     (snap = (BitArraySnap*)_ba_malloc(a, sizeof(BitArraySnap))) == NULL ||
+     (snap->shared = (uint8_t*)_ba_malloc(a, nchunks)) == NULL) goto nomem;
 
-  return i;
+  pthread_mutex_lock(&cow->lock);
+  if(nchunks > cow->nrefs)
+  {
+    refs = cow->refs == NULL
+           ? (uint32_t*)_ba_malloc(a, nchunks * sizeof(uint32_t))
+           : (uint32_t*)_ba_realloc(a, cow->refs, cow->nrefs * sizeof(uint32_t),
+                                    nchunks * sizeof(uint32_t));
+    if(refs == NULL) {
+      pthread_mutex_unlock(&cow->lock);
+      goto nomem;
+    }
+    memset(refs + cow->nrefs, 0, (nchunks - cow->nrefs) * sizeof(uint32_t));
+    cow->refs = refs;
+    cow->nrefs = nchunks;
+  }
+  for(c = 0; c < nchunks; c++) {
+    if(cow->refs[c]++ == 0) cow->nshared++;
+    snap->shared[c] = 1;
+  }
+  snap->cow = cow;
+  snap->base = (uint8_t*)base;
+  snap->nchunks = nchunks;
+  snap->next = cow->snaps;
+  cow->snaps = snap;
+  pthread_mutex_unlock(&cow->lock);
+
+  snaparr->words = (word_t*)base;
+  snaparr->num_of_bits = bitarr->num_of_bits;
+  snaparr->num_of_words = bitarr->num_of_words;
+  snaparr->capacity_in_words = nchunks * COW_CHUNK_WORDS;
+  snaparr->storage = BIT_ARRAY_SNAPSHOT;
+  snaparr->store = snap;
+  snaparr->allocator = a;
+  snaparr->growth = bitarr->growth;
+  snaparr->inline_bytes = 0;
+  snaparr->watch = WATCH_RDONLY; // writes abort
+  snaparr->dirty = NULL;
+
+  DEBUG_VALIDATE(snaparr);
+  return snaparr;
+
+  nomem:
+  // snap->shared is always assigned once snap is allocated
+  if(snap != NULL) {
+    _ba_free(a, snap->shared, nchunks);
+    _ba_free(a, snap, sizeof(BitArraySnap));
+  }
+  _ba_free(a, snaparr, sizeof(BIT_ARRAY));
+  munmap(base, nchunks * COW_CHUNK_BYTES);
+  errno = ENOMEM;
+  return NULL;
 }
 
-//
-// Hexidecimal
-//
+bit_index_t bit_array_length(const BIT_ARRAY* bit_arr)
+{
+  return bit_arr->num_of_bits;
+}
 
-char bit_array_hex_to_nibble(char c, uint8_t *b)
+// Change the size of a bit array. Enlarging an array will add zeros
+// to the end of it. Returns 1 on success, 0 on failure (e.g. not enough memory)
+char bit_array_resize(BIT_ARRAY* bitarr, bit_index_t new_num_of_bits)
 {
-  c = tolower(c);
+  word_addr_t old_num_of_words = bitarr->num_of_words;
+  word_addr_t new_num_of_words = roundup_bits2words64(new_num_of_bits);
 
-  if(c >= '0' && c <= '9')
+  DEBUG_PRINT("Resize: old_num_of_words: %i; new_num_of_words: %i capacity: %i\n",
+              (int)old_num_of_words, (int)new_num_of_words,
+              (int)bitarr->capacity_in_words);
+
+  if(new_num_of_bits == bitarr->num_of_bits) return 1;
+
+  if(_fixed_size(bitarr))
   {
-    *b = c - '0';
-    return 1;
+    errno = EPERM;
+    return 0;
   }
-  else if(c >= 'a' && c <= 'f')
+
+  if(new_num_of_words > bitarr->capacity_in_words)
   {
-    *b = 0xa + (c - 'a');
-    return 1;
+    // Need to change the amount of memory used
+    if(!_grow_capacity(bitarr, _next_capacity(bitarr, new_num_of_words)))
+    {
+      // error - could not allocate enough memory
+      perror("resize realloc");
+      errno = ENOMEM;
+      return 0;
+    }
   }
-  else
+  else if(new_num_of_words < old_num_of_words)
   {
-    return 0;
+    // Shrunk -- need to zero old memory
+    _zero_words(bitarr, new_num_of_words, old_num_of_words - new_num_of_words);
   }
+
+  bitarr->num_of_bits = new_num_of_bits;
+  bitarr->num_of_words = new_num_of_words;
+
+  // Mask top word
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
 }
 
-char bit_array_nibble_to_hex(uint8_t b, char uppercase)
+// Ensure capacity for at least nbits without changing the length
+char bit_array_reserve(BIT_ARRAY* bitarr, bit_index_t nbits)
 {
-  if(b <= 9)
+  word_addr_t nwords = roundup_bits2words64(nbits);
+
+  if(nwords <= bitarr->capacity_in_words) return 1;
+
+  if(_fixed_size(bitarr))
   {
-    return '0' + b;
+    errno = EPERM;
+    return 0;
   }
-  else
+
+  if(!_grow_capacity(bitarr, nwords))
   {
-    return (uppercase ? 'A' : 'a') + (b - 0xa);
+    errno = ENOMEM;
+    return 0;
   }
+
+  return 1;
 }
 
-// Loads array from hex string
-// Returns the number of bits loaded (will be chars rounded up to multiple of 4)
-// (0 on failure)
-bit_index_t bit_array_from_hex(BIT_ARRAY* bitarr, bit_index_t offset,
-                               const char* str, size_t len)
+// Release capacity beyond the words in use (keeps at least one word)
+char bit_array_shrink_to_fit(BIT_ARRAY* bitarr)
 {
-  if(str[0] == '0' && tolower(str[1]) == 'x')
-  {
-    str += 2;
-    len -= 2;
-  }
+  word_addr_t nwords = MAX(1, bitarr->num_of_words);
 
-  size_t i;
-  for(i = 0; i < len; i++, offset += 4)
-  {
-    uint8_t b;
-    if(bit_array_hex_to_nibble(str[i], &b))
-    {
-      bit_array_ensure_size(bitarr, offset + 4);
-      _set_nibble(bitarr, offset, b);
-    }
-    else
-    {
-      break;
-    }
-  }
+  if(nwords >= bitarr->capacity_in_words || _storage_readonly(bitarr)) return 1;
 
-  return 4 * i;
+  return _shrink_capacity(bitarr, nwords);
 }
 
-// Returns number of characters written
-size_t bit_array_to_hex(const BIT_ARRAY* bitarr,
-                        bit_index_t start, bit_index_t length,
-                        char* str, char uppercase)
+void bit_array_set_growth(BIT_ARRAY* bitarr, int policy)
 {
-  assert(start + length <= bitarr->num_of_bits);
+  assert(policy == BIT_ARRAY_GROW_POW2 || policy == BIT_ARRAY_GROW_1_5X ||
+         policy == BIT_ARRAY_GROW_EXACT);
+  bitarr->growth = policy;
+}
 
-  size_t k = 0;
-  bit_index_t offset, end = start + length;
+void bit_array_resize_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+{
+  bit_index_t old_num_of_bits = bitarr->num_of_bits;
 
-  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
+  if(!bit_array_resize(bitarr, num_of_bits))
   {
-    word_t w = _get_word(bitarr, offset);
-
-    word_offset_t j;
-    for(j = 0; j < 64; j += 4)
-    {
-      str[k++] = bit_array_nibble_to_hex((w>>j) & 0xf, uppercase);
-    }
+    if(errno == EPERM)
+      fprintf(stderr, "Cannot resize a view or read only array [%lu -> %lu]\n",
+              (unsigned long)old_num_of_bits, (unsigned long)num_of_bits);
+    else
+      fprintf(stderr, "Ran out of memory resizing [%lu -> %lu]",
+              (unsigned long)old_num_of_bits, (unsigned long)num_of_bits);
+    abort();
   }
+}
 
-  if(offset < end)
+// If bitarr length < num_bits, resizes to num_bits
+char bit_array_ensure_size(BIT_ARRAY* bitarr, bit_index_t ensure_num_of_bits)
+{
+  if(bitarr->num_of_bits < ensure_num_of_bits)
   {
-    // Remaining full nibbles (4 bits)
-    word_t w = _get_word(bitarr, offset);
-
-    for(; offset + 4 <= end; offset += 4)
-    {
-      str[k++] = bit_array_nibble_to_hex(w & 0xf, uppercase);
-      w >>= 4;
-    }
-
-    if(offset < end)
-    {
-      // Remaining bits
-      str[k++] = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
-    }
+    return bit_array_resize(bitarr, ensure_num_of_bits);
   }
 
-  str[k] = '\0';
-
-  // Return number of characters written
-  return k;
+  return 1;
 }
 
-// Print bit array as hex
-size_t bit_array_print_hex(const BIT_ARRAY* bitarr,
-                           bit_index_t start, bit_index_t length,
-                           FILE* fout, char uppercase)
+void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
 {
-  assert(start + length <= bitarr->num_of_bits);
+  if(num_of_bits > bitarr->num_of_bits)
+  {
+    bit_array_resize_critical(bitarr, num_of_bits);
+  }
+}
 
-  size_t k = 0;
-  bit_index_t offset, end = start + length;
+// Resize an array that a function with a return value loads into. Views and
+// read only arrays cannot be resized: returns 0 with errno set to EPERM. Aborts
+// if out of memory. Functions without a return value use
+// bit_array_resize_critical(), which aborts for views too
+static char _resize_result(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+{
+  if(num_of_bits == bitarr->num_of_bits) return 1;
 
-  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
+  if(_fixed_size(bitarr))
   {
-    word_t w = _get_word(bitarr, offset);
-
-    word_offset_t j;
-    for(j = 0; j < 64; j += 4)
-    {
-      fprintf(fout, "%c", bit_array_nibble_to_hex((w>>j) & 0xf, uppercase));
-      k++;
-    }
+    errno = EPERM;
+    return 0;
   }
 
-  if(offset < end)
-  {
-    // Remaining full nibbles (4 bits)
-    word_t w = _get_word(bitarr, offset);
+  bit_array_resize_critical(bitarr, num_of_bits);
+  return 1;
+}
 
-    for(; offset + 4 <= end; offset += 4)
-    {
-      fprintf(fout, "%c", bit_array_nibble_to_hex(w & 0xf, uppercase));
-      w >>= 4;
-      k++;
-    }
+static inline
+void _bit_array_ensure_nwords(BIT_ARRAY* bitarr, word_addr_t nwords,
+                              const char *file, int lineno, const char *func)
+{
+  size_t newmem, oldmem;
+  if(bitarr->capacity_in_words < nwords) {
+    oldmem = bitarr->capacity_in_words * sizeof(word_t);
+    newmem = _next_capacity(bitarr, nwords) * sizeof(word_t);
 
-    if(offset < end)
-    {
-      // Remaining bits
-      char hex = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
-      fprintf(fout, "%c", hex);
-      k++;
+    if(_fixed_size(bitarr)) {
+      fprintf(stderr, "[%s:%i:%s()] Cannot resize a view or read only array "
+                      "[%zu -> %zu]\n", file, lineno, func, oldmem, newmem);
+      abort();
+    }
+    if(!_grow_capacity(bitarr, _next_capacity(bitarr, nwords))) {
+      fprintf(stderr, "[%s:%i:%s()] Ran out of memory resizing [%zu -> %zu]",
+              file, lineno, func, oldmem, newmem);
+      abort();
     }
-  }
 
-  return k;
+    DEBUG_PRINT("Ensure nwords realloc %zu -> %zu\n", oldmem, newmem);
+  }
 }
 
+
 //
-// Clone and copy
+// Get, set, clear, assign and toggle individual bits
 //
 
-// Returns NULL if cannot malloc
-BIT_ARRAY* bit_array_clone(const BIT_ARRAY* bitarr)
+// Get the value of a bit (returns 0 or 1)
+char bit_array_get_bit(const BIT_ARRAY* bitarr, bit_index_t b)
 {
-  BIT_ARRAY* cpy = bit_array_create(bitarr->num_of_bits);
-
-  if(cpy == NULL)
-  {
-    return NULL;
-  }
-
-  // Copy across bits
-  memcpy(cpy->words, bitarr->words, bitarr->num_of_words * sizeof(word_t));
-
-  DEBUG_VALIDATE(cpy);
-  return cpy;
+  assert(b < bitarr->num_of_bits);
+  return bit_array_get(bitarr, b);
 }
 
-// destination and source may be the same bit_array
-// and src/dst regions may overlap
-static void _array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
+// set a bit (to 1) at position b
+void bit_array_set_bit(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  bit_array_set(bitarr,b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// clear a bit (to 0) at position b
+void bit_array_clear_bit(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  bit_array_clear(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
+void bit_array_toggle_bit(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  bit_array_toggle(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If char c != 0, set bit; otherwise clear bit
+void bit_array_assign_bit(BIT_ARRAY* bitarr, bit_index_t b, char c)
+{
+  assert(b < bitarr->num_of_bits);
+  bit_array_assign(bitarr, b, c ? 1 : 0);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Get, set etc with resize
+//
+
+// Get the value of a bit (returns 0 or 1)
+char bit_array_rget(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  return bit_array_get(bitarr, b);
+}
+
+// set a bit (to 1) at position b
+void bit_array_rset(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  bit_array_set(bitarr,b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// clear a bit (to 0) at position b
+void bit_array_rclear(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  bit_array_clear(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
+void bit_array_rtoggle(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  bit_array_toggle(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If char c != 0, set bit; otherwise clear bit
+void bit_array_rassign(BIT_ARRAY* bitarr, bit_index_t b, char c)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  bit_array_assign(bitarr, b, c ? 1 : 0);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Get, set, clear and toggle several bits at once
+//
+
+// Get the offsets of the set bits (for offsets start<=offset<end)
+// Returns the number of bits set
+// It is assumed that dst is at least of length (end-start)
+bit_index_t bit_array_get_bits(const BIT_ARRAY* bitarr,
+                               bit_index_t start, bit_index_t end,
+                               bit_index_t* dst)
+{
+  bit_index_t i, n = 0;
+  assert(end <= bitarr->num_of_bits);
+  for(i = start; i < end; i++) {
+    if(bit_array_get(bitarr, i)) {
+      dst[n++] = i;
+    }
+  }
+  return n;
+}
+
+// Set multiple bits at once.
+// e.g. set bits 1, 20 & 31: bit_array_set_bits(bitarr, 3, 1,20,31);
+void bit_array_set_bits(BIT_ARRAY* bitarr, size_t n, ...)
+{
+  size_t i;
+  va_list argptr;
+  va_start(argptr, n);
+
+  for(i = 0; i < n; i++)
+  {
+    unsigned int bit_index = va_arg(argptr, unsigned int);
+    bit_array_set_bit(bitarr, bit_index);
+  }
+
+  va_end(argptr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Clear multiple bits at once.
+// e.g. clear bits 1, 20 & 31: bit_array_clear_bits(bitarr, 3, 1,20,31);
+void bit_array_clear_bits(BIT_ARRAY* bitarr, size_t n, ...)
+{
+  size_t i;
+  va_list argptr;
+  va_start(argptr, n);
+
+  for(i = 0; i < n; i++)
+  {
+    unsigned int bit_index = va_arg(argptr, unsigned int);
+    bit_array_clear_bit(bitarr, bit_index);
+  }
+
+  va_end(argptr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Toggle multiple bits at once
+// e.g. toggle bits 1, 20 & 31: bit_array_toggle_bits(bitarr, 3, 1,20,31);
+void bit_array_toggle_bits(BIT_ARRAY* bitarr, size_t n, ...)
+{
+  size_t i;
+  va_list argptr;
+  va_start(argptr, n);
+
+  for(i = 0; i < n; i++)
+  {
+    unsigned int bit_index = va_arg(argptr, unsigned int);
+    bit_array_toggle_bit(bitarr, bit_index);
+  }
+
+  va_end(argptr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Set, clear and toggle all bits in a region
+//
+
+// Set all the bits in a region
+void bit_array_set_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  SET_REGION(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+// Clear all the bits in a region
+void bit_array_clear_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  CLEAR_REGION(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Toggle all the bits in a region
+void bit_array_toggle_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  TOGGLE_REGION(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Set, clear and toggle all bits at once
+//
+
+// set all elements of data to one
+void bit_array_set_all(BIT_ARRAY* bitarr)
+{
+  _store_words(bitarr, 0, bitarr->num_of_words, WORD_MAX);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// set all elements of data to zero
+void bit_array_clear_all(BIT_ARRAY* bitarr)
+{
+  _zero_words(bitarr, 0, bitarr->num_of_words);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Set all 1 bits to 0, and all 0 bits to 1. AKA flip
+void bit_array_toggle_all(BIT_ARRAY* bitarr)
+{
+  _write_words(bitarr, 0, bitarr->num_of_words);
+  _toggle_words(bitarr->words, bitarr->num_of_words);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Get a word at a time
+//
+
+uint64_t bit_array_get_word64(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint64_t)_get_word(bitarr, start);
+}
+
+uint32_t bit_array_get_word32(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint32_t)_get_word(bitarr, start);
+}
+
+uint16_t bit_array_get_word16(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint16_t)_get_word(bitarr, start);
+}
+
+uint8_t bit_array_get_word8(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint8_t)_get_word(bitarr, start);
+}
+
+uint64_t bit_array_get_wordn(const BIT_ARRAY* bitarr, bit_index_t start, int n)
+{
+  assert(start < bitarr->num_of_bits);
+  assert(n <= 64);
+  return (uint64_t)(_get_word(bitarr, start) & bitmask64(n));
+}
+
+//
+// Set a word at a time
+//
+// Doesn't extend bit array. However it is safe to TRY to set bits beyond the
+// end of the array, as long as: `start` is < `bit_array_length(arr)`
+//
+
+void bit_array_set_word64(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word)
+{
+  assert(start < bitarr->num_of_bits);
+  _set_word(bitarr, start, (word_t)word);
+}
+
+void bit_array_set_word32(BIT_ARRAY* bitarr, bit_index_t start, uint32_t word)
+{
+  assert(start < bitarr->num_of_bits);
+  word_t w = _get_word(bitarr, start);
+  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffff00000000UL));
+}
+
+void bit_array_set_word16(BIT_ARRAY* bitarr, bit_index_t start, uint16_t word)
+{
+  assert(start < bitarr->num_of_bits);
+  word_t w = _get_word(bitarr, start);
+  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffffffff0000UL));
+}
+
+void bit_array_set_word8(BIT_ARRAY* bitarr, bit_index_t start, uint8_t byte)
+{
+  assert(start < bitarr->num_of_bits);
+  _set_byte(bitarr, start, byte);
+}
+
+void bit_array_set_wordn(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word, int n)
+{
+  assert(start < bitarr->num_of_bits);
+  assert(n <= 64);
+  word_t w = _get_word(bitarr, start), m = bitmask64(n);
+  _set_word(bitarr, start, bitmask_merge(word,w,m));
+}
+
+//
+// Number of bits set
+//
+
+// Get the number of bits set (hamming weight)
+bit_index_t bit_array_num_bits_set(const BIT_ARRAY* bitarr)
+{
+  word_addr_t i;
+
+  bit_index_t num_of_bits_set = 0;
+
+  for(i = 0; i < bitarr->num_of_words; i++)
+  {
+    if(bitarr->words[i] > 0)
+    {
+      num_of_bits_set += POPCOUNT(bitarr->words[i]);
+    }
+  }
+
+  return num_of_bits_set;
+}
+
+// Get the number of bits not set (1 - hamming weight)
+bit_index_t bit_array_num_bits_cleared(const BIT_ARRAY* bitarr)
+{
+  return bitarr->num_of_bits - bit_array_num_bits_set(bitarr);
+}
+
+
+// Get the number of bits set in on array and not the other.  This is equivalent
+// to hamming weight of the XOR when the two arrays are the same length.
+// e.g. 10101 vs 00111 => hamming distance 2 (XOR is 10010)
+bit_index_t bit_array_hamming_distance(const BIT_ARRAY* arr1,
+                                       const BIT_ARRAY* arr2)
+{
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  word_addr_t max_words = MAX(arr1->num_of_words, arr2->num_of_words);
+
+  bit_index_t hamming_distance = 0;
+  word_addr_t i;
+
+  for(i = 0; i < min_words; i++)
+  {
+    hamming_distance += POPCOUNT(arr1->words[i] ^ arr2->words[i]);
+  }
+
+  if(min_words != max_words)
+  {
+    const BIT_ARRAY* long_arr
+      = (arr1->num_of_words > arr2->num_of_words ? arr1 : arr2);
+
+    for(i = min_words; i < max_words; i++)
+    {
+      hamming_distance += POPCOUNT(long_arr->words[i]);
+    }
+  }
+
+  return hamming_distance;
+}
+
+// Parity - returns 1 if odd number of bits set, 0 if even
+char bit_array_parity(const BIT_ARRAY* bitarr)
+{
+  word_addr_t w;
+  unsigned int parity = 0;
+
+  for(w = 0; w < bitarr->num_of_words; w++)
+  {
+    parity ^= PARITY(bitarr->words[w]);
+  }
+
+  return (char)parity;
+}
+
+//
+// Find indices of set/clear bits
+//
+
+// Find the index of the next bit that is set/clear, at or after `offset`
+// Returns 1 if such a bit is found, otherwise 0
+// Index is stored in the integer pointed to by `result`
+// If no such bit is found, value at `result` is not changed
+#define _next_bit_func_def(FUNC,GET) \
+char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
+{ \
+  assert(offset < bitarr->num_of_bits); \
+  if(bitarr->num_of_bits == 0 || offset >= bitarr->num_of_bits) { return 0; } \
+ \
+  /* Find first word that is greater than zero */ \
+  word_addr_t i = bitset64_wrd(offset); \
+  word_t w = GET(bitarr->words[i]) & ~bitmask64(bitset64_idx(offset)); \
+ \
+  while(1) { \
+    if(w > 0) { \
+      bit_index_t pos = i * WORD_SIZE + trailing_zeros(w); \
+      if(pos < bitarr->num_of_bits) { *result = pos; return 1; } \
+      else { return 0; } \
+    } \
+    i++; \
+    if(i >= bitarr->num_of_words) break; \
+    w = GET(bitarr->words[i]); \
+  } \
+ \
+  return 0; \
+}
+
+// Find the index of the previous bit that is set/clear, before `offset`.
+// Returns 1 if such a bit is found, otherwise 0
+// Index is stored in the integer pointed to by `result`
+// If no such bit is found, value at `result` is not changed
+#define _prev_bit_func_def(FUNC,GET) \
+char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
+{ \
+  assert(offset <= bitarr->num_of_bits); \
+  if(bitarr->num_of_bits == 0 || offset == 0) { return 0; } \
+ \
+  /* Find prev word that is greater than zero */ \
+  word_addr_t i = bitset64_wrd(offset-1); \
+  word_t w = GET(bitarr->words[i]) & bitmask64(bitset64_idx(offset-1)+1); \
+ \
+  if(w > 0) { *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; return 1; } \
+ \
+  /* i is unsigned so have to use break when i == 0 */ \
+  for(--i; i != BIT_INDEX_MAX; i--) { \
+    w = GET(bitarr->words[i]); \
+    if(w > 0) { \
+      *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; \
+      return 1; \
+    } \
+  } \
+ \
+  return 0; \
+}
+
+#define GET_WORD(x) (x)
+#define NEG_WORD(x) (~(x))
+_next_bit_func_def(bit_array_find_next_set_bit,  GET_WORD);
+_next_bit_func_def(bit_array_find_next_clear_bit,NEG_WORD);
+_prev_bit_func_def(bit_array_find_prev_set_bit,  GET_WORD);
+_prev_bit_func_def(bit_array_find_prev_clear_bit,NEG_WORD);
+
+// Find the index of the first bit that is set.
+// Returns 1 if a bit is set, otherwise 0
+// Index of first set bit is stored in the integer pointed to by result
+// If no bits are set, value at `result` is not changed
+char bit_array_find_first_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_next_set_bit(bitarr, 0, result);
+}
+
+// same same
+char bit_array_find_first_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_next_clear_bit(bitarr, 0, result);
+}
+
+// Find the index of the last bit that is set.
+// Returns 1 if a bit is set, otherwise 0
+// Index of last set bit is stored in the integer pointed to by `result`
+// If no bits are set, value at `result` is not changed
+char bit_array_find_last_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_prev_set_bit(bitarr, bitarr->num_of_bits, result);
+}
+
+// same same
+char bit_array_find_last_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_prev_clear_bit(bitarr, bitarr->num_of_bits, result);
+}
+
+//
+// "Sorting" bits
+//
+
+// Put all the 0s before all the 1s
+void bit_array_sort_bits(BIT_ARRAY* bitarr)
+{
+  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
+  bit_index_t num_of_bits_cleared = bitarr->num_of_bits - num_of_bits_set;
+  bit_array_set_all(bitarr);
+  CLEAR_REGION(bitarr, 0, num_of_bits_cleared);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Put all the 1s before all the 0s
+void bit_array_sort_bits_rev(BIT_ARRAY* bitarr)
+{
+  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
+  bit_array_clear_all(bitarr);
+  SET_REGION(bitarr, 0, num_of_bits_set);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Strings and printing
+//
+
+// Construct a BIT_ARRAY from a substring with given on and off characters.
+void bit_array_from_substr(BIT_ARRAY* bitarr, bit_index_t offset,
+                           const char *str, size_t len,
+                           const char *on, const char *off,
+                           char left_to_right)
+{
+  bit_array_ensure_size_critical(bitarr, offset + len);
+  bit_array_clear_region(bitarr, offset, len);
+
+  // BitArray region is now all 0s (and passed to the write hook) -- just set
+  // the 1s
+  size_t i;
+  bit_index_t j;
+
+  for(i = 0; i < len; i++)
+  {
+    if(strchr(on, str[i]) != NULL)
+    {
+      j = offset + (left_to_right ? i : len - i - 1);
+      bitset_set(bitarr->words, j);
+    }
+    else { assert(strchr(off, str[i]) != NULL); }
+  }
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+// From string method
+void bit_array_from_str(BIT_ARRAY* bitarr, const char* str)
+{
+  bit_array_from_substr(bitarr, 0, str, strlen(str), "1", "0", 1);
+}
+
+// Takes a char array to write to.  `str` must be bitarr->num_of_bits+1 in length
+// Terminates string with '\0'
+char* bit_array_to_str(const BIT_ARRAY* bitarr, char* str)
+{
+  bit_index_t i;
+
+  for(i = 0; i < bitarr->num_of_bits; i++)
+  {
+    str[i] = bit_array_get(bitarr, i) ? '1' : '0';
+  }
+
+  str[bitarr->num_of_bits] = '\0';
+
+  return str;
+}
+
+char* bit_array_to_str_rev(const BIT_ARRAY* bitarr, char* str)
+{
+  bit_index_t i;
+
+  for(i = 0; i < bitarr->num_of_bits; i++)
+  {
+    str[i] = bit_array_get(bitarr, bitarr->num_of_bits-i-1) ? '1' : '0';
+  }
+
+  str[bitarr->num_of_bits] = '\0';
+
+  return str;
+}
+
+
+// Get a string representations for a given region, using given on/off characters.
+// Note: does not null-terminate
+void bit_array_to_substr(const BIT_ARRAY* bitarr,
+                         bit_index_t start, bit_index_t length,
+                         char* str, char on, char off,
+                         char left_to_right)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  bit_index_t i, j;
+  bit_index_t end = start + length - 1;
+
+  for(i = 0; i < length; i++)
+  {
+    j = (left_to_right ? start + i : end - i);
+    str[i] = bit_array_get(bitarr, j) ? on : off;
+  }
+
+//  str[length] = '\0';
+}
+
+// Print this array to a file stream.  Prints '0's and '1'.  Doesn't print newline.
+void bit_array_print(const BIT_ARRAY* bitarr, FILE* fout)
+{
+  bit_index_t i;
+
+  for(i = 0; i < bitarr->num_of_bits; i++)
+  {
+    fprintf(fout, "%c", bit_array_get(bitarr, i) ? '1' : '0');
+  }
+}
+
+// Print a string representations for a given region, using given on/off characters.
+void bit_array_print_substr(const BIT_ARRAY* bitarr,
+                            bit_index_t start, bit_index_t length,
+                            FILE* fout, char on, char off,
+                            char left_to_right)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  bit_index_t i, j;
+  bit_index_t end = start + length - 1;
+
+  for(i = 0; i < length; i++)
+  {
+    j = (left_to_right ? start + i : end - i);
+    fprintf(fout, "%c", bit_array_get(bitarr, j) ? on : off);
+  }
+}
+
+//
+// Decimal
+//
+
+// Get bit array as decimal str (e.g. 0b1101 -> "13")
+// len is the length of str char array -- will write at most len-1 chars
+// returns the number of characters needed
+// return is the same as strlen(str)
+size_t bit_array_to_decimal(const BIT_ARRAY *bitarr, char *str, size_t len)
+{
+  size_t i = 0;
+
+  if(bit_array_cmp_uint64(bitarr, 0) == 0)
+  {
+    if(len >= 2)
+    {
+      *str = '0';
+      *(str+1) = '\0';
+    }
+
+    return 1;
+  }
+
+  BIT_ARRAY *tmp = bit_array_clone(bitarr);
+  uint64_t rem;
+
+  str[len-1] = '\0';
+
+  while(bit_array_cmp_uint64(tmp, 0) != 0)
+  {
+    bit_array_div_uint64(tmp, 10, &rem);
+
+    if(i < len-1)
+    {
+      str[len-2-i] = '0' + rem;
+    }
+
+    i++;
+  }
+
+  if(i < len-1)
+  {
+    // Moves null-terminator as well
+    memmove(str, str+len-i-1, i+1);
+  }
+
+  bit_array_free(tmp);
+
+  return i;
+}
+
+// Get bit array from decimal str (e.g. "13" -> 0b1101)
+// Returns number of characters used
+size_t bit_array_from_decimal(BIT_ARRAY *bitarr, const char* decimal)
+{
+  bit_array_clear_all(bitarr);
+  size_t i = 0;
+
+  if(decimal[0] == '\0' || decimal[0] < '0' || decimal[0] > '9')
+  {
+    return 0;
+  }
+
+  bit_array_add_uint64(bitarr, decimal[i] - '0');
+  i++;
+
+  while(decimal[i] != '\0' && decimal[i] >= '0' && decimal[i] <= '9')
+  {
+    bit_array_mul_uint64(bitarr, 10);
+    bit_array_add_uint64(bitarr, decimal[i] - '0');
+    i++;
+  }
+
+  return i;
+}
+
+//
+// Hexidecimal
+//
+
+char bit_array_hex_to_nibble(char c, uint8_t *b)
+{
+  c = tolower(c);
+
+  if(c >= '0' && c <= '9')
+  {
+    *b = c - '0';
+    return 1;
+  }
+  else if(c >= 'a' && c <= 'f')
+  {
+    *b = 0xa + (c - 'a');
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+char bit_array_nibble_to_hex(uint8_t b, char uppercase)
+{
+  if(b <= 9)
+  {
+    return '0' + b;
+  }
+  else
+  {
+    return (uppercase ? 'A' : 'a') + (b - 0xa);
+  }
+}
+
+// Loads array from hex string
+// Returns the number of bits loaded (will be chars rounded up to multiple of 4)
+// (0 on failure)
+bit_index_t bit_array_from_hex(BIT_ARRAY* bitarr, bit_index_t offset,
+                               const char* str, size_t len)
+{
+  if(str[0] == '0' && tolower(str[1]) == 'x')
+  {
+    str += 2;
+    len -= 2;
+  }
+
+  size_t i;
+  for(i = 0; i < len; i++, offset += 4)
+  {
+    uint8_t b;
+    if(bit_array_hex_to_nibble(str[i], &b))
+    {
+      if(!bit_array_ensure_size(bitarr, offset + 4)) break;
+      _set_nibble(bitarr, offset, b);
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  return 4 * i;
+}
+
+// Returns number of characters written
+size_t bit_array_to_hex(const BIT_ARRAY* bitarr,
+                        bit_index_t start, bit_index_t length,
+                        char* str, char uppercase)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  size_t k = 0;
+  bit_index_t offset, end = start + length;
+
+  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
+  {
+    word_t w = _get_word(bitarr, offset);
+
+    word_offset_t j;
+    for(j = 0; j < 64; j += 4)
+    {
+      str[k++] = bit_array_nibble_to_hex((w>>j) & 0xf, uppercase);
+    }
+  }
+
+  if(offset < end)
+  {
+    // Remaining full nibbles (4 bits)
+    word_t w = _get_word(bitarr, offset);
+
+    for(; offset + 4 <= end; offset += 4)
+    {
+      str[k++] = bit_array_nibble_to_hex(w & 0xf, uppercase);
+      w >>= 4;
+    }
+
+    if(offset < end)
+    {
+      // Remaining bits
+      str[k++] = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
+    }
+  }
+
+  str[k] = '\0';
+
+  // Return number of characters written
+  return k;
+}
+
+// Print bit array as hex
+size_t bit_array_print_hex(const BIT_ARRAY* bitarr,
+                           bit_index_t start, bit_index_t length,
+                           FILE* fout, char uppercase)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  size_t k = 0;
+  bit_index_t offset, end = start + length;
+
+  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
+  {
+    word_t w = _get_word(bitarr, offset);
+
+    word_offset_t j;
+    for(j = 0; j < 64; j += 4)
+    {
+      fprintf(fout, "%c", bit_array_nibble_to_hex((w>>j) & 0xf, uppercase));
+      k++;
+    }
+  }
+
+  if(offset < end)
+  {
+    // Remaining full nibbles (4 bits)
+    word_t w = _get_word(bitarr, offset);
+
+    for(; offset + 4 <= end; offset += 4)
+    {
+      fprintf(fout, "%c", bit_array_nibble_to_hex(w & 0xf, uppercase));
+      w >>= 4;
+      k++;
+    }
+
+    if(offset < end)
+    {
+      // Remaining bits
+      char hex = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
+      fprintf(fout, "%c", hex);
+      k++;
+    }
+  }
+
+  return k;
+}
+
+//
+// Clone and copy
+//
+
+// Returns NULL if cannot malloc
+BIT_ARRAY* bit_array_clone(const BIT_ARRAY* bitarr)
+{
+  BIT_ARRAY* cpy = bit_array_create_with(bitarr->num_of_bits,
+                                         bitarr->allocator);
+
+  if(cpy == NULL)
+  {
+    return NULL;
+  }
+
+  // Copy across bits
+  memcpy(cpy->words, bitarr->words, bitarr->num_of_words * sizeof(word_t));
+  cpy->growth = bitarr->growth;
+
+  DEBUG_VALIDATE(cpy);
+  return cpy;
+}
+
+// destination and source may be the same bit_array
+// and src/dst regions may overlap
+static void _array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
                         const BIT_ARRAY* src, bit_index_t srcindx,
                         bit_index_t length)
 {
-  DEBUG_PRINT("bit_array_copy(dst: %zu, src: %zu, length: %zu)\n",
-              (size_t)dstindx, (size_t)srcindx, (size_t)length);
+  DEBUG_PRINT("bit_array_copy(dst: %zu, src: %zu, length: %zu)\n",
+              (size_t)dstindx, (size_t)srcindx, (size_t)length);
+
+  // Num of full words to copy
+  word_addr_t num_of_full_words = length / WORD_SIZE;
+  word_addr_t i;
+
+  word_offset_t bits_in_last_word = bits_in_top_word(length);
+
+  if(dst == src && srcindx > dstindx)
+  {
+    // Work left to right
+    DEBUG_PRINT("work left to right\n");
+
+    for(i = 0; i < num_of_full_words; i++)
+    {
+      word_t word = _get_word(src, srcindx+i*WORD_SIZE);
+      _set_word(dst, dstindx+i*WORD_SIZE, word);
+    }
+
+    if(bits_in_last_word > 0)
+    {
+      word_t src_word = _get_word(src, srcindx+i*WORD_SIZE);
+      word_t dst_word = _get_word(dst, dstindx+i*WORD_SIZE);
+
+      word_t mask = bitmask64(bits_in_last_word);
+      word_t word = bitmask_merge(src_word, dst_word, mask);
+
+      _set_word(dst, dstindx+num_of_full_words*WORD_SIZE, word);
+    }
+  }
+  else
+  {
+    // Work right to left
+    DEBUG_PRINT("work right to left\n");
+
+    for(i = 0; i < num_of_full_words; i++)
+    {
+      word_t word = _get_word(src, srcindx+length-(i+1)*WORD_SIZE);
+      _set_word(dst, dstindx+length-(i+1)*WORD_SIZE, word);
+    }
+
+    DEBUG_PRINT("Copy %i,%i to %i\n", (int)srcindx, (int)bits_in_last_word,
+                                      (int)dstindx);
+
+    if(bits_in_last_word > 0)
+    {
+      word_t src_word = _get_word(src, srcindx);
+      word_t dst_word = _get_word(dst, dstindx);
+
+      word_t mask = bitmask64(bits_in_last_word);
+      word_t word = bitmask_merge(src_word, dst_word, mask);
+      _set_word(dst, dstindx, word);
+    }
+  }
+
+  _mask_top_word(dst);
+}
+
+// destination and source may be the same bit_array
+// and src/dst regions may overlap
+void bit_array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
+                    const BIT_ARRAY* src, bit_index_t srcindx,
+                    bit_index_t length)
+{
+  assert(srcindx + length <= src->num_of_bits);
+  assert(dstindx <= dst->num_of_bits);
+  _array_copy(dst, dstindx, src, srcindx, length);
+  DEBUG_VALIDATE(dst);
+}
+
+// Clone `src` into `dst`. Resizes `dst`.
+void bit_array_copy_all(BIT_ARRAY* dst, const BIT_ARRAY* src)
+{
+  bit_array_resize_critical(dst, src->num_of_bits);
+  _store_copy(dst, 0, src->words, src->num_of_words);
+  DEBUG_VALIDATE(dst);
+}
+
+
+//
+// Logic operators
+//
+
+// Destination can be the same as one or both of the sources
+void bit_array_and(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+{
+  // Ensure dst array is big enough
+  word_addr_t max_bits = MAX(src1->num_of_bits, src2->num_of_bits);
+  bit_array_ensure_size_critical(dst, max_bits);
+
+  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
+
+  word_addr_t i, hooked = 0;
+
+  for(i = 0; i < min_words; i++)
+  {
+    _store_word(dst, i, src1->words[i] & src2->words[i], &hooked);
+  }
+
+  // Set remaining bits to zero
+  _store_words(dst, min_words, dst->num_of_words - min_words, 0);
+
+  DEBUG_VALIDATE(dst);
+}
+
+// Destination can be the same as one or both of the sources
+static void _logical_or_xor(BIT_ARRAY* dst,
+                            const BIT_ARRAY* src1,
+                            const BIT_ARRAY* src2,
+                            char use_xor)
+{
+  // Ensure dst array is big enough
+  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
+
+  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
+  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
+
+  word_addr_t i, hooked = 0;
+
+  if(use_xor)
+  {
+    for(i = 0; i < min_words; i++)
+      _store_word(dst, i, src1->words[i] ^ src2->words[i], &hooked);
+  }
+  else
+  {
+    for(i = 0; i < min_words; i++)
+      _store_word(dst, i, src1->words[i] | src2->words[i], &hooked);
+  }
+
+  // Copy remaining bits from longer src array
+  if(min_words != max_words)
+  {
+    const BIT_ARRAY* longer = src1->num_of_words > src2->num_of_words ? src1 : src2;
+    _store_copy(dst, min_words, longer->words + min_words, max_words - min_words);
+  }
+
+  // Set remaining bits to zero
+  _store_words(dst, max_words, dst->num_of_words - max_words, 0);
+
+  DEBUG_VALIDATE(dst);
+}
+
+void bit_array_or(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+{
+  _logical_or_xor(dst, src1, src2, 0);
+}
+
+// Destination can be the same as one or both of the sources
+void bit_array_xor(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+{
+  _logical_or_xor(dst, src1, src2, 1);
+}
+
+// If dst is longer than src, top bits are set to 1
+void bit_array_not(BIT_ARRAY* dst, const BIT_ARRAY* src)
+{
+  bit_array_ensure_size_critical(dst, src->num_of_bits);
+
+  word_addr_t i, hooked = 0;
+
+  for(i = 0; i < src->num_of_words; i++)
+  {
+    _store_word(dst, i, ~(src->words[i]), &hooked);
+  }
+
+  // Set remaining words to 1s
+  _store_words(dst, src->num_of_words, dst->num_of_words - src->num_of_words,
+               WORD_MAX);
+
+  _mask_top_word(dst);
+
+  DEBUG_VALIDATE(dst);
+}
+
+//
+// Comparisons
+//
+
+// Compare two bit arrays by value stored, with index 0 being the Least
+// Significant Bit (LSB). Arrays do not have to be the same length.
+// Example: ..0101 (5) > ...0011 (3) [index 0 is LSB at right hand side]
+// Sorts on length if all zeros: (0,0) < (0,0,0)
+// returns:
+//  >0 iff bitarr1 > bitarr2
+//   0 iff bitarr1 == bitarr2
+//  <0 iff bitarr1 < bitarr2
+int bit_array_cmp(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
+{
+  word_addr_t i;
+  word_t word1, word2;
+  word_addr_t min_words = bitarr1->num_of_words;
+
+  // i is unsigned so break when i == 0
+  if(bitarr1->num_of_words > bitarr2->num_of_words) {
+    min_words = bitarr2->num_of_words;
+    for(i = bitarr1->num_of_words-1; ; i--) {
+      if(bitarr1->words[i]) return 1;
+      if(i == bitarr2->num_of_words) break;
+    }
+  }
+  else if(bitarr1->num_of_words < bitarr2->num_of_words) {
+    for(i = bitarr2->num_of_words-1; ; i--) {
+      if(bitarr2->words[i]) return 1;
+      if(i == bitarr1->num_of_words) break;
+    }
+  }
+
+  if(min_words == 0) return 0;
+
+  for(i = min_words-1; ; i--)
+  {
+    word1 = bitarr1->words[i];
+    word2 = bitarr2->words[i];
+    if(word1 != word2) return (word1 > word2 ? 1 : -1);
+    if(i == 0) break;
+  }
+
+  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
+  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
+}
+
+// Compare two bit arrays by value stored, with index 0 being the Most
+// Significant Bit (MSB). Arrays do not have to be the same length.
+// Example: 10.. > 01.. [index 0 is MSB at left hand side]
+// Sorts on length if all zeros: (0,0) < (0,0,0)
+// returns:
+//  >0 iff bitarr1 > bitarr2
+//   0 iff bitarr1 == bitarr2
+//  <0 iff bitarr1 < bitarr2
+int bit_array_cmp_big_endian(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
+{
+  word_addr_t min_words = MAX(bitarr1->num_of_words, bitarr2->num_of_words);
+
+  word_addr_t i;
+  word_t word1, word2;
+
+  for(i = 0; i < min_words; i++) {
+    word1 = _reverse_word(bitarr1->words[i]);
+    word2 = _reverse_word(bitarr2->words[i]);
+    if(word1 != word2) return (word1 > word2 ? 1 : -1);
+  }
+
+  // Check remaining words. Only one of these loops will execute
+  for(; i < bitarr1->num_of_words; i++)
+    if(bitarr1->words[i]) return 1;
+  for(; i < bitarr2->num_of_words; i++)
+    if(bitarr2->words[i]) return -1;
+
+  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
+  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
+}
+
+// compare bitarr with (bitarr2 << pos)
+// bit_array_cmp(bitarr1, bitarr2<<pos)
+// returns:
+//  >0 iff bitarr1 > bitarr2
+//   0 iff bitarr1 == bitarr2
+//  <0 iff bitarr1 < bitarr2
+int bit_array_cmp_words(const BIT_ARRAY *arr1,
+                        bit_index_t pos, const BIT_ARRAY *arr2)
+{
+  if(arr1->num_of_bits == 0 && arr2->num_of_bits == 0)
+  {
+    return 0;
+  }
+
+  bit_index_t top_bit1 = 0, top_bit2 = 0;
+
+  char arr1_zero = !bit_array_find_last_set_bit(arr1, &top_bit1);
+  char arr2_zero = !bit_array_find_last_set_bit(arr2, &top_bit2);
+
+  if(arr1_zero && arr2_zero) return 0;
+  if(arr1_zero) return -1;
+  if(arr2_zero) return 1;
+
+  bit_index_t top_bit2_offset = top_bit2 + pos;
+
+  if(top_bit1 != top_bit2_offset) {
+    return top_bit1 > top_bit2_offset ? 1 : -1;
+  }
+
+  word_addr_t i;
+  word_t word1, word2;
+
+  for(i = top_bit2 / WORD_SIZE; i > 0; i--)
+  {
+    word1 = _get_word(arr1, pos + i * WORD_SIZE);
+    word2 = arr2->words[i];
+
+    if(word1 > word2) return 1;
+    if(word1 < word2) return -1;
+  }
+
+  word1 = _get_word(arr1, pos);
+  word2 = arr2->words[0];
+
+  if(word1 > word2) return 1;
+  if(word1 < word2) return -1;
+
+  // return 1 if arr1[0..pos] != 0, 0 otherwise
+
+  // Whole words
+  word_addr_t num_words = pos / WORD_SIZE;
+
+  for(i = 0; i < num_words; i++)
+  {
+    if(arr1->words[i] > 0)
+    {
+      return 1;
+    }
+  }
+
+  word_offset_t bits_remaining = pos - num_words * WORD_SIZE;
+
+  if(arr1->words[num_words] & bitmask64(bits_remaining))
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+
+//
+// Slices
+//
+
+BIT_ARRAY_SLICE bit_array_slice(const BIT_ARRAY* bitarr,
+                                bit_index_t start, bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  BIT_ARRAY_SLICE s = {bitarr, start, len};
+  return s;
+}
+
+#define _slice_nwords(s) roundup_bits2words64((s).len)
+
+// Word i of a slice, shifted into place. Bits past the end are zero
+static inline word_t _slice_word(BIT_ARRAY_SLICE s, word_addr_t i)
+{
+  bit_index_t offset = (bit_index_t)i * WORD_SIZE;
+  word_t w = _get_word(s.arr, s.start + offset);
+  if(s.len - offset < WORD_SIZE) w &= bitmask64(s.len - offset);
+  return w;
+}
+
+bit_index_t bit_array_slice_num_bits_set(BIT_ARRAY_SLICE s)
+{
+  bit_index_t num_of_bits_set = 0;
+  word_addr_t i, nwords = _slice_nwords(s);
+
+  for(i = 0; i < nwords; i++)
+    num_of_bits_set += POPCOUNT(_slice_word(s, i));
+
+  return num_of_bits_set;
+}
+
+// 64 bits from offset, inverted if find_clear, with bits past the end zeroed
+static inline word_t _slice_find_word(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                      bit_index_t nbits, char find_clear)
+{
+  word_t w = _get_word(s.arr, s.start + offset);
+  if(find_clear) w = ~w;
+  return nbits < WORD_SIZE ? w & bitmask64(nbits) : w;
+}
+
+static char _slice_find_next(BIT_ARRAY_SLICE s, bit_index_t offset,
+                             bit_index_t *result, char find_clear)
+{
+  word_t w;
+
+  for(; offset < s.len; offset += WORD_SIZE)
+  {
+    w = _slice_find_word(s, offset, s.len - offset, find_clear);
+    if(w) {
+      *result = offset + trailing_zeros(w);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static char _slice_find_prev(BIT_ARRAY_SLICE s, bit_index_t offset,
+                             bit_index_t *result, char find_clear)
+{
+  bit_index_t start;
+  word_t w;
+
+  offset = MIN(offset, s.len);
+
+  while(offset > 0)
+  {
+    start = offset < WORD_SIZE ? 0 : offset - WORD_SIZE;
+    w = _slice_find_word(s, start, offset - start, find_clear);
+    if(w) {
+      *result = start + WORD_SIZE - 1 - leading_zeros(w);
+      return 1;
+    }
+    offset = start;
+  }
+
+  return 0;
+}
+
+char bit_array_slice_find_next_set_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                       bit_index_t *result)
+{
+  return _slice_find_next(s, offset, result, 0);
+}
+
+char bit_array_slice_find_next_clear_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                         bit_index_t *result)
+{
+  return _slice_find_next(s, offset, result, 1);
+}
+
+char bit_array_slice_find_prev_set_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                       bit_index_t *result)
+{
+  return _slice_find_prev(s, offset, result, 0);
+}
+
+char bit_array_slice_find_prev_clear_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                         bit_index_t *result)
+{
+  return _slice_find_prev(s, offset, result, 1);
+}
+
+// Compare by value, index 0 is the LSB. Equal values: longer is bigger
+int bit_array_slice_cmp(BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2)
+{
+  word_addr_t n1 = _slice_nwords(s1), n2 = _slice_nwords(s2);
+  word_addr_t i = MAX(n1, n2);
+  word_t w1, w2;
+
+  while(i > 0)
+  {
+    i--;
+    w1 = i < n1 ? _slice_word(s1, i) : 0;
+    w2 = i < n2 ? _slice_word(s2, i) : 0;
+    if(w1 != w2) return w1 > w2 ? 1 : -1;
+  }
+
+  if(s1.len == s2.len) return 0;
+  return s1.len > s2.len ? 1 : -1;
+}
+
+uint64_t bit_array_slice_hash(BIT_ARRAY_SLICE s, uint64_t seed)
+{
+  return bit_array_hash_region(s.arr, s.start, s.len, seed);
+}
+
+size_t bit_array_slice_to_hex(BIT_ARRAY_SLICE s, char *str, char uppercase)
+{
+  return bit_array_to_hex(s.arr, s.start, s.len, str, uppercase);
+}
+
+// Reads word i of the sources before writing word i of dst, and later words
+// of a source are never before word i of its array, so dst may be s1.arr or
+// s2.arr
+static void _slice_logic(BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2,
+                         char op)
+{
+  word_addr_t n1 = _slice_nwords(s1), n2 = _slice_nwords(s2);
+  word_addr_t i, max_words = MAX(n1, n2), hooked = 0;
+  word_t w1, w2;
+
+  bit_array_ensure_size_critical(dst, MAX(s1.len, s2.len));
+
+  for(i = 0; i < max_words; i++)
+  {
+    w1 = i < n1 ? _slice_word(s1, i) : 0;
+    w2 = i < n2 ? _slice_word(s2, i) : 0;
+    switch(op) {
+      case '&': _store_word(dst, i, w1 & w2, &hooked); break;
+      case '|': _store_word(dst, i, w1 | w2, &hooked); break;
+      case '^': _store_word(dst, i, w1 ^ w2, &hooked); break;
+    }
+  }
+
+  // Set remaining bits to zero
+  _store_words(dst, max_words, dst->num_of_words - max_words, 0);
+
+  DEBUG_VALIDATE(dst);
+}
+
+void bit_array_slice_and(BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2)
+{
+  _slice_logic(dst, s1, s2, '&');
+}
+
+void bit_array_slice_or(BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2)
+{
+  _slice_logic(dst, s1, s2, '|');
+}
+
+void bit_array_slice_xor(BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2)
+{
+  _slice_logic(dst, s1, s2, '^');
+}
+
+void bit_array_slice_not(BIT_ARRAY* dst, BIT_ARRAY_SLICE s)
+{
+  word_addr_t i, nwords = _slice_nwords(s), hooked = 0;
+
+  if(s.len != dst->num_of_bits && _fixed_size(dst)) {
+    errno = EPERM;
+    return;
+  }
+
+  // Shrink after reading, dst may be s.arr
+  bit_array_ensure_size_critical(dst, s.len);
+
+  for(i = 0; i < nwords; i++)
+    _store_word(dst, i, ~_slice_word(s, i), &hooked);
+
+  bit_array_resize_critical(dst, s.len);
+  _mask_top_word(dst);
+  DEBUG_VALIDATE(dst);
+}
+
+
+//
+// Reverse -- coords may wrap around
+//
+
+// No bounds checking
+// length cannot be zero
+static void _reverse_region(BIT_ARRAY* bitarr,
+                            bit_index_t start,
+                            bit_index_t length)
+{
+  bit_index_t left = start;
+  bit_index_t right = (start + length - WORD_SIZE) % bitarr->num_of_bits;
+
+  while(length >= 2 * WORD_SIZE)
+  {
+    // Swap entire words
+    word_t left_word = _get_word_cyclic(bitarr, left);
+    word_t right_word = _get_word_cyclic(bitarr, right);
+
+    // reverse words individually
+    left_word = _reverse_word(left_word);
+    right_word = _reverse_word(right_word);
+
+    // Swap
+    _set_word_cyclic(bitarr, left, right_word);
+    _set_word_cyclic(bitarr, right, left_word);
+
+    // Update
+    left = (left + WORD_SIZE) % bitarr->num_of_bits;
+    right = (right < WORD_SIZE ? right + bitarr->num_of_bits : right) - WORD_SIZE;
+    length -= 2 * WORD_SIZE;
+  }
+
+  word_t word, rev;
+
+  if(length == 0)
+  {
+    return;
+  }
+  else if(length > WORD_SIZE)
+  {
+    // Words overlap
+    word_t left_word = _get_word_cyclic(bitarr, left);
+    word_t right_word = _get_word_cyclic(bitarr, right);
+
+    rev = _reverse_word(left_word);
+    right_word = _reverse_word(right_word);
+
+    // fill left 64 bits with right word rev
+    _set_word_cyclic(bitarr, left, right_word);
+
+    // Now do remaining bits (length is between 1 and 64 bits)
+    left += WORD_SIZE;
+    length -= WORD_SIZE;
+
+    word = _get_word_cyclic(bitarr, left);
+  }
+  else
+  {
+    word = _get_word_cyclic(bitarr, left);
+    rev = _reverse_word(word);
+  }
+
+  rev >>= WORD_SIZE - length;
+  word_t mask = bitmask64(length);
+
+  word = bitmask_merge(rev, word, mask);
+
+  _set_word_cyclic(bitarr, left, word);
+}
+
+void bit_array_reverse_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  if(len > 0) _reverse_region(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+void bit_array_reverse(BIT_ARRAY* bitarr)
+{
+  if(bitarr->num_of_bits > 0) _reverse_region(bitarr, 0, bitarr->num_of_bits);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Shift left / right
+//
+
+// Shift towards MSB / higher index
+void bit_array_shift_left(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
+{
+  if(shift_dist >= bitarr->num_of_bits)
+  {
+    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
+    return;
+  }
+  else if(shift_dist == 0)
+  {
+    return;
+  }
+
+  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+
+  bit_index_t cpy_length = bitarr->num_of_bits - shift_dist;
+  _array_copy(bitarr, shift_dist, bitarr, 0, cpy_length);
+  _set_region(bitarr, 0, shift_dist, action);
+}
+
+// shift left extend - don't truncate bits when shifting UP, instead
+// make room for them.
+void bit_array_shift_left_extend(BIT_ARRAY* bitarr, bit_index_t shift_dist,
+                                 char fill)
+{
+   bit_index_t newlen = bitarr->num_of_bits + shift_dist;
+   bit_index_t cpy_length = bitarr->num_of_bits;
+
+  if(shift_dist == 0)
+  {
+    return;
+  }
+
+  bit_array_resize_critical(bitarr, newlen);
+
+  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+  _array_copy(bitarr, shift_dist, bitarr, 0, cpy_length);
+  _set_region(bitarr, 0, shift_dist, action);
+}
+
+// Shift towards LSB / lower index
+void bit_array_shift_right(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
+{
+  if(shift_dist >= bitarr->num_of_bits)
+  {
+    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
+    return;
+  }
+  else if(shift_dist == 0)
+  {
+    return;
+  }
+
+  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+
+  bit_index_t cpy_length = bitarr->num_of_bits - shift_dist;
+  bit_array_copy(bitarr, 0, bitarr, shift_dist, cpy_length);
+
+  _set_region(bitarr, cpy_length, shift_dist, action);
+}
+
+//
+// Cycle
+//
+
+// Cycle towards index 0
+void bit_array_cycle_right(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
+{
+  if(bitarr->num_of_bits == 0)
+  {
+    return;
+  }
+
+  cycle_dist = cycle_dist % bitarr->num_of_bits;
+
+  if(cycle_dist == 0)
+  {
+    return;
+  }
+
+  bit_index_t len1 = cycle_dist;
+  bit_index_t len2 = bitarr->num_of_bits - cycle_dist;
+
+  _reverse_region(bitarr, 0, len1);
+  _reverse_region(bitarr, len1, len2);
+  bit_array_reverse(bitarr);
+}
+
+// Cycle away from index 0
+void bit_array_cycle_left(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
+{
+  if(bitarr->num_of_bits == 0)
+  {
+    return;
+  }
+
+  cycle_dist = cycle_dist % bitarr->num_of_bits;
+
+  if(cycle_dist == 0)
+  {
+    return;
+  }
+
+  bit_index_t len1 = bitarr->num_of_bits - cycle_dist;
+  bit_index_t len2 = cycle_dist;
+
+  _reverse_region(bitarr, 0, len1);
+  _reverse_region(bitarr, len1, len2);
+  bit_array_reverse(bitarr);
+}
+
+//
+// Next permutation
+//
+
+static word_t _next_permutation(word_t v)
+{
+  assert(v);
+  // From http://graphics.stanford.edu/~seander/bithacks.html#NextBitPermutation
+  word_t t = v | (v - 1); // t gets v's least significant 0 bits set to 1
+  // Next set to 1 the most significant bit to change,
+  // set to 0 the least significant ones, and add the necessary 1 bits.
+  return (t+1) | (((~t & (t+1)) - 1) >> (trailing_zeros(v) + 1));
+}
+
+// Get the next permutation of an array with a fixed size and given number of
+// bits set.  Also known as next lexicographic permutation.
+// Given a bit array find the next lexicographic orginisation of the bits
+// Number of possible combinations given by (size choose bits_set) i.e. nCk
+// 00011 -> 00101 -> 00110 -> 01001 -> 01010 ->
+// 01100 -> 10001 -> 10010 -> 10100 -> 11000 -> 00011 (back to start)
+void bit_array_next_permutation(BIT_ARRAY* bitarr)
+{
+  if(bitarr->num_of_bits == 0)
+  {
+    return;
+  }
+
+  word_addr_t w;
+
+  char carry = 0;
+  word_offset_t top_bits = bitset64_idx(bitarr->num_of_bits);
+
+  for(w = 0; w < bitarr->num_of_words; w++)
+  {
+    word_t mask
+      = (w < bitarr->num_of_words - 1 || top_bits == 0) ? WORD_MAX
+                                                        : bitmask64(top_bits);
+
+    if(bitarr->words[w] > 0 &&
+       (bitarr->words[w] | (bitarr->words[w]-1)) == mask)
+    {
+      // Bits in this word cannot be moved forward
+      carry = 1;
+    }
+    else if(carry)
+    {
+      // 0111 -> 1000, 1000 -> 1001
+      word_t tmp = bitarr->words[w] + 1;
+
+      // Count bits previously set
+      bit_index_t bits_previously_set = POPCOUNT(bitarr->words[w]);
+
+      // set new word
+      _write_words(bitarr, 0, w+1);
+      bitarr->words[w] = tmp;
+
+      // note: w is unsigned
+      // Zero words while counting bits set
+      while(w > 0)
+      {
+        bits_previously_set += POPCOUNT(bitarr->words[w-1]);
+        bitarr->words[w-1] = 0;
+        w--;
+      }
+
+      // Set bits at the beginning
+      SET_REGION(bitarr, 0, bits_previously_set - POPCOUNT(tmp));
+
+      carry = 0;
+      break;
+    }
+    else if(bitarr->words[w] > 0)
+    {
+      _write_words(bitarr, w, 1);
+      bitarr->words[w] = _next_permutation(bitarr->words[w]);
+      break;
+    }
+  }
+
+  if(carry)
+  {
+    // Loop around
+    bit_index_t num_bits_set = bit_array_num_bits_set(bitarr);
+    bit_array_clear_all(bitarr);
+    SET_REGION(bitarr, 0, num_bits_set);
+  }
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Interleave
+//
+
+// dst cannot point to the same bit array as src1 or src2
+// src1, src2 may point to the same bit array
+// abcd 1234 -> a1b2c3d4
+// 0011 0000 -> 00001010
+// 1111 0000 -> 10101010
+// 0101 1010 -> 01100110
+void bit_array_interleave(BIT_ARRAY* dst,
+                          const BIT_ARRAY* src1,
+                          const BIT_ARRAY* src2)
+{
+  // dst cannot be either src1 or src2
+  assert(dst != src1 && dst != src2);
+  // Behaviour undefined when src1 length != src2 length",
+  assert(src1->num_of_bits == src2->num_of_bits);
+
+  bit_array_resize_critical(dst, src1->num_of_bits + src2->num_of_bits);
+
+  // Need at least src1->num_of_words + src2->num_of_words
+  size_t nwords = MIN(src1->num_of_words + src2->num_of_words, 2);
+  _bit_array_ensure_nwords(dst, nwords, __FILE__, __LINE__, __func__);
+  dst->num_of_bits = src1->num_of_bits + src2->num_of_bits;
+  dst->num_of_words = roundup_bits2words64(dst->num_of_bits);
+
+  word_addr_t i, j, hooked = 0;
+
+  for(i = 0, j = 0; i < src1->num_of_words; i++)
+  {
+    word_t a = src1->words[i];
+    word_t b = src2->words[i];
+
+    _store_word(dst, j++, morton_table0[(a      ) & 0xff] |
+                          morton_table1[(b      ) & 0xff] |
+                         (morton_table0[(a >>  8) & 0xff] << 16) |
+                         (morton_table1[(b >>  8) & 0xff] << 16) |
+                         (morton_table0[(a >> 16) & 0xff] << 32) |
+                         (morton_table1[(b >> 16) & 0xff] << 32) |
+                         (morton_table0[(a >> 24) & 0xff] << 48) |
+                         (morton_table1[(b >> 24) & 0xff] << 48), &hooked);
+
+    _store_word(dst, j++, morton_table0[(a >> 32) & 0xff] |
+                          morton_table1[(b >> 32) & 0xff] |
+                         (morton_table0[(a >> 40) & 0xff] << 16) |
+                         (morton_table1[(b >> 40) & 0xff] << 16) |
+                         (morton_table0[(a >> 48) & 0xff] << 32) |
+                         (morton_table1[(b >> 48) & 0xff] << 32) |
+                         (morton_table0[(a >> 56)       ] << 48) |
+                         (morton_table1[(b >> 56)       ] << 48), &hooked);
+  }
+
+  DEBUG_VALIDATE(dst);
+}
+
+//
+// Random
+//
+
+// xoshiro256** generator by David Blackman and Sebastiano Vigna (public domain)
+// http://prng.di.unimi.it/  Seeded with splitmix64.
+
+static inline uint64_t _splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t _rng_next(BIT_ARRAY_RNG *rng)
+{
+  uint64_t *s = rng->s;
+  uint64_t result = rot64(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rot64(s[3], 45);
+  return result;
+}
+
+// Uniform random number in [0, n), n > 0
+// Lemire's nearly divisionless method: https://arxiv.org/abs/1805.10941
+static inline uint64_t _rng_uniform(BIT_ARRAY_RNG *rng, uint64_t n)
+{
+  unsigned __int128 m = (unsigned __int128)_rng_next(rng) * n;
+  uint64_t l = (uint64_t)m;
+  if(l < n) {
+    uint64_t t = -n % n;
+    while(l < t) {
+      m = (unsigned __int128)_rng_next(rng) * n;
+      l = (uint64_t)m;
+    }
+  }
+  return (uint64_t)(m >> 64);
+}
+
+void bit_array_rng_seed(BIT_ARRAY_RNG *rng, uint64_t seed)
+{
+  int i;
+  for(i = 0; i < 4; i++) rng->s[i] = _splitmix64(&seed);
+}
+
+uint64_t bit_array_rng_next(BIT_ARRAY_RNG *rng)
+{
+  return _rng_next(rng);
+}
+
+// Equivalent to 2^128 calls to bit_array_rng_next()
+void bit_array_rng_jump(BIT_ARRAY_RNG *rng)
+{
+  static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                   0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i, b;
+
+  for(i = 0; i < 4; i++) {
+    for(b = 0; b < 64; b++) {
+      if(jump[i] & ((uint64_t)1 << b)) {
+        s0 ^= rng->s[0];
+        s1 ^= rng->s[1];
+        s2 ^= rng->s[2];
+        s3 ^= rng->s[3];
+      }
+      _rng_next(rng);
+    }
+  }
+
+  rng->s[0] = s0;
+  rng->s[1] = s1;
+  rng->s[2] = s2;
+  rng->s[3] = s3;
+}
+
+// One generator per thread, seeded from the clock on first use
+static __thread BIT_ARRAY_RNG thread_rng;
+static __thread char thread_rng_initiated = 0;
+
+static BIT_ARRAY_RNG* _thread_rng()
+{
+  if(!thread_rng_initiated)
+  {
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    uint64_t seed = ((uint64_t)time.tv_sec << 20) ^ (uint64_t)time.tv_usec ^
+                    ((uint64_t)getpid() << 32) ^ (uint64_t)(size_t)&thread_rng;
+    bit_array_rng_seed(&thread_rng, seed);
+    thread_rng_initiated = 1;
+  }
+  return &thread_rng;
+}
+
+// Probabilities are rounded to a multiple of 2^-RAND_PROB_BITS
+#define RAND_PROB_BITS 32
+
+// Generate a word where each bit is set with probability m / 2^k.
+// Each bit is set iff a k-bit random number U < m. The 64 comparisons are done
+// at once, a bit-slice at a time from the most significant bit of U. We stop
+// as soon as every bit is decided, which is ~8 random words on average
+// whatever the precision.
+static inline word_t _rng_bernoulli_word(BIT_ARRAY_RNG *rng, uint64_t m, int k)
+{
+  word_t r, mbit, result = 0, undecided = WORD_MAX;
+  int i;
+
+  for(i = k-1; i >= 0 && undecided; i--)
+  {
+    r = _rng_next(rng);
+    mbit = -(word_t)((m >> i) & 1);
+    // If this bit of m is 1: U < m where this bit of U is 0
+    // If this bit of m is 0: U > m where this bit of U is 1
+    result |= undecided & ~r & mbit;
+    undecided &= ~(r ^ mbit);
+  }
+
+  // Remaining undecided bits have U == m
+  return result;
+}
+
+// Fill words [first, first+nwords) of a single block, where the generator
+// `blockrng` is at the start of the block that word `first` is in
+static void _random_block(BIT_ARRAY* bitarr, word_addr_t first,
+                          word_addr_t nwords, float prob,
+                          const BIT_ARRAY_RNG *blockrng)
+{
+  uint64_t m = (uint64_t)((double)prob * ((uint64_t)1 << RAND_PROB_BITS) + 0.5);
+
+  _write_words(bitarr, first, nwords);
+
+  if(m == 0) {
+    memset(bitarr->words + first, 0, nwords * sizeof(word_t));
+    return;
+  }
+  else if(m >> RAND_PROB_BITS) {
+    memset(bitarr->words + first, 0xff, nwords * sizeof(word_t));
+    return;
+  }
+
+  // Drop trailing zeros: m / 2^k is the same probability with fewer slices
+  int tz = trailing_zeros(m);
+  int k = RAND_PROB_BITS - tz;
+  m >>= tz;
+
+  // Work on local copies: words and rng state are both uint64_t so may alias
+  BIT_ARRAY_RNG r = *blockrng;
+  word_t *words = bitarr->words;
+  word_addr_t w, skip = first % BIT_ARRAY_RNG_BLOCK_WORDS;
+  word_addr_t end = first + nwords;
+
+  if(k == 1) {
+    // prob == 0.5
+    for(w = 0; w < skip; w++) _rng_next(&r);
+    for(w = first; w < end; w++) words[w] = _rng_next(&r);
+  }
+  else {
+    for(w = 0; w < skip; w++) _rng_bernoulli_word(&r, m, k);
+    for(w = first; w < end; w++) words[w] = _rng_bernoulli_word(&r, m, k);
+  }
+}
+
+// Fill words [first_word, first_word+nwords) exactly as bit_array_random_r()
+// would fill them given the same `rng`. `rng` is not changed.
+void bit_array_random_words(BIT_ARRAY* bitarr, word_addr_t first_word,
+                            word_addr_t nwords, float prob,
+                            const BIT_ARRAY_RNG *rng)
+{
+  assert(prob >= 0 && prob <= 1);
+  assert(first_word + nwords <= bitarr->num_of_words);
+
+  if(nwords == 0) return;
+
+  BIT_ARRAY_RNG blockrng = *rng;
+  word_addr_t b, w = first_word, end = first_word + nwords;
+
+  for(b = 0; b < first_word / BIT_ARRAY_RNG_BLOCK_WORDS; b++)
+    bit_array_rng_jump(&blockrng);
+
+  while(w < end)
+  {
+    word_addr_t block_end = (w / BIT_ARRAY_RNG_BLOCK_WORDS + 1) *
+                            BIT_ARRAY_RNG_BLOCK_WORDS;
+    word_addr_t n = MIN(block_end, end) - w;
+    _random_block(bitarr, w, n, prob, &blockrng);
+    bit_array_rng_jump(&blockrng);
+    w += n;
+  }
+
+  if(end == bitarr->num_of_words) _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Set bits randomly with probability prob : 0 <= prob <= 1
+// rng is jumped once per block of BIT_ARRAY_RNG_BLOCK_WORDS words
+void bit_array_random_r(BIT_ARRAY* bitarr, float prob, BIT_ARRAY_RNG *rng)
+{
+  assert(prob >= 0 && prob <= 1);
+
+  word_addr_t w;
+
+  for(w = 0; w < bitarr->num_of_words; w += BIT_ARRAY_RNG_BLOCK_WORDS)
+  {
+    word_addr_t n = MIN(BIT_ARRAY_RNG_BLOCK_WORDS, bitarr->num_of_words - w);
+    _random_block(bitarr, w, n, prob, rng);
+    bit_array_rng_jump(rng);
+  }
+
+  if(bitarr->num_of_words > 0) _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Set bits randomly with probability prob : 0 <= prob <= 1
+// prob is rounded to the nearest multiple of 2^-32
+void bit_array_random(BIT_ARRAY* bitarr, float prob)
+{
+  bit_array_random_r(bitarr, prob, _thread_rng());
+}
+
+// Floyd's algorithm: choose k of n positions, using the array itself as the
+// set of positions chosen so far. Positions not yet chosen must be `!fill`.
+// O(k) time. Positions are chosen by setting them to `fill`.
+static void _floyd_sample(BIT_ARRAY* bitarr, bit_index_t k, char fill,
+                          BIT_ARRAY_RNG *rng)
+{
+  bit_index_t j, t, n = bitarr->num_of_bits;
+
+  for(j = n - k; j < n; j++)
+  {
+    t = _rng_uniform(rng, j+1);
+    if((char)bit_array_get(bitarr, t) == fill) t = j;
+    bit_array_assign(bitarr, t, fill);
+  }
+}
+
+// Set `d` uniformly chosen bits that are currently `!fill` to `fill`, by
+// rejection sampling. Bits equal to `!fill` must not be too rare.
+static void _reject_sample(BIT_ARRAY* bitarr, bit_index_t d, char fill,
+                           BIT_ARRAY_RNG *rng)
+{
+  bit_index_t t, n = bitarr->num_of_bits;
+
+  while(d > 0)
+  {
+    t = _rng_uniform(rng, n);
+    if((char)bit_array_get(bitarr, t) != fill) {
+      bit_array_assign(bitarr, t, fill);
+      d--;
+    }
+  }
+}
+
+// Set exactly k bits, chosen uniformly at random. Other bits are cleared.
+// Sparse arrays use Floyd's algorithm on an empty array, dense arrays do the
+// same for the zeros of a full array. Otherwise we fill with probability k/n
+// and then set or clear a few random bits to get exactly k set. A uniform
+// c-subset with d random elements added or removed is a uniform (c+-d)-subset.
+void bit_array_random_k(BIT_ARRAY* bitarr, bit_index_t k, BIT_ARRAY_RNG *rng)
+{
+  bit_index_t n = bitarr->num_of_bits;
+  assert(k <= n);
+
+  if(k <= n / WORD_SIZE)
+  {
+    bit_array_clear_all(bitarr);
+    _floyd_sample(bitarr, k, 1, rng);
+  }
+  else if(n - k <= n / WORD_SIZE)
+  {
+    bit_array_set_all(bitarr);
+    _floyd_sample(bitarr, n - k, 0, rng);
+  }
+  else
+  {
+    bit_array_random_r(bitarr, (float)((double)k / n), rng);
+    bit_index_t c = bit_array_num_bits_set(bitarr);
+    if(c < k) _reject_sample(bitarr, k - c, 1, rng);
+    else if(c > k) _reject_sample(bitarr, c - k, 0, rng);
+  }
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Shuffle the bits in an array randomly
+// The result only depends on the number of bits set, so we count them and then
+// choose a random set of positions for them
+void bit_array_shuffle_r(BIT_ARRAY* bitarr, BIT_ARRAY_RNG *rng)
+{
+  bit_array_random_k(bitarr, bit_array_num_bits_set(bitarr), rng);
+}
+
+// Shuffle the bits in an array randomly
+void bit_array_shuffle(BIT_ARRAY* bitarr)
+{
+  bit_array_shuffle_r(bitarr, _thread_rng());
+}
+
+//
+// Arithmetic
+//
+
+// Returns 1 on sucess, 0 if value in array is too big
+char bit_array_as_num(const BIT_ARRAY* bitarr, uint64_t* result)
+{
+  if(bitarr->num_of_bits == 0)
+  {
+    *result = 0;
+    return 1;
+  }
+
+  word_addr_t w;
+
+  for(w = bitarr->num_of_words-1; w > 0; w--)
+  {
+    if(bitarr->words[w] > 0)
+    {
+      return 0;
+    }
+  }
+
+  *result = bitarr->words[0];
+  return 1;
+}
+
+
+// 1 iff bitarr > value
+// 0 iff bitarr == value
+// -1 iff bitarr < value
+int bit_array_cmp_uint64(const BIT_ARRAY* bitarr, uint64_t value)
+{
+  uint64_t arr_num = 0;
+
+  // If cannot put bitarr in uint64, it is > value
+  if(!bit_array_as_num(bitarr, &arr_num)) return 1;
+
+  if(arr_num > value)      return  1;
+  else if(arr_num < value) return -1;
+  else                     return  0;
+}
+
+// If value is zero, no change is made
+void bit_array_add_uint64(BIT_ARRAY* bitarr, uint64_t value)
+{
+  if(value == 0)
+  {
+    return;
+  }
+  else if(bitarr->num_of_bits == 0)
+  {
+    bit_array_resize_critical(bitarr, WORD_SIZE - leading_zeros(value));
+    _write_words(bitarr, 0, 1);
+    bitarr->words[0] = (word_t)value;
+    return;
+  }
+
+  char carry = 0;
+  word_addr_t i;
+
+  for(i = 0; i < bitarr->num_of_words; i++)
+  {
+    _write_words(bitarr, i, 1);
+
+    if(WORD_MAX - bitarr->words[i] < value)
+    {
+      carry = 1;
+      bitarr->words[i] += value;
+      value = 1;
+    }
+    else
+    {
+      // Carry is absorbed
+      bitarr->words[i] += value;
+      carry = 0;
+      break;
+    }
+  }
+
+  if(carry)
+  {
+    // Bit array full, need another bit after all words filled
+    bit_array_resize_critical(bitarr, bitarr->num_of_words * WORD_SIZE + 1);
+
+    // Set top word to 1
+    _write_words(bitarr, bitarr->num_of_words-1, 1);
+    bitarr->words[bitarr->num_of_words-1] = 1;
+  }
+  else
+  {
+    word_t final_word = bitarr->words[bitarr->num_of_words-1];
+    word_offset_t expected_bits = bits_in_top_word(bitarr->num_of_bits);
+    word_offset_t actual_bits = WORD_SIZE - leading_zeros(final_word);
+
+    if(actual_bits > expected_bits)
+    {
+      // num_of_bits has increased -- num_of_words has not
+      bitarr->num_of_bits += (actual_bits - expected_bits);
+    }
+  }
+}
+
+// If value is greater than bitarr, bitarr is not changed and 0 is returned
+// Returns 1 on success, 0 if value > bitarr
+char bit_array_sub_uint64(BIT_ARRAY* bitarr, uint64_t value)
+{
+  if(value == 0)
+  {
+    return 1;
+  }
+
+  if(bitarr->words[0] >= value)
+  {
+    _write_words(bitarr, 0, 1);
+    bitarr->words[0] -= value;
+    return 1;
+  }
+
+  value -= bitarr->words[0];
+
+  word_addr_t i;
+
+  for(i = 1; i < bitarr->num_of_words; i++)
+  {
+    if(bitarr->words[i] > 0)
+    {
+      // deduct one
+      _write_words(bitarr, 0, i+1);
+      bitarr->words[i]--;
+
+      for(; i > 0; i--)
+      {
+        bitarr->words[i] = WORD_MAX;
+      }
+
+      // -1 since we've already deducted 1
+      bitarr->words[0] = WORD_MAX - value - 1;
+
+      return 1;
+    }
+  }
+
+  // subtract value is greater than array
+  return 0;
+}
+
+//
+// Arithmetic between bit arrays
+//
+
+// src1, src2 and dst can all be the same BIT_ARRAY
+static void _arithmetic(BIT_ARRAY* dst,
+                        const BIT_ARRAY* src1,
+                        const BIT_ARRAY* src2,
+                        char subtract)
+{
+  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
+
+  // Adding: dst_words >= max(src1 words, src2 words)
+  // Subtracting: dst_words is >= src1->num_of_words
+
+  char carry = subtract ? 1 : 0;
+
+  word_addr_t i, hooked = 0;
+  word_t word1, word2;
+
+  for(i = 0; i < max_words; i++)
+  {
+    word1 = (i < src1->num_of_words ? src1->words[i] : 0);
+    word2 = (i < src2->num_of_words ? src2->words[i] : 0);
+
+    if(subtract)
+      word2 = ~word2;
+
+    _store_word(dst, i, word1 + word2 + carry, &hooked);
+    // Update carry
+    carry = WORD_MAX - word1 < word2 || WORD_MAX - word1 - word2 < (word_t)carry;
+  }
+
+  if(subtract)
+  {
+    carry = 0;
+  }
+  else
+  {
+    // Check last word
+    word_offset_t bits_on_last_word = bits_in_top_word(dst->num_of_bits);
+
+    if(bits_on_last_word < WORD_SIZE)
+    {
+      word_t mask = bitmask64(bits_on_last_word);
+
+      if(dst->words[max_words-1] > mask)
+      {
+        // Array has overflowed, increase size
+        dst->num_of_bits++;
+      }
+    }
+    else if(carry)
+    {
+      // Carry onto a new word
+      if(dst->num_of_words == max_words)
+      {
+        // Need to resize for the carry bit
+        bit_array_resize_critical(dst, dst->num_of_bits+1);
+      }
+
+      _write_words(dst, max_words, 1);
+      dst->words[max_words] = (word_t)1;
+    }
+  }
+
+  // Zero the rest of dst array
+  _store_words(dst, max_words+carry, dst->num_of_words - (max_words+carry), 0);
+
+  DEBUG_VALIDATE(dst);
+}
+
+// src1, src2 and dst can all be the same BIT_ARRAY
+// If dst is shorter than either of src1, src2, it is enlarged
+void bit_array_add(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+{
+  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
+  _arithmetic(dst, src1, src2, 0);
+}
+
+// dst = src1 - src2
+// src1, src2 and dst can all be the same BIT_ARRAY
+// If dst is shorter than src1, it will be extended to be as long as src1
+// src1 must be greater than or equal to src2 (src1 >= src2)
+void bit_array_subtract(BIT_ARRAY* dst,
+                          const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+{
+  // subtraction by method of complements:
+  // a - b = a + ~b + 1 = src1 + ~src2 +1
+
+  assert(bit_array_cmp(src1, src2) >= 0); // Require src1 >= src2
+
+  bit_array_ensure_size_critical(dst, src1->num_of_bits);
+  _arithmetic(dst, src1, src2, 1);
+}
+
+
+// Add `add` to `bitarr` at `pos`
+// Bounds checking not needed as out of bounds is valid
+void bit_array_add_word(BIT_ARRAY *bitarr, bit_index_t pos, uint64_t add)
+{
+  DEBUG_VALIDATE(bitarr);
 
-  // Num of full words to copy
-  word_addr_t num_of_full_words = length / WORD_SIZE;
-  word_addr_t i;
+  if(add == 0)
+  {
+    return;
+  }
+  else if(pos >= bitarr->num_of_bits)
+  {
+    // Resize and add!
+    bit_index_t num_bits_required = pos + (WORD_SIZE - leading_zeros(add));
+    bit_array_resize_critical(bitarr, num_bits_required);
+    _set_word(bitarr, pos, (word_t)add);
+    return;
+  }
+
+  /*
+  char str[1000];
+  printf(" add_word: %s\n", bit_array_to_str_rev(bitarr, str));
+  printf("     word: %s [pos: %i]\n", _word_to_str(add, str), (int)pos);
+  */
+
+  word_t w = _get_word(bitarr, pos);
+  word_t sum = w + add;
+  char carry = WORD_MAX - w < add;
+
+  // Ensure array is big enough
+  bit_index_t num_bits_required = pos + (carry ? WORD_SIZE + 1
+                                               : (WORD_SIZE - leading_zeros(sum)));
+
+  bit_array_ensure_size_critical(bitarr, num_bits_required);
+
+  _set_word(bitarr, pos, sum);
+  pos += WORD_SIZE;
+
+  if(carry)
+  {
+    word_offset_t offset = pos % WORD_SIZE;
+    word_addr_t addr = bitset64_wrd(pos), hooked = 0;
+
+    add = (word_t)0x1 << offset;
+    carry = (WORD_MAX - bitarr->words[addr] < add);
+    sum = bitarr->words[addr] + add;
+
+    num_bits_required = addr * WORD_SIZE +
+                        (carry ? WORD_SIZE + 1 : (WORD_SIZE - leading_zeros(sum)));
+
+    bit_array_ensure_size_critical(bitarr, num_bits_required);
+
+    _store_word(bitarr, addr++, sum, &hooked);
+
+    if(carry)
+    {
+      while(addr < bitarr->num_of_words && bitarr->words[addr] == WORD_MAX)
+      {
+        _store_word(bitarr, addr++, 0, &hooked);
+      }
+
+      if(addr == bitarr->num_of_words)
+      {
+        bit_array_resize_critical(bitarr, addr * WORD_SIZE + 1);
+      }
+      else if(addr == bitarr->num_of_words-1 &&
+              bitarr->words[addr] == bitmask64(bits_in_top_word(bitarr->num_of_bits)))
+      {
+        bit_array_resize_critical(bitarr, bitarr->num_of_bits + 1);
+      }
+
+      _write_words(bitarr, addr, 1);
+      bitarr->words[addr]++;
+    }
+  }
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Add `add` to `bitarr` at `pos`
+// Bounds checking not needed as out of bounds is valid
+void bit_array_add_words(BIT_ARRAY *bitarr, bit_index_t pos, const BIT_ARRAY *add)
+{
+  assert(bitarr != add); // bitarr and add cannot point to the same bit array
+
+  bit_index_t add_top_bit_set;
+
+  if(!bit_array_find_last_set_bit(add, &add_top_bit_set))
+  {
+    // No bits set in add
+    return;
+  }
+  else if(pos >= bitarr->num_of_bits)
+  {
+    // Just resize and copy!
+    bit_index_t num_bits_required = pos + add_top_bit_set + 1;
+    bit_array_resize_critical(bitarr, num_bits_required);
+    _array_copy(bitarr, pos, add, 0, add->num_of_bits);
+    return;
+  }
+  else if(pos == 0)
+  {
+    bit_array_add(bitarr, bitarr, add);
+    return;
+  }
+
+  /*
+  char str[1000];
+  printf(" add_words1: %s\n", bit_array_to_str_rev(bitarr, str));
+  printf(" add_words2: %s\n", bit_array_to_str_rev(add, str));
+  printf(" [pos: %i]\n", (int)pos);
+  */
+
+  bit_index_t num_bits_required = pos + add_top_bit_set + 1;
+  bit_array_ensure_size_critical(bitarr, num_bits_required);
+
+  word_addr_t first_word = bitset64_wrd(pos);
+  word_offset_t first_offset = bitset64_idx(pos);
+
+  word_t w = add->words[0] << first_offset;
+  unsigned char carry = (WORD_MAX - bitarr->words[first_word] < w);
+
+  _write_words(bitarr, first_word, 1);
+  bitarr->words[first_word] += w;
+
+  word_addr_t i = first_word + 1;
+  bit_index_t offset = WORD_SIZE - first_offset;
+
+  for(; carry || offset <= add_top_bit_set; i++, offset += WORD_SIZE)
+  {
+    w = offset < add->num_of_bits ? _get_word(add, offset) : (word_t)0;
+
+    if(i >= bitarr->num_of_words)
+    {
+      // Extend by a word
+      bit_array_resize_critical(bitarr, (bit_index_t)(i+1)*WORD_SIZE+1);
+    }
+
+    word_t prev = bitarr->words[i];
+
+    _write_words(bitarr, i, 1);
+    bitarr->words[i] += w + carry;
+
+    carry = (WORD_MAX - prev < w || (carry && prev + w == WORD_MAX)) ? 1 : 0;
+  }
+
+  word_offset_t top_bits
+    = WORD_SIZE - leading_zeros(bitarr->words[bitarr->num_of_words-1]);
+
+  bit_index_t min_bits = (bitarr->num_of_words-1)*WORD_SIZE + top_bits;
+
+  if(bitarr->num_of_bits < min_bits)
+  {
+    // Extend within the last word
+    bitarr->num_of_bits = min_bits;
+  }
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+char bit_array_sub_word(BIT_ARRAY* bitarr, bit_index_t pos, word_t minus)
+{
+  DEBUG_VALIDATE(bitarr);
+
+  if(minus == 0)
+  {
+    return 1;
+  }
+
+  word_t w = _get_word(bitarr, pos);
+
+  if(w >= minus)
+  {
+    _set_word(bitarr, pos, w - minus);
+    DEBUG_VALIDATE(bitarr);
+    return 1;
+  }
+
+  minus -= w;
+
+  bit_index_t offset;
+  for(offset = pos + WORD_SIZE; offset < bitarr->num_of_bits; offset += WORD_SIZE)
+  {
+    w = _get_word(bitarr, offset);
+
+    if(w > 0)
+    {
+      // deduct one
+      _set_word(bitarr, offset, w - 1);
+
+      SET_REGION(bitarr, pos, offset-pos);
+
+      // -1 since we've already deducted 1
+      minus--;
+
+      _set_word(bitarr, pos, WORD_MAX - minus);
+
+      DEBUG_VALIDATE(bitarr);
+      return 1;
+    }
+  }
+
+  DEBUG_VALIDATE(bitarr);
+
+  return 0;
+}
+
+char bit_array_sub_words(BIT_ARRAY* bitarr, bit_index_t pos, BIT_ARRAY* minus)
+{
+  assert(bitarr != minus); // bitarr and minus cannot point to the same bit array
+
+  int cmp = bit_array_cmp_words(bitarr, pos, minus);
+
+  if(cmp == 0)
+  {
+    bit_array_clear_all(bitarr);
+    return 1;
+  }
+  else if(cmp < 0)
+  {
+    return 0;
+  }
+
+  bit_index_t bitarr_length = bitarr->num_of_bits;
+
+  bit_index_t bitarr_top_bit_set;
+  bit_array_find_last_set_bit(bitarr, &bitarr_top_bit_set);
+
+  // subtraction by method of complements:
+  // a - b = a + ~b + 1 = src1 + ~src2 +1
+
+  bit_array_not(minus, minus);
+
+  bit_array_add_words(bitarr, pos, minus);
+  bit_array_add_word(bitarr, pos, (word_t)1);
+
+  bit_array_sub_word(bitarr, pos+minus->num_of_bits, 1);
+  bit_array_resize(bitarr, bitarr_length);
+
+  bit_array_not(minus, minus);
+
+  DEBUG_VALIDATE(bitarr);
+
+  return 1;
+}
+
+void bit_array_mul_uint64(BIT_ARRAY *bitarr, uint64_t multiplier)
+{
+  if(bitarr->num_of_bits == 0 || multiplier == 1)
+  {
+    return;
+  }
+  else if(multiplier == 0)
+  {
+    bit_array_clear_all(bitarr);
+    return;
+  }
 
-  word_offset_t bits_in_last_word = bits_in_top_word(length);
+  bit_index_t i;
 
-  if(dst == src && srcindx > dstindx)
+  for(i = bitarr->num_of_bits; i > 0; i--)
   {
-    // Work left to right
-    DEBUG_PRINT("work left to right\n");
-
-    for(i = 0; i < num_of_full_words; i++)
+    if(bit_array_get(bitarr, i-1))
     {
-      word_t word = _get_word(src, srcindx+i*WORD_SIZE);
-      _set_word(dst, dstindx+i*WORD_SIZE, word);
+      bit_array_clear(bitarr, i-1);
+      bit_array_add_word(bitarr, i-1, multiplier);
     }
+  }
 
-    if(bits_in_last_word > 0)
-    {
-      word_t src_word = _get_word(src, srcindx+i*WORD_SIZE);
-      word_t dst_word = _get_word(dst, dstindx+i*WORD_SIZE);
+  DEBUG_VALIDATE(bitarr);
+}
 
-      word_t mask = bitmask64(bits_in_last_word);
-      word_t word = bitmask_merge(src_word, dst_word, mask);
+void bit_array_multiply(BIT_ARRAY *dst, BIT_ARRAY *src1, BIT_ARRAY *src2)
+{
+  if(src1->num_of_bits == 0 || src2->num_of_bits == 0)
+  {
+    bit_array_clear_all(dst);
+    return;
+  }
 
-      _set_word(dst, dstindx+num_of_full_words*WORD_SIZE, word);
-    }
+  // Cannot pass the same array as dst, src1 AND src2
+  assert(dst != src1 || dst != src2);
+
+  // Dev: multiplier == 1?
+
+  BIT_ARRAY *read_arr, *add_arr;
+
+  if(src1 == dst)
+  {
+    read_arr = src1;
+    add_arr = src2;
   }
   else
   {
-    // Work right to left
-    DEBUG_PRINT("work right to left\n");
+    read_arr = src2;
+    add_arr = src1;
+  }
 
-    for(i = 0; i < num_of_full_words; i++)
-    {
-      word_t word = _get_word(src, srcindx+length-(i+1)*WORD_SIZE);
-      _set_word(dst, dstindx+length-(i+1)*WORD_SIZE, word);
-    }
+  if(dst != src1 && dst != src2)
+  {
+    bit_array_clear_all(dst);
+  }
 
-    DEBUG_PRINT("Copy %i,%i to %i\n", (int)srcindx, (int)bits_in_last_word,
-                                      (int)dstindx);
+  bit_index_t i;
 
-    if(bits_in_last_word > 0)
+  for(i = read_arr->num_of_bits; i > 0; i--)
+  {
+    if(bit_array_get(read_arr, i-1))
     {
-      word_t src_word = _get_word(src, srcindx);
-      word_t dst_word = _get_word(dst, dstindx);
-
-      word_t mask = bitmask64(bits_in_last_word);
-      word_t word = bitmask_merge(src_word, dst_word, mask);
-      _set_word(dst, dstindx, word);
+      bit_array_clear(dst, i-1);
+      bit_array_add_words(dst, i-1, add_arr);
     }
   }
 
-  _mask_top_word(dst);
-}
-
-// destination and source may be the same bit_array
-// and src/dst regions may overlap
-void bit_array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
-                    const BIT_ARRAY* src, bit_index_t srcindx,
-                    bit_index_t length)
-{
-  assert(srcindx + length <= src->num_of_bits);
-  assert(dstindx <= dst->num_of_bits);
-  _array_copy(dst, dstindx, src, srcindx, length);
   DEBUG_VALIDATE(dst);
 }
 
-// Clone `src` into `dst`. Resizes `dst`.
-void bit_array_copy_all(BIT_ARRAY* dst, const BIT_ARRAY* src)
+// bitarr = round_down(bitarr / divisor)
+// rem = bitarr % divisor
+void bit_array_div_uint64(BIT_ARRAY *bitarr, uint64_t divisor, uint64_t *rem)
 {
-  bit_array_resize_critical(dst, src->num_of_bits);
-  memmove(dst->words, src->words, src->num_of_words * sizeof(word_t));
-  DEBUG_VALIDATE(dst);
-}
+  assert(divisor != 0); // cannot divide by zero
 
+  bit_index_t div_top_bit = 63 - leading_zeros(divisor);
+  bit_index_t bitarr_top_bit;
 
-//
-// Logic operators
-//
+  if(!bit_array_find_last_set_bit(bitarr, &bitarr_top_bit))
+  {
+    *rem = 0;
+    return;
+  }
 
-// Destination can be the same as one or both of the sources
-void bit_array_and(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
-{
-  // Ensure dst array is big enough
-  word_addr_t max_bits = MAX(src1->num_of_bits, src2->num_of_bits);
-  bit_array_ensure_size_critical(dst, max_bits);
+  if(bitarr_top_bit < div_top_bit)
+  {
+    *rem = bitarr->words[0];
+    bit_array_clear_all(bitarr);
+    return;
+  }
 
-  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
+  // When div is shifted by offset, their top set bits are aligned
+  bit_index_t offset = bitarr_top_bit - div_top_bit;
 
-  word_addr_t i;
+  uint64_t tmp = _get_word(bitarr, offset);
+  _set_word(bitarr, offset, (word_t)0);
 
-  for(i = 0; i < min_words; i++)
-  {
-    dst->words[i] = src1->words[i] & src2->words[i];
-  }
+  // Every bit below offset is assigned, so pass the range to the write hook
+  // once and skip it in the loop
+  _write_words(bitarr, 0, bitset64_wrd(offset) + 1);
 
-  // Set remaining bits to zero
-  for(i = min_words; i < dst->num_of_words; i++)
+  // Carry if 1 if the top bit was set before left shift
+  char carry = 0;
+
+  // offset unsigned so break when offset == 0
+  while(1)
   {
-    dst->words[i] = (word_t)0;
+    if(carry)
+    {
+      // (carry:tmp) - divisor = (WORD_MAX+1+tmp)-divisor
+      tmp = WORD_MAX - divisor + tmp + 1;
+      bitset_set(bitarr->words, offset);
+    }
+    else if(tmp >= divisor)
+    {
+      tmp -= divisor;
+      bitset_set(bitarr->words, offset);
+    }
+    else
+    {
+      bitset_del(bitarr->words, offset);
+    }
+
+    if(offset == 0)
+      break;
+
+    offset--;
+
+    // Is the top bit set (that we're about to shift off)?
+    carry = tmp & 0x8000000000000000;
+
+    tmp <<= 1;
+    tmp |= bit_array_get(bitarr, offset);
   }
 
-  DEBUG_VALIDATE(dst);
+  *rem = tmp;
 }
 
-// Destination can be the same as one or both of the sources
-static void _logical_or_xor(BIT_ARRAY* dst,
-                            const BIT_ARRAY* src1,
-                            const BIT_ARRAY* src2,
-                            char use_xor)
+// Results in:
+//   quotient = dividend / divisor
+//   dividend = dividend % divisor
+// (dividend is used to return the remainder)
+void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divisor)
 {
-  // Ensure dst array is big enough
-  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
+  assert(bit_array_cmp_uint64(divisor, 0) != 0); // Cannot divide by zero
 
-  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
-  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
+  bit_array_clear_all(quotient);
 
-  word_addr_t i;
+  int cmp = bit_array_cmp(dividend, divisor);
 
-  if(use_xor)
+  if(cmp == 0)
   {
-    for(i = 0; i < min_words; i++)
-      dst->words[i] = src1->words[i] ^ src2->words[i];
+    bit_array_ensure_size_critical(quotient, 1);
+    bit_array_set(quotient, 0);
+    bit_array_clear_all(dividend);
+    return;
   }
-  else
+  else if(cmp < 0)
   {
-    for(i = 0; i < min_words; i++)
-      dst->words[i] = src1->words[i] | src2->words[i];
+    // dividend is < divisor, quotient is zero -- done
+    return;
   }
 
-  // Copy remaining bits from longer src array
-  if(min_words != max_words)
-  {
-    const BIT_ARRAY* longer = src1->num_of_words > src2->num_of_words ? src1 : src2;
+  // now we know: dividend > divisor, quotient is zero'd,
+  //              dividend != 0, divisor != 0
+  bit_index_t dividend_top_bit = 0, div_top_bit = 0;
 
-    for(i = min_words; i < max_words; i++)
+  bit_array_find_last_set_bit(dividend, &dividend_top_bit);
+  bit_array_find_last_set_bit(divisor, &div_top_bit);
+
+  // When divisor is shifted by offset, their top set bits are aligned
+  bit_index_t offset = dividend_top_bit - div_top_bit;
+
+  // offset unsigned so break when offset == 0
+  for(; ; offset--)
+  {
+    if(bit_array_cmp_words(dividend, offset, divisor) >= 0)
     {
-      dst->words[i] = longer->words[i];
+      // Fails on the first (top) bit of a quotient too short to hold it,
+      // before dividend is changed
+      bit_array_ensure_size_critical(quotient, offset+1);
+      bit_array_sub_words(dividend, offset, divisor);
+      bit_array_set(quotient, offset);
     }
+
+    if(offset == 0)
+      break;
   }
+}
 
-  // Set remaining bits to zero
-  size_t size = (dst->num_of_words - max_words) * sizeof(word_t);
-  memset(dst->words + max_words, 0, size);
+//
+// Read/Write from files
+//
+// file format is [8 bytes: for number of elements in array][data]
+// data is written in little endian order (least sig byte first)
+//
+
+// Saves bit array to a file. Returns the number of bytes written
+// number of bytes returned should be 8+(bitarr->num_of_bits+7)/8
+bit_index_t bit_array_save(const BIT_ARRAY* bitarr, FILE* f)
+{
+  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
+  bit_index_t bytes_written = 0;
+
+  const int endian = 1;
+  if(*(uint8_t*)&endian == 1)
+  {
+    // Little endian machine
+    // Write 8 bytes to store the number of bits in the array
+    bytes_written += fwrite(&bitarr->num_of_bits, 1, 8, f);
+
+    // Write the array
+    bytes_written += fwrite(bitarr->words, 1, num_of_bytes, f);
+  }
+  else
+  {
+    // Big endian machine
+    uint64_t i, w, whole_words = num_of_bytes/sizeof(word_t);
+    uint64_t rem_bytes = num_of_bytes - whole_words*sizeof(word_t);
+    uint64_t n_bits = byteswap64(bitarr->num_of_bits);
+
+    // Write 8 bytes to store the number of bits in the array
+    bytes_written += fwrite(&n_bits, 1, 8, f);
+
+    // Write the array
+    for(i = 0; i < whole_words; i++) {
+      w = byteswap64(bitarr->words[i]);
+      bytes_written += fwrite(&w, 1, 8, f);
+    }
+
+    if(rem_bytes > 0) {
+      w = byteswap64(bitarr->words[whole_words]);
+      bytes_written += fwrite(&w, 1, rem_bytes, f);
+    }
+  }
 
-  DEBUG_VALIDATE(dst);
+  return bytes_written;
 }
 
-void bit_array_or(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+// Load a uint64 from little endian format.
+// Works for both big and little endian architectures
+static inline uint64_t le64_to_cpu(const uint8_t *x)
 {
-  _logical_or_xor(dst, src1, src2, 0);
+  return (((uint64_t)(x[0]))       | ((uint64_t)(x[1]) << 8)  |
+          ((uint64_t)(x[2]) << 16) | ((uint64_t)(x[3]) << 24) |
+          ((uint64_t)(x[4]) << 32) | ((uint64_t)(x[5]) << 40) |
+          ((uint64_t)(x[6]) << 48) | ((uint64_t)(x[7]) << 56));
 }
 
-// Destination can be the same as one or both of the sources
-void bit_array_xor(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+static inline uint32_t le32_to_cpu(const uint8_t *x)
 {
-  _logical_or_xor(dst, src1, src2, 1);
+  return (((uint32_t)(x[0]))       | ((uint32_t)(x[1]) << 8) |
+          ((uint32_t)(x[2]) << 16) | ((uint32_t)(x[3]) << 24));
 }
 
-// If dst is longer than src, top bits are set to 1
-void bit_array_not(BIT_ARRAY* dst, const BIT_ARRAY* src)
+static inline void cpu_to_le64(uint8_t *x, uint64_t v)
 {
-  bit_array_ensure_size_critical(dst, src->num_of_bits);
-
-  word_addr_t i;
-
-  for(i = 0; i < src->num_of_words; i++)
-  {
-    dst->words[i] = ~(src->words[i]);
-  }
-
-  // Set remaining words to 1s
-  for(i = src->num_of_words; i < dst->num_of_words; i++)
-  {
-    dst->words[i] = WORD_MAX;
-  }
-
-  _mask_top_word(dst);
+  int i;
+  for(i = 0; i < 8; i++) x[i] = (uint8_t)(v >> (8*i));
+}
 
-  DEBUG_VALIDATE(dst);
+static inline void cpu_to_le32(uint8_t *x, uint32_t v)
+{
+  int i;
+  for(i = 0; i < 4; i++) x[i] = (uint8_t)(v >> (8*i));
 }
 
 //
-// Comparisons
+// CRC32C (Castagnoli), used to check v2 files
+// Uses the SSE4.2 crc32 instruction when the CPU has it
 //
 
-// Compare two bit arrays by value stored, with index 0 being the Least
-// Significant Bit (LSB). Arrays do not have to be the same length.
-// Example: ..0101 (5) > ...0011 (3) [index 0 is LSB at right hand side]
-// Sorts on length if all zeros: (0,0) < (0,0,0)
-// returns:
-//  >0 iff bitarr1 > bitarr2
-//   0 iff bitarr1 == bitarr2
-//  <0 iff bitarr1 < bitarr2
-int bit_array_cmp(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
-{
-  word_addr_t i;
-  word_t word1, word2;
-  word_addr_t min_words = bitarr1->num_of_words;
-
-  // i is unsigned so break when i == 0
-  if(bitarr1->num_of_words > bitarr2->num_of_words) {
-    min_words = bitarr2->num_of_words;
-    for(i = bitarr1->num_of_words-1; ; i--) {
-      if(bitarr1->words[i]) return 1;
-      if(i == bitarr2->num_of_words) break;
-    }
-  }
-  else if(bitarr1->num_of_words < bitarr2->num_of_words) {
-    for(i = bitarr2->num_of_words-1; ; i--) {
-      if(bitarr2->words[i]) return 1;
-      if(i == bitarr1->num_of_words) break;
-    }
-  }
-
-  if(min_words == 0) return 0;
+// Set up once with pthread_once, crc32c() may be called from several threads
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
 
-  for(i = min_words-1; ; i--)
-  {
-    word1 = bitarr1->words[i];
-    word2 = bitarr2->words[i];
-    if(word1 != word2) return (word1 > word2 ? 1 : -1);
-    if(i == 0) break;
+static void _crc32c_init_table()
+{
+  uint32_t i, j, c;
+  for(i = 0; i < 256; i++) {
+    for(c = i, j = 0; j < 8; j++) c = (c >> 1) ^ (0x82F63B78U & (0U - (c & 1)));
+    crc32c_table[i] = c;
   }
-
-  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
-  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
 }
 
-// Compare two bit arrays by value stored, with index 0 being the Most
-// Significant Bit (MSB). Arrays do not have to be the same length.
-// Example: 10.. > 01.. [index 0 is MSB at left hand side]
-// Sorts on length if all zeros: (0,0) < (0,0,0)
-// returns:
-//  >0 iff bitarr1 > bitarr2
-//   0 iff bitarr1 == bitarr2
-//  <0 iff bitarr1 < bitarr2
-int bit_array_cmp_big_endian(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
+static uint32_t _crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
 {
-  word_addr_t min_words = MAX(bitarr1->num_of_words, bitarr2->num_of_words);
+  pthread_once(&crc32c_table_once, _crc32c_init_table);
+  crc = ~crc;
+  while(len--) crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
 
-  word_addr_t i;
-  word_t word1, word2;
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
 
-  for(i = 0; i < min_words; i++) {
-    word1 = _reverse_word(bitarr1->words[i]);
-    word2 = _reverse_word(bitarr2->words[i]);
-    if(word1 != word2) return (word1 > word2 ? 1 : -1);
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  uint64_t c = ~crc, w;
+  for(; len >= 8; buf += 8, len -= 8) {
+    memcpy(&w, buf, 8);
+    c = _mm_crc32_u64(c, w);
   }
+  for(; len > 0; buf++, len--) c = _mm_crc32_u8((uint32_t)c, *buf);
+  return ~(uint32_t)c;
+}
 
-  // Check remaining words. Only one of these loops will execute
-  for(; i < bitarr1->num_of_words; i++)
-    if(bitarr1->words[i]) return 1;
-  for(; i < bitarr2->num_of_words; i++)
-    if(bitarr2->words[i]) return -1;
+static int crc32c_have_sse42;
+static pthread_once_t crc32c_cpu_once = PTHREAD_ONCE_INIT;
 
-  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
-  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
+static void _crc32c_init_cpu()
+{
+  crc32c_have_sse42 = __builtin_cpu_supports("sse4.2");
 }
 
-// compare bitarr with (bitarr2 << pos)
-// bit_array_cmp(bitarr1, bitarr2<<pos)
-// returns:
-//  >0 iff bitarr1 > bitarr2
-//   0 iff bitarr1 == bitarr2
-//  <0 iff bitarr1 < bitarr2
-int bit_array_cmp_words(const BIT_ARRAY *arr1,
-                        bit_index_t pos, const BIT_ARRAY *arr2)
+static uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len)
 {
-  if(arr1->num_of_bits == 0 && arr2->num_of_bits == 0)
-  {
-    return 0;
-  }
+  pthread_once(&crc32c_cpu_once, _crc32c_init_cpu);
+  return crc32c_have_sse42 ? _crc32c_hw(crc, buf, len)
+                           : _crc32c_sw(crc, buf, len);
+}
+#else
+  #define crc32c _crc32c_sw
+#endif
 
-  bit_index_t top_bit1 = 0, top_bit2 = 0;
+//
+// Version 2 file format
+//
+// All fields little endian:
+//   [0]  8 bytes  magic "BITARRAY"
+//   [8]  4 bytes  version (2)
+//   [12] 4 bytes  chunk size in bytes (multiple of 8)
+//   [16] 8 bytes  number of bits
+//   [24] 8 bytes  number of bits set
+//   [32] 8 bytes  offset of rank index, 0 if none
+//   [40] 8 bytes  offset of payload (multiple of BIT_ARRAY_V2_ALIGN)
+//   [48] 4 bytes  CRC32C of the first 48 bytes
+//   [52] 12 bytes zero
+//   [64] 4 bytes per chunk: CRC32C of each chunk of the payload
+// Payload is num_of_words little endian words, zero padded to a multiple of
+// BIT_ARRAY_V2_ALIGN. Version 1 files start with the number of bits, which
+// cannot be the magic value as a file that long could not exist.
+//
 
-  char arr1_zero = !bit_array_find_last_set_bit(arr1, &top_bit1);
-  char arr2_zero = !bit_array_find_last_set_bit(arr2, &top_bit2);
+#define V2_MAGIC "BITARRAY"
+#define V2_HDR_SIZE 64
+#define V2_CHUNK_SIZE (1UL<<20)
 
-  if(arr1_zero && arr2_zero) return 0;
-  if(arr1_zero) return -1;
-  if(arr2_zero) return 1;
+static inline uint64_t _v2_num_chunks(word_addr_t nwords, size_t chunk_size)
+{
+  return (nwords * sizeof(word_t) + chunk_size - 1) / chunk_size;
+}
 
-  bit_index_t top_bit2_offset = top_bit2 + pos;
+static inline uint64_t _v2_payload_offset(uint64_t nchunks)
+{
+  uint64_t end = V2_HDR_SIZE + 4 * nchunks;
+  return (end + BIT_ARRAY_V2_ALIGN - 1) / BIT_ARRAY_V2_ALIGN * BIT_ARRAY_V2_ALIGN;
+}
 
-  if(top_bit1 != top_bit2_offset) {
-    return top_bit1 > top_bit2_offset ? 1 : -1;
-  }
+// Parse and check a v2 header. Returns 1 if valid, 0 otherwise
+static char _v2_read_header(const uint8_t *hdr, bit_index_t *num_bits,
+                            uint64_t *payload_offset, size_t *chunk_size)
+{
+  if(memcmp(hdr, V2_MAGIC, 8) != 0 || le32_to_cpu(hdr+8) != 2 ||
+     le32_to_cpu(hdr+48) != crc32c(0, hdr, 48)) return 0;
 
-  word_addr_t i;
-  word_t word1, word2;
+  *chunk_size = le32_to_cpu(hdr+12);
+  *num_bits = le64_to_cpu(hdr+16);
+  *payload_offset = le64_to_cpu(hdr+40);
 
-  for(i = top_bit2 / WORD_SIZE; i > 0; i--)
-  {
-    word1 = _get_word(arr1, pos + i * WORD_SIZE);
-    word2 = arr2->words[i];
+  return *chunk_size > 0 && *chunk_size % sizeof(word_t) == 0 &&
+         *payload_offset % BIT_ARRAY_V2_ALIGN == 0 &&
+         *payload_offset >= _v2_payload_offset(
+           _v2_num_chunks(roundup_bits2words64(*num_bits), *chunk_size));
+}
 
-    if(word1 > word2) return 1;
-    if(word1 < word2) return -1;
+// Saves bit array to a file in version 2 format.
+// Returns the number of bytes written
+bit_index_t bit_array_save_v2(const BIT_ARRAY* bitarr, FILE* f)
+{
+  const int endian = 1;
+  char little_endian = (*(uint8_t*)&endian == 1);
+  word_addr_t nwords = bitarr->num_of_words;
+  uint64_t c, nchunks = _v2_num_chunks(nwords, V2_CHUNK_SIZE);
+  uint64_t offset = _v2_payload_offset(nchunks);
+  size_t chunk_words = V2_CHUNK_SIZE / sizeof(word_t), n;
+  bit_index_t bytes_written = 0;
+  uint8_t hdr[V2_HDR_SIZE], pad[64] = {0};
+  uint64_t payload = nwords * sizeof(word_t), padding, i;
+  size_t buf_bytes = MIN(nwords, chunk_words) * sizeof(word_t);
+  word_t *buf = NULL;
+
+  // Big endian machines write swapped copies of each chunk
+  if(!little_endian && nwords > 0 &&
+     (buf = (word_t*)_ba_malloc(bitarr->allocator, buf_bytes)) == NULL) {
+    errno = ENOMEM;
+    return 0;
   }
 
-  word1 = _get_word(arr1, pos);
-  word2 = arr2->words[0];
-
-  if(word1 > word2) return 1;
-  if(word1 < word2) return -1;
-
-  // return 1 if arr1[0..pos] != 0, 0 otherwise
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, V2_MAGIC, 8);
+  cpu_to_le32(hdr+8, 2);
+  cpu_to_le32(hdr+12, (uint32_t)V2_CHUNK_SIZE);
+  cpu_to_le64(hdr+16, bitarr->num_of_bits);
+  cpu_to_le64(hdr+24, bit_array_num_bits_set(bitarr));
+  cpu_to_le64(hdr+32, 0);
+  cpu_to_le64(hdr+40, offset);
+  cpu_to_le32(hdr+48, crc32c(0, hdr, 48));
+  bytes_written += fwrite(hdr, 1, V2_HDR_SIZE, f);
+
+  // Chunk checksums
+  for(c = 0; c < nchunks; c++)
+  {
+    const word_t *src = bitarr->words + c * chunk_words;
+    n = MIN(chunk_words, nwords - c * chunk_words);
+    if(!little_endian) {
+      for(i = 0; i < n; i++) buf[i] = byteswap64(src[i]);
+      src = buf;
+    }
+    uint8_t crc[4];
+    cpu_to_le32(crc, crc32c(0, (const uint8_t*)src, n * sizeof(word_t)));
+    bytes_written += fwrite(crc, 1, 4, f);
+  }
 
-  // Whole words
-  word_addr_t num_words = pos / WORD_SIZE;
+  // Pad up to the payload
+  for(padding = offset - V2_HDR_SIZE - 4 * nchunks; padding > 0; padding -= n) {
+    n = MIN(padding, sizeof(pad));
+    bytes_written += fwrite(pad, 1, n, f);
+  }
 
-  for(i = 0; i < num_words; i++)
+  // Payload
+  for(c = 0; c < nchunks; c++)
   {
-    if(arr1->words[i] > 0)
-    {
-      return 1;
+    const word_t *src = bitarr->words + c * chunk_words;
+    n = MIN(chunk_words, nwords - c * chunk_words);
+    if(!little_endian) {
+      for(i = 0; i < n; i++) buf[i] = byteswap64(src[i]);
+      src = buf;
     }
+    bytes_written += fwrite(src, 1, n * sizeof(word_t), f);
   }
 
-  word_offset_t bits_remaining = pos - num_words * WORD_SIZE;
-
-  if(arr1->words[num_words] & bitmask64(bits_remaining))
-  {
-    return 1;
+  padding = (BIT_ARRAY_V2_ALIGN - payload % BIT_ARRAY_V2_ALIGN) % BIT_ARRAY_V2_ALIGN;
+  for(; padding > 0; padding -= n) {
+    n = MIN(padding, sizeof(pad));
+    bytes_written += fwrite(pad, 1, n, f);
   }
 
-  return 0;
+  _ba_free(bitarr->allocator, buf, buf_bytes);
+  return bytes_written;
 }
 
-
-//
-// Reverse -- coords may wrap around
-//
-
-// No bounds checking
-// length cannot be zero
-static void _reverse_region(BIT_ARRAY* bitarr,
-                            bit_index_t start,
-                            bit_index_t length)
+// Load the rest of a v2 file, after the magic has been read
+static char _load_v2(BIT_ARRAY* bitarr, FILE* f)
 {
-  bit_index_t left = start;
-  bit_index_t right = (start + length - WORD_SIZE) % bitarr->num_of_bits;
+  uint8_t hdr[V2_HDR_SIZE], *crcs = NULL;
+  bit_index_t num_bits;
+  uint64_t offset, c, nchunks, skip;
+  size_t chunk_size, chunk_words, n;
+  word_addr_t i, nwords;
+  char buf[256];
 
-  while(length >= 2 * WORD_SIZE)
-  {
-    // Swap entire words
-    word_t left_word = _get_word_cyclic(bitarr, left);
-    word_t right_word = _get_word_cyclic(bitarr, right);
+  memcpy(hdr, V2_MAGIC, 8);
+  if(fread(hdr+8, 1, V2_HDR_SIZE-8, f) != V2_HDR_SIZE-8 ||
+     !_v2_read_header(hdr, &num_bits, &offset, &chunk_size)) return 0;
 
-    // reverse words individually
-    left_word = _reverse_word(left_word);
-    right_word = _reverse_word(right_word);
+  nwords = roundup_bits2words64(num_bits);
+  nchunks = _v2_num_chunks(nwords, chunk_size);
+  chunk_words = chunk_size / sizeof(word_t);
 
-    // Swap
-    _set_word_cyclic(bitarr, left, right_word);
-    _set_word_cyclic(bitarr, right, left_word);
+  if((crcs = (uint8_t*)_ba_malloc(bitarr->allocator, 4 * nchunks + 1)) == NULL)
+    return 0;
+  if(fread(crcs, 1, 4 * nchunks, f) != 4 * nchunks) goto fail;
 
-    // Update
-    left = (left + WORD_SIZE) % bitarr->num_of_bits;
-    right = (right < WORD_SIZE ? right + bitarr->num_of_bits : right) - WORD_SIZE;
-    length -= 2 * WORD_SIZE;
+  // Skip to the payload
+  for(skip = offset - V2_HDR_SIZE - 4 * nchunks; skip > 0; skip -= n) {
+    n = MIN(skip, sizeof(buf));
+    if(fread(buf, 1, n, f) != n) goto fail;
   }
 
-  word_t word, rev;
+  if(!_resize_result(bitarr, num_bits)) goto fail;
+  _write_words(bitarr, 0, bitarr->num_of_words);
 
-  if(length == 0)
+  // Check each chunk as it is read, while it is still in cache
+  for(c = 0; c < nchunks; c++)
   {
-    return;
+    word_t *dst = bitarr->words + c * chunk_words;
+    n = MIN(chunk_words, nwords - c * chunk_words) * sizeof(word_t);
+    if(fread(dst, 1, n, f) != n ||
+       crc32c(0, (uint8_t*)dst, n) != le32_to_cpu(crcs + 4*c)) goto fail;
   }
-  else if(length > WORD_SIZE)
-  {
-    // Words overlap
-    word_t left_word = _get_word_cyclic(bitarr, left);
-    word_t right_word = _get_word_cyclic(bitarr, right);
-
-    rev = _reverse_word(left_word);
-    right_word = _reverse_word(right_word);
-
-    // fill left 64 bits with right word rev
-    _set_word_cyclic(bitarr, left, right_word);
-
-    // Now do remaining bits (length is between 1 and 64 bits)
-    left += WORD_SIZE;
-    length -= WORD_SIZE;
 
-    word = _get_word_cyclic(bitarr, left);
-  }
-  else
-  {
-    word = _get_word_cyclic(bitarr, left);
-    rev = _reverse_word(word);
+  // Skip padding after the payload
+  skip = (BIT_ARRAY_V2_ALIGN - (nwords * sizeof(word_t)) % BIT_ARRAY_V2_ALIGN) %
+         BIT_ARRAY_V2_ALIGN;
+  for(; skip > 0; skip -= n) {
+    n = MIN(skip, sizeof(buf));
+    if(fread(buf, 1, n, f) != n) goto fail;
   }
 
-  rev >>= WORD_SIZE - length;
-  word_t mask = bitmask64(length);
+  _ba_free(bitarr->allocator, crcs, 4 * nchunks + 1);
 
-  word = bitmask_merge(rev, word, mask);
+  // Fix endianness
+  for(i = 0; i < nwords; i++)
+    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
 
-  _set_word_cyclic(bitarr, left, word);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
+
+  fail:
+  _ba_free(bitarr->allocator, crcs, 4 * nchunks + 1);
+  return 0;
 }
 
-void bit_array_reverse_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+// Reads bit array from a file (version 1 or 2). bitarr is resized and filled.
+// Returns 1 on success, 0 on failure
+char bit_array_load(BIT_ARRAY* bitarr, FILE* f)
 {
-  assert(start + len <= bitarr->num_of_bits);
-  if(len > 0) _reverse_region(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
-}
+  // Read in number of bits (or v2 magic), return 0 if we can't read in
+  bit_index_t num_bits;
+  if(fread(&num_bits, 1, 8, f) != 8) return 0;
+  if(memcmp(&num_bits, V2_MAGIC, 8) == 0) return _load_v2(bitarr, f);
+  num_bits = le64_to_cpu((uint8_t*)&num_bits);
+
+  // Resize
+  if(!_resize_result(bitarr, num_bits)) return 0;
+  _write_words(bitarr, 0, bitarr->num_of_words);
+
+  // Have to calculate how many bytes are needed for the file
+  // (Note: this may be different from num_of_words * sizeof(word_t))
+  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
+  if(fread(bitarr->words, 1, num_of_bytes, f) != num_of_bytes) return 0;
+
+  // Fix endianness
+  word_addr_t i;
+  for(i = 0; i < bitarr->num_of_words; i++)
+    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
 
-void bit_array_reverse(BIT_ARRAY* bitarr)
-{
-  if(bitarr->num_of_bits > 0) _reverse_region(bitarr, 0, bitarr->num_of_bits);
+  // Mask top word
+  _mask_top_word(bitarr);
   DEBUG_VALIDATE(bitarr);
+  return 1;
 }
 
 //
-// Shift left / right
+// Partial save/load
 //
 
-// Shift towards MSB / higher index
-void bit_array_shift_left(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
+// Skip forward n bytes, seeking if possible
+static char _file_skip(FILE *f, uint64_t n)
 {
-  if(shift_dist >= bitarr->num_of_bits)
-  {
-    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
-    return;
-  }
-  else if(shift_dist == 0)
-  {
-    return;
-  }
+  char buf[4096];
+  size_t m;
 
-  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+  if(n == 0) return 1;
+  if(n <= (uint64_t)INT64_MAX && fseeko(f, (off_t)n, SEEK_CUR) == 0) return 1;
 
-  bit_index_t cpy_length = bitarr->num_of_bits - shift_dist;
-  _array_copy(bitarr, shift_dist, bitarr, 0, cpy_length);
-  _set_region(bitarr, 0, shift_dist, action);
+  for(; n > 0; n -= m) {
+    m = (size_t)MIN(n, sizeof(buf));
+    if(fread(buf, 1, m, f) != m) return 0;
+  }
+  return 1;
 }
 
-// shift left extend - don't truncate bits when shifting UP, instead
-// make room for them.
-void bit_array_shift_left_extend(BIT_ARRAY* bitarr, bit_index_t shift_dist,
-                                 char fill)
+// Saves bits [start, start+len) to a file in version 1 format, as if saving
+// a copy of the region. Returns the number of bytes written
+bit_index_t bit_array_save_range(const BIT_ARRAY* bitarr, FILE* f,
+                                 bit_index_t start, bit_index_t len)
 {
-   bit_index_t newlen = bitarr->num_of_bits + shift_dist;
-   bit_index_t cpy_length = bitarr->num_of_bits;
+  assert(start + len <= bitarr->num_of_bits);
 
-  if(shift_dist == 0)
+  word_t buf[512];
+  bit_index_t i, num_of_bytes = roundup_bits2bytes(len), bytes_written = 0;
+  size_t n = 0, nbytes;
+  uint8_t hdr[8];
+
+  cpu_to_le64(hdr, len);
+  bytes_written += fwrite(hdr, 1, 8, f);
+
+  for(i = 0; i < len; i += WORD_SIZE)
   {
-    return;
-  }
+    word_t w = _get_word(bitarr, start + i);
+    if(len - i < WORD_SIZE) w &= bitmask64(len - i);
+    cpu_to_le64((uint8_t*)&buf[n++], w);
 
-  bit_array_resize_critical(bitarr, newlen);
+    if(n == sizeof(buf)/sizeof(buf[0]) || i + WORD_SIZE >= len) {
+      // Last word may only be partly written
+      nbytes = MIN(n * sizeof(word_t), num_of_bytes - (bytes_written - 8));
+      bytes_written += fwrite(buf, 1, nbytes, f);
+      n = 0;
+    }
+  }
 
-  FillAction action = fill ? FILL_REGION : ZERO_REGION;
-  _array_copy(bitarr, shift_dist, bitarr, 0, cpy_length);
-  _set_region(bitarr, 0, shift_dist, action);
+  return bytes_written;
 }
 
-// Shift towards LSB / lower index
-void bit_array_shift_right(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
+// Reads bits [start, start+len) of a file saved in version 1 or 2 format.
+// Only the words covering the range are read. bitarr is resized to len.
+// Returns 1 on success, 0 on failure
+char bit_array_load_range(BIT_ARRAY* bitarr, FILE* f,
+                          bit_index_t start, bit_index_t len)
 {
-  if(shift_dist >= bitarr->num_of_bits)
-  {
-    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
-    return;
+  uint8_t hdr[V2_HDR_SIZE];
+  bit_index_t num_bits;
+  uint64_t offset, header_read = 8;
+  size_t chunk_size;
+  word_addr_t i, first, nwords;
+  word_offset_t shift = bitset64_idx(start);
+  bit_index_t file_bytes, nbytes;
+
+  if(fread(hdr, 1, 8, f) != 8) return 0;
+
+  if(memcmp(hdr, V2_MAGIC, 8) == 0) {
+    if(fread(hdr+8, 1, V2_HDR_SIZE-8, f) != V2_HDR_SIZE-8 ||
+       !_v2_read_header(hdr, &num_bits, &offset, &chunk_size)) return 0;
+    header_read = V2_HDR_SIZE;
   }
-  else if(shift_dist == 0)
-  {
-    return;
+  else {
+    num_bits = le64_to_cpu(hdr);
+    offset = 8;
   }
 
-  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+  if(start > num_bits || len > num_bits - start) return 0;
 
-  bit_index_t cpy_length = bitarr->num_of_bits - shift_dist;
-  bit_array_copy(bitarr, 0, bitarr, shift_dist, cpy_length);
+  // Words covering the range: [first, first+nwords)
+  first = bitset64_wrd(start);
+  nwords = roundup_bits2words64(shift + len);
 
-  _set_region(bitarr, cpy_length, shift_dist, action);
+  // Size of the payload in the file (v1 files can end with a partial word)
+  file_bytes = roundup_bits2bytes(num_bits);
+  nbytes = MIN(nwords * sizeof(word_t), file_bytes - first * sizeof(word_t));
+
+  if(!_file_skip(f, offset - header_read + first * sizeof(word_t))) return 0;
+
+  // Read covering words then shift them down into place
+  if(!_resize_result(bitarr, nwords * WORD_SIZE)) return 0;
+  _write_words(bitarr, 0, bitarr->num_of_words);
+  if(nwords > 0 && fread(bitarr->words, 1, nbytes, f) != nbytes) return 0;
+  if(nbytes < nwords * sizeof(word_t))
+    memset((uint8_t*)bitarr->words + nbytes, 0, nwords * sizeof(word_t) - nbytes);
+
+  for(i = 0; i < nwords; i++)
+    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
+
+  if(shift > 0) {
+    for(i = 0; i + 1 < nwords; i++)
+      bitarr->words[i] = (bitarr->words[i] >> shift) |
+                         (bitarr->words[i+1] << (WORD_SIZE - shift));
+    if(nwords > 0) bitarr->words[nwords-1] >>= shift;
+  }
+
+  if(!_resize_result(bitarr, len)) return 0;
+  DEBUG_VALIDATE(bitarr);
+  return 1;
 }
 
 //
-// Cycle
+// Compressed files
+//
+// Word aligned run length encoding in the style of EWAH (Lemire et al.).
+// File is [8 bytes: magic "BITAEWAH"][8 bytes: number of bits] then groups of
+// [marker word][literal words]. A marker word holds:
+//   bit 0      value of the run of clean words (all 0 or all 1)
+//   bits 1-32  number of clean words in the run
+//   bits 33-63 number of literal words that follow the marker
+// All words are little endian. Runs and literals cover num_of_words words.
 //
 
-// Cycle towards index 0
-void bit_array_cycle_right(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
+#define EWAH_MAGIC "BITAEWAH"
+#define EWAH_MAX_RUN ((1ULL<<32)-1)
+#define EWAH_MAX_LITERALS ((1ULL<<31)-1)
+#define EWAH_BUF_WORDS 4096
+
+static inline word_t _ewah_marker(char bit, uint64_t run, uint64_t nlit)
 {
-  if(bitarr->num_of_bits == 0)
-  {
-    return;
-  }
+  return (word_t)bit | (run << 1) | (nlit << 33);
+}
 
-  cycle_dist = cycle_dist % bitarr->num_of_bits;
+// Saves bit array to a file, compressing runs of 0 or 1 words.
+// Returns the number of bytes written
+bit_index_t bit_array_save_compressed(const BIT_ARRAY* bitarr, FILE* f)
+{
+  const word_t *words = bitarr->words;
+  word_addr_t i = 0, j, nwords = bitarr->num_of_words;
+  word_t buf[EWAH_BUF_WORDS];
+  size_t nbuf = 0;
+  uint64_t run, nlit;
+  bit_index_t bytes_written = 0;
+  uint8_t hdr[16];
+  char bit;
 
-  if(cycle_dist == 0)
+  memcpy(hdr, EWAH_MAGIC, 8);
+  cpu_to_le64(hdr+8, bitarr->num_of_bits);
+  bytes_written += fwrite(hdr, 1, 16, f);
+
+  while(i < nwords)
   {
-    return;
-  }
+    // Need room for a marker and at least one literal
+    if(nbuf + 2 > EWAH_BUF_WORDS) {
+      bytes_written += fwrite(buf, 1, nbuf * sizeof(word_t), f);
+      nbuf = 0;
+    }
 
-  bit_index_t len1 = cycle_dist;
-  bit_index_t len2 = bitarr->num_of_bits - cycle_dist;
+    // Run of clean words
+    bit = (words[i] == WORD_MAX);
+    run = 0;
+    if(words[i] == 0 || words[i] == WORD_MAX) {
+      for(j = i; j < nwords && words[j] == words[i] && run < EWAH_MAX_RUN; j++)
+        run++;
+      i = j;
+    }
 
-  _reverse_region(bitarr, 0, len1);
-  _reverse_region(bitarr, len1, len2);
-  bit_array_reverse(bitarr);
+    // Literal words, as many as fit in the buffer
+    for(j = i; j < nwords && words[j] != 0 && words[j] != WORD_MAX &&
+               j - i < EWAH_MAX_LITERALS && nbuf + 1 + (j-i) < EWAH_BUF_WORDS; j++)
+    {
+      cpu_to_le64((uint8_t*)&buf[nbuf + 1 + (j-i)], words[j]);
+    }
+
+    nlit = j - i;
+    cpu_to_le64((uint8_t*)&buf[nbuf], _ewah_marker(bit, run, nlit));
+    nbuf += 1 + nlit;
+    i = j;
+  }
+
+  bytes_written += fwrite(buf, 1, nbuf * sizeof(word_t), f);
+  return bytes_written;
 }
 
-// Cycle away from index 0
-void bit_array_cycle_left(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
+// Reads a bit array saved with bit_array_save_compressed(). Runs are filled
+// with memset and literal words are read straight into the array.
+// Returns 1 on success, 0 on failure
+char bit_array_load_compressed(BIT_ARRAY* bitarr, FILE* f)
 {
-  if(bitarr->num_of_bits == 0)
-  {
-    return;
-  }
+  uint8_t hdr[16];
+  word_t marker;
+  word_addr_t i = 0, k, nwords;
+  uint64_t run, nlit;
 
-  cycle_dist = cycle_dist % bitarr->num_of_bits;
+  if(fread(hdr, 1, 16, f) != 16 || memcmp(hdr, EWAH_MAGIC, 8) != 0) return 0;
 
-  if(cycle_dist == 0)
+  if(!_resize_result(bitarr, le64_to_cpu(hdr+8))) return 0;
+  _write_words(bitarr, 0, bitarr->num_of_words);
+  nwords = bitarr->num_of_words;
+
+  while(i < nwords)
   {
-    return;
-  }
+    if(fread(&marker, 1, 8, f) != 8) return 0;
+    marker = le64_to_cpu((uint8_t*)&marker);
+    run = (marker >> 1) & EWAH_MAX_RUN;
+    nlit = marker >> 33;
+    if(run + nlit > nwords - i) return 0;
 
-  bit_index_t len1 = bitarr->num_of_bits - cycle_dist;
-  bit_index_t len2 = cycle_dist;
+    memset(bitarr->words + i, (marker & 1) ? 0xff : 0, run * sizeof(word_t));
+    i += run;
 
-  _reverse_region(bitarr, 0, len1);
-  _reverse_region(bitarr, len1, len2);
-  bit_array_reverse(bitarr);
+    if(fread(bitarr->words + i, sizeof(word_t), nlit, f) != nlit) return 0;
+    for(k = i; k < i + nlit; k++)
+      bitarr->words[k] = le64_to_cpu((uint8_t*)&bitarr->words[k]);
+    i += nlit;
+  }
+
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
 }
 
 //
-// Next permutation
+// XOR deltas
+//
+// File is [8 bytes: magic "BITADLTA"][8 bytes: length of from in bits]
+// [8 bytes: length of to in bits] then records covering the words of
+// from ^ to (from is zero past its end). Each record is two
+// varints (LEB128): the number of zero words skipped, then a command
+//   (n << 2) | 0   one word with n bits set, followed by n bytes of offsets
+//   (n << 2) | 1   n literal words follow (8 bytes each, little endian)
+//   (n << 2) | 2   n words of all ones
+//   3              end of the delta
 //
 
-static word_t _next_permutation(word_t v)
+#define DELTA_MAGIC "BITADLTA"
+#define DELTA_MAX_OFFSETS 7 // more bits than this are cheaper as a literal
+#define DELTA_MAX_LITERALS 64
+#define DELTA_BUF_BYTES 8192
+// Largest record: two varints and a group of literals
+#define DELTA_MAX_RECORD (20 + DELTA_MAX_LITERALS * sizeof(word_t))
+
+// Word i of from ^ to, ignoring bits of from past the end of to
+static inline word_t _delta_word(const BIT_ARRAY* from, const BIT_ARRAY* to,
+                                 word_addr_t i)
 {
-  assert(v);
-  // From http://graphics.stanford.edu/~seander/bithacks.html#NextBitPermutation
-  word_t t = v | (v - 1); // t gets v's least significant 0 bits set to 1
-  // Next set to 1 the most significant bit to change,
-  // set to 0 the least significant ones, and add the necessary 1 bits.
-  return (t+1) | (((~t & (t+1)) - 1) >> (trailing_zeros(v) + 1));
+  word_t x = (i < from->num_of_words ? from->words[i] : 0) ^ to->words[i];
+  if(i + 1 == to->num_of_words)
+    x &= bitmask64(bits_in_top_word(to->num_of_bits));
+  return x;
 }
 
-// Get the next permutation of an array with a fixed size and given number of
-// bits set.  Also known as next lexicographic permutation.
-// Given a bit array find the next lexicographic orginisation of the bits
-// Number of possible combinations given by (size choose bits_set) i.e. nCk
-// 00011 -> 00101 -> 00110 -> 01001 -> 01010 ->
-// 01100 -> 10001 -> 10010 -> 10100 -> 11000 -> 00011 (back to start)
-void bit_array_next_permutation(BIT_ARRAY* bitarr)
+static inline size_t _put_varint(uint8_t *buf, uint64_t v)
 {
-  if(bitarr->num_of_bits == 0)
-  {
-    return;
+  size_t n = 0;
+  for(; v >= 0x80; v >>= 7) buf[n++] = (uint8_t)(v | 0x80);
+  buf[n++] = (uint8_t)v;
+  return n;
+}
+
+static char _get_varint(FILE* f, uint64_t *v)
+{
+  int c, shift;
+  *v = 0;
+  for(shift = 0; shift < 64; shift += 7) {
+    if((c = getc(f)) == EOF) return 0;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if(!(c & 0x80)) return 1;
   }
+  return 0;
+}
 
-  word_addr_t w;
+// Writes the changes that turn `from` into `to`, which may differ in length.
+// Neither array is copied. Returns the number of bytes written
+bit_index_t bit_array_delta_encode(const BIT_ARRAY* from, const BIT_ARRAY* to,
+                                   FILE* f)
+{
+  word_addr_t i = 0, j, nwords = to->num_of_words;
+  uint64_t skip = 0;
+  uint8_t buf[DELTA_BUF_BYTES];
+  size_t nbuf = 0;
+  bit_index_t bytes_written = 0;
+  word_t x;
 
-  char carry = 0;
-  word_offset_t top_bits = bitset64_idx(bitarr->num_of_bits);
+  memcpy(buf, DELTA_MAGIC, 8);
+  cpu_to_le64(buf+8, from->num_of_bits);
+  cpu_to_le64(buf+16, to->num_of_bits);
+  nbuf = 24;
 
-  for(w = 0; w < bitarr->num_of_words; w++)
+  for(i = 0; i < nwords; )
   {
-    word_t mask
-      = (w < bitarr->num_of_words - 1 || top_bits == 0) ? WORD_MAX
-                                                        : bitmask64(top_bits);
+    if((x = _delta_word(from, to, i)) == 0) { skip++; i++; continue; }
 
-    if(bitarr->words[w] > 0 &&
-       (bitarr->words[w] | (bitarr->words[w]-1)) == mask)
-    {
-      // Bits in this word cannot be moved forward
-      carry = 1;
+    if(nbuf + DELTA_MAX_RECORD > DELTA_BUF_BYTES) {
+      bytes_written += fwrite(buf, 1, nbuf, f);
+      nbuf = 0;
     }
-    else if(carry)
-    {
-      // 0111 -> 1000, 1000 -> 1001
-      word_t tmp = bitarr->words[w] + 1;
-
-      // Count bits previously set
-      bit_index_t bits_previously_set = POPCOUNT(bitarr->words[w]);
-
-      // set new word
-      bitarr->words[w] = tmp;
-
-      // note: w is unsigned
-      // Zero words while counting bits set
-      while(w > 0)
-      {
-        bits_previously_set += POPCOUNT(bitarr->words[w-1]);
-        bitarr->words[w-1] = 0;
-        w--;
-      }
 
-      // Set bits at the beginning
-      SET_REGION(bitarr, 0, bits_previously_set - POPCOUNT(tmp));
+    nbuf += _put_varint(buf+nbuf, skip);
+    skip = 0;
 
-      carry = 0;
-      break;
+    if(x == WORD_MAX)
+    {
+      // Run of all ones (e.g. a toggled region)
+      for(j = i+1; j < nwords && _delta_word(from, to, j) == WORD_MAX; j++) {}
+      nbuf += _put_varint(buf+nbuf, ((j-i) << 2) | 2);
+      i = j;
     }
-    else if(bitarr->words[w] > 0)
+    else if(POPCOUNT(x) <= DELTA_MAX_OFFSETS)
     {
-      bitarr->words[w] = _next_permutation(bitarr->words[w]);
-      break;
+      nbuf += _put_varint(buf+nbuf, ((uint64_t)POPCOUNT(x) << 2) | 0);
+      for(; x; x &= x - 1) buf[nbuf++] = (uint8_t)trailing_zeros(x);
+      i++;
+    }
+    else
+    {
+      // Literal words, until a word that is cheaper another way
+      for(j = i; j < nwords && j - i < DELTA_MAX_LITERALS; j++) {
+        x = _delta_word(from, to, j);
+        if(x == WORD_MAX || POPCOUNT(x) <= DELTA_MAX_OFFSETS) break;
+      }
+      nbuf += _put_varint(buf+nbuf, ((j-i) << 2) | 1);
+      for(; i < j; i++, nbuf += sizeof(word_t))
+        cpu_to_le64(buf+nbuf, _delta_word(from, to, i));
     }
   }
 
-  if(carry)
-  {
-    // Loop around
-    bit_index_t num_bits_set = bit_array_num_bits_set(bitarr);
-    bit_array_clear_all(bitarr);
-    SET_REGION(bitarr, 0, num_bits_set);
+  if(nbuf + 2 > DELTA_BUF_BYTES) {
+    bytes_written += fwrite(buf, 1, nbuf, f);
+    nbuf = 0;
   }
-
-  DEBUG_VALIDATE(bitarr);
+  buf[nbuf++] = 0;
+  buf[nbuf++] = 3;
+  bytes_written += fwrite(buf, 1, nbuf, f);
+  return bytes_written;
 }
 
-
-//
-// Interleave
-//
-
-// dst cannot point to the same bit array as src1 or src2
-// src1, src2 may point to the same bit array
-// abcd 1234 -> a1b2c3d4
-// 0011 0000 -> 00001010
-// 1111 0000 -> 10101010
-// 0101 1010 -> 01100110
-void bit_array_interleave(BIT_ARRAY* dst,
-                          const BIT_ARRAY* src1,
-                          const BIT_ARRAY* src2)
+// Applies a delta written by bit_array_delta_encode() to bitarr, which must
+// hold the first array. Words are changed in place as the delta is read.
+// Returns 1 on success, 0 on failure. If the delta is for an array of another
+// length bitarr is not changed, if it is corrupt bitarr may be partly changed
+char bit_array_delta_apply(BIT_ARRAY* bitarr, FILE* f)
 {
-  // dst cannot be either src1 or src2
-  assert(dst != src1 && dst != src2);
-  // Behaviour undefined when src1 length != src2 length",
-  assert(src1->num_of_bits == src2->num_of_bits);
+  uint8_t hdr[24], offsets[DELTA_MAX_OFFSETS];
+  bit_index_t new_bits;
+  word_addr_t i = 0, j, nwords;
+  uint64_t skip, cmd, n;
+  word_t x;
 
-  // Need at least src1->num_of_words + src2->num_of_words
-  size_t nwords = MIN(src1->num_of_words + src2->num_of_words, 2);
-  _bit_array_ensure_nwords(dst, nwords, __FILE__, __LINE__, __func__);
-  dst->num_of_bits = src1->num_of_bits + src2->num_of_bits;
-  dst->num_of_words = roundup_bits2words64(dst->num_of_bits);
+  if(fread(hdr, 1, 24, f) != 24 || memcmp(hdr, DELTA_MAGIC, 8) != 0 ||
+     le64_to_cpu(hdr+8) != bitarr->num_of_bits) return 0;
 
-  word_addr_t i, j;
+  new_bits = le64_to_cpu(hdr+16);
+  nwords = roundup_bits2words64(new_bits);
+  if(new_bits != bitarr->num_of_bits && _fixed_size(bitarr)) {
+    errno = EPERM;
+    return 0;
+  }
+  if(new_bits > bitarr->num_of_bits) bit_array_resize_critical(bitarr, new_bits);
 
-  for(i = 0, j = 0; i < src1->num_of_words; i++)
+  while(1)
   {
-    word_t a = src1->words[i];
-    word_t b = src2->words[i];
+    if(!_get_varint(f, &skip) || !_get_varint(f, &cmd)) return 0;
+    if(cmd == 3) break;
+    if(skip > nwords - i) return 0;
+    i += skip;
+    n = cmd >> 2;
+    if(n == 0 || i == nwords) return 0;
 
-    dst->words[j++] =  morton_table0[(a      ) & 0xff] |
-                       morton_table1[(b      ) & 0xff] |
-                      (morton_table0[(a >>  8) & 0xff] << 16) |
-                      (morton_table1[(b >>  8) & 0xff] << 16) |
-                      (morton_table0[(a >> 16) & 0xff] << 32) |
-                      (morton_table1[(b >> 16) & 0xff] << 32) |
-                      (morton_table0[(a >> 24) & 0xff] << 48) |
-                      (morton_table1[(b >> 24) & 0xff] << 48);
-
-    dst->words[j++] =  morton_table0[(a >> 32) & 0xff] |
-                       morton_table1[(b >> 32) & 0xff] |
-                      (morton_table0[(a >> 40) & 0xff] << 16) |
-                      (morton_table1[(b >> 40) & 0xff] << 16) |
-                      (morton_table0[(a >> 48) & 0xff] << 32) |
-                      (morton_table1[(b >> 48) & 0xff] << 32) |
-                      (morton_table0[(a >> 56)       ] << 48) |
-                      (morton_table1[(b >> 56)       ] << 48);
+    switch(cmd & 3)
+    {
+      case 0:
+        if(n > DELTA_MAX_OFFSETS || fread(offsets, 1, n, f) != n) return 0;
+        for(x = 0, j = 0; j < n; j++) x |= (word_t)1 << (offsets[j] & 63);
+        _write_words(bitarr, i, 1);
+        bitarr->words[i++] ^= x;
+        break;
+      case 1:
+        if(n > nwords - i) return 0;
+        _write_words(bitarr, i, n);
+        for(j = 0; j < n; j++, i++) {
+          if(fread(hdr, 1, 8, f) != 8) return 0;
+          bitarr->words[i] ^= le64_to_cpu(hdr);
+        }
+        break;
+      case 2:
+        if(n > nwords - i) return 0;
+        _write_words(bitarr, i, n);
+        _toggle_words(bitarr->words + i, n);
+        i += n;
+        break;
+      default:
+        return 0;
+    }
   }
 
-  DEBUG_VALIDATE(dst);
+  if(new_bits < bitarr->num_of_bits) bit_array_resize_critical(bitarr, new_bits);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
 }
 
 //
-// Random
+// Incremental saves of dirty chunks
+//
+// File is [8 bytes: magic "BITADRTY"][8 bytes: number of bits]
+// [8 bytes: chunk size in bytes] then for each changed chunk
+// [8 bytes: chunk index][words of the chunk], ending with an index of
+// DIRTY_END. The last chunk stops at the end of the array. All little endian.
 //
 
-// Set bits randomly with probability prob : 0 <= prob <= 1
-void bit_array_random(BIT_ARRAY* bitarr, float prob)
-{
-  assert(prob >= 0 && prob <= 1);
-
-  if(bitarr->num_of_bits == 0)
-  {
-    return;
-  }
-  else if(prob == 1)
-  {
-    bit_array_set_all(bitarr);
-    return;
-  }
-
-  // rand() generates number between 0 and RAND_MAX inclusive
-  // therefore we want to check if rand() <= p
-  long p = RAND_MAX * prob;
-
-  _seed_rand();
+#define DIRTY_MAGIC "BITADRTY"
+#define DIRTY_END (~(uint64_t)0)
 
-  word_addr_t w;
-  word_offset_t o;
+char bit_array_track_dirty(BIT_ARRAY* bitarr)
+{
+  if(bitarr->dirty != NULL) return 1;
+  if((bitarr->dirty = bit_array_create_with(0, bitarr->allocator)) == NULL)
+    return 0;
+  if(!_dirty_reserve(bitarr, bitarr->capacity_in_words)) {
+    _untrack_dirty(bitarr);
+    return 0;
+  }
+  bitarr->watch |= WATCH_DIRTY;
+  return 1;
+}
 
-  // Initialise to zero
-  memset(bitarr->words, 0, bitarr->num_of_words * sizeof(word_t));
+void bit_array_untrack_dirty(BIT_ARRAY* bitarr)
+{
+  _untrack_dirty(bitarr);
+}
 
-  for(w = 0; w < bitarr->num_of_words - 1; w++)
-  {
-    for(o = 0; o < WORD_SIZE; o++)
-    {
-      if(rand() <= p)
-      {
-        bitarr->words[w] |= ((word_t)0x1 << o);
-      }
+// Words of the bitmap are stored atomically, since writers may be setting bits
+void bit_array_clear_dirty(BIT_ARRAY* bitarr)
+{
+  word_addr_t w;
+  if(bitarr->dirty == NULL) return;
+  for(w = 0; w < bitarr->dirty->num_of_words; w++)
+    __atomic_store_n(&bitarr->dirty->words[w], 0, __ATOMIC_RELAXED);
+}
+
+// Each word of the bitmap is taken and cleared in one atomic exchange before
+// its chunks are copied, so no separate clear can drop marks made meanwhile: a
+// chunk marked after its word is taken is saved next time. Writes are marked
+// before they are stored, so one still in flight when its chunk is copied may
+// be missed; writers must pause for an exact checkpoint. Chunks past the end
+// of the array (if it has shrunk) are skipped and stay marked
+bit_index_t bit_array_save_dirty(BIT_ARRAY* bitarr, FILE* f)
+{
+  BIT_ARRAY *dirty = bitarr->dirty;
+  word_addr_t nwords = bitarr->num_of_words, first, n, i, w;
+  bit_index_t c, nchunks, bytes_written = 0;
+  word_t buf[DIRTY_CHUNK_WORDS], marked, mask;
+  uint8_t hdr[24];
+
+  memcpy(hdr, DIRTY_MAGIC, 8);
+  cpu_to_le64(hdr+8, bitarr->num_of_bits);
+  cpu_to_le64(hdr+16, BIT_ARRAY_DIRTY_CHUNK);
+  bytes_written += fwrite(hdr, 1, 24, f);
+
+  nchunks = (nwords + DIRTY_CHUNK_WORDS - 1) / DIRTY_CHUNK_WORDS;
+  nchunks = dirty == NULL ? 0 : MIN(nchunks, dirty->num_of_bits);
+
+  for(w = 0; w < roundup_bits2words64(nchunks); w++)
+  {
+    if(dirty->words[w] == 0) continue;
+    if(nchunks - w * WORD_SIZE >= WORD_SIZE)
+      marked = __atomic_exchange_n(&dirty->words[w], 0, __ATOMIC_ACQUIRE);
+    else {
+      mask = bitmask64(nchunks - w * WORD_SIZE);
+      marked = __atomic_fetch_and(&dirty->words[w], ~mask, __ATOMIC_ACQUIRE);
+      marked &= mask;
     }
-  }
 
-  // Top word
-  word_offset_t bits_in_last_word = bits_in_top_word(bitarr->num_of_bits);
-  w = bitarr->num_of_words - 1;
-
-  for(o = 0; o < bits_in_last_word; o++)
-  {
-    if(rand() <= p)
+    for(; marked != 0; marked &= marked - 1)
     {
-      bitarr->words[w] |= ((word_t)0x1 << o);
+      c = w * WORD_SIZE + trailing_zeros(marked);
+      first = c * DIRTY_CHUNK_WORDS;
+      n = MIN(DIRTY_CHUNK_WORDS, nwords - first);
+      cpu_to_le64(hdr, c);
+      for(i = 0; i < n; i++)
+        cpu_to_le64((uint8_t*)&buf[i], bitarr->words[first + i]);
+      bytes_written += fwrite(hdr, 1, 8, f);
+      bytes_written += fwrite(buf, 1, n * sizeof(word_t), f);
     }
   }
 
-  DEBUG_VALIDATE(bitarr);
+  cpu_to_le64(hdr, DIRTY_END);
+  bytes_written += fwrite(hdr, 1, 8, f);
+  return bytes_written;
 }
 
-// Shuffle the bits in an array randomly
-void bit_array_shuffle(BIT_ARRAY* bitarr)
+char bit_array_load_dirty(BIT_ARRAY* bitarr, FILE* f)
 {
-  if(bitarr->num_of_bits == 0)
-    return;
+  uint8_t hdr[24];
+  word_addr_t nwords, first, n, i;
+  uint64_t c;
 
-  _seed_rand();
+  if(fread(hdr, 1, 24, f) != 24 || memcmp(hdr, DIRTY_MAGIC, 8) != 0 ||
+     le64_to_cpu(hdr+16) != BIT_ARRAY_DIRTY_CHUNK) return 0;
 
-  bit_index_t i, j;
+  if(!_resize_result(bitarr, le64_to_cpu(hdr+8))) return 0;
+  nwords = bitarr->num_of_words;
 
-  for(i = bitarr->num_of_bits - 1; i > 0; i--)
+  while(1)
   {
-    j = (bit_index_t)rand() % i;
-
-    // Swap i and j
-    char x = (bitarr->words[bitset64_wrd(i)] >> bitset64_idx(i)) & 0x1;
-    char y = (bitarr->words[bitset64_wrd(j)] >> bitset64_idx(j)) & 0x1;
-
-    if(!y)
-      bitarr->words[bitset64_wrd(i)] &= ~((word_t)0x1 << bitset64_idx(i));
-    else
-      bitarr->words[bitset64_wrd(i)] |= (word_t)0x1 << bitset64_idx(i);
+    if(fread(hdr, 1, 8, f) != 8) return 0;
+    if((c = le64_to_cpu(hdr)) == DIRTY_END) break;
+    if(c >= (nwords + DIRTY_CHUNK_WORDS - 1) / DIRTY_CHUNK_WORDS) return 0;
 
-    if(!x)
-      bitarr->words[bitset64_wrd(j)] &= ~((word_t)0x1 << bitset64_idx(j));
-    else
-      bitarr->words[bitset64_wrd(j)] |= (word_t)0x1 << bitset64_idx(j);
+    first = c * DIRTY_CHUNK_WORDS;
+    n = MIN(DIRTY_CHUNK_WORDS, nwords - first);
+    _write_words(bitarr, first, n);
+    if(fread(bitarr->words + first, sizeof(word_t), n, f) != n) return 0;
+    for(i = first; i < first + n; i++)
+      bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
   }
 
+  _mask_top_word(bitarr);
   DEBUG_VALIDATE(bitarr);
+  return 1;
 }
 
 //
-// Arithmetic
+// Parallel file IO with pread/pwrite
+//
+// Files are written in version 2 format, so chunks start at BIT_ARRAY_V2_ALIGN
+// aligned offsets. If the fd was opened with O_DIRECT, each thread copies
+// through an aligned buffer and reads and writes whole aligned blocks.
 //
 
-// Returns 1 on sucess, 0 if value in array is too big
-char bit_array_as_num(const BIT_ARRAY* bitarr, uint64_t* result)
+typedef struct
 {
-  if(bitarr->num_of_bits == 0)
-  {
-    *result = 0;
-    return 1;
-  }
-
-  word_addr_t w;
+  word_t *words;
+  word_addr_t nwords;
+  uint64_t first_chunk, end_chunk; // chunks [first_chunk, end_chunk)
+  size_t chunk_words;
+  uint64_t offset; // file offset of the first word
+  uint8_t *crcs; // little endian CRC32C per chunk, NULL if none
+  int fd;
+  char direct, writing, ok;
+  int err;
+} BitArrayIOJob;
 
-  for(w = bitarr->num_of_words-1; w > 0; w--)
-  {
-    if(bitarr->words[w] > 0)
-    {
-      return 0;
-    }
+static char _pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+  ssize_t n;
+  while(len > 0) {
+    n = pread(fd, buf, len, (off_t)offset);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) { if(n == 0) errno = EIO; return 0; }
+    buf = (uint8_t*)buf + n; len -= (size_t)n; offset += (uint64_t)n;
   }
-
-  *result = bitarr->words[0];
   return 1;
 }
 
+static char _pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+  ssize_t n;
+  while(len > 0) {
+    n = pwrite(fd, buf, len, (off_t)offset);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return 0;
+    buf = (const uint8_t*)buf + n; len -= (size_t)n; offset += (uint64_t)n;
+  }
+  return 1;
+}
 
-// 1 iff bitarr > value
-// 0 iff bitarr == value
-// -1 iff bitarr < value
-int bit_array_cmp_uint64(const BIT_ARRAY* bitarr, uint64_t value)
+// O_DIRECT reads: read the aligned blocks covering the range. Reading past the
+// end of the file is fine as long as the range itself is in the file
+static char _pread_direct(int fd, uint8_t *aligned, void *dst, size_t len,
+                          uint64_t offset)
 {
-  uint64_t arr_num = 0;
+  uint64_t start = offset / BIT_ARRAY_V2_ALIGN * BIT_ARRAY_V2_ALIGN;
+  uint64_t end = (offset + len + BIT_ARRAY_V2_ALIGN - 1) /
+                 BIT_ARRAY_V2_ALIGN * BIT_ARRAY_V2_ALIGN;
+  size_t got = 0;
+  ssize_t n;
 
-  // If cannot put bitarr in uint64, it is > value
-  if(!bit_array_as_num(bitarr, &arr_num)) return 1;
+  while(start + got < offset + len) {
+    n = pread(fd, aligned + got, (size_t)(end - start - got), (off_t)(start + got));
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) { if(n == 0) errno = EIO; return 0; }
+    got += (size_t)n;
+  }
 
-  if(arr_num > value)      return  1;
-  else if(arr_num < value) return -1;
-  else                     return  0;
+  memmove(dst, aligned + (offset - start), len);
+  return 1;
 }
 
-// If value is zero, no change is made
-void bit_array_add_uint64(BIT_ARRAY* bitarr, uint64_t value)
+static void* _io_worker(void *ptr)
 {
-  if(value == 0)
-  {
-    return;
-  }
-  else if(bitarr->num_of_bits == 0)
-  {
-    bit_array_resize_critical(bitarr, WORD_SIZE - leading_zeros(value));
-    bitarr->words[0] = (word_t)value;
-    return;
-  }
-
-  char carry = 0;
+  BitArrayIOJob *job = (BitArrayIOJob*)ptr;
+  const int endian = 1;
+  char little_endian = (*(uint8_t*)&endian == 1);
+  size_t chunk_bytes = job->chunk_words * sizeof(word_t);
+  uint8_t *buf = NULL;
+  uint64_t c, offset;
   word_addr_t i;
+  word_t *src;
+  size_t n, nbytes;
 
-  for(i = 0; i < bitarr->num_of_words; i++)
+  job->ok = 0;
+
+  if((job->direct || !little_endian) &&
+     posix_memalign((void**)&buf, BIT_ARRAY_V2_ALIGN,
+                    chunk_bytes + 2 * BIT_ARRAY_V2_ALIGN) != 0) {
+    job->err = ENOMEM;
+    return NULL;
+  }
+
+  for(c = job->first_chunk; c < job->end_chunk; c++)
   {
-    if(WORD_MAX - bitarr->words[i] < value)
+    src = job->words + c * job->chunk_words;
+    n = MIN(job->chunk_words, job->nwords - c * job->chunk_words);
+    nbytes = n * sizeof(word_t);
+    offset = job->offset + c * chunk_bytes;
+
+    if(job->writing)
     {
-      carry = 1;
-      bitarr->words[i] += value;
-      value = 1;
+      if(buf != NULL) {
+        for(i = 0; i < n; i++) cpu_to_le64(buf + i*sizeof(word_t), src[i]);
+        src = (word_t*)buf;
+      }
+
+      cpu_to_le32(job->crcs + 4*c, crc32c(0, (uint8_t*)src, nbytes));
+
+      if(job->direct) {
+        // Pad the last chunk out to a whole block
+        size_t padded = (nbytes + BIT_ARRAY_V2_ALIGN - 1) /
+                        BIT_ARRAY_V2_ALIGN * BIT_ARRAY_V2_ALIGN;
+        memset(buf + nbytes, 0, padded - nbytes);
+        nbytes = padded;
+      }
+
+      if(!_pwrite_all(job->fd, src, nbytes, offset)) goto fail;
     }
     else
     {
-      // Carry is absorbed
-      bitarr->words[i] += value;
-      carry = 0;
-      break;
-    }
-  }
-
-  if(carry)
-  {
-    // Bit array full, need another bit after all words filled
-    bit_array_resize_critical(bitarr, bitarr->num_of_words * WORD_SIZE + 1);
+      if(job->direct) {
+        if(!_pread_direct(job->fd, buf, src, nbytes, offset)) goto fail;
+      }
+      else if(!_pread_all(job->fd, src, nbytes, offset)) goto fail;
 
-    // Set top word to 1
-    bitarr->words[bitarr->num_of_words-1] = 1;
-  }
-  else
-  {
-    word_t final_word = bitarr->words[bitarr->num_of_words-1];
-    word_offset_t expected_bits = bits_in_top_word(bitarr->num_of_bits);
-    word_offset_t actual_bits = WORD_SIZE - leading_zeros(final_word);
+      if(job->crcs != NULL &&
+         crc32c(0, (uint8_t*)src, nbytes) != le32_to_cpu(job->crcs + 4*c)) {
+        errno = EIO;
+        goto fail;
+      }
 
-    if(actual_bits > expected_bits)
-    {
-      // num_of_bits has increased -- num_of_words has not
-      bitarr->num_of_bits += (actual_bits - expected_bits);
+      if(!little_endian) {
+        for(i = 0; i < n; i++) src[i] = le64_to_cpu((uint8_t*)&src[i]);
+      }
     }
   }
+
+  free(buf);
+  job->ok = 1;
+  return NULL;
+
+  fail:
+  job->err = errno;
+  free(buf);
+  return NULL;
 }
 
-// If value is greater than bitarr, bitarr is not changed and 0 is returned
-// Returns 1 on success, 0 if value > bitarr
-char bit_array_sub_uint64(BIT_ARRAY* bitarr, uint64_t value)
+// Split chunks between threads and run them. Returns 1 on success, 0 on
+// failure with errno set
+static char _run_io_jobs(const BIT_ARRAY_ALLOCATOR *allocator,
+                         BitArrayIOJob *tmpl, uint64_t nchunks, int nthreads)
 {
-  if(value == 0)
-  {
-    return 1;
+  BitArrayIOJob *jobs;
+  pthread_t *threads;
+  uint64_t per_thread;
+  int t, nstarted = 0, err = 0;
+
+  if(nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = (int)MAX(1, MIN((uint64_t)nthreads, nchunks));
+  per_thread = (nchunks + nthreads - 1) / nthreads;
+
+  jobs = (BitArrayIOJob*)_ba_malloc(allocator, nthreads * sizeof(BitArrayIOJob));
+  threads = (pthread_t*)_ba_malloc(allocator, nthreads * sizeof(pthread_t));
+
+  if(jobs == NULL || threads == NULL) {
+    _ba_free(allocator, jobs, nthreads * sizeof(BitArrayIOJob));
+    _ba_free(allocator, threads, nthreads * sizeof(pthread_t));
+    errno = ENOMEM;
+    return 0;
   }
-  else if(bitarr->words[0] >= value)
-  {
-    bitarr->words[0] -= value;
-    return 1;
+
+  for(t = 0; t < nthreads; t++) {
+    jobs[t] = *tmpl;
+    jobs[t].first_chunk = MIN(nchunks, t * per_thread);
+    jobs[t].end_chunk = MIN(nchunks, (t+1) * per_thread);
+    jobs[t].ok = 0;
+    jobs[t].err = 0;
   }
 
-  value -= bitarr->words[0];
+  // Main thread does the first job
+  for(t = 1; t < nthreads; t++) {
+    if(pthread_create(&threads[t], NULL, _io_worker, &jobs[t]) != 0) break;
+    nstarted++;
+  }
 
-  word_addr_t i;
+  for(t = nstarted+1; t < nthreads; t++) _io_worker(&jobs[t]);
+  _io_worker(&jobs[0]);
 
-  for(i = 1; i < bitarr->num_of_words; i++)
-  {
-    if(bitarr->words[i] > 0)
-    {
-      // deduct one
-      bitarr->words[i]--;
+  for(t = 1; t <= nstarted; t++) pthread_join(threads[t], NULL);
 
-      for(; i > 0; i--)
-      {
-        bitarr->words[i] = WORD_MAX;
-      }
+  for(t = 0; t < nthreads; t++)
+    if(!jobs[t].ok && err == 0) err = jobs[t].err ? jobs[t].err : EIO;
 
-      // -1 since we've already deducted 1
-      bitarr->words[0] = WORD_MAX - value - 1;
+  _ba_free(allocator, jobs, nthreads * sizeof(BitArrayIOJob));
+  _ba_free(allocator, threads, nthreads * sizeof(pthread_t));
 
-      return 1;
-    }
-  }
+  if(err) errno = err;
+  return !err;
+}
 
-  // subtract value is greater than array
-  return 0;
+static char _fd_is_direct(int fd)
+{
+  #ifdef O_DIRECT
+    int fl = fcntl(fd, F_GETFL);
+    return fl != -1 && (fl & O_DIRECT);
+  #else
+    (void)fd;
+    return 0;
+  #endif
 }
 
-//
-// Arithmetic between bit arrays
-//
+// Build the header and (empty) checksum table of a version 2 file in an
+// aligned buffer of *offset bytes. Returns NULL if out of memory
+static uint8_t* _fd_save_header(const BIT_ARRAY* bitarr, BitArrayIOJob *job,
+                                uint64_t *nchunks, uint64_t *offset,
+                                uint64_t *total)
+{
+  word_addr_t nwords = bitarr->num_of_words;
+  uint8_t *hdr;
 
-// src1, src2 and dst can all be the same BIT_ARRAY
-static void _arithmetic(BIT_ARRAY* dst,
-                        const BIT_ARRAY* src1,
-                        const BIT_ARRAY* src2,
-                        char subtract)
+  *nchunks = _v2_num_chunks(nwords, V2_CHUNK_SIZE);
+  *offset = _v2_payload_offset(*nchunks);
+  *total = *offset + (nwords * sizeof(word_t) + BIT_ARRAY_V2_ALIGN - 1) /
+                     BIT_ARRAY_V2_ALIGN * BIT_ARRAY_V2_ALIGN;
+
+  if(posix_memalign((void**)&hdr, BIT_ARRAY_V2_ALIGN, *offset) != 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  memset(hdr, 0, *offset);
+  memcpy(hdr, V2_MAGIC, 8);
+  cpu_to_le32(hdr+8, 2);
+  cpu_to_le32(hdr+12, (uint32_t)V2_CHUNK_SIZE);
+  cpu_to_le64(hdr+16, bitarr->num_of_bits);
+  cpu_to_le64(hdr+24, bit_array_num_bits_set(bitarr));
+  cpu_to_le64(hdr+32, 0);
+  cpu_to_le64(hdr+40, *offset);
+  cpu_to_le32(hdr+48, crc32c(0, hdr, 48));
+
+  memset(job, 0, sizeof(*job));
+  job->words = bitarr->words;
+  job->nwords = nwords;
+  job->chunk_words = V2_CHUNK_SIZE / sizeof(word_t);
+  job->offset = *offset;
+  job->crcs = hdr + V2_HDR_SIZE; // chunk checksums are filled in as written
+  job->writing = 1;
+
+  return hdr;
+}
+
+// Saves bit array to fd (from offset 0) in version 2 format using nthreads
+// threads. Returns the number of bytes written, 0 on failure with errno set
+bit_index_t bit_array_save_fd(const BIT_ARRAY* bitarr, int fd, int nthreads)
 {
-  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
+  uint64_t nchunks, offset, total;
+  BitArrayIOJob job;
+  uint8_t *hdr;
+  char ok;
 
-  // Adding: dst_words >= max(src1 words, src2 words)
-  // Subtracting: dst_words is >= src1->num_of_words
+  if((hdr = _fd_save_header(bitarr, &job, &nchunks, &offset, &total)) == NULL)
+    return 0;
 
-  char carry = subtract ? 1 : 0;
+  job.fd = fd;
+  job.direct = _fd_is_direct(fd);
 
-  word_addr_t i;
-  word_t word1, word2;
+  // Padding after the payload is left as a hole
+  ok = ftruncate(fd, (off_t)total) == 0 &&
+       _run_io_jobs(bitarr->allocator, &job, nchunks, nthreads) &&
+       _pwrite_all(fd, hdr, offset, 0);
 
-  for(i = 0; i < max_words; i++)
-  {
-    word1 = (i < src1->num_of_words ? src1->words[i] : 0);
-    word2 = (i < src2->num_of_words ? src2->words[i] : 0);
+  free(hdr);
+  return ok ? total : 0;
+}
 
-    if(subtract)
-      word2 = ~word2;
+// Read the header of a version 1 or 2 file, resize bitarr and set up job to
+// read the payload in nchunks chunks. The partial last word of a version 1
+// file is read here. Returns 1 on success, 0 on failure with errno set.
+// On success job->crcs (4 * nchunks + 1 bytes, from bitarr's allocator) must
+// be freed by the caller
+static char _fd_load_header(BIT_ARRAY* bitarr, int fd, char direct,
+                            BitArrayIOJob *job, uint64_t *nchunks)
+{
+  size_t chunk_size = V2_CHUNK_SIZE;
+  uint64_t offset = 8;
+  bit_index_t num_bits;
+  uint8_t *hdr;
+  ssize_t got;
 
-    dst->words[i] = word1 + word2 + carry;
-    // Update carry
-    carry = WORD_MAX - word1 < word2 || WORD_MAX - word1 - word2 < (word_t)carry;
-  }
+  memset(job, 0, sizeof(*job));
 
-  if(subtract)
-  {
-    carry = 0;
+  // Two blocks: also used for reading a word that may span blocks
+  if(posix_memalign((void**)&hdr, BIT_ARRAY_V2_ALIGN, 2*BIT_ARRAY_V2_ALIGN) != 0) {
+    errno = ENOMEM;
+    return 0;
   }
-  else
-  {
-    // Check last word
-    word_offset_t bits_on_last_word = bits_in_top_word(dst->num_of_bits);
 
-    if(bits_on_last_word < WORD_SIZE)
-    {
-      word_t mask = bitmask64(bits_on_last_word);
+  // Aligned read of the first block. File may be shorter than a block
+  do { got = pread(fd, hdr, BIT_ARRAY_V2_ALIGN, 0); }
+  while(got < 0 && errno == EINTR);
+  if(got < 8) { if(got >= 0) errno = EINVAL; goto fail; }
 
-      if(dst->words[max_words-1] > mask)
-      {
-        // Array has overflowed, increase size
-        dst->num_of_bits++;
-      }
+  if(memcmp(hdr, V2_MAGIC, 8) == 0)
+  {
+    if(got < V2_HDR_SIZE ||
+       !_v2_read_header(hdr, &num_bits, &offset, &chunk_size)) {
+      errno = EINVAL;
+      goto fail;
     }
-    else if(carry)
-    {
-      // Carry onto a new word
-      if(dst->num_of_words == max_words)
-      {
-        // Need to resize for the carry bit
-        bit_array_resize_critical(dst, dst->num_of_bits+1);
-      }
 
-      dst->words[max_words] = (word_t)1;
+    *nchunks = _v2_num_chunks(roundup_bits2words64(num_bits), chunk_size);
+    job->crcs = (uint8_t*)_ba_malloc(bitarr->allocator, 4 * *nchunks + 1);
+    if(job->crcs == NULL) { errno = ENOMEM; goto fail; }
+
+    // Checksums follow the header and end before the payload
+    if(V2_HDR_SIZE + 4 * *nchunks <= (uint64_t)got)
+      memcpy(job->crcs, hdr + V2_HDR_SIZE, 4 * *nchunks);
+    else {
+      uint8_t *tmp;
+      if(posix_memalign((void**)&tmp, BIT_ARRAY_V2_ALIGN, offset) != 0) {
+        errno = ENOMEM;
+        goto fail;
+      }
+      char r = direct ? _pread_direct(fd, tmp, tmp, offset, 0)
+                      : _pread_all(fd, tmp, offset, 0);
+      if(r) memcpy(job->crcs, tmp + V2_HDR_SIZE, 4 * *nchunks);
+      free(tmp);
+      if(!r) goto fail;
     }
   }
+  else
+  {
+    num_bits = le64_to_cpu(hdr);
+    *nchunks = _v2_num_chunks(roundup_bits2words64(num_bits), chunk_size);
+  }
 
-  // Zero the rest of dst array
-  for(i = max_words+carry; i < dst->num_of_words; i++)
+  if(!_resize_result(bitarr, num_bits)) goto fail;
+  _write_words(bitarr, 0, bitarr->num_of_words);
+
+  job->words = bitarr->words;
+  job->nwords = bitarr->num_of_words;
+  job->chunk_words = chunk_size / sizeof(word_t);
+  job->offset = offset;
+  job->fd = fd;
+  job->direct = direct;
+  job->writing = 0;
+
+  // Version 1 files end with a partial word: read it separately
+  if(job->crcs == NULL && job->nwords > 0 &&
+     roundup_bits2bytes(num_bits) % sizeof(word_t) != 0)
   {
-    dst->words[i] = (word_t)0;
+    word_addr_t last = job->nwords - 1;
+    size_t rem = roundup_bits2bytes(num_bits) - last * sizeof(word_t);
+    uint8_t tmp[8] = {0};
+    uint64_t pos = offset + last * sizeof(word_t);
+    if(!(direct ? _pread_direct(fd, hdr, tmp, rem, pos)
+                : _pread_all(fd, tmp, rem, pos))) goto fail;
+    bitarr->words[last] = le64_to_cpu(tmp);
+    job->nwords--;
+    *nchunks = _v2_num_chunks(job->nwords, chunk_size);
   }
 
-  DEBUG_VALIDATE(dst);
-}
+  free(hdr);
+  return 1;
 
-// src1, src2 and dst can all be the same BIT_ARRAY
-// If dst is shorter than either of src1, src2, it is enlarged
-void bit_array_add(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
-{
-  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
-  _arithmetic(dst, src1, src2, 0);
+  fail:
+  _ba_free(bitarr->allocator, job->crcs, 4 * *nchunks + 1);
+  job->crcs = NULL;
+  free(hdr);
+  return 0;
 }
 
-// dst = src1 - src2
-// src1, src2 and dst can all be the same BIT_ARRAY
-// If dst is shorter than src1, it will be extended to be as long as src1
-// src1 must be greater than or equal to src2 (src1 >= src2)
-void bit_array_subtract(BIT_ARRAY* dst,
-                          const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+// Reads a version 1 or 2 file from fd (from offset 0) using nthreads threads.
+// Returns 1 on success, 0 on failure with errno set
+char bit_array_load_fd(BIT_ARRAY* bitarr, int fd, int nthreads)
 {
-  // subtraction by method of complements:
-  // a - b = a + ~b + 1 = src1 + ~src2 +1
+  BitArrayIOJob job;
+  uint64_t nchunks;
+  char ok;
 
-  assert(bit_array_cmp(src1, src2) >= 0); // Require src1 >= src2
+  if(!_fd_load_header(bitarr, fd, _fd_is_direct(fd), &job, &nchunks)) return 0;
+
+  ok = _run_io_jobs(bitarr->allocator, &job, nchunks, nthreads);
+
+  if(ok) {
+    _mask_top_word(bitarr);
+    DEBUG_VALIDATE(bitarr);
+  }
 
-  bit_array_ensure_size_critical(dst, src1->num_of_bits);
-  _arithmetic(dst, src1, src2, 1);
+  _ba_free(bitarr->allocator, job.crcs, 4 * nchunks + 1);
+  return ok;
 }
 
+//
+// Asynchronous save/load
+//
+// Chunks are read and written through an io_uring, set up with raw syscalls.
+// The caller drives it with bit_array_aio_poll() or bit_array_aio_wait().
+// If io_uring is not available (or the fd uses O_DIRECT, or the machine is big
+// endian) a background thread runs bit_array_save_fd()/bit_array_load_fd().
+// The array is written in place, so it must not change while a save runs:
+// changing a snapshot's array instead leaves the snapshot as it was. The header
+// goes last, once the chunk checksums are known.
+//
 
-// Add `add` to `bitarr` at `pos`
-// Bounds checking not needed as out of bounds is valid
-void bit_array_add_word(BIT_ARRAY *bitarr, bit_index_t pos, uint64_t add)
+#define AIO_QUEUE_DEPTH 32
+#define AIO_HEADER_CHUNK UINT64_MAX // user_data for the header write
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+    #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+        defined(__NR_io_uring_register) && defined(IO_URING_OP_SUPPORTED)
+      #define HAVE_IO_URING 1
+    #endif
+  #endif
+#endif
+
+typedef struct
+{
+  uint64_t chunk; // chunk index or AIO_HEADER_CHUNK
+  size_t done; // bytes transferred so far
+} BitArrayAioSlot;
+
+struct BIT_ARRAY_AIO
+{
+  BIT_ARRAY *bitarr;
+  BitArrayIOJob job;
+  uint64_t nchunks, next_chunk, nfinished;
+  uint8_t *hdr; // save: header and checksum table
+  uint64_t hdr_len, total;
+  char writing, finished, ok, header_sent, header_done;
+  int err;
+  bit_array_aio_cb cb;
+  void *ctx;
+
+  // Background thread, when not using io_uring
+  char threaded;
+  pthread_t thread;
+  int thread_done;
+
+  // io_uring state
+  int ring_fd;
+  unsigned inflight;
+  BitArrayAioSlot slots[AIO_QUEUE_DEPTH];
+  unsigned free_slots[AIO_QUEUE_DEPTH], nfree;
+  void *sq_ring, *cq_ring, *sqes;
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  void *cqes;
+};
+
+static void _aio_finish(BIT_ARRAY_AIO *aio, int err)
 {
-  DEBUG_VALIDATE(bitarr);
+  aio->finished = 1;
+  aio->ok = (err == 0);
+  aio->err = err;
 
-  if(add == 0)
-  {
-    return;
-  }
-  else if(pos >= bitarr->num_of_bits)
-  {
-    // Resize and add!
-    bit_index_t num_bits_required = pos + (WORD_SIZE - leading_zeros(add));
-    bit_array_resize_critical(bitarr, num_bits_required);
-    _set_word(bitarr, pos, (word_t)add);
-    return;
+  if(aio->ok && !aio->writing) {
+    _mask_top_word(aio->bitarr);
+    DEBUG_VALIDATE(aio->bitarr);
   }
 
-  /*
-  char str[1000];
-  printf(" add_word: %s\n", bit_array_to_str_rev(bitarr, str));
-  printf("     word: %s [pos: %i]\n", _word_to_str(add, str), (int)pos);
-  */
+  if(aio->cb != NULL) aio->cb(aio, aio->ok, aio->ctx);
+}
 
-  word_t w = _get_word(bitarr, pos);
-  word_t sum = w + add;
-  char carry = WORD_MAX - w < add;
+static void* _aio_thread(void *ptr)
+{
+  BIT_ARRAY_AIO *aio = (BIT_ARRAY_AIO*)ptr;
+  char ok;
 
-  // Ensure array is big enough
-  bit_index_t num_bits_required = pos + (carry ? WORD_SIZE + 1
-                                               : (WORD_SIZE - leading_zeros(sum)));
+  aio->job.first_chunk = 0;
+  aio->job.end_chunk = aio->nchunks;
+  aio->job.err = 0;
+  _io_worker(&aio->job);
+  ok = aio->job.ok;
+  if(!ok) errno = aio->job.err ? aio->job.err : EIO;
 
-  bit_array_ensure_size(bitarr, num_bits_required);
+  if(ok && aio->writing)
+    ok = _pwrite_all(aio->job.fd, aio->hdr, aio->hdr_len, 0);
 
-  _set_word(bitarr, pos, sum);
-  pos += WORD_SIZE;
+  aio->err = ok ? 0 : errno;
+  __atomic_store_n(&aio->thread_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
-  if(carry)
-  {
-    word_offset_t offset = pos % WORD_SIZE;
-    word_addr_t addr = bitset64_wrd(pos);
+#ifdef HAVE_IO_URING
 
-    add = (word_t)0x1 << offset;
-    carry = (WORD_MAX - bitarr->words[addr] < add);
-    sum = bitarr->words[addr] + add;
+static int _uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                        unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
 
-    num_bits_required = addr * WORD_SIZE +
-                        (carry ? WORD_SIZE + 1 : (WORD_SIZE - leading_zeros(sum)));
+static char _uring_setup(BIT_ARRAY_AIO *aio)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  aio->sq_ring = aio->cq_ring = aio->sqes = MAP_FAILED;
 
-    bit_array_ensure_size(bitarr, num_bits_required);
+  aio->ring_fd = (int)syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p);
+  if(aio->ring_fd < 0) { aio->ring_fd = -1; return 0; }
 
-    bitarr->words[addr++] = sum;
+  aio->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  aio->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    aio->sq_ring_sz = aio->cq_ring_sz = MAX(aio->sq_ring_sz, aio->cq_ring_sz);
 
-    if(carry)
-    {
-      while(addr < bitarr->num_of_words && bitarr->words[addr] == WORD_MAX)
-      {
-        bitarr->words[addr++] = 0;
-      }
+  aio->sq_ring = mmap(NULL, aio->sq_ring_sz, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+  if(aio->sq_ring == MAP_FAILED) goto fail;
 
-      if(addr == bitarr->num_of_words)
-      {
-        bit_array_resize_critical(bitarr, addr * WORD_SIZE + 1);
-      }
-      else if(addr == bitarr->num_of_words-1 &&
-              bitarr->words[addr] == bitmask64(bits_in_top_word(bitarr->num_of_bits)))
-      {
-        bit_array_resize_critical(bitarr, bitarr->num_of_bits + 1);
-      }
+  if(p.features & IORING_FEAT_SINGLE_MMAP) aio->cq_ring = aio->sq_ring;
+  else {
+    aio->cq_ring = mmap(NULL, aio->cq_ring_sz, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+    if(aio->cq_ring == MAP_FAILED) goto fail;
+  }
 
-      bitarr->words[addr]++;
-    }
+  aio->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  aio->sqes = mmap(NULL, aio->sqes_sz, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+  if(aio->sqes == MAP_FAILED) goto fail;
+
+  uint8_t *sq = (uint8_t*)aio->sq_ring, *cq = (uint8_t*)aio->cq_ring;
+  aio->sq_head = (unsigned*)(sq + p.sq_off.head);
+  aio->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  aio->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  aio->sq_array = (unsigned*)(sq + p.sq_off.array);
+  aio->cq_head = (unsigned*)(cq + p.cq_off.head);
+  aio->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  aio->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  aio->cqes = cq + p.cq_off.cqes;
+
+  // Kernels before 5.6 set up a ring but fail IORING_OP_READ/WRITE
+  uint64_t probe_buf[(sizeof(struct io_uring_probe) +
+                      256 * sizeof(struct io_uring_probe_op)) / 8 + 1];
+  struct io_uring_probe *probe = (struct io_uring_probe*)probe_buf;
+  memset(probe_buf, 0, sizeof(probe_buf));
+  if(syscall(__NR_io_uring_register, aio->ring_fd, IORING_REGISTER_PROBE,
+             probe, 256) < 0 ||
+     probe->last_op < IORING_OP_WRITE ||
+     !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+     !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+    munmap(aio->sqes, aio->sqes_sz);
+    goto fail;
   }
 
-  DEBUG_VALIDATE(bitarr);
+  return 1;
+
+  fail:
+  if(aio->sq_ring != MAP_FAILED) munmap(aio->sq_ring, aio->sq_ring_sz);
+  if(aio->cq_ring != MAP_FAILED && aio->cq_ring != aio->sq_ring)
+    munmap(aio->cq_ring, aio->cq_ring_sz);
+  close(aio->ring_fd);
+  aio->ring_fd = -1;
+  return 0;
 }
 
-// Add `add` to `bitarr` at `pos`
-// Bounds checking not needed as out of bounds is valid
-void bit_array_add_words(BIT_ARRAY *bitarr, bit_index_t pos, const BIT_ARRAY *add)
+static void _uring_teardown(BIT_ARRAY_AIO *aio)
 {
-  assert(bitarr != add); // bitarr and add cannot point to the same bit array
-
-  bit_index_t add_top_bit_set;
+  munmap(aio->sqes, aio->sqes_sz);
+  if(aio->cq_ring != aio->sq_ring) munmap(aio->cq_ring, aio->cq_ring_sz);
+  munmap(aio->sq_ring, aio->sq_ring_sz);
+  close(aio->ring_fd);
+  aio->ring_fd = -1;
+}
 
-  if(!bit_array_find_last_set_bit(add, &add_top_bit_set))
-  {
-    // No bits set in add
-    return;
-  }
-  else if(pos >= bitarr->num_of_bits)
-  {
-    // Just resize and copy!
-    bit_index_t num_bits_required = pos + add_top_bit_set + 1;
-    bit_array_resize_critical(bitarr, num_bits_required);
-    _array_copy(bitarr, pos, add, 0, add->num_of_bits);
-    return;
+// Address and length of what a slot still has to transfer
+static void _aio_slot_io(const BIT_ARRAY_AIO *aio, const BitArrayAioSlot *slot,
+                         uint8_t **buf, size_t *len, uint64_t *offset)
+{
+  const BitArrayIOJob *job = &aio->job;
+  if(slot->chunk == AIO_HEADER_CHUNK) {
+    *buf = aio->hdr;
+    *len = aio->hdr_len;
+    *offset = 0;
   }
-  else if(pos == 0)
-  {
-    bit_array_add(bitarr, bitarr, add);
-    return;
+  else {
+    word_addr_t first = slot->chunk * job->chunk_words;
+    *buf = (uint8_t*)(job->words + first);
+    *len = MIN(job->chunk_words, job->nwords - first) * sizeof(word_t);
+    *offset = job->offset + first * sizeof(word_t);
   }
+  *buf += slot->done;
+  *len -= slot->done;
+  *offset += slot->done;
+}
 
-  /*
-  char str[1000];
-  printf(" add_words1: %s\n", bit_array_to_str_rev(bitarr, str));
-  printf(" add_words2: %s\n", bit_array_to_str_rev(add, str));
-  printf(" [pos: %i]\n", (int)pos);
-  */
+// Queue a read or write for a slot. Returns 1 if queued, 0 if the ring is full
+static char _aio_queue(BIT_ARRAY_AIO *aio, unsigned slot_idx)
+{
+  unsigned tail = *aio->sq_tail, head;
+  head = __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+  if(tail - head > *aio->sq_mask) return 0;
 
-  bit_index_t num_bits_required = pos + add_top_bit_set + 1;
-  bit_array_ensure_size(bitarr, num_bits_required);
+  unsigned idx = tail & *aio->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe*)aio->sqes + idx;
+  uint8_t *buf;
+  size_t len;
+  uint64_t offset;
 
-  word_addr_t first_word = bitset64_wrd(pos);
-  word_offset_t first_offset = bitset64_idx(pos);
+  _aio_slot_io(aio, &aio->slots[slot_idx], &buf, &len, &offset);
 
-  word_t w = add->words[0] << first_offset;
-  unsigned char carry = (WORD_MAX - bitarr->words[first_word] < w);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = aio->writing ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = aio->job.fd;
+  sqe->off = offset;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)len;
+  sqe->user_data = slot_idx;
 
-  bitarr->words[first_word] += w;
+  aio->sq_array[idx] = idx;
+  __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  aio->inflight++;
+  return 1;
+}
 
-  word_addr_t i = first_word + 1;
-  bit_index_t offset = WORD_SIZE - first_offset;
+// Start as many chunks as there are free slots
+static unsigned _aio_fill(BIT_ARRAY_AIO *aio)
+{
+  unsigned n = 0, slot;
 
-  for(; carry || offset <= add_top_bit_set; i++, offset += WORD_SIZE)
+  while(aio->nfree > 0 && !aio->err)
   {
-    w = offset < add->num_of_bits ? _get_word(add, offset) : (word_t)0;
-
-    if(i >= bitarr->num_of_words)
-    {
-      // Extend by a word
-      bit_array_resize_critical(bitarr, (bit_index_t)(i+1)*WORD_SIZE+1);
-    }
-
-    word_t prev = bitarr->words[i];
+    uint64_t chunk;
 
-    bitarr->words[i] += w + carry;
+    if(aio->next_chunk < aio->nchunks) chunk = aio->next_chunk;
+    else if(aio->writing && !aio->header_sent && aio->nfinished == aio->nchunks)
+      chunk = AIO_HEADER_CHUNK; // header goes last, once checksums are known
+    else break;
 
-    carry = (WORD_MAX - prev < w || (carry && prev + w == WORD_MAX)) ? 1 : 0;
-  }
+    slot = aio->free_slots[aio->nfree-1];
+    aio->slots[slot].chunk = chunk;
+    aio->slots[slot].done = 0;
 
-  word_offset_t top_bits
-    = WORD_SIZE - leading_zeros(bitarr->words[bitarr->num_of_words-1]);
+    if(!_aio_queue(aio, slot)) break;
 
-  bit_index_t min_bits = (bitarr->num_of_words-1)*WORD_SIZE + top_bits;
+    if(aio->writing && chunk != AIO_HEADER_CHUNK) {
+      // Checksum the chunk while the kernel writes it, it must not change
+      uint8_t *buf;
+      size_t len;
+      uint64_t offset;
+      _aio_slot_io(aio, &aio->slots[slot], &buf, &len, &offset);
+      cpu_to_le32(aio->job.crcs + 4*chunk, crc32c(0, buf, len));
+    }
+    aio->nfree--;
+    n++;
 
-  if(bitarr->num_of_bits < min_bits)
-  {
-    // Extend within the last word
-    bitarr->num_of_bits = min_bits;
+    if(chunk == AIO_HEADER_CHUNK) aio->header_sent = 1;
+    else aio->next_chunk++;
   }
 
-  DEBUG_VALIDATE(bitarr);
+  return n;
 }
 
-char bit_array_sub_word(BIT_ARRAY* bitarr, bit_index_t pos, word_t minus)
+// Handle completed requests
+static void _aio_reap(BIT_ARRAY_AIO *aio)
 {
-  DEBUG_VALIDATE(bitarr);
+  unsigned head = *aio->cq_head;
+  unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
 
-  if(minus == 0)
+  for(; head != tail; head++)
   {
-    return 1;
-  }
+    struct io_uring_cqe *cqe = (struct io_uring_cqe*)aio->cqes +
+                               (head & *aio->cq_mask);
+    unsigned slot_idx = (unsigned)cqe->user_data;
+    BitArrayAioSlot *slot = &aio->slots[slot_idx];
+    uint8_t *buf;
+    size_t len;
+    uint64_t offset;
 
-  word_t w = _get_word(bitarr, pos);
+    aio->inflight--;
 
-  if(w >= minus)
-  {
-    _set_word(bitarr, pos, w - minus);
-    DEBUG_VALIDATE(bitarr);
-    return 1;
-  }
+    if(cqe->res <= 0) {
+      // Reading 0 bytes means the file is too short
+      if(!aio->err) aio->err = cqe->res < 0 ? -cqe->res : EIO;
+      aio->free_slots[aio->nfree++] = slot_idx;
+      continue;
+    }
 
-  minus -= w;
+    slot->done += (size_t)cqe->res;
+    _aio_slot_io(aio, slot, &buf, &len, &offset);
+
+    // Short read or write: queue the rest
+    if(len > 0 && !aio->err && _aio_queue(aio, slot_idx)) continue;
+    if(len > 0 && !aio->err) aio->err = EIO;
+
+    if(slot->chunk == AIO_HEADER_CHUNK) aio->header_done = 1;
+    else {
+      if(!aio->writing && aio->job.crcs != NULL && !aio->err) {
+        // Check the chunk while it is in cache
+        slot->done = 0;
+        _aio_slot_io(aio, slot, &buf, &len, &offset);
+        if(crc32c(0, buf, len) != le32_to_cpu(aio->job.crcs + 4*slot->chunk))
+          aio->err = EIO;
+      }
+      aio->nfinished++;
+    }
 
-  bit_index_t offset;
-  for(offset = pos + WORD_SIZE; offset < bitarr->num_of_bits; offset += WORD_SIZE)
-  {
-    w = _get_word(bitarr, offset);
+    aio->free_slots[aio->nfree++] = slot_idx;
+  }
 
-    if(w > 0)
-    {
-      // deduct one
-      _set_word(bitarr, offset, w - 1);
+  __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+}
 
-      SET_REGION(bitarr, pos, offset-pos);
+// Pass queued requests to the kernel. If wait, block until at least one
+// request completes
+static void _aio_submit(BIT_ARRAY_AIO *aio, char wait)
+{
+  unsigned pending = *aio->sq_tail - __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+  wait = wait && aio->inflight > 0;
 
-      // -1 since we've already deducted 1
-      minus--;
+  if(pending == 0 && !wait) return;
 
-      _set_word(bitarr, pos, WORD_MAX - minus);
+  int r = _uring_enter(aio->ring_fd, pending, wait ? 1 : 0,
+                       wait ? IORING_ENTER_GETEVENTS : 0);
 
-      DEBUG_VALIDATE(bitarr);
-      return 1;
+  if(r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    if(!aio->err) aio->err = errno;
+    // Take back the requests the kernel has not consumed: they will never
+    // complete and must not be submitted by a later call
+    unsigned head = __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *aio->sq_tail;
+    for(; tail != head; tail--) {
+      struct io_uring_sqe *sqe = (struct io_uring_sqe*)aio->sqes +
+                                 ((tail-1) & *aio->sq_mask);
+      aio->free_slots[aio->nfree++] = (unsigned)sqe->user_data;
+      aio->inflight--;
     }
+    __atomic_store_n(aio->sq_tail, head, __ATOMIC_RELEASE);
   }
+}
 
-  DEBUG_VALIDATE(bitarr);
+static void _aio_progress(BIT_ARRAY_AIO *aio, char wait)
+{
+  _aio_fill(aio);
+  _aio_submit(aio, wait);
+  _aio_reap(aio);
+  // Keep the queue full while the caller gets on with other work
+  _aio_fill(aio);
+  _aio_submit(aio, 0);
+}
 
-  return 0;
+#endif /* HAVE_IO_URING */
+
+static BIT_ARRAY_AIO* _aio_start(BIT_ARRAY_AIO *aio)
+{
+  const int endian = 1;
+  char little_endian = (*(uint8_t*)&endian == 1);
+  unsigned i;
+
+  aio->ring_fd = -1;
+  aio->nfree = AIO_QUEUE_DEPTH;
+  for(i = 0; i < AIO_QUEUE_DEPTH; i++) aio->free_slots[i] = AIO_QUEUE_DEPTH-1-i;
+
+  #ifdef HAVE_IO_URING
+    if(little_endian && !aio->job.direct && _uring_setup(aio)) {
+      _aio_progress(aio, 0);
+      return aio;
+    }
+  #else
+    (void)little_endian;
+  #endif
+
+  aio->threaded = 1;
+  if(pthread_create(&aio->thread, NULL, _aio_thread, aio) != 0) {
+    // Couldn't start a thread: do it now
+    aio->threaded = 0;
+    _aio_thread(aio);
+    _aio_finish(aio, aio->err);
+  }
+  return aio;
 }
 
-char bit_array_sub_words(BIT_ARRAY* bitarr, bit_index_t pos, BIT_ARRAY* minus)
+BIT_ARRAY_AIO* bit_array_aio_save(const BIT_ARRAY* bitarr, int fd,
+                                  bit_array_aio_cb cb, void *ctx)
 {
-  assert(bitarr != minus); // bitarr and minus cannot point to the same bit array
+  BIT_ARRAY_AIO *aio = (BIT_ARRAY_AIO*)_ba_calloc(bitarr->allocator,
+                                                   sizeof(BIT_ARRAY_AIO));
+  if(aio == NULL) { errno = ENOMEM; return NULL; }
 
-  int cmp = bit_array_cmp_words(bitarr, pos, minus);
+  aio->bitarr = (BIT_ARRAY*)bitarr;
+  aio->writing = 1;
+  aio->cb = cb;
+  aio->ctx = ctx;
 
-  if(cmp == 0)
-  {
-    bit_array_clear_all(bitarr);
-    return 1;
+  aio->hdr = _fd_save_header(bitarr, &aio->job, &aio->nchunks, &aio->hdr_len,
+                             &aio->total);
+  if(aio->hdr == NULL) {
+    _ba_free(bitarr->allocator, aio, sizeof(BIT_ARRAY_AIO));
+    return NULL;
   }
-  else if(cmp < 0)
-  {
-    return 0;
+
+  aio->job.fd = fd;
+  aio->job.direct = _fd_is_direct(fd);
+
+  // Padding after the payload is left as a hole
+  if(ftruncate(fd, (off_t)aio->total) != 0) {
+    int err = errno;
+    free(aio->hdr);
+    _ba_free(bitarr->allocator, aio, sizeof(BIT_ARRAY_AIO));
+    errno = err;
+    return NULL;
   }
 
-  bit_index_t bitarr_length = bitarr->num_of_bits;
+  return _aio_start(aio);
+}
 
-  bit_index_t bitarr_top_bit_set;
-  bit_array_find_last_set_bit(bitarr, &bitarr_top_bit_set);
+BIT_ARRAY_AIO* bit_array_aio_load(BIT_ARRAY* bitarr, int fd,
+                                  bit_array_aio_cb cb, void *ctx)
+{
+  BIT_ARRAY_AIO *aio = (BIT_ARRAY_AIO*)_ba_calloc(bitarr->allocator,
+                                                   sizeof(BIT_ARRAY_AIO));
+  if(aio == NULL) { errno = ENOMEM; return NULL; }
 
-  // subtraction by method of complements:
-  // a - b = a + ~b + 1 = src1 + ~src2 +1
+  aio->bitarr = bitarr;
+  aio->cb = cb;
+  aio->ctx = ctx;
 
-  bit_array_not(minus, minus);
+  if(!_fd_load_header(bitarr, fd, _fd_is_direct(fd), &aio->job, &aio->nchunks)) {
+    _ba_free(bitarr->allocator, aio, sizeof(BIT_ARRAY_AIO));
+    return NULL;
+  }
 
-  bit_array_add_words(bitarr, pos, minus);
-  bit_array_add_word(bitarr, pos, (word_t)1);
+  return _aio_start(aio);
+}
 
-  bit_array_sub_word(bitarr, pos+minus->num_of_bits, 1);
-  bit_array_resize(bitarr, bitarr_length);
+char bit_array_aio_poll(BIT_ARRAY_AIO *aio)
+{
+  if(aio->finished) return 1;
 
-  bit_array_not(minus, minus);
+  if(aio->threaded) {
+    if(!__atomic_load_n(&aio->thread_done, __ATOMIC_ACQUIRE)) return 0;
+    pthread_join(aio->thread, NULL);
+    aio->threaded = 0;
+    _aio_finish(aio, aio->err);
+    return 1;
+  }
 
-  DEBUG_VALIDATE(bitarr);
+  #ifdef HAVE_IO_URING
+    _aio_progress(aio, 0);
+    if(aio->inflight == 0 &&
+       (aio->err || (aio->nfinished == aio->nchunks &&
+                     (!aio->writing || aio->header_done)))) {
+      _uring_teardown(aio);
+      _aio_finish(aio, aio->err);
+    }
+  #endif
 
-  return 1;
+  return aio->finished;
 }
 
-void bit_array_mul_uint64(BIT_ARRAY *bitarr, uint64_t multiplier)
+char bit_array_aio_wait(BIT_ARRAY_AIO *aio)
 {
-  if(bitarr->num_of_bits == 0 || multiplier == 1)
-  {
-    return;
-  }
-  else if(multiplier == 0)
-  {
-    bit_array_clear_all(bitarr);
-    return;
+  if(aio->threaded) {
+    pthread_join(aio->thread, NULL);
+    aio->threaded = 0;
+    _aio_finish(aio, aio->err);
   }
 
-  bit_index_t i;
+  #ifdef HAVE_IO_URING
+    while(!bit_array_aio_poll(aio)) _aio_progress(aio, 1);
+  #endif
 
-  for(i = bitarr->num_of_bits; i > 0; i--)
-  {
-    if(bit_array_get(bitarr, i-1))
-    {
-      bit_array_clear(bitarr, i-1);
-      bit_array_add_word(bitarr, i-1, multiplier);
-    }
-  }
+  if(!aio->ok) errno = aio->err;
+  return aio->ok;
+}
 
-  DEBUG_VALIDATE(bitarr);
+void bit_array_aio_free(BIT_ARRAY_AIO *aio)
+{
+  if(!aio->finished) bit_array_aio_wait(aio);
+  const BIT_ARRAY_ALLOCATOR *allocator = aio->bitarr->allocator;
+  if(aio->writing) free(aio->hdr);
+  else _ba_free(allocator, aio->job.crcs, 4 * aio->nchunks + 1);
+  _ba_free(allocator, aio, sizeof(BIT_ARRAY_AIO));
 }
 
-void bit_array_multiply(BIT_ARRAY *dst, BIT_ARRAY *src1, BIT_ARRAY *src2)
+//
+// Memory mapped files
+//
+// The file written by bit_array_save is mapped and words are used in place.
+// The payload starts 8 bytes into the file (BIT_ARRAY_V2_ALIGN for version 2
+// files), so words are aligned. The last
+// word may run up to 7 bytes past the end of the file, those bytes are still
+// in the last page and read as zero. Shared mappings round the file to whole
+// words when opened and grow it to hold their whole capacity, bytes after the
+// payload are ignored when loading.
+//
+
+BIT_ARRAY* bit_array_mmap_open(const char *path, int flags)
 {
-  if(src1->num_of_bits == 0 || src2->num_of_bits == 0)
-  {
-    bit_array_clear_all(dst);
-    return;
+  const int endian = 1;
+  char little_endian = (*(uint8_t*)&endian == 1);
+  int mode = flags & BIT_ARRAY_MMAP_MODES;
+  BIT_ARRAY *bitarr = NULL;
+  BitArrayMmap *map = NULL;
+  struct stat st;
+  uint8_t *base = (uint8_t*)MAP_FAILED;
+  bit_index_t num_bits;
+  size_t length = 0, offset;
+  word_addr_t i, nwords, capacity;
+  word_t *words;
+  int fd, prot, err = EINVAL;
+
+  if((flags & ~(BIT_ARRAY_MMAP_MODES | BIT_ARRAY_MMAP_CREATE)) ||
+     (mode != BIT_ARRAY_MMAP_RDONLY && mode != BIT_ARRAY_MMAP_PRIVATE &&
+      mode != BIT_ARRAY_MMAP_SHARED) ||
+     ((flags & BIT_ARRAY_MMAP_CREATE) && mode != BIT_ARRAY_MMAP_SHARED)) {
+    errno = EINVAL;
+    return NULL;
   }
 
-  // Cannot pass the same array as dst, src1 AND src2
-  assert(dst != src1 || dst != src2);
+  // Shared mappings write words to the file as they are, which must be LE
+  if(mode == BIT_ARRAY_MMAP_SHARED && !little_endian) {
+    errno = ENOTSUP;
+    return NULL;
+  }
 
-  // Dev: multiplier == 1?
+  if(mode == BIT_ARRAY_MMAP_SHARED)
+    fd = open(path, O_RDWR | (flags & BIT_ARRAY_MMAP_CREATE ? O_CREAT : 0), 0644);
+  else
+    fd = open(path, O_RDONLY);
 
-  BIT_ARRAY *read_arr, *add_arr;
+  if(fd == -1) return NULL;
+  if(fstat(fd, &st) != 0) { err = errno; goto fail; }
 
-  if(src1 == dst)
-  {
-    read_arr = src1;
-    add_arr = src2;
+  if(st.st_size == 0 && (flags & BIT_ARRAY_MMAP_CREATE)) {
+    // New file: header only, zero bits
+    if(ftruncate(fd, 8) != 0) { err = errno; goto fail; }
+    st.st_size = 8;
   }
-  else
+
+  if(st.st_size < 8) goto fail;
+
+  // Map header and payload. Big endian machines need to swap words in place
+  length = (size_t)st.st_size;
+  prot = PROT_READ;
+  if(mode != BIT_ARRAY_MMAP_RDONLY || !little_endian) prot |= PROT_WRITE;
+  base = (uint8_t*)mmap(NULL, length, prot,
+                        mode == BIT_ARRAY_MMAP_SHARED ? MAP_SHARED : MAP_PRIVATE,
+                        fd, 0);
+  if(base == (uint8_t*)MAP_FAILED) { err = errno; goto fail; }
+
+  if(length >= V2_HDR_SIZE && memcmp(base, V2_MAGIC, 8) == 0)
   {
-    read_arr = src2;
-    add_arr = src1;
+    size_t chunk_size;
+    if(mode == BIT_ARRAY_MMAP_SHARED ||
+       !_v2_read_header(base, &num_bits, &offset, &chunk_size)) goto fail;
+  }
+  else {
+    num_bits = le64_to_cpu(base);
+    offset = 8;
   }
 
-  if(dst != src1 && dst != src2)
+  // The v2 payload offset comes from the header, check it against the file
+  if(offset > length ||
+     num_bits > (length - offset) * 8 ||
+     roundup_bits2bytes(num_bits) > length - offset) goto fail;
+
+  if(num_bits == 0 && mode != BIT_ARRAY_MMAP_SHARED)
   {
-    bit_array_clear_all(dst);
+    // Nothing to map
+    munmap(base, length);
+    close(fd);
+    return bit_array_create(0);
   }
 
-  bit_index_t i;
+  nwords = roundup_bits2words64(num_bits);
 
-  for(i = read_arr->num_of_bits; i > 0; i--)
+  // A shared file is cut or extended to exactly its words. Bytes left after
+  // the payload (e.g. by a crash) are dropped rather than taken as spare
+  // capacity, so growing the file later only ever adds zeros, and the top word
+  // is wholly inside the file
+  if(mode == BIT_ARRAY_MMAP_SHARED && length != 8 + nwords * sizeof(word_t))
   {
-    if(bit_array_get(read_arr, i-1))
-    {
-      bit_array_clear(dst, i-1);
-      bit_array_add_words(dst, i-1, add_arr);
-    }
+    munmap(base, length);
+    length = 8 + nwords * sizeof(word_t);
+    base = (uint8_t*)MAP_FAILED;
+    if(ftruncate(fd, (off_t)length) != 0) { err = errno; goto fail; }
+    base = (uint8_t*)mmap(NULL, length, prot, MAP_SHARED, fd, 0);
+    if(base == (uint8_t*)MAP_FAILED) { err = errno; goto fail; }
   }
 
-  DEBUG_VALIDATE(dst);
-}
+  capacity = nwords;
+  words = (word_t*)(base + offset);
 
-// bitarr = round_down(bitarr / divisor)
-// rem = bitarr % divisor
-void bit_array_div_uint64(BIT_ARRAY *bitarr, uint64_t divisor, uint64_t *rem)
-{
-  assert(divisor != 0); // cannot divide by zero
+  if(!little_endian) {
+    for(i = 0; i < nwords; i++) words[i] = le64_to_cpu((uint8_t*)&words[i]);
+  }
 
-  bit_index_t div_top_bit = 63 - leading_zeros(divisor);
-  bit_index_t bitarr_top_bit;
+  // Bits above num_bits must be zero
+  if(nwords > 0 && (words[nwords-1] & ~bitmask64(bits_in_top_word(num_bits)))) {
+    if(mode == BIT_ARRAY_MMAP_RDONLY) goto fail;
+    words[nwords-1] &= bitmask64(bits_in_top_word(num_bits));
+  }
 
-  if(!bit_array_find_last_set_bit(bitarr, &bitarr_top_bit))
-  {
-    *rem = 0;
-    return;
+  if(mode == BIT_ARRAY_MMAP_RDONLY && (prot & PROT_WRITE) &&
+     mprotect(base, length, PROT_READ) != 0) { err = errno; goto fail; }
+
+  if((bitarr = (BIT_ARRAY*)_ba_malloc(default_allocator, sizeof(BIT_ARRAY))) == NULL ||
+     (map = (BitArrayMmap*)_ba_malloc(default_allocator, sizeof(BitArrayMmap))) == NULL) {
+    err = ENOMEM;
+    goto fail;
   }
 
-  if(bitarr_top_bit < div_top_bit)
-  {
-    *rem = bitarr->words[0];
-    bit_array_clear_all(bitarr);
-    return;
+  // Only shared mappings need the file again (to grow it)
+  if(mode != BIT_ARRAY_MMAP_SHARED) {
+    close(fd);
+    fd = -1;
   }
 
-  // When div is shifted by offset, their top set bits are aligned
-  bit_index_t offset = bitarr_top_bit - div_top_bit;
+  map->base = base;
+  map->length = length;
+  map->mode = mode;
+  map->fd = fd;
 
-  uint64_t tmp = _get_word(bitarr, offset);
-  _set_word(bitarr, offset, (word_t)0);
+  bitarr->words = words;
+  bitarr->num_of_bits = num_bits;
+  bitarr->num_of_words = nwords;
+  bitarr->capacity_in_words = capacity;
+  bitarr->storage = BIT_ARRAY_MMAP;
+  bitarr->store = map;
+  bitarr->allocator = default_allocator;
+  bitarr->growth = BIT_ARRAY_GROW_POW2;
+  bitarr->inline_bytes = 0;
+  bitarr->watch = 0;
+  bitarr->dirty = NULL;
 
-  // Carry if 1 if the top bit was set before left shift
-  char carry = 0;
+  DEBUG_VALIDATE(bitarr);
+  return bitarr;
 
-  // offset unsigned so break when offset == 0
-  while(1)
-  {
-    if(carry)
-    {
-      // (carry:tmp) - divisor = (WORD_MAX+1+tmp)-divisor
-      tmp = WORD_MAX - divisor + tmp + 1;
-      bit_array_set(bitarr, offset);
-    }
-    else if(tmp >= divisor)
-    {
-      tmp -= divisor;
-      bit_array_set(bitarr, offset);
-    }
-    else
-    {
-      bit_array_clear(bitarr, offset);
-    }
+  fail:
+  if(base != (uint8_t*)MAP_FAILED) munmap(base, length);
+  _ba_free(default_allocator, bitarr, sizeof(BIT_ARRAY));
+  close(fd);
+  errno = err;
+  return NULL;
+}
 
-    if(offset == 0)
-      break;
+// Flush changes in bits [start, start+len) of a shared mapping to disk, along
+// with the file header. Does nothing for other arrays.
+// Returns 1 on success, 0 on failure (errno is set by msync)
+char bit_array_sync_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  if(!_storage_shared(bitarr)) return 1;
 
-    offset--;
+  assert(start + len <= bitarr->num_of_bits);
 
-    // Is the top bit set (that we're about to shift off)?
-    carry = tmp & 0x8000000000000000;
+  BitArrayMmap *map = (BitArrayMmap*)bitarr->store;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t from, to;
 
-    tmp <<= 1;
-    tmp |= bit_array_get(bitarr, offset);
-  }
+  _mmap_write_header(bitarr);
 
-  *rem = tmp;
+  // msync works on whole pages, this also writes the rest of the first page
+  if(msync(map->base, 8, MS_SYNC) != 0) return 0;
+  if(len == 0) return 1;
+
+  from = 8 + bitset64_wrd(start) * sizeof(word_t);
+  to = 8 + roundup_bits2words64(start+len) * sizeof(word_t);
+  from = (from / page) * page;
+
+  if(to <= page) return 1;
+  return msync(map->base + from, to - from, MS_SYNC) == 0;
 }
 
-// Results in:
-//   quotient = dividend / divisor
-//   dividend = dividend % divisor
-// (dividend is used to return the remainder)
-void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divisor)
+char bit_array_sync(BIT_ARRAY* bitarr)
 {
-  assert(bit_array_cmp_uint64(divisor, 0) != 0); // Cannot divide by zero
+  return bit_array_sync_region(bitarr, 0, bitarr->num_of_bits);
+}
 
-  bit_array_clear_all(quotient);
+//
+// Hash function
+//
 
-  int cmp = bit_array_cmp(dividend, divisor);
+// 64 bit hash in the style of XXH3 (https://github.com/Cyan4973/xxHash).
+// Bits are consumed as a stream of 64 bit words, 4 words (a stripe) at a time.
+// Each word goes into one of four independent accumulators using only 32x32
+// bit multiplies, so compilers can vectorise it. We hash word values rather
+// than bytes so the result is the same on big and little endian machines.
 
-  if(cmp == 0)
-  {
-    bit_array_ensure_size(quotient, 1);
-    bit_array_set(quotient, 0);
-    bit_array_clear_all(dividend);
-    return;
-  }
-  else if(cmp < 0)
-  {
-    // dividend is < divisor, quotient is zero -- done
-    return;
-  }
+#define HASH_PRIME32   0x9E3779B1U
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_3 0x165667B19E3779F9ULL
+#define HASH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME64_5 0x27D4EB2F165667C5ULL
 
-  // now we know: dividend > divisor, quotient is zero'd,
-  //              dividend != 0, divisor != 0
-  bit_index_t dividend_top_bit = 0, div_top_bit = 0;
+// Scramble accumulators every HASH_STRIPES_PER_BLOCK stripes
+#define HASH_STRIPES_PER_BLOCK 16
 
-  bit_array_find_last_set_bit(dividend, &dividend_top_bit);
-  bit_array_find_last_set_bit(divisor, &div_top_bit);
+static const uint64_t hash_keys[4] = {
+  HASH_PRIME64_1, HASH_PRIME64_2, HASH_PRIME64_3, HASH_PRIME64_4
+};
 
-  // When divisor is shifted by offset, their top set bits are aligned
-  bit_index_t offset = dividend_top_bit - div_top_bit;
+static const uint64_t hash_scramble_keys[4] = {
+  HASH_PRIME64_5, HASH_PRIME64_4 ^ HASH_PRIME64_1,
+  HASH_PRIME64_3 ^ HASH_PRIME64_2, HASH_PRIME64_2 ^ HASH_PRIME64_5
+};
 
-  // offset unsigned so break when offset == 0
-  for(; ; offset--)
-  {
-    if(bit_array_cmp_words(dividend, offset, divisor) >= 0)
-    {
-      bit_array_sub_words(dividend, offset, divisor);
-      bit_array_ensure_size(quotient, offset+1);
-      bit_array_set(quotient, offset);
-    }
+// Fold 128 bit product
+static inline uint64_t _hash_mum(uint64_t a, uint64_t b)
+{
+  unsigned __int128 r = (unsigned __int128)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
 
-    if(offset == 0)
-      break;
-  }
+static inline uint64_t _hash_avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  h ^= h >> 32;
+  return h;
 }
 
-//
-// Read/Write from files
-//
-// file format is [8 bytes: for number of elements in array][data]
-// data is written in little endian order (least sig byte first)
-//
+// Stripe number `s` within a block gets its own keys, so that moving bits
+// between stripes changes the hash
+static inline void _hash_stripe(uint64_t acc[4], const word_t w[4],
+                                uint64_t seed, uint64_t s)
+{
+  uint64_t skey = HASH_PRIME64_5 * (s % HASH_STRIPES_PER_BLOCK + 1);
+  int i;
+  for(i = 0; i < 4; i++) {
+    uint64_t key = (hash_keys[i] + ((i & 1) ? -seed : seed)) ^ rot64(skey, 16*i+1);
+    uint64_t dk = w[i] ^ key;
+    acc[i^1] += w[i];
+    acc[i] += (dk & 0xffffffff) * (dk >> 32);
+  }
+}
 
-// Saves bit array to a file. Returns the number of bytes written
-// number of bytes returned should be 8+(bitarr->num_of_bits+7)/8
-bit_index_t bit_array_save(const BIT_ARRAY* bitarr, FILE* f)
+static inline void _hash_scramble(uint64_t acc[4])
 {
-  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
-  bit_index_t bytes_written = 0;
+  int i;
+  for(i = 0; i < 4; i++) {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= hash_scramble_keys[i];
+    acc[i] *= HASH_PRIME32;
+  }
+}
 
-  const int endian = 1;
-  if(*(uint8_t*)&endian == 1)
-  {
-    // Little endian machine
-    // Write 8 bytes to store the number of bits in the array
-    bytes_written += fwrite(&bitarr->num_of_bits, 1, 8, f);
+// Absorb stripes from `words`, scrambling at block boundaries
+static inline void _hash_stripes(BIT_ARRAY_HASHER *h, const word_t *words,
+                                 size_t nstripes)
+{
+  uint64_t acc[4] = {h->acc[0], h->acc[1], h->acc[2], h->acc[3]};
+  size_t i;
 
-    // Write the array
-    bytes_written += fwrite(bitarr->words, 1, num_of_bytes, f);
+  for(i = 0; i < nstripes; i++) {
+    _hash_stripe(acc, words + i*4, h->seed, h->nstripes);
+    if(++h->nstripes % HASH_STRIPES_PER_BLOCK == 0) _hash_scramble(acc);
   }
-  else
-  {
-    // Big endian machine
-    uint64_t i, w, whole_words = num_of_bytes/sizeof(word_t);
-    uint64_t rem_bytes = num_of_bytes - whole_words*sizeof(word_t);
-    uint64_t n_bits = byteswap64(bitarr->num_of_bits);
 
-    // Write 8 bytes to store the number of bits in the array
-    bytes_written += fwrite(&n_bits, 1, 8, f);
+  memcpy(h->acc, acc, sizeof(acc));
+}
 
-    // Write the array
-    for(i = 0; i < whole_words; i++) {
-      w = byteswap64(bitarr->words[i]);
-      bytes_written += fwrite(&w, 1, 8, f);
-    }
+// Append `n` (1 <= n <= 64) bits to the hash. Bits above n must be zero.
+static inline void _hash_push(BIT_ARRAY_HASHER *h, word_t w, unsigned int n)
+{
+  unsigned int idx = h->nbits / WORD_SIZE, off = h->nbits % WORD_SIZE;
 
-    if(rem_bytes > 0) {
-      w = byteswap64(bitarr->words[whole_words]);
-      bytes_written += fwrite(&w, 1, rem_bytes, f);
-    }
+  // Invariant: all bits in buf above h->nbits are zero
+  h->buf[idx] |= w << off;
+  if(off > 0 && off + n > WORD_SIZE) h->buf[idx+1] = w >> (WORD_SIZE - off);
+  h->nbits += n;
+
+  if(h->nbits >= 4 * WORD_SIZE) {
+    _hash_stripes(h, h->buf, 1);
+    h->buf[0] = h->buf[4];
+    h->buf[1] = h->buf[2] = h->buf[3] = h->buf[4] = 0;
+    h->nbits -= 4 * WORD_SIZE;
   }
+}
 
-  return bytes_written;
+void bit_array_hash_init(BIT_ARRAY_HASHER *h, uint64_t seed)
+{
+  memset(h, 0, sizeof(BIT_ARRAY_HASHER));
+  h->seed = seed;
+  h->acc[0] = HASH_PRIME32;
+  h->acc[1] = HASH_PRIME64_1;
+  h->acc[2] = HASH_PRIME64_2;
+  h->acc[3] = HASH_PRIME64_3;
 }
 
-// Load a uint64 from little endian format.
-// Works for both big and little endian architectures
-static inline uint64_t le64_to_cpu(const uint8_t *x)
+// Add bits [start, start+len) of bitarr to the hash
+void bit_array_hash_update(BIT_ARRAY_HASHER *h, const BIT_ARRAY* bitarr,
+                           bit_index_t start, bit_index_t len)
 {
-  return (((uint64_t)(x[0]))       | ((uint64_t)(x[1]) << 8)  |
-          ((uint64_t)(x[2]) << 16) | ((uint64_t)(x[3]) << 24) |
-          ((uint64_t)(x[4]) << 32) | ((uint64_t)(x[5]) << 40) |
-          ((uint64_t)(x[6]) << 48) | ((uint64_t)(x[7]) << 56));
+  assert(start + len <= bitarr->num_of_bits);
+
+  h->total_bits += len;
+
+  // Fast path: whole stripes straight from the array
+  if(h->nbits == 0 && bitset64_idx(start) == 0 && len >= 4 * WORD_SIZE)
+  {
+    size_t nstripes = len / (4 * WORD_SIZE);
+    _hash_stripes(h, bitarr->words + bitset64_wrd(start), nstripes);
+    start += nstripes * 4 * WORD_SIZE;
+    len -= nstripes * 4 * WORD_SIZE;
+  }
+
+  for(; len >= WORD_SIZE; start += WORD_SIZE, len -= WORD_SIZE)
+    _hash_push(h, _get_word(bitarr, start), WORD_SIZE);
+
+  if(len > 0)
+    _hash_push(h, _get_word(bitarr, start) & bitmask64(len), (unsigned int)len);
 }
 
-// Reads bit array from a file. bitarr is resized and filled.
-// Returns 1 on success, 0 on failure
-char bit_array_load(BIT_ARRAY* bitarr, FILE* f)
+// Get the hash value of all bits added so far. Does not change the hasher, so
+// more bits can be added afterwards.
+uint64_t bit_array_hash_final(const BIT_ARRAY_HASHER *h)
 {
-  // Read in number of bits, return 0 if we can't read in
-  bit_index_t num_bits;
-  if(fread(&num_bits, 1, 8, f) != 8) return 0;
-  num_bits = le64_to_cpu((uint8_t*)&num_bits);
+  uint64_t acc[4] = {h->acc[0], h->acc[1], h->acc[2], h->acc[3]};
 
-  // Resize
-  bit_array_resize_critical(bitarr, num_bits);
+  // Remaining bits are zero padded. Length is added below, so padding does not
+  // cause collisions.
+  if(h->nbits > 0) _hash_stripe(acc, h->buf, h->seed, h->nstripes);
 
-  // Have to calculate how many bytes are needed for the file
-  // (Note: this may be different from num_of_words * sizeof(word_t))
-  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
-  if(fread(bitarr->words, 1, num_of_bytes, f) != num_of_bytes) return 0;
+  uint64_t r = (h->total_bits * HASH_PRIME64_1) ^ h->seed;
+  r += _hash_mum(acc[0] ^ hash_scramble_keys[0], acc[1] ^ hash_scramble_keys[1]);
+  r += _hash_mum(acc[2] ^ hash_scramble_keys[2], acc[3] ^ hash_scramble_keys[3]);
+  return _hash_avalanche(r);
+}
 
-  // Fix endianness
-  word_addr_t i;
-  for(i = 0; i < bitarr->num_of_words; i++)
-    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
+// Hash bits [start, start+len) of bitarr.
+// Gives the same value as a copy of the region passed to bit_array_hash()
+uint64_t bit_array_hash_region(const BIT_ARRAY* bitarr,
+                               bit_index_t start, bit_index_t len,
+                               uint64_t seed)
+{
+  BIT_ARRAY_HASHER h;
+  bit_array_hash_init(&h, seed);
+  bit_array_hash_update(&h, bitarr, start, len);
+  return bit_array_hash_final(&h);
+}
 
-  // Mask top word
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
-  return 1;
+// Pass seed as 0 on first call, pass previous hash value if rehashing due
+// to a collision
+uint64_t bit_array_hash(const BIT_ARRAY* bitarr, uint64_t seed)
+{
+  return bit_array_hash_region(bitarr, 0, bitarr->num_of_bits, seed);
 }
 
 //
-// Hash function
+// Rolling hash
 //
 
-/* From: lookup3.c, by Bob Jenkins, May 2006, Public Domain. */
-#define hashsize(n) ((uint32_t)1<<(n))
-#define hashmask(n) (hashsize(n)-1)
-#define rot(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
+// Polynomial hash of a window of w bits x_0..x_{w-1} (x_0 has lowest index):
+//   H = sum x_i * B^(w-1-i)  mod P,  P = 2^61-1
+// Sliding by one bit: H' = H*B - x_0*B^w + x_w
+// The modulus is prime: mod 2^64 the bits of B above the lowest set bit drop
+// out of high powers, and a window and its complement can collide (Thue-Morse).
+// The base B is picked by the seed, and the value returned is H passed through
+// a bijective mixer with the seed.
+#define ROLLHASH_PRIME 0x1FFFFFFFFFFFFFFFULL
+#define ROLLHASH_BASE 0x9E3779B97F4A7C15ULL
 
-/* From: lookup3.c, by Bob Jenkins, May 2006, Public Domain. */
-#define mix(a,b,c) \
-{ \
-  a -= c;  a ^= rot(c, 4);  c += b; \
-  b -= a;  b ^= rot(a, 6);  a += c; \
-  c -= b;  c ^= rot(b, 8);  b += a; \
-  a -= c;  a ^= rot(c,16);  c += b; \
-  b -= a;  b ^= rot(a,19);  a += c; \
-  c -= b;  c ^= rot(b, 4);  b += a; \
+static inline uint64_t _rollhash_mix(uint64_t h, uint64_t seed)
+{
+  h ^= seed;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
 }
 
-/* From: lookup3.c, by Bob Jenkins, May 2006, Public Domain. */
-#define final(a,b,c) \
-{ \
-  c ^= b; c -= rot(b,14); \
-  a ^= c; a -= rot(c,11); \
-  b ^= a; b -= rot(a,25); \
-  c ^= b; c -= rot(b,16); \
-  a ^= c; a -= rot(c,4);  \
-  b ^= a; b -= rot(a,14); \
-  c ^= b; c -= rot(b,24); \
+// a * b mod 2^61-1, for a, b < 2^61-1
+static inline uint64_t _rollhash_mulmod(uint64_t a, uint64_t b)
+{
+  unsigned __int128 r = (unsigned __int128)a * b;
+  uint64_t h = ((uint64_t)r & ROLLHASH_PRIME) + (uint64_t)(r >> 61);
+  return h >= ROLLHASH_PRIME ? h - ROLLHASH_PRIME : h;
 }
 
-/*
-From: lookup3.c, by Bob Jenkins, May 2006, Public Domain.
---------------------------------------------------------------------
-hashword2() -- same as hashword(), but take two seeds and return two
-32-bit values.  pc and pb must both be nonnull, and *pc and *pb must
-both be initialized with seeds.  If you pass in (*pb)==0, the output
-(*pc) will be the same as the return value from hashword().
---------------------------------------------------------------------
-*/
-static void hashword2 (
-const uint32_t *k,                   /* the key, an array of uint32_t values */
-size_t          length,               /* the length of the key, in uint32_ts */
-uint32_t       *pc,                      /* IN: seed OUT: primary hash value */
-uint32_t       *pb)               /* IN: more seed OUT: secondary hash value */
+// b^e mod 2^61-1 by squaring
+static uint64_t _rollhash_pow(uint64_t b, bit_index_t e)
+{
+  uint64_t r = 1;
+  for(; e > 0; e >>= 1) {
+    if(e & 1) r = _rollhash_mulmod(r, b);
+    b = _rollhash_mulmod(b, b);
+  }
+  return r;
+}
+
+// Slide on by one bit: drop x_0 (out) and append x_w (in)
+static inline uint64_t _rollhash_slide(uint64_t h, uint64_t base, uint64_t bw,
+                                       word_t out, word_t in)
 {
-  uint32_t a,b,c;
+  h = _rollhash_mulmod(h, base) + in + (-out & (ROLLHASH_PRIME - bw));
+  return h >= ROLLHASH_PRIME ? h - ROLLHASH_PRIME : h;
+}
 
-  /* Set up the internal state */
-  a = b = c = 0xdeadbeef + ((uint32_t)(length<<2)) + *pc;
-  c += *pb;
+// Hash of window starting at `start`, without the final mix
+static uint64_t _rollhash_window(const BIT_ARRAY* bitarr, bit_index_t start,
+                                 bit_index_t window, uint64_t base)
+{
+  uint64_t h = 0;
+  bit_index_t i, end = start + window;
 
-  /*------------------------------------------------- handle most of the key */
-  while (length > 3)
+  for(i = start; i < end; i += WORD_SIZE)
   {
-    a += k[0];
-    b += k[1];
-    c += k[2];
-    mix(a,b,c);
-    length -= 3;
-    k += 3;
+    word_t w = _get_word(bitarr, i);
+    bit_index_t j, n = MIN(WORD_SIZE, end - i);
+    for(j = 0; j < n; j++) {
+      h = _rollhash_mulmod(h, base) + ((w >> j) & 1);
+      if(h >= ROLLHASH_PRIME) h -= ROLLHASH_PRIME;
+    }
   }
 
-  /*------------------------------------------- handle the last 3 uint32_t's */
-  switch(length)                     /* all the case statements fall through */
+  return h;
+}
+
+// Returns 1 on success, 0 if window is zero or longer than the array
+char bit_array_rollhash_init(BIT_ARRAY_ROLLHASH *rh, const BIT_ARRAY* bitarr,
+                             bit_index_t window, uint64_t seed)
+{
+  if(window == 0 || window > bitarr->num_of_bits) return 0;
+
+  rh->arr = bitarr;
+  rh->window = window;
+  rh->pos = 0;
+  rh->seed = seed;
+  // base in [2, P-1)
+  rh->base = _rollhash_mix(ROLLHASH_BASE, seed) % (ROLLHASH_PRIME - 2) + 2;
+  rh->bw = _rollhash_pow(rh->base, window);
+  rh->h = _rollhash_window(bitarr, 0, window, rh->base);
+  return 1;
+}
+
+// Get the hash of the window starting at rh->pos, then slide on by one bit.
+// Returns 1 on success, 0 if there are no more windows
+char bit_array_rollhash_next(BIT_ARRAY_ROLLHASH *rh, uint64_t *hash)
+{
+  const BIT_ARRAY *arr = rh->arr;
+  bit_index_t end = rh->pos + rh->window;
+
+  if(end > arr->num_of_bits) return 0;
+
+  *hash = _rollhash_mix(rh->h, rh->seed);
+
+  if(end < arr->num_of_bits)
   {
-  case 3 : c+=k[2];
-  case 2 : b+=k[1];
-  case 1 : a+=k[0];
-    final(a,b,c);
-  case 0:     /* case 0: nothing left to add */
-    break;
+    rh->h = _rollhash_slide(rh->h, rh->base, rh->bw,
+                            bit_array_get(arr, rh->pos),
+                            bit_array_get(arr, end));
   }
-  /*------------------------------------------------------ report the result */
-  *pc=c; *pb=b;
+
+  rh->pos++;
+  return 1;
 }
 
-// Pass seed as 0 on first call, pass previous hash value if rehashing due
-// to a collision
-// Using bob jenkins hash lookup3
-uint64_t bit_array_hash(const BIT_ARRAY* bitarr, uint64_t seed)
+// Hash every window of `window` bits. hashes[i] is the hash of bits
+// [i, i+window). `hashes` must have space for length-window+1 values.
+// Returns the number of hashes written
+bit_index_t bit_array_rollhash_all(const BIT_ARRAY* bitarr, bit_index_t window,
+                                   uint64_t seed, uint64_t *hashes)
 {
-  uint32_t seed32[2];
-  memcpy(seed32, &seed, sizeof(uint32_t)*2);
+  BIT_ARRAY_ROLLHASH rh;
+  if(!bit_array_rollhash_init(&rh, bitarr, window, seed)) return 0;
+
+  bit_index_t s, j, n, nwindows = bitarr->num_of_bits - window + 1;
+  uint64_t h = rh.h, bw = rh.bw, base = rh.base;
 
-  // Round up length to number 32bit words
-  hashword2((uint32_t*)bitarr->words, (bitarr->num_of_bits + 31) / 32,
-            &seed32[0], &seed32[1]);
+  // 64 windows at a time: fetch the next 64 bits leaving and entering
+  for(s = 0; s < nwindows; s += WORD_SIZE)
+  {
+    n = MIN(WORD_SIZE, nwindows - s);
+    word_t out = _get_word(bitarr, s);
+    // last window has no next bit
+    word_t in = s + window < bitarr->num_of_bits ? _get_word(bitarr, s + window)
+                                                 : 0;
 
-  // XOR with array length. This ensures arrays with different length but same
-  // contents have different hash values
-  seed ^= bitarr->num_of_bits;
+    for(j = 0; j < n; j++)
+    {
+      hashes[s+j] = _rollhash_mix(h, seed);
+      h = _rollhash_slide(h, base, bw, (out >> j) & 1, (in >> j) & 1);
+    }
+  }
 
-  return seed;
+  return nwindows;
 }
 
 
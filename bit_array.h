@@ -16,6 +16,14 @@
 #include "bit_macros.h"
 
 typedef struct BIT_ARRAY BIT_ARRAY;
+typedef struct BIT_ARRAY_RNG BIT_ARRAY_RNG;
+typedef struct BIT_ARRAY_HASHER BIT_ARRAY_HASHER;
+typedef struct BIT_ARRAY_ROLLHASH BIT_ARRAY_ROLLHASH;
+typedef struct BIT_ARRAY_AIO BIT_ARRAY_AIO;
+typedef struct BIT_ARRAY_ALLOCATOR BIT_ARRAY_ALLOCATOR;
+typedef struct BIT_ARRAY_SMALL BIT_ARRAY_SMALL;
+typedef struct BIT_ARRAY_POOL BIT_ARRAY_POOL;
+typedef struct BIT_ARRAY_SLICE BIT_ARRAY_SLICE;
 
 // 64 bit words
 typedef uint64_t word_t, word_addr_t, bit_index_t;
@@ -42,6 +50,102 @@ struct BIT_ARRAY
   // For more efficient allocation we use realloc only to double size --
   // not for adding every word.  Initial size is INIT_CAPACITY_WORDS.
   word_addr_t capacity_in_words;
+  // Where words live: BIT_ARRAY_HEAP (malloc), BIT_ARRAY_MMAP (a file mapped
+  // with bit_array_mmap_open), BIT_ARRAY_ANON (an anonymous mapping for
+  // huge pages or lazy zeroing), BIT_ARRAY_INLINE (allocated with the
+  // struct), BIT_ARRAY_WRAP (a caller's buffer, see bit_array_wrap()),
+  // BIT_ARRAY_COW (shared with snapshots) or BIT_ARRAY_SNAPSHOT (a snapshot,
+  // see bit_array_snapshot()). store holds data for file backed storage,
+  // snapshots and flags for wrapped buffers.
+  int storage;
+  void *store;
+  // Allocator for the words and the struct itself, NULL means malloc/free
+  const BIT_ARRAY_ALLOCATOR *allocator;
+  // How capacity grows: BIT_ARRAY_GROW_POW2 (default), _1_5X or _EXACT
+  int growth;
+  // Bytes of words allocated directly after the struct by
+  // bit_array_create_compact(), otherwise 0
+  size_t inline_bytes;
+  // Nonzero if words must be passed to a write hook before they are changed
+  // (arrays with snapshots or dirty tracking, and read only views)
+  int watch;
+  // One bit per BIT_ARRAY_DIRTY_CHUNK bytes of words changed since
+  // bit_array_clear_dirty(), NULL unless bit_array_track_dirty() was called
+  BIT_ARRAY *dirty;
+};
+
+// A bit array with room for BIT_ARRAY_SMALL_WORDS words inside the struct,
+// see bit_array_alloc_small(). Must not be copied or moved while in use.
+// Fixed, since the library and its users must agree on the size
+#define BIT_ARRAY_SMALL_WORDS 2
+
+struct BIT_ARRAY_SMALL
+{
+  BIT_ARRAY arr;
+  word_t buf[BIT_ARRAY_SMALL_WORDS];
+};
+
+// Memory allocation functions. ctx is passed to each call. Sizes passed to
+// realloc and free are those of the original request, for accounting.
+// Allocations must be suitably aligned for word_t (like malloc)
+struct BIT_ARRAY_ALLOCATOR
+{
+  void* (*alloc)(size_t size, void *ctx);
+  void* (*realloc)(void *ptr, size_t old_size, size_t new_size, void *ctx);
+  void (*free)(void *ptr, size_t size, void *ctx);
+  void *ctx;
+};
+
+// Values for BIT_ARRAY.storage
+#define BIT_ARRAY_HEAP 0
+#define BIT_ARRAY_MMAP 1
+#define BIT_ARRAY_ANON 2
+#define BIT_ARRAY_INLINE 3
+#define BIT_ARRAY_WRAP 4
+#define BIT_ARRAY_COW 5
+#define BIT_ARRAY_SNAPSHOT 6
+
+// Values for BIT_ARRAY.growth
+#define BIT_ARRAY_GROW_POW2  0
+#define BIT_ARRAY_GROW_1_5X  1
+#define BIT_ARRAY_GROW_EXACT 2
+
+// Alignment in bytes of words from the default allocator (a cache line).
+// Arrays in anonymous maps (see bit_array_set_hugepage_threshold()) are also
+// aligned to a huge page. Words kept next to the struct (compact, pool and
+// BIT_ARRAY_SMALL arrays) and views are only word aligned
+#define BIT_ARRAY_ALIGN 64
+
+// Random number generator state (xoshiro256**)
+// Initialise with bit_array_rng_seed()
+struct BIT_ARRAY_RNG
+{
+  uint64_t s[4];
+};
+
+// Bits [start, start+len) of arr. Create with bit_array_slice()
+struct BIT_ARRAY_SLICE
+{
+  const BIT_ARRAY *arr;
+  bit_index_t start, len;
+};
+
+// Streaming hash state. Initialise with bit_array_hash_init()
+struct BIT_ARRAY_HASHER
+{
+  uint64_t acc[4], seed, nstripes;
+  word_t buf[5]; // bits waiting to be hashed
+  unsigned int nbits; // number of bits in buf
+  bit_index_t total_bits;
+};
+
+// Rolling hash over windows of a bit array.
+// Initialise with bit_array_rollhash_init()
+struct BIT_ARRAY_ROLLHASH
+{
+  const BIT_ARRAY *arr;
+  bit_index_t window, pos; // pos is the start of the current window
+  uint64_t h, bw, base, seed; // h, bw and base are mod 2^61-1
 };
 
 //
@@ -58,6 +162,51 @@ void bit_array_free(BIT_ARRAY* bitarray);
 BIT_ARRAY* bit_array_alloc(BIT_ARRAY* bitarr, bit_index_t nbits);
 void bit_array_dealloc(BIT_ARRAY* bitarr);
 
+// As above, but all memory for the array comes from allocator, which must
+// outlive the array. Pass NULL to use malloc/realloc/free.
+BIT_ARRAY* bit_array_create_with(bit_index_t nbits,
+                                 const BIT_ARRAY_ALLOCATOR *allocator);
+BIT_ARRAY* bit_array_alloc_with(BIT_ARRAY* bitarr, bit_index_t nbits,
+                                const BIT_ARRAY_ALLOCATOR *allocator);
+
+// Create a bit array with its words in the same allocation as the struct.
+// Free with bit_array_free(). Words move to the heap if it is enlarged
+BIT_ARRAY* bit_array_create_compact(bit_index_t nbits);
+
+// Use an existing BIT_ARRAY_SMALL, keeping words in its buffer while they fit
+// (up to BIT_ARRAY_SMALL_WORDS words, on the heap otherwise). Release with
+// bit_array_dealloc(). Pass the returned pointer to other functions
+BIT_ARRAY* bit_array_alloc_small(BIT_ARRAY_SMALL* sarr, bit_index_t nbits);
+
+// Set the allocator used by bit_array_create() and bit_array_alloc() for new
+// arrays (not thread safe). NULL means malloc/realloc/free (the default).
+// Existing arrays keep the allocator they were created with, as do copies made
+// with bit_array_clone()
+void bit_array_set_allocator(const BIT_ARRAY_ALLOCATOR *allocator);
+const BIT_ARRAY_ALLOCATOR* bit_array_get_allocator();
+
+// Arrays using the default allocator whose capacity reaches nbytes are put in
+// anonymous memory maps advised to use transparent huge pages, and grown with
+// mremap. 0 disables this (the default). Not thread safe
+void bit_array_set_hugepage_threshold(size_t nbytes);
+size_t bit_array_get_hugepage_threshold();
+
+// Arrays using the default allocator whose capacity reaches nbytes are put in
+// anonymous memory maps, so growing them needs no memset and clearing them
+// (bit_array_clear_all, shrinking) returns whole pages to the kernel with
+// MADV_DONTNEED. Memory is then zeroed when next touched. 0 disables this.
+// Default is BIT_ARRAY_LAZY_ZERO_DEFAULT. Not thread safe
+#define BIT_ARRAY_LAZY_ZERO_DEFAULT ((size_t)1 << 26)
+void bit_array_set_lazy_zero_threshold(size_t nbytes);
+size_t bit_array_get_lazy_zero_threshold();
+
+// Fills (bit_array_set_all, clear_all, toggle_all and the region functions)
+// of at least nbytes use non-temporal stores that bypass the cache, on x86-64.
+// Toggles still read the words through the cache. Default is the size of the
+// last level cache. 0 disables
+void bit_array_set_stream_threshold(size_t nbytes);
+size_t bit_array_get_stream_threshold();
+
 // Get length of bit array
 bit_index_t bit_array_length(const BIT_ARRAY* bit_arr);
 
@@ -72,6 +221,84 @@ char bit_array_ensure_size(BIT_ARRAY* bitarr, bit_index_t ensure_num_of_bits);
 void bit_array_resize_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits);
 void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits);
 
+// Make room for at least nbits without changing the length, so growing up to
+// nbits needs no more allocation. Returns 1 on success, 0 on failure
+char bit_array_reserve(BIT_ARRAY* bitarr, bit_index_t nbits);
+
+// Release unused capacity, e.g. after shrinking a large array.
+// Returns 1 on success, 0 on failure
+char bit_array_shrink_to_fit(BIT_ARRAY* bitarr);
+
+// Set how capacity grows when the array needs more memory: doubling to the
+// next power of two (BIT_ARRAY_GROW_POW2, the default), by half
+// (BIT_ARRAY_GROW_1_5X) or to exactly the size needed (BIT_ARRAY_GROW_EXACT)
+void bit_array_set_growth(BIT_ARRAY* bitarr, int policy);
+
+//
+// Pools of same sized arrays
+//
+
+// Hands out arrays of a fixed length from slabs of per_slab arrays, each array
+// stored contiguously with its words. Arrays from a pool must be returned with
+// bit_array_pool_put(), not bit_array_free(). They may be resized.
+// Not thread safe. Returns NULL if out of memory
+BIT_ARRAY_POOL* bit_array_pool_create(bit_index_t nbits, size_t per_slab);
+
+// Get a zeroed array of the pool's length. Returns NULL if out of memory
+BIT_ARRAY* bit_array_pool_get(BIT_ARRAY_POOL* pool);
+
+// Return an array to the pool
+void bit_array_pool_put(BIT_ARRAY_POOL* pool, BIT_ARRAY* bitarr);
+
+// Return all arrays to the pool at once, keeping the memory for reuse
+void bit_array_pool_reset(BIT_ARRAY_POOL* pool);
+
+// Free the pool, including any arrays still in use
+void bit_array_pool_free(BIT_ARRAY_POOL* pool);
+
+//
+// Views of external buffers
+//
+
+// Flags for bit_array_wrap()
+#define BIT_ARRAY_WRAP_RDONLY 1 // functions that modify the array abort
+
+// Use buf, which holds nbits bits (not accessed if nbits is 0), as the words of
+// bitarr without copying. The buffer stays owned by the caller. The view cannot
+// be resized: bit_array_resize(), and loads that would need to resize it, fail
+// with errno set to EPERM, leaving it unchanged. Other functions that would
+// need to enlarge it abort, as they do when out of memory.
+// bit_array_free() does nothing and sets errno to EPERM; use
+// bit_array_dealloc(). Bits past nbits in the last word are cleared, or with
+// BIT_ARRAY_WRAP_RDONLY must already be zero.
+// Returns NULL and sets errno to EINVAL on failure
+BIT_ARRAY* bit_array_wrap(BIT_ARRAY* bitarr, word_t *buf, bit_index_t nbits,
+                          int flags);
+
+//
+// Copy-on-write snapshots
+//
+
+// Chunks of this many bytes are copied when first changed after a snapshot
+#define BIT_ARRAY_SNAPSHOT_CHUNK (1UL<<16)
+
+// Get a read only copy of bitarr as it is now, without copying its words.
+// The first snapshot moves the words into shared memory (one copy), unless
+// bit_array_prepare_snapshots() already has. After that the two arrays share
+// pages until bitarr changes a chunk, when the old chunk is copied for the
+// snapshot. Changing a snapshot aborts. Snapshots may be read by other threads
+// while bitarr is changed, and freed with bit_array_free() in any order with
+// bitarr. Take snapshots on the thread that changes bitarr.
+// Returns NULL and sets errno on failure: ENOTSUP for file mappings, views
+// and snapshots, or if not supported by the system (needs Linux memfd)
+BIT_ARRAY* bit_array_snapshot(BIT_ARRAY* bitarr);
+
+// Move the words of bitarr into shared memory now rather than at the first
+// snapshot. Called on an empty array nothing is copied: the array then grows
+// in shared memory. Returns 1 on success, 0 and sets errno as
+// bit_array_snapshot() on failure
+char bit_array_prepare_snapshots(BIT_ARRAY* bitarr);
+
 
 //
 // Macros
@@ -83,11 +310,19 @@ void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits);
 //
 
 #define bit_array_get(arr,i)      bitset_get((arr)->words, i)
-#define bit_array_set(arr,i)      bitset_set((arr)->words, i)
-#define bit_array_clear(arr,i)    bitset_del((arr)->words, i)
-#define bit_array_toggle(arr,i)   bitset_tgl((arr)->words, i)
+#define bit_array_set(arr,i)      (_bit_array_write(arr,i), bitset_set((arr)->words, i))
+#define bit_array_clear(arr,i)    (_bit_array_write(arr,i), bitset_del((arr)->words, i))
+#define bit_array_toggle(arr,i)   (_bit_array_write(arr,i), bitset_tgl((arr)->words, i))
 // c must be 0 or 1
-#define bit_array_assign(arr,i,c) bitset_cpy((arr)->words,i,c)
+#define bit_array_assign(arr,i,c) (_bit_array_write(arr,i), bitset_cpy((arr)->words,i,c))
+
+// Internal: called before words [first, first+nwords) of an array with
+// watch set are changed
+void _bit_array_write_words(BIT_ARRAY* bitarr, word_addr_t first,
+                            word_addr_t nwords);
+
+#define _bit_array_write(arr,i) \
+  ((arr)->watch ? _bit_array_write_words((arr), bitset64_wrd(i), 1) : (void)0)
 
 #define bit_array_len(arr) ((arr)->num_of_bits)
 
@@ -395,6 +630,46 @@ int bit_array_cmp_big_endian(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
 int bit_array_cmp_words(const BIT_ARRAY *bitarr,
                         bit_index_t pos, const BIT_ARRAY *bitarr2);
 
+//
+// Slices
+//
+
+// A slice refers to bits [start, start+len) of an array without copying them.
+// It is valid until the array is resized or freed. Functions taking slices
+// shift misaligned slices into place one word at a time. Indices passed to and
+// returned from them are relative to the start of the slice
+BIT_ARRAY_SLICE bit_array_slice(const BIT_ARRAY* bitarr,
+                                bit_index_t start, bit_index_t len);
+
+bit_index_t bit_array_slice_num_bits_set(BIT_ARRAY_SLICE s);
+
+// As bit_array_find_next_set_bit() etc.
+char bit_array_slice_find_next_set_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                       bit_index_t *result);
+char bit_array_slice_find_next_clear_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                         bit_index_t *result);
+char bit_array_slice_find_prev_set_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                       bit_index_t *result);
+char bit_array_slice_find_prev_clear_bit(BIT_ARRAY_SLICE s, bit_index_t offset,
+                                         bit_index_t *result);
+
+// Compare by value with index 0 as the LSB, like bit_array_cmp()
+int bit_array_slice_cmp(BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2);
+
+// Same as bit_array_hash() of a copy of the slice
+uint64_t bit_array_slice_hash(BIT_ARRAY_SLICE s, uint64_t seed);
+
+// Returns number of characters written
+size_t bit_array_slice_to_hex(BIT_ARRAY_SLICE s, char *str, char uppercase);
+
+// Logic operators with slices as sources. dst is enlarged to the length of the
+// longer slice, as with bit_array_and() etc. dst may be the array a slice is
+// taken from. bit_array_slice_not() sets dst to the length of s
+void bit_array_slice_and(BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2);
+void bit_array_slice_or (BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2);
+void bit_array_slice_xor(BIT_ARRAY* dst, BIT_ARRAY_SLICE s1, BIT_ARRAY_SLICE s2);
+void bit_array_slice_not(BIT_ARRAY* dst, BIT_ARRAY_SLICE s);
+
 //
 // Shift, interleave, reverse
 //
@@ -504,37 +779,257 @@ void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divis
 //
 // Read/Write bit_array to a file
 //
-// File format is [8 bytes: for number of elements in array][data]
+// Version 1 file format is [8 bytes: for number of elements in array][data]
 // Number of bytes of data is: (int)((num_of_bits + 7) / 8)
 //
+// Version 2 files have a 64 byte header (magic, version, number of bits,
+// number of bits set, rank index offset), a CRC32C checksum for every 1MB
+// chunk, then the words starting at a multiple of BIT_ARRAY_V2_ALIGN bytes.
+//
+
+#define BIT_ARRAY_V2_ALIGN 4096
 
 // Saves bit array to a file
 // returns the number of bytes written
 bit_index_t bit_array_save(const BIT_ARRAY* bitarr, FILE* f);
 
-// Reads bit array from a file. bitarr is resized and filled.
+// Saves bit array to a file in version 2 format
+// returns the number of bytes written
+bit_index_t bit_array_save_v2(const BIT_ARRAY* bitarr, FILE* f);
+
+// Reads bit array from a file, version 1 or 2. bitarr is resized and filled.
+// Checksums of version 2 files are checked as they are read.
 // Returns 1 on success, 0 on failure
 char bit_array_load(BIT_ARRAY* bitarr, FILE* f);
 
+// Saves bits [start, start+len) to a file in version 1 format, the same as
+// saving a copy of the region. Returns the number of bytes written
+bit_index_t bit_array_save_range(const BIT_ARRAY* bitarr, FILE* f,
+                                 bit_index_t start, bit_index_t len);
+
+// Reads bits [start, start+len) of a version 1 or 2 file into bitarr, which
+// is resized to len. Seeks past the rest of the file where possible and only
+// reads the words covering the range. Checksums are not checked.
+// Returns 1 on success, 0 on failure (e.g. range is past the end of the array)
+char bit_array_load_range(BIT_ARRAY* bitarr, FILE* f,
+                          bit_index_t start, bit_index_t len);
+
+// Saves bit array to a file using word aligned run length encoding (EWAH
+// style): runs of all-zero or all-one words are stored as a count.
+// Streams through a fixed size buffer. Returns the number of bytes written
+bit_index_t bit_array_save_compressed(const BIT_ARRAY* bitarr, FILE* f);
+
+// Reads a file written by bit_array_save_compressed(). bitarr is resized and
+// filled. Returns 1 on success, 0 on failure
+char bit_array_load_compressed(BIT_ARRAY* bitarr, FILE* f);
+
+// Writes a delta that turns array `from` into array `to` (which may differ in
+// length): positions of changed bits for sparse changes, runs for toggled
+// regions and literal words otherwise. Streams through a fixed size buffer
+// without building the XOR of the arrays. Returns the number of bytes written
+bit_index_t bit_array_delta_encode(const BIT_ARRAY* from, const BIT_ARRAY* to,
+                                   FILE* f);
+
+// Applies a delta from bit_array_delta_encode() to bitarr in place. bitarr
+// must have the length of `from`. Returns 1 on success, 0 on failure: bitarr
+// is unchanged if the lengths don't match, and may be partly changed if the
+// delta is corrupt
+char bit_array_delta_apply(BIT_ARRAY* bitarr, FILE* f);
+
+// Incremental saves: once tracking is turned on, the mutating functions
+// (including the macros) mark each chunk of BIT_ARRAY_DIRTY_CHUNK bytes they
+// change. All chunks start clean.
+#define BIT_ARRAY_DIRTY_CHUNK 4096
+
+// Start tracking changed chunks. Returns 1 on success, 0 if out of memory
+char bit_array_track_dirty(BIT_ARRAY* bitarr);
+// Stop tracking and free the record of changed chunks
+void bit_array_untrack_dirty(BIT_ARRAY* bitarr);
+// Mark all chunks clean without saving them, e.g. after a full save
+void bit_array_clear_dirty(BIT_ARRAY* bitarr);
+
+// Saves the length of the array and the chunks changed since the last save,
+// tracking started or bit_array_clear_dirty() was called, each with its
+// offset, and marks them clean. Other threads may keep changing bitarr, but a
+// write still in progress may be missed: pause writers for an exact save.
+// Returns the number of bytes written
+bit_index_t bit_array_save_dirty(BIT_ARRAY* bitarr, FILE* f);
+
+// Reads a file written by bit_array_save_dirty() into bitarr, which should
+// hold the array as it was when the chunks were last marked clean. bitarr is
+// resized and the saved chunks are overwritten.
+// Returns 1 on success, 0 on failure
+char bit_array_load_dirty(BIT_ARRAY* bitarr, FILE* f);
+
+// Saves bit array to a file descriptor in version 2 format, writing 1MB chunks
+// in parallel with pwrite() from nthreads threads (0 means one per CPU).
+// Writes from the start of the file and sets its length. If fd was opened with
+// O_DIRECT, data is copied through aligned buffers.
+// Returns the number of bytes written, 0 on failure with errno set
+bit_index_t bit_array_save_fd(const BIT_ARRAY* bitarr, int fd, int nthreads);
+
+// Reads a version 1 or 2 file from a file descriptor, reading chunks in
+// parallel with pread() from nthreads threads (0 means one per CPU).
+// O_DIRECT file descriptors are supported. Returns 1 on success, 0 on failure
+// with errno set (EIO if a checksum does not match)
+char bit_array_load_fd(BIT_ARRAY* bitarr, int fd, int nthreads);
+
+//
+// Asynchronous save/load
+//
+// Reads and writes version 2 files in 1MB chunks through io_uring (Linux),
+// keeping many requests in flight while the caller does other work. Where
+// io_uring is not available a background thread is used instead.
+// Words are written in place, so the array must not be changed, resized or
+// freed until a save has finished, and must not be used at all during a load.
+// To keep changing an array while it is saved, save a bit_array_snapshot() of
+// it and free the snapshot when the save has finished.
+//
+
+// Called once an operation finishes, from bit_array_aio_poll() or
+// bit_array_aio_wait(). ok is 1 on success, 0 on failure
+typedef void (*bit_array_aio_cb)(BIT_ARRAY_AIO *aio, char ok, void *ctx);
+
+// Start saving bitarr to fd (from offset 0). cb may be NULL.
+// Returns NULL and sets errno if the save could not be started
+BIT_ARRAY_AIO* bit_array_aio_save(const BIT_ARRAY* bitarr, int fd,
+                                  bit_array_aio_cb cb, void *ctx);
+
+// Start loading a version 1 or 2 file from fd (from offset 0). The header is
+// read and bitarr resized before returning. cb may be NULL.
+// Returns NULL and sets errno if the load could not be started
+BIT_ARRAY_AIO* bit_array_aio_load(BIT_ARRAY* bitarr, int fd,
+                                  bit_array_aio_cb cb, void *ctx);
+
+// Submit more requests and handle completions without blocking.
+// Returns 1 once the operation has finished, 0 otherwise
+char bit_array_aio_poll(BIT_ARRAY_AIO *aio);
+
+// Block until the operation finishes.
+// Returns 1 on success, 0 on failure with errno set
+char bit_array_aio_wait(BIT_ARRAY_AIO *aio);
+
+// Waits for the operation if still running, then frees it
+void bit_array_aio_free(BIT_ARRAY_AIO *aio);
+
+//
+// Memory mapped files
+//
+
+// Flags for bit_array_mmap_open(). Pass one of RDONLY, PRIVATE or SHARED
+#define BIT_ARRAY_MMAP_RDONLY  0 // mapping is read only, array cannot change
+#define BIT_ARRAY_MMAP_PRIVATE 1 // copy-on-write, changes are not saved
+#define BIT_ARRAY_MMAP_SHARED  2 // changes are written to the file
+#define BIT_ARRAY_MMAP_CREATE  4 // with SHARED: create the file if missing
+
+// Map a file written by bit_array_save() or bit_array_save_v2() into memory
+// without reading it. Checksums of version 2 files are not checked.
+// Pages are read from disk as they are used. With BIT_ARRAY_MMAP_RDONLY the
+// array must not be modified and bit_array_resize() fails with EPERM. With
+// BIT_ARRAY_MMAP_PRIVATE the array can be modified; growing it past the end of
+// the file moves it to the heap. With BIT_ARRAY_MMAP_SHARED the array stays
+// backed by the file: resizing grows the file and remaps it, and changes reach
+// the file as the OS writes pages back (or on bit_array_sync()). Shared
+// mappings are only supported for version 1 files on little endian machines.
+// Free with bit_array_free(), which leaves the file in bit_array_save() format.
+// Returns NULL and sets errno on failure (EINVAL if the file is not valid)
+BIT_ARRAY* bit_array_mmap_open(const char *path, int flags);
+
+// Write changes to a shared mapping (and its length) to disk with msync().
+// Does nothing for other arrays. Returns 1 on success, 0 on failure
+char bit_array_sync(BIT_ARRAY* bitarr);
+
+// Only write pages holding bits [start, start+len) and the file header
+char bit_array_sync_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len);
+
 
 //
 // Hash function
 //
 
+// 64 bit hash of the bits in the array (XXH3 style). Gives the same value on
+// big and little endian machines. Arrays of different lengths have different
+// hash values, even if the extra bits are zero.
+
 // Pass seed as 0 on first call, pass previous hash value if rehashing due
 // to a collision
-// Using bob jenkins hash lookup3
 uint64_t bit_array_hash(const BIT_ARRAY* bitarr, uint64_t seed);
 
+// Hash bits [start, start+len). Same as hashing a copy of the region.
+uint64_t bit_array_hash_region(const BIT_ARRAY* bitarr,
+                               bit_index_t start, bit_index_t len,
+                               uint64_t seed);
+
+// Streaming hash: the hash of several regions added with
+// bit_array_hash_update() is the hash of the regions concatenated.
+// bit_array_hash_final() does not change the hasher.
+void bit_array_hash_init(BIT_ARRAY_HASHER *h, uint64_t seed);
+void bit_array_hash_update(BIT_ARRAY_HASHER *h, const BIT_ARRAY* bitarr,
+                           bit_index_t start, bit_index_t len);
+uint64_t bit_array_hash_final(const BIT_ARRAY_HASHER *h);
+
+//
+// Rolling hash
+//
+
+// Hash every window of `window` bits, updating in O(1) per bit (polynomial
+// rolling hash mod 2^61-1, with a base picked by the seed). Windows with the
+// same bits have the same hash, wherever they are. Not the same hash function
+// as bit_array_hash().
+
+// Returns 1 on success, 0 if window is zero or longer than the array
+char bit_array_rollhash_init(BIT_ARRAY_ROLLHASH *rh, const BIT_ARRAY* bitarr,
+                             bit_index_t window, uint64_t seed);
+
+// Get the hash of the window starting at rh->pos, then slide on by one bit.
+// Returns 1 on success, 0 if there are no more windows
+char bit_array_rollhash_next(BIT_ARRAY_ROLLHASH *rh, uint64_t *hash);
+
+// hashes[i] is set to the hash of bits [i, i+window). `hashes` must have space
+// for length-window+1 values. Returns the number of hashes written.
+bit_index_t bit_array_rollhash_all(const BIT_ARRAY* bitarr, bit_index_t window,
+                                   uint64_t seed, uint64_t *hashes);
+
 //
 // Randomness
 //
 
+// Random number generators
+// The same seed always gives the same sequence of numbers
+void bit_array_rng_seed(BIT_ARRAY_RNG *rng, uint64_t seed);
+uint64_t bit_array_rng_next(BIT_ARRAY_RNG *rng);
+// Equivalent to 2^128 calls to bit_array_rng_next(). Use to get
+// non-overlapping streams from a single seed.
+void bit_array_rng_jump(BIT_ARRAY_RNG *rng);
+
 // Set bits randomly with probability prob : 0 <= prob <= 1
+// prob is rounded to the nearest multiple of 2^-32. Uses a per-thread
+// xoshiro256** generator, so is safe to call from several threads.
 void bit_array_random(BIT_ARRAY* bitarr, float prob);
 
+// Randomly fill words in blocks of BIT_ARRAY_RNG_BLOCK_WORDS words. Block b is
+// filled from `rng` jumped b times, so output only depends on the seed.
+#define BIT_ARRAY_RNG_BLOCK_WORDS (1UL<<14)
+
+// Set bits randomly with probability prob using a given generator.
+// `rng` is jumped once per block of words
+void bit_array_random_r(BIT_ARRAY* bitarr, float prob, BIT_ARRAY_RNG *rng);
+
+// Fill words [first_word, first_word+nwords) exactly as bit_array_random_r()
+// would fill them given the same `rng`. `rng` is not changed. Lets threads
+// fill disjoint ranges of an array. Ranges starting on a block boundary are
+// fastest.
+void bit_array_random_words(BIT_ARRAY* bitarr, word_addr_t first_word,
+                            word_addr_t nwords, float prob,
+                            const BIT_ARRAY_RNG *rng);
+
+// Set exactly k bits (0 <= k <= length), chosen uniformly at random.
+// All other bits are cleared. Takes O(k) time for sparse arrays.
+void bit_array_random_k(BIT_ARRAY* bitarr, bit_index_t k, BIT_ARRAY_RNG *rng);
+
 // Shuffle the bits in an array randomly
 void bit_array_shuffle(BIT_ARRAY* bitarr);
+void bit_array_shuffle_r(BIT_ARRAY* bitarr, BIT_ARRAY_RNG *rng);
 
 // Get the next permutation of an array with a fixed size and given number of
 // bits set.  Also known as next lexicographic permutation.
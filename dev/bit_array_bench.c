@@ -0,0 +1,290 @@
+/*
+ dev/bit_array_bench.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Throughput benchmarks. Not run by `make test`, use:
+//   make bench && ./bit_array_bench [nbits]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bit_array.h"
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define die(fmt,...) do { \
+  fprintf(stderr, "[%s:%i] Error: %s() "fmt"\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
+  exit(EXIT_FAILURE); \
+} while(0);
+
+static void print_result(const char *name, double secs, bit_index_t nbits)
+{
+  printf("  %-36s %9.4fs %10.1f Mbit/s\n", name, secs, nbits / secs / 1e6);
+}
+
+//
+// Exactly k random bits set
+//
+
+// Previous approach: fill with probability k/n, then fix up the count by
+// setting or clearing the first bits found
+static void _random_k_fixup(BIT_ARRAY *arr, bit_index_t k, BIT_ARRAY_RNG *rng)
+{
+  bit_index_t i, n = bit_array_length(arr);
+  bit_array_random_r(arr, (float)((double)k / n), rng);
+  bit_index_t c = bit_array_num_bits_set(arr);
+
+  for(i = 0; c < k && i < n; i++)
+    if(!bit_array_get(arr, i)) { bit_array_set(arr, i); c++; }
+  for(i = 0; c > k && i < n; i++)
+    if(bit_array_get(arr, i)) { bit_array_clear(arr, i); c--; }
+}
+
+// Previous approach: set the first k bits then Fisher-Yates shuffle each bit
+static void _random_k_fisher_yates(BIT_ARRAY *arr, bit_index_t k,
+                                   BIT_ARRAY_RNG *rng)
+{
+  bit_index_t i, j, n = bit_array_length(arr);
+  bit_array_clear_all(arr);
+  bit_array_set_region(arr, 0, k);
+
+  for(i = n - 1; i > 0; i--)
+  {
+    j = bit_array_rng_next(rng) % (i+1);
+    char x = bit_array_get(arr, i), y = bit_array_get(arr, j);
+    bit_array_assign(arr, i, y);
+    bit_array_assign(arr, j, x);
+  }
+}
+
+static void bench_random_k(bit_index_t nbits)
+{
+  printf("Random k-subset, %lu bits\n", (unsigned long)nbits);
+
+  BIT_ARRAY *arr = bit_array_create(nbits);
+  BIT_ARRAY_RNG rng;
+  bit_array_rng_seed(&rng, 1);
+
+  double fracs[] = {0.0001, 0.01, 0.1, 0.5, 0.9999};
+  char name[100];
+  size_t i;
+  double t;
+
+  if(arr == NULL) die("Out of memory");
+
+  for(i = 0; i < sizeof(fracs)/sizeof(fracs[0]); i++)
+  {
+    bit_index_t k = (bit_index_t)(nbits * fracs[i]);
+
+    t = now();
+    bit_array_random_k(arr, k, &rng);
+    sprintf(name, "random_k      k/n=%g", fracs[i]);
+    print_result(name, now() - t, nbits);
+
+    t = now();
+    _random_k_fixup(arr, k, &rng);
+    sprintf(name, "random+fixup  k/n=%g", fracs[i]);
+    print_result(name, now() - t, nbits);
+
+    // per-bit shuffle is too slow for big arrays
+    if(nbits <= 100000000) {
+      t = now();
+      _random_k_fisher_yates(arr, k, &rng);
+      sprintf(name, "fisher-yates  k/n=%g", fracs[i]);
+      print_result(name, now() - t, nbits);
+    }
+  }
+
+  bit_array_free(arr);
+}
+
+//
+// Growth policies
+//
+
+typedef struct { size_t nallocs, nreallocs, peak, cur; } AllocCount;
+
+static void* _count_alloc(size_t size, void *ctx)
+{
+  AllocCount *c = (AllocCount*)ctx;
+  c->nallocs++;
+  c->cur += size;
+  if(c->cur > c->peak) c->peak = c->cur;
+  return malloc(size);
+}
+
+static void* _count_realloc(void *ptr, size_t old_size, size_t new_size,
+                            void *ctx)
+{
+  AllocCount *c = (AllocCount*)ctx;
+  c->nreallocs++;
+  c->cur += new_size - old_size;
+  if(c->cur > c->peak) c->peak = c->cur;
+  return realloc(ptr, new_size);
+}
+
+static void _count_free(void *ptr, size_t size, void *ctx)
+{
+  AllocCount *c = (AllocCount*)ctx;
+  c->cur -= size;
+  free(ptr);
+}
+
+// Grow an array to nbits in small steps, then shrink to a tenth of that
+static void bench_growth(bit_index_t nbits)
+{
+  printf("Growth by %i bits to %lu bits, then shrink to 10%%\n", 1000,
+         (unsigned long)nbits);
+  printf("  %-14s %9s %9s %12s %12s %12s\n", "policy", "secs", "reallocs",
+         "peak bytes", "shrunk", "after fit");
+
+  const char *names[] = {"pow2", "1.5x", "exact", "pow2+reserve"};
+  int policies[] = {BIT_ARRAY_GROW_POW2, BIT_ARRAY_GROW_1_5X,
+                    BIT_ARRAY_GROW_EXACT, BIT_ARRAY_GROW_POW2};
+  size_t i, shrunk;
+  bit_index_t len;
+  double t;
+
+  for(i = 0; i < sizeof(policies)/sizeof(policies[0]); i++)
+  {
+    AllocCount c = {0,0,0,0};
+    BIT_ARRAY_ALLOCATOR a = {_count_alloc, _count_realloc, _count_free, &c};
+    BIT_ARRAY *arr = bit_array_create_with(0, &a);
+    if(arr == NULL) die("Out of memory");
+
+    t = now();
+    bit_array_set_growth(arr, policies[i]);
+    if(i == 3) bit_array_reserve(arr, nbits);
+    for(len = 0; len < nbits; len += 1000) {
+      bit_array_resize(arr, len);
+      if(len > 0) bit_array_set(arr, len-1);
+    }
+    bit_array_resize(arr, nbits / 10);
+    shrunk = c.cur;
+    bit_array_shrink_to_fit(arr);
+    t = now() - t;
+
+    printf("  %-14s %9.4f %9zu %12zu %12zu %12zu\n", names[i], t, c.nreallocs,
+           c.peak, shrunk, c.cur);
+    bit_array_free(arr);
+  }
+}
+
+//
+// Create/free churn
+//
+
+#define CHURN_LIVE 100000
+
+// Keep CHURN_LIVE arrays alive, repeatedly replacing a random one
+static void bench_churn(bit_index_t nops)
+{
+  printf("Create/free churn, %lu ops, %i live arrays of 128 bits\n",
+         (unsigned long)nops, CHURN_LIVE);
+
+  const char *names[] = {"create/free", "create_compact/free", "pool get/put"};
+  BIT_ARRAY **live = (BIT_ARRAY**)malloc(CHURN_LIVE * sizeof(BIT_ARRAY*));
+  BIT_ARRAY_POOL *pool = bit_array_pool_create(128, 4096);
+  BIT_ARRAY_RNG rng;
+  bit_index_t i, j;
+  size_t m;
+  double t;
+
+  if(live == NULL || pool == NULL) die("Out of memory");
+
+  for(m = 0; m < 3; m++)
+  {
+    bit_array_rng_seed(&rng, 1);
+    t = now();
+    for(i = 0; i < CHURN_LIVE + nops; i++)
+    {
+      j = i < CHURN_LIVE ? i : bit_array_rng_next(&rng) % CHURN_LIVE;
+      if(i >= CHURN_LIVE) {
+        if(m == 2) bit_array_pool_put(pool, live[j]);
+        else bit_array_free(live[j]);
+      }
+      live[j] = m == 0 ? bit_array_create(128)
+              : m == 1 ? bit_array_create_compact(128)
+                       : bit_array_pool_get(pool);
+      if(live[j] == NULL) die("Out of memory");
+      bit_array_set(live[j], i & 127);
+    }
+    for(j = 0; j < CHURN_LIVE; j++) {
+      if(m == 2) bit_array_pool_put(pool, live[j]);
+      else bit_array_free(live[j]);
+    }
+    t = now() - t;
+    printf("  %-36s %9.4fs %10.1f Mops/s\n", names[m], t,
+           (CHURN_LIVE + nops) / t / 1e6);
+  }
+
+  bit_array_pool_free(pool);
+  free(live);
+}
+
+//
+// Single bits
+//
+
+// Toggle every bit in turn, as the loops in bit_array_div_uint64 do
+static void bench_bits(bit_index_t nbits)
+{
+  printf("Single bit toggles, %lu bits\n", (unsigned long)nbits);
+
+  BIT_ARRAY *arr = bit_array_create(nbits);
+  bit_index_t i;
+  uint64_t rem;
+  double t;
+
+  if(arr == NULL) die("Out of memory");
+  bit_array_set_all(arr);
+
+  t = now();
+  for(i = 0; i < nbits; i++) bit_array_toggle(arr, i);
+  print_result("bit_array_toggle (macro)", now() - t, nbits);
+
+  t = now();
+  for(i = 0; i < nbits; i++) bit_array_toggle_bit(arr, i);
+  print_result("bit_array_toggle_bit", now() - t, nbits);
+
+  t = now();
+  bit_array_random(arr, 0.5f);
+  bit_array_div_uint64(arr, 12345, &rem);
+  print_result("bit_array_div_uint64", now() - t, nbits);
+
+  if(!bit_array_track_dirty(arr)) die("Out of memory");
+  t = now();
+  for(i = 0; i < nbits; i++) bit_array_toggle_bit(arr, i);
+  print_result("bit_array_toggle_bit, dirty tracked", now() - t, nbits);
+
+  bit_array_free(arr);
+}
+
+int main(int argc, char* argv[])
+{
+  bit_index_t nbits = 100000000;
+
+  if(argc > 2 || (argc == 2 && (nbits = strtoull(argv[1], NULL, 10)) == 0))
+  {
+    printf("Usage: ./bit_array_bench [nbits]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  bench_bits(nbits);
+  bench_random_k(nbits);
+  bench_growth(nbits);
+  bench_churn(nbits / 10);
+
+  return EXIT_SUCCESS;
+}
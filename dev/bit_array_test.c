@@ -7,13 +7,23 @@
  date: Sep 2014
 */
 
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE // O_DIRECT
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <math.h>
 #include <time.h> // needed for rand()
 #include <unistd.h>  // need for getpid() for getting setting rand number
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include "bit_array.h"
 
 // Constants
@@ -673,49 +683,153 @@ void test_compare2()
   SUITE_END();
 }
 
-/*
+// Hash of region [start, start+len) should match the hash of a copy of it
+void _test_hash_region(BIT_ARRAY *arr, BIT_ARRAY *tmp,
+                       bit_index_t start, bit_index_t len)
+{
+  bit_array_resize(tmp, len);
+  bit_array_copy(tmp, 0, arr, start, len);
+  ASSERT(bit_array_hash_region(arr, start, len, 5) == bit_array_hash(tmp, 5));
+}
+
+int _cmp_uint64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : (x > y);
+}
+
 void test_hash()
 {
+  SUITE_START("hash");
 
-  printf("== Testing hash ==\n");
+  BIT_ARRAY *arr = bit_array_create(0), *tmp = bit_array_create(0);
+  size_t i, n = 2000;
+  uint64_t *hashes = (uint64_t*)malloc(n * sizeof(uint64_t));
 
-  BIT_ARRAY* arr = bit_array_create(0);
-  char str[200];
+  // Seed and length change the hash
+  ASSERT(bit_array_hash(arr, 0) != bit_array_hash(arr, 1));
+  bit_array_resize(tmp, 1);
+  ASSERT(bit_array_hash(arr, 0) != bit_array_hash(tmp, 0));
 
-  printf("arr: %s\n", bit_array_to_str(arr, str));
-  printf("hash: %lu\n", (unsigned long)bit_array_hash(arr, 0));
-  printf("--\n");
+  // Zero arrays of every length, and arrays with a single bit set, all differ
+  for(i = 0; i < n/2; i++) {
+    bit_array_resize(arr, i);
+    hashes[i] = bit_array_hash(arr, 0);
+  }
+  bit_array_resize(arr, n/2);
+  for(i = 0; i < n/2; i++) {
+    bit_array_clear_all(arr);
+    bit_array_set_bit(arr, i);
+    hashes[n/2 + i] = bit_array_hash(arr, 0);
+  }
+  qsort(hashes, n, sizeof(uint64_t), _cmp_uint64);
+  for(i = 1; i < n; i++) ASSERT(hashes[i-1] != hashes[i]);
 
-  bit_array_resize(arr, 10);
-  printf("arr: %s\n", bit_array_to_str(arr, str));
-  printf("hash: %lu\n", (unsigned long)bit_array_hash(arr, 0));
-  printf("--\n");
+  // Regions
+  bit_array_resize(arr, 3000);
+  bit_array_random(arr, 0.5f);
+  for(i = 0; i < 200; i++) {
+    bit_index_t start = RAND(3000), len = RAND(3000 - start);
+    _test_hash_region(arr, tmp, start, len);
+  }
+  _test_hash_region(arr, tmp, 0, 3000);
+  _test_hash_region(arr, tmp, 64, 2048);
+
+  // Streaming: hashing pieces is the same as hashing them all at once
+  BIT_ARRAY_HASHER h;
+  bit_index_t pos = 0, len;
+  bit_array_hash_init(&h, 9);
+  while(pos < 3000) {
+    len = RAND(300);
+    len = MIN(len, 3000 - pos);
+    bit_array_hash_update(&h, arr, pos, len);
+    pos += len;
+  }
+  ASSERT(bit_array_hash_final(&h) == bit_array_hash(arr, 9));
+  ASSERT(bit_array_hash_final(&h) == bit_array_hash(arr, 9));
 
-  bit_array_set_bits(arr, 3, 5,7,9);
-  printf("arr: %s\n", bit_array_to_str(arr, str));
-  printf("hash: %lu\n", (unsigned long)bit_array_hash(arr, 0));
-  printf("--\n");
+  free(hashes);
+  bit_array_free(arr);
+  bit_array_free(tmp);
 
-  bit_array_resize(arr, 80);
-  printf("arr: %s\n", bit_array_to_str(arr, str));
-  printf("hash: %lu\n", (unsigned long)bit_array_hash(arr, 0));
-  printf("--\n");
+  SUITE_END();
+}
+
+void _test_rollhash(BIT_ARRAY *arr, bit_index_t window)
+{
+  bit_index_t i, j, n, len = bit_array_length(arr);
+  uint64_t *hashes = (uint64_t*)malloc((len+1) * sizeof(uint64_t)), hash;
+  BIT_ARRAY *tmp = bit_array_create(window), *tmp2 = bit_array_create(window);
+  BIT_ARRAY_ROLLHASH rh, rh2;
+
+  n = bit_array_rollhash_all(arr, window, 77, hashes);
+  ASSERT(n == (window > 0 && window <= len ? len - window + 1 : 0));
+
+  // Iterator gives the same values
+  if(bit_array_rollhash_init(&rh, arr, window, 77)) {
+    for(i = 0; bit_array_rollhash_next(&rh, &hash); i++)
+      ASSERT(hash == hashes[i]);
+    ASSERT(i == n);
+  }
+
+  // Each hash only depends on the window contents
+  for(i = 0; i < n; i += 1 + n / 50)
+  {
+    bit_array_copy(tmp, 0, arr, i, window);
+    ASSERT(bit_array_rollhash_init(&rh2, tmp, window, 77));
+    ASSERT(bit_array_rollhash_next(&rh2, &hash) && hash == hashes[i]);
+
+    // Different windows have different hashes
+    for(j = 0; j < n && window >= 20; j += 1 + n / 50) {
+      if(hashes[i] == hashes[j]) {
+        bit_array_copy(tmp2, 0, arr, j, window);
+        ASSERT(bit_array_cmp(tmp, tmp2) == 0);
+      }
+    }
+  }
+
+  free(hashes);
+  bit_array_free(tmp);
+  bit_array_free(tmp2);
+}
+
+void test_rollhash()
+{
+  SUITE_START("rolling hash");
 
-  bit_array_set_bits(arr, 3, 50,57,59);
-  printf("arr: %s\n", bit_array_to_str(arr, str));
-  printf("hash: %lu\n", (unsigned long)bit_array_hash(arr, 0));
-  printf("--\n");
+  BIT_ARRAY *arr = bit_array_create(5000);
+  bit_array_random(arr, 0.5f);
+
+  bit_index_t windows[] = {0, 1, 5, 20, 63, 64, 65, 200, 4999, 5000, 5001};
+  size_t i;
+  for(i = 0; i < sizeof(windows)/sizeof(windows[0]); i++)
+    _test_rollhash(arr, windows[i]);
 
+  // Repeated pattern gives repeated hashes
+  uint64_t hashes[1000];
   bit_array_resize(arr, 1000);
-  printf("len: %lu\n", (unsigned long)bit_array_length(arr));
-  printf("hash: %lu\n", (unsigned long)bit_array_hash(arr, 0));
-  printf("--\n");
+  bit_array_clear_all(arr);
+  for(i = 0; i < 1000; i += 10) bit_array_set_bit(arr, i);
+  bit_array_rollhash_all(arr, 30, 0, hashes);
+  for(i = 10; i < 971; i++) ASSERT(hashes[i] == hashes[i-10]);
+  ASSERT(hashes[0] != hashes[1]);
+
+  // Thue-Morse: the second 2048 bits are the complement of the first. The two
+  // windows collide under a polynomial hash mod 2^64 with any odd base
+  uint64_t *tm = (uint64_t*)malloc(2049 * sizeof(uint64_t));
+  bit_array_resize(arr, 4096);
+  for(i = 0; i < 4096; i++)
+    bit_array_assign_bit(arr, i, __builtin_popcountll(i) & 1);
+  for(i = 0; i < 4; i++) {
+    ASSERT(bit_array_rollhash_all(arr, 2048, i, tm) == 2049);
+    ASSERT(tm[0] != tm[2048]);
+  }
+  free(tm);
 
   bit_array_free(arr);
 
-  printf("== End of testing hash ==\n\n");
+  SUITE_END();
 }
-*/
 
 void _test_reverse(int len)
 {
@@ -894,6 +1008,185 @@ void test_random_and_shuffle()
   SUITE_END();
 }
 
+// Check the number of bits set is within 6 standard deviations of expected
+void _test_random_prob(BIT_ARRAY *arr, bit_index_t len, float prob)
+{
+  bit_array_resize(arr, len);
+  bit_array_random(arr, prob);
+
+  double mean = len * (double)prob;
+  double sd = sqrt(len * (double)prob * (1 - (double)prob));
+  double nset = bit_array_num_bits_set(arr);
+
+  ASSERT(nset >= mean - 6*sd - 1 && nset <= mean + 6*sd + 1);
+
+  // Top word must be masked
+  if(len % 64) {
+    bit_array_resize(arr, len + 64 - len % 64);
+    ASSERT(bit_array_num_bits_set(arr) == (bit_index_t)nset);
+  }
+}
+
+void test_random()
+{
+  SUITE_START("random");
+
+  BIT_ARRAY *arr = bit_array_create(0);
+
+  // Empty array
+  bit_array_random(arr, 0.5f);
+  ASSERT(bit_array_length(arr) == 0);
+
+  bit_array_resize(arr, 1000);
+  bit_array_random(arr, 0.0f);
+  ASSERT(bit_array_num_bits_set(arr) == 0);
+  bit_array_random(arr, 1.0f);
+  ASSERT(bit_array_num_bits_set(arr) == 1000);
+
+  float probs[] = {0.5f, 0.25f, 0.1f, 0.01f, 0.9f, 0.333f, 1e-6f};
+  bit_index_t lens[] = {1, 63, 64, 65, 1000, 100000, 1000003};
+  size_t i, j;
+
+  for(i = 0; i < sizeof(probs)/sizeof(probs[0]); i++)
+    for(j = 0; j < sizeof(lens)/sizeof(lens[0]); j++)
+      _test_random_prob(arr, lens[j], probs[i]);
+
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
+// Check seeded random fills are reproducible and can be done in parts
+void test_random_seeded()
+{
+  SUITE_START("seeded random");
+
+  BIT_ARRAY_RNG rng1, rng2;
+  bit_index_t len = 3 * 64 * BIT_ARRAY_RNG_BLOCK_WORDS + 1001;
+  BIT_ARRAY *arr1 = bit_array_create(len);
+  BIT_ARRAY *arr2 = bit_array_create(len);
+  float probs[] = {0.5f, 0.1f, 0.0f, 1.0f};
+  size_t i, j;
+
+  for(i = 0; i < sizeof(probs)/sizeof(probs[0]); i++)
+  {
+    // Same seed, same output
+    bit_array_rng_seed(&rng1, 42);
+    bit_array_rng_seed(&rng2, 42);
+    bit_array_random_r(arr1, probs[i], &rng1);
+    bit_array_random_r(arr2, probs[i], &rng2);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+    ASSERT(memcmp(&rng1, &rng2, sizeof(rng1)) == 0);
+
+    // Fill in uneven parts, as worker threads would
+    bit_array_rng_seed(&rng2, 42);
+    bit_array_clear_all(arr2);
+    word_addr_t nwords = arr2->num_of_words;
+    word_addr_t bounds[] = {0, 1, 1000, BIT_ARRAY_RNG_BLOCK_WORDS,
+                            2*BIT_ARRAY_RNG_BLOCK_WORDS+7, nwords-1, nwords};
+    for(j = 0; j + 1 < sizeof(bounds)/sizeof(bounds[0]); j++)
+      bit_array_random_words(arr2, bounds[j], bounds[j+1]-bounds[j], probs[i], &rng2);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+  }
+
+  // Different seed, different output
+  bit_array_rng_seed(&rng1, 42);
+  bit_array_rng_seed(&rng2, 43);
+  bit_array_random_r(arr1, 0.5f, &rng1);
+  bit_array_random_r(arr2, 0.5f, &rng2);
+  ASSERT(bit_array_cmp(arr1, arr2) != 0);
+
+  // Jumped generator gives a different stream
+  bit_array_rng_seed(&rng1, 42);
+  bit_array_rng_seed(&rng2, 42);
+  bit_array_rng_jump(&rng2);
+  ASSERT(bit_array_rng_next(&rng1) != bit_array_rng_next(&rng2));
+
+  // Seeded shuffle
+  bit_array_resize(arr1, 1000);
+  bit_array_clear_all(arr1);
+  bit_array_set_region(arr1, 0, 100);
+  bit_array_copy_all(arr2, arr1);
+  bit_array_rng_seed(&rng1, 7);
+  bit_array_rng_seed(&rng2, 7);
+  bit_array_shuffle_r(arr1, &rng1);
+  bit_array_shuffle_r(arr2, &rng2);
+  ASSERT(bit_array_cmp(arr1, arr2) == 0);
+  ASSERT(bit_array_num_bits_set(arr1) == 100);
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+void test_random_k()
+{
+  SUITE_START("random k");
+
+  BIT_ARRAY *arr = bit_array_create(0);
+  BIT_ARRAY_RNG rng;
+  bit_index_t lens[] = {0, 1, 63, 64, 65, 1000, 12345};
+  bit_index_t k;
+  size_t i;
+
+  bit_array_rng_seed(&rng, 3);
+
+  for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++)
+  {
+    bit_array_resize(arr, lens[i]);
+    for(k = 0; k <= lens[i]; k += 1 + lens[i] / 37) {
+      bit_array_set_all(arr);
+      bit_array_random_k(arr, k, &rng);
+      ASSERT(bit_array_num_bits_set(arr) == k);
+    }
+    bit_array_random_k(arr, lens[i], &rng);
+    ASSERT(bit_array_num_bits_set(arr) == lens[i]);
+  }
+
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
+// Shuffle arrays of different densities, check the number of bits set is
+// unchanged and that each tenth of the array gets about a tenth of them
+void test_shuffle_density()
+{
+  SUITE_START("shuffle density");
+
+  bit_index_t n = 100000, i, b, nbuckets = 10;
+  bit_index_t ks[] = {0, 1, 10, 1000, 1563, 20000, 50000, 98437, 99990, 99999,
+                      100000};
+  BIT_ARRAY *arr = bit_array_create(n);
+  BIT_ARRAY_RNG rng;
+  size_t j;
+
+  bit_array_rng_seed(&rng, 99);
+
+  for(j = 0; j < sizeof(ks)/sizeof(ks[0]); j++)
+  {
+    bit_array_clear_all(arr);
+    bit_array_set_region(arr, 0, ks[j]);
+    bit_array_shuffle_r(arr, &rng);
+    ASSERT(bit_array_num_bits_set(arr) == ks[j]);
+
+    double p = (double)ks[j] / n, m = p * n / nbuckets;
+    double sd = sqrt(m * (1 - p));
+
+    for(b = 0; b < nbuckets; b++) {
+      bit_index_t c = 0;
+      for(i = b * n / nbuckets; i < (b + 1) * n / nbuckets; i++)
+        c += bit_array_get(arr, i);
+      ASSERT(c >= m - 6*sd - 1 && c <= m + 6*sd + 1);
+    }
+  }
+
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
 /*
 // used in test_random
 void _print_random_arr(BIT_ARRAY* arr, float *rates, int num_rates, char *tmp)
@@ -916,7 +1209,7 @@ void _print_random_arr(BIT_ARRAY* arr, float *rates, int num_rates, char *tmp)
   }
 }
 
-void test_random()
+void _print_test_random()
 {
   printf("== Testing random ==\n");
 
@@ -1271,67 +1564,804 @@ void _test_save_load(BIT_ARRAY *arr1, BIT_ARRAY *arr2)
 
   f = fopen(test_filename, "r");
 
-  if(f == NULL)
-  {
-    die("Couldn't open file to read: '%s'", test_filename);
-  }
+  if(f == NULL)
+  {
+    die("Couldn't open file to read: '%s'", test_filename);
+  }
+
+  if(!bit_array_load(arr2, f))
+  {
+    die("Load returned warning [file: %s]", test_filename);
+  }
+
+  fclose(f);
+
+  ASSERT(bit_array_cmp(arr1, arr2) == 0);
+
+  if(bit_array_cmp(arr1, arr2) != 0 && bit_array_length(arr1) < 500)
+  {
+    // debug output
+    bit_index_t len = MAX(bit_array_length(arr1), bit_array_length(arr2));
+    char *tmp = (char*)malloc((len+1) * sizeof(char));
+
+    printf("out: %s\n", bit_array_to_str(arr1, tmp));
+    printf("in : %s\n", bit_array_to_str(arr2, tmp));
+
+    free(tmp);
+  }
+}
+
+void test_save_load()
+{
+  SUITE_START("load and save");
+
+  BIT_ARRAY* arr1 = bit_array_create(0);
+  BIT_ARRAY* arr2 = bit_array_create(0);
+
+  // Empty array
+  _test_save_load(arr1, arr2);
+
+  // Ten 0s
+  bit_array_resize(arr1, 10);
+  _test_save_load(arr1, arr2);
+
+  // Thousand 1s:
+  bit_array_resize(arr1, 1000);
+  bit_array_set_all(arr1);
+  _test_save_load(arr1, arr2);
+
+  // 1100111010
+  bit_array_resize(arr1, 10);
+  bit_array_clear_bits(arr1, 4, 2,3,7,9);
+  _test_save_load(arr1, arr2);
+
+  // 100 x random lengths and bits
+  int i;
+  for(i = 0; i < 10; i++)
+  {
+    bit_array_resize(arr1, RAND(5000UL));
+    bit_array_random(arr1, 0.5f);
+    _test_save_load(arr1, arr2);
+  }
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+// Save arr to test_filename
+void _save_to_test_file(const BIT_ARRAY *arr)
+{
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_array_save(arr, f);
+  fclose(f);
+}
+
+void test_save_load_v2()
+{
+  SUITE_START("load and save v2");
+
+  BIT_ARRAY *arr1 = bit_array_create(0), *arr2 = bit_array_create(0), *map;
+  bit_index_t lens[] = {0, 1, 64, 1000, 8*1024*1024, 8*1024*1024+1, 20000000};
+  bit_index_t written;
+  size_t i;
+  long pos;
+  FILE *f;
+
+  for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++)
+  {
+    bit_array_resize(arr1, lens[i]);
+    bit_array_random(arr1, 0.5f);
+
+    f = fopen(test_filename, "w");
+    if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+    written = bit_array_save_v2(arr1, f);
+    fclose(f);
+    ASSERT(written % BIT_ARRAY_V2_ALIGN == 0);
+
+    f = fopen(test_filename, "r");
+    if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+    ASSERT(bit_array_load(arr2, f));
+    ASSERT(ftell(f) == (long)written);
+    fclose(f);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+
+    map = bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_RDONLY);
+    ASSERT(map != NULL);
+    ASSERT(bit_array_cmp(arr1, map) == 0);
+    bit_array_free(map);
+
+    ASSERT(bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_SHARED) == NULL);
+
+    // Corrupt the last byte of the payload
+    if(lens[i] > 0)
+    {
+      pos = (long)(written - BIT_ARRAY_V2_ALIGN +
+                   ((lens[i]+63)/64*8 - 1) % BIT_ARRAY_V2_ALIGN);
+      f = fopen(test_filename, "r+");
+      if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+      fseek(f, pos, SEEK_SET);
+      int c = fgetc(f);
+      fseek(f, pos, SEEK_SET);
+      fputc(c ^ 0x10, f);
+      fclose(f);
+
+      f = fopen(test_filename, "r");
+      if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+      ASSERT(!bit_array_load(arr2, f));
+      fclose(f);
+    }
+  }
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+typedef bit_index_t (*test_save_func)(const BIT_ARRAY *arr, FILE *f);
+typedef char (*test_load_func)(BIT_ARRAY *arr, FILE *f);
+
+// Saves src with save(), loads the file into dst with load() and checks that
+// the whole file was read and dst now equals src.
+// Returns the number of bytes written
+bit_index_t _test_round_trip(const BIT_ARRAY *src, BIT_ARRAY *dst,
+                             test_save_func save, test_load_func load)
+{
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_index_t written = save(src, f);
+  fclose(f);
+
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(load(dst, f));
+  ASSERT(ftell(f) == (long)written);
+  fclose(f);
+
+  ASSERT(bit_array_cmp(src, dst) == 0);
+  ASSERT(bit_array_length(src) == bit_array_length(dst));
+  return written;
+}
+
+bit_index_t _test_save_load_compressed(BIT_ARRAY *arr1, BIT_ARRAY *arr2)
+{
+  return _test_round_trip(arr1, arr2, bit_array_save_compressed,
+                          bit_array_load_compressed);
+}
+
+void test_save_load_compressed()
+{
+  SUITE_START("load and save compressed");
+
+  BIT_ARRAY *arr1 = bit_array_create(0), *arr2 = bit_array_create(10);
+  bit_index_t i, n = 10000000;
+  FILE *f;
+
+  _test_save_load_compressed(arr1, arr2);
+
+  // Sparse arrays compress well
+  bit_array_resize(arr1, n);
+  for(i = 0; i < 100; i++) bit_array_set(arr1, RAND(n-1));
+  ASSERT(_test_save_load_compressed(arr1, arr2) < 16 + 8*2*101);
+
+  // Runs of ones, a partial top word
+  bit_array_set_region(arr1, 1000, n/2);
+  bit_array_resize(arr1, n-3);
+  bit_array_set_all(arr1);
+  ASSERT(_test_save_load_compressed(arr1, arr2) == 16 + 8*2);
+
+  // Incompressible: more literals than fit in one buffer
+  bit_array_random(arr1, 0.5f);
+  ASSERT(_test_save_load_compressed(arr1, arr2) < 16 + (n/64+1)*8*101/100);
+
+  // Mixed random lengths and densities
+  for(i = 0; i < 20; i++)
+  {
+    bit_array_resize(arr1, RAND(100000UL));
+    bit_array_random(arr1, (float)(i % 5) / 4);
+    bit_array_clear_region(arr1, 0, RAND(bit_array_length(arr1)));
+    _test_save_load_compressed(arr1, arr2);
+  }
+
+  // Wrong file type
+  bit_array_resize(arr1, 100);
+  _save_to_test_file(arr1);
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(!bit_array_load_compressed(arr2, f));
+  fclose(f);
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+// Array the delta is encoded from in _test_delta_encode()
+const BIT_ARRAY *test_delta_from;
+
+bit_index_t _test_delta_encode(const BIT_ARRAY *to, FILE *f)
+{
+  return bit_array_delta_encode(test_delta_from, to, f);
+}
+
+// Encodes the delta from arr1 to arr2, applies it to a copy of arr1 and
+// compares with arr2. Returns the number of bytes written
+bit_index_t _test_delta(const BIT_ARRAY *arr1, const BIT_ARRAY *arr2)
+{
+  BIT_ARRAY *cpy = bit_array_clone(arr1);
+  test_delta_from = arr1;
+  bit_index_t written = _test_round_trip(arr2, cpy, _test_delta_encode,
+                                         bit_array_delta_apply);
+  bit_array_free(cpy);
+  return written;
+}
+
+void test_delta()
+{
+  SUITE_START("xor delta encode and apply");
+
+  bit_index_t i, n = 10000000;
+  BIT_ARRAY *arr1 = bit_array_create(n), *arr2, *other;
+  FILE *f;
+
+  bit_array_random(arr1, 0.5f);
+  arr2 = bit_array_clone(arr1);
+
+  // Header and end marker only
+  ASSERT(_test_delta(arr1, arr2) == 24 + 2);
+
+  // Toggled regions are runs
+  bit_array_toggle_region(arr2, 64*1000, 64*100000);
+  ASSERT(_test_delta(arr1, arr2) < 24 + 2 + 8);
+  bit_array_toggle_region(arr2, 64*1000, 64*100000);
+
+  // A few changed bits cost a few bytes each
+  for(i = 0; i < 1000; i++) bit_array_toggle_bit(arr2, RAND(n-1));
+  ASSERT(_test_delta(arr1, arr2) < 24 + 2 + 1000 * 6);
+
+  // Dense changes, more literals than fit in one buffer
+  bit_array_random(arr2, 0.5f);
+  ASSERT(_test_delta(arr1, arr2) < 24 + (n/64+1)*8*101/100);
+
+  // Changes of length both ways, including to and from empty
+  bit_array_resize(arr2, n + 1000);
+  bit_array_set_region(arr2, n, 1000);
+  _test_delta(arr1, arr2);
+  _test_delta(arr2, arr1);
+  bit_array_resize(arr2, 70);
+  _test_delta(arr1, arr2);
+  _test_delta(arr2, arr1);
+  bit_array_resize(arr2, 0);
+  _test_delta(arr1, arr2);
+  _test_delta(arr2, arr1);
+
+  for(i = 0; i < 20; i++)
+  {
+    bit_array_resize(arr1, RAND(100000UL));
+    bit_array_resize(arr2, RAND(100000UL));
+    bit_array_random(arr1, (float)(i % 5) / 4);
+    bit_array_random(arr2, (float)(i % 3) / 2);
+    _test_delta(arr1, arr2);
+  }
+
+  // Delta for an array of another length is rejected
+  f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_array_delta_encode(arr1, arr2, f);
+  fclose(f);
+  other = bit_array_create(bit_array_length(arr1) + 1);
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(!bit_array_delta_apply(other, f));
+  fclose(f);
+  ASSERT(bit_array_num_bits_set(other) == 0);
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+  bit_array_free(other);
+
+  SUITE_END();
+}
+
+// Saving marks the chunks clean, so src is not const
+bit_index_t _save_dirty(const BIT_ARRAY *src, FILE *f)
+{
+  return bit_array_save_dirty((BIT_ARRAY*)src, f);
+}
+
+bit_index_t _test_save_load_dirty(BIT_ARRAY *arr, BIT_ARRAY *base)
+{
+  return _test_round_trip(arr, base, _save_dirty, bit_array_load_dirty);
+}
+
+void test_dirty()
+{
+  SUITE_START("dirty chunk tracking");
+
+  const bit_index_t chunk_bits = BIT_ARRAY_DIRTY_CHUNK * 8;
+  const bit_index_t rec = 8 + BIT_ARRAY_DIRTY_CHUNK; // one saved chunk
+  bit_index_t n = 1000 * chunk_bits + 100;
+  BIT_ARRAY *arr = bit_array_create(n), *base, *other;
+
+  bit_array_random(arr, 0.5f);
+  base = bit_array_clone(arr);
+  other = bit_array_create(n); // sparse mask
+  bit_array_toggle_region(other, 10 * chunk_bits, 100);
+
+  ASSERT(bit_array_track_dirty(arr));
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8);
+
+  // Bit functions, regions, logic ops and copies all mark chunks
+  bit_array_set_bit(arr, 5);
+  bit_array_clear_bit(arr, 5 * chunk_bits + 1);
+  bit_array_toggle_region(arr, 20 * chunk_bits - 10, 20);
+  bit_array_copy(arr, 30 * chunk_bits, arr, 0, 64);
+  bit_array_toggle(arr, 40 * chunk_bits + 3); // macros too
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8 + 6 * rec);
+
+  // Whole array operations only mark the chunks they change. Saving marks the
+  // chunks clean
+  bit_array_xor(arr, arr, other);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8 + 1 * rec);
+  bit_array_add(arr, arr, other);
+  bit_array_subtract(arr, arr, other);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8 + 1 * rec);
+  bit_array_or(arr, arr, arr);
+  bit_array_and(arr, arr, arr);
+  bit_array_copy_all(arr, arr);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8);
+
+  // Clean chunks are not saved again, and a chunk changed back is saved
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8);
+  bit_array_toggle_bit(arr, 7);
+  bit_array_toggle_bit(arr, 7);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8 + 1 * rec);
+
+  // The last chunk is short
+  bit_array_set_bit(arr, n-1);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8 + 8 + 16);
+
+  // Growing and shrinking
+  bit_array_resize(arr, n + 3 * chunk_bits);
+  // The bitmap grows with the capacity, writes never resize it
+  ASSERT(bit_array_length(arr->dirty) * chunk_bits >=
+         arr->capacity_in_words * 64);
+  bit_array_set_bit(arr, n + 2 * chunk_bits);
+  _test_save_load_dirty(arr, base);
+  bit_array_resize(arr, n / 2);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8 + 8 + 8);
+  bit_array_random(arr, 0.1f);
+  _test_save_load_dirty(arr, base);
+
+  // Clearing marks chunks clean without saving them
+  bit_array_set_bit(arr, 3 * chunk_bits);
+  bit_array_clear_dirty(arr);
+  bit_array_copy_all(base, arr);
+  ASSERT(_test_save_load_dirty(arr, base) == 24 + 8);
+
+  // Tracking is off for other arrays and after untracking
+  ASSERT(_test_save_load_dirty(other, other) == 24 + 8);
+  bit_array_untrack_dirty(arr);
+  bit_array_set_all(arr);
+  ASSERT(arr->dirty == NULL && arr->watch == 0);
+
+  bit_array_free(arr);
+  bit_array_free(base);
+  bit_array_free(other);
+
+  SUITE_END();
+}
+
+void test_save_load_fd()
+{
+  SUITE_START("load and save fd");
+
+  BIT_ARRAY *arr1 = bit_array_create(0), *arr2 = bit_array_create(0);
+  bit_index_t lens[] = {0, 1, 100, 8*1024*1024, 8*1024*1024+65, 50000001};
+  int threads[] = {0, 1, 3};
+  size_t i, j;
+  int fd;
+
+  for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++)
+  {
+    bit_array_resize(arr1, lens[i]);
+    bit_array_random(arr1, 0.3f);
+
+    for(j = 0; j < sizeof(threads)/sizeof(threads[0]); j++)
+    {
+      fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
+      if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+      ASSERT(bit_array_save_fd(arr1, fd, threads[j]) > 0);
+      bit_array_resize(arr2, 7);
+      ASSERT(bit_array_load_fd(arr2, fd, threads[j]));
+      close(fd);
+      ASSERT(bit_array_cmp(arr1, arr2) == 0);
+    }
+
+    // Readable by bit_array_load
+    FILE *f = fopen(test_filename, "r");
+    if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+    ASSERT(bit_array_load(arr2, f));
+    fclose(f);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+
+    // Version 1 files
+    _save_to_test_file(arr1);
+    fd = open(test_filename, O_RDONLY);
+    if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+    ASSERT(bit_array_load_fd(arr2, fd, 2));
+    close(fd);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+
+    #ifdef O_DIRECT
+    // Not all filesystems support O_DIRECT
+    fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR | O_DIRECT, 0644);
+    if(fd != -1) {
+      ASSERT(bit_array_save_fd(arr1, fd, 2) > 0);
+      ASSERT(bit_array_load_fd(arr2, fd, 2));
+      close(fd);
+      ASSERT(bit_array_cmp(arr1, arr2) == 0);
+    }
+    _save_to_test_file(arr1);
+    fd = open(test_filename, O_RDONLY | O_DIRECT);
+    if(fd != -1) {
+      ASSERT(bit_array_load_fd(arr2, fd, 2));
+      close(fd);
+      ASSERT(bit_array_cmp(arr1, arr2) == 0);
+    }
+    #endif
+  }
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+void test_save_load_range()
+{
+  SUITE_START("load and save range");
+
+  BIT_ARRAY *arr = bit_array_create(0), *arr2 = bit_array_create(0);
+  BIT_ARRAY *region = bit_array_create(0);
+  bit_index_t len, start, n;
+  int i, v;
+  FILE *f;
+
+  for(v = 1; v <= 2; v++)
+  {
+    bit_array_resize(arr, 100000 + RAND(1000UL));
+    bit_array_random(arr, 0.5f);
+    len = bit_array_length(arr);
+
+    f = fopen(test_filename, "w");
+    if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+    if(v == 1) bit_array_save(arr, f);
+    else bit_array_save_v2(arr, f);
+    fclose(f);
+
+    for(i = 0; i < 200; i++)
+    {
+      start = i < 3 ? (bit_index_t)(i == 2 ? len : 0) : RAND(len);
+      n = i == 1 ? len : RAND(len - start);
+      bit_array_resize(region, n);
+      bit_array_copy(region, 0, arr, start, n);
+
+      f = fopen(test_filename, "r");
+      if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+      ASSERT(bit_array_load_range(arr2, f, start, n));
+      fclose(f);
+      ASSERT(bit_array_cmp(arr2, region) == 0);
+    }
+
+    f = fopen(test_filename, "r");
+    if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+    ASSERT(!bit_array_load_range(arr2, f, 10, len));
+    fclose(f);
+  }
+
+  // Save a region, load it back with bit_array_load
+  for(i = 0; i < 50; i++)
+  {
+    start = RAND(len);
+    n = RAND(len - start);
+    bit_array_resize(region, n);
+    bit_array_copy(region, 0, arr, start, n);
+
+    f = fopen(test_filename, "w");
+    if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+    ASSERT(bit_array_save_range(arr, f, start, n) == 8 + (n+7)/8);
+    fclose(f);
+
+    f = fopen(test_filename, "r");
+    if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+    ASSERT(bit_array_load(arr2, f));
+    fclose(f);
+    ASSERT(bit_array_cmp(arr2, region) == 0);
+  }
+
+  bit_array_free(arr);
+  bit_array_free(arr2);
+  bit_array_free(region);
+
+  SUITE_END();
+}
+
+void _test_aio_cb(BIT_ARRAY_AIO *aio, char ok, void *ctx)
+{
+  (void)aio;
+  *(int*)ctx += ok ? 1 : 100;
+}
+
+void test_aio()
+{
+  SUITE_START("async load and save");
+
+  BIT_ARRAY *arr1 = bit_array_create(0), *arr2 = bit_array_create(0);
+  bit_index_t lens[] = {0, 1, 100, 8*1024*1024+65, 100000001};
+  BIT_ARRAY_AIO *aio;
+  size_t i;
+  int fd, calls, polls;
+
+  for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++)
+  {
+    bit_array_resize(arr1, lens[i]);
+    bit_array_random(arr1, 0.7f);
+
+    fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+
+    calls = polls = 0;
+    aio = bit_array_aio_save(arr1, fd, _test_aio_cb, &calls);
+    ASSERT(aio != NULL);
+    while(!bit_array_aio_poll(aio)) polls++;
+    ASSERT(calls == 1);
+    ASSERT(bit_array_aio_wait(aio));
+    bit_array_aio_free(aio);
+    ASSERT(calls == 1);
+
+    aio = bit_array_aio_load(arr2, fd, _test_aio_cb, &calls);
+    ASSERT(aio != NULL);
+    ASSERT(bit_array_length(arr2) == lens[i]);
+    ASSERT(bit_array_aio_wait(aio));
+    bit_array_aio_free(aio);
+    close(fd);
+    ASSERT(calls == 2);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+
+    // Version 1 file, no callback
+    _save_to_test_file(arr1);
+    fd = open(test_filename, O_RDONLY);
+    if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+    aio = bit_array_aio_load(arr2, fd, NULL, NULL);
+    ASSERT(aio != NULL);
+    bit_array_aio_free(aio);
+    close(fd);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+
+    #ifdef O_DIRECT
+    // O_DIRECT uses a background thread
+    fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR | O_DIRECT, 0644);
+    if(fd != -1) {
+      calls = 0;
+      aio = bit_array_aio_save(arr1, fd, _test_aio_cb, &calls);
+      ASSERT(aio != NULL && bit_array_aio_wait(aio));
+      bit_array_aio_free(aio);
+      aio = bit_array_aio_load(arr2, fd, _test_aio_cb, &calls);
+      while(!bit_array_aio_poll(aio)) {}
+      bit_array_aio_free(aio);
+      close(fd);
+      ASSERT(calls == 2);
+      ASSERT(bit_array_cmp(arr1, arr2) == 0);
+    }
+    #endif
+  }
+
+  // Changing bits during a save of a snapshot: the file holds the snapshot,
+  // with a matching bit count
+  BIT_ARRAY *snap = bit_array_snapshot(arr1);
+  if(snap != NULL) {
+    bit_array_free(arr2);
+    arr2 = bit_array_clone(arr1);
+    fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+    aio = bit_array_aio_save(snap, fd, NULL, NULL);
+    ASSERT(aio != NULL);
+    for(i = 0; !bit_array_aio_poll(aio); i++)
+      bit_array_toggle_bit(arr1, (i * 1000003) % bit_array_length(arr1));
+    bit_array_clear_all(arr1);
+    ASSERT(bit_array_aio_wait(aio));
+    bit_array_aio_free(aio);
+    bit_array_free(snap);
+    aio = bit_array_aio_load(arr1, fd, NULL, NULL);
+    ASSERT(aio != NULL && bit_array_aio_wait(aio));
+    bit_array_aio_free(aio);
+    ASSERT(bit_array_cmp(arr1, arr2) == 0);
+    uint8_t nset[8];
+    uint64_t nbits_set = 0;
+    ASSERT(pread(fd, nset, 8, 24) == 8);
+    for(i = 8; i > 0; i--) nbits_set = (nbits_set << 8) | nset[i-1];
+    ASSERT(nbits_set == bit_array_num_bits_set(arr2));
+    close(fd);
+  }
+  else ASSERT(errno == ENOTSUP);
+
+  // Corrupt file: checksum fails
+  fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+  ASSERT(bit_array_save_fd(arr1, fd, 1) > 0);
+  ASSERT(pwrite(fd, "x", 1, BIT_ARRAY_V2_ALIGN*2) == 1);
+  calls = 0;
+  aio = bit_array_aio_load(arr2, fd, _test_aio_cb, &calls);
+  ASSERT(aio != NULL);
+  ASSERT(!bit_array_aio_wait(aio) && errno == EIO);
+  bit_array_aio_free(aio);
+  close(fd);
+  ASSERT(calls == 100);
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+void test_mmap_open()
+{
+  SUITE_START("mmap open");
+
+  BIT_ARRAY *arr = bit_array_create(0), *map;
+  bit_index_t lens[] = {0, 1, 63, 64, 65, 1000, 4088*8, 100003};
+  size_t i;
+  errno = 0;
 
-  if(!bit_array_load(arr2, f))
+  for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++)
   {
-    die("Load returned warning [file: %s]", test_filename);
+    bit_array_resize(arr, lens[i]);
+    bit_array_random(arr, 0.5f);
+    _save_to_test_file(arr);
+
+    map = bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_RDONLY);
+    ASSERT(map != NULL);
+    ASSERT(bit_array_cmp(arr, map) == 0);
+    ASSERT(bit_array_num_bits_set(arr) == bit_array_num_bits_set(map));
+    if(lens[i] > 0) {
+      // Read only arrays cannot be resized
+      ASSERT(bit_array_resize(map, lens[i]+1) == 0 && errno == EPERM);
+      ASSERT(bit_array_length(map) == lens[i]);
+    }
+    bit_array_free(map);
+
+    // Copy on write: changes are not written to the file
+    map = bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_PRIVATE);
+    ASSERT(map != NULL);
+    ASSERT(bit_array_cmp(arr, map) == 0);
+    bit_array_toggle_all(map);
+    bit_array_not(arr, arr);
+    ASSERT(bit_array_cmp(arr, map) == 0);
+    bit_array_free(map);
+
+    map = bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_PRIVATE);
+    bit_array_not(arr, arr);
+    ASSERT(bit_array_cmp(arr, map) == 0);
+
+    // Grow past the end of the file
+    bit_array_resize(map, lens[i]*3+100);
+    bit_array_resize(arr, lens[i]*3+100);
+    bit_array_set(map, lens[i]*3+99);
+    bit_array_set(arr, lens[i]*3+99);
+    ASSERT(bit_array_cmp(arr, map) == 0);
+    bit_array_free(map);
   }
 
+  // Not a valid file
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  fputs("abc", f);
   fclose(f);
+  ASSERT(bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_RDONLY) == NULL);
+  ASSERT(errno == EINVAL);
 
-  ASSERT(bit_array_cmp(arr1, arr2) == 0);
-
-  if(bit_array_cmp(arr1, arr2) != 0 && bit_array_length(arr1) < 500)
-  {
-    // debug output
-    bit_index_t len = MAX(bit_array_length(arr1), bit_array_length(arr2));
-    char *tmp = (char*)malloc((len+1) * sizeof(char));
+  // Version 2 file truncated inside its header padding
+  bit_array_resize(arr, 1000000);
+  bit_array_random(arr, 0.5f);
+  f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_array_save_v2(arr, f);
+  fclose(f);
+  ASSERT(truncate(test_filename, 100) == 0);
+  errno = 0;
+  ASSERT(bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_RDONLY) == NULL);
+  ASSERT(errno == EINVAL);
+  ASSERT(bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_PRIVATE) == NULL);
 
-    printf("out: %s\n", bit_array_to_str(arr1, tmp));
-    printf("in : %s\n", bit_array_to_str(arr2, tmp));
+  bit_array_free(arr);
 
-    free(tmp);
-  }
+  SUITE_END();
 }
 
-void test_save_load()
+void test_mmap_shared()
 {
-  SUITE_START("load and save");
+  SUITE_START("mmap shared");
 
-  BIT_ARRAY* arr1 = bit_array_create(0);
-  BIT_ARRAY* arr2 = bit_array_create(0);
+  BIT_ARRAY *arr = bit_array_create(0), *map, *arr2 = bit_array_create(0);
+  bit_index_t i, len;
+  FILE *f;
 
-  // Empty array
-  _test_save_load(arr1, arr2);
+  remove(test_filename);
+  ASSERT(bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_SHARED) == NULL);
+  map = bit_array_mmap_open(test_filename,
+                            BIT_ARRAY_MMAP_SHARED | BIT_ARRAY_MMAP_CREATE);
+  ASSERT(map != NULL);
+  ASSERT(bit_array_length(map) == 0);
 
-  // Ten 0s
-  bit_array_resize(arr1, 10);
-  _test_save_load(arr1, arr2);
+  // Grow in steps, mapped array should match the heap array
+  for(len = 10; len < 2000000; len = len*3+7)
+  {
+    bit_array_resize(map, len);
+    bit_array_resize(arr, len);
+    for(i = 0; i < 100; i++) {
+      bit_index_t j = RAND(len-1);
+      bit_array_toggle(map, j);
+      bit_array_toggle(arr, j);
+    }
+    bit_array_set_region(map, len/3, len/4);
+    bit_array_set_region(arr, len/3, len/4);
+    ASSERT(bit_array_cmp(arr, map) == 0);
+    ASSERT(bit_array_sync_region(map, len/3, len/4));
+  }
 
-  // Thousand 1s:
-  bit_array_resize(arr1, 1000);
-  bit_array_set_all(arr1);
-  _test_save_load(arr1, arr2);
+  // Shrink
+  bit_array_resize(map, 123457);
+  bit_array_resize(arr, 123457);
+  bit_array_sync(map);
 
-  // 1100111010
-  bit_array_resize(arr1, 10);
-  bit_array_clear_bits(arr1, 4, 2,3,7,9);
-  _test_save_load(arr1, arr2);
+  // Synced file can be loaded while still mapped
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(bit_array_load(arr2, f));
+  fclose(f);
+  ASSERT(bit_array_cmp(arr, arr2) == 0);
+  bit_array_free(map);
 
-  // 100 x random lengths and bits
-  int i;
-  for(i = 0; i < 10; i++)
-  {
-    bit_array_resize(arr1, RAND(5000UL));
-    bit_array_random(arr1, 0.5f);
-    _test_save_load(arr1, arr2);
-  }
+  // Reopen and change
+  map = bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_SHARED);
+  ASSERT(map != NULL);
+  ASSERT(bit_array_cmp(arr, map) == 0);
+  bit_array_toggle_all(map);
+  bit_array_toggle_all(arr);
+  bit_array_free(map);
 
-  bit_array_free(arr1);
+  // Free leaves file in bit_array_save format
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(bit_array_load(arr2, f));
+  ASSERT(ftell(f) == 8 + (123457+7)/8);
+  ASSERT(fgetc(f) == EOF);
+  fclose(f);
+  ASSERT(bit_array_cmp(arr, arr2) == 0);
+
+  // Stale bytes after the payload are dropped on open, not used as capacity
+  f = fopen(test_filename, "a");
+  if(f == NULL) die("Couldn't open file to append: '%s'", test_filename);
+  for(i = 0; i < 10000; i++) fputc(0xff, f);
+  fclose(f);
+  map = bit_array_mmap_open(test_filename, BIT_ARRAY_MMAP_SHARED);
+  ASSERT(map != NULL && bit_array_cmp(arr, map) == 0);
+  ASSERT(map->capacity_in_words == map->num_of_words);
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(fseek(f, 0, SEEK_END) == 0 && ftell(f) == 8 + 8 * (long)map->num_of_words);
+  fclose(f);
+  bit_array_resize(map, 123457 + 50000);
+  bit_array_resize(arr, 123457 + 50000);
+  ASSERT(bit_array_cmp(arr, map) == 0);
+  bit_array_free(map);
+
+  bit_array_free(arr);
   bit_array_free(arr2);
 
   SUITE_END();
@@ -2471,6 +3501,919 @@ void test_get_set_bytes()
 // exercise short names. (some of them anyway)
 #include "bar.h"
 
+//
+// Allocators
+//
+
+typedef struct { long nallocs, nfrees, nbytes; } AllocStats;
+
+void* _count_alloc(size_t size, void *ctx)
+{
+  AllocStats *st = (AllocStats*)ctx;
+  st->nallocs++;
+  st->nbytes += (long)size;
+  return malloc(size);
+}
+
+void* _count_realloc(void *ptr, size_t old_size, size_t new_size, void *ctx)
+{
+  AllocStats *st = (AllocStats*)ctx;
+  st->nbytes += (long)new_size - (long)old_size;
+  return realloc(ptr, new_size);
+}
+
+void _count_free(void *ptr, size_t size, void *ctx)
+{
+  AllocStats *st = (AllocStats*)ctx;
+  st->nfrees++;
+  st->nbytes -= (long)size;
+  free(ptr);
+}
+
+// Counts like _count_alloc(), failing once fail_in more allocations or
+// reallocations have succeeded (never if fail_in < 0)
+typedef struct { AllocStats st; long fail_in; } FailStats;
+
+void* _fail_alloc(size_t size, void *ctx)
+{
+  FailStats *fs = (FailStats*)ctx;
+  if(fs->fail_in == 0) return NULL;
+  if(fs->fail_in > 0) fs->fail_in--;
+  return _count_alloc(size, &fs->st);
+}
+
+void* _fail_realloc(void *ptr, size_t old_size, size_t new_size, void *ctx)
+{
+  FailStats *fs = (FailStats*)ctx;
+  if(fs->fail_in == 0) return NULL;
+  if(fs->fail_in > 0) fs->fail_in--;
+  return _count_realloc(ptr, old_size, new_size, &fs->st);
+}
+
+void _fail_free(void *ptr, size_t size, void *ctx)
+{
+  _count_free(ptr, size, &((FailStats*)ctx)->st);
+}
+
+void test_allocator()
+{
+  SUITE_START("allocators");
+
+  AllocStats st1 = {0,0,0}, st2 = {0,0,0};
+  BIT_ARRAY_ALLOCATOR a1 = {_count_alloc, _count_realloc, _count_free, &st1};
+  BIT_ARRAY_ALLOCATOR a2 = {_count_alloc, _count_realloc, _count_free, &st2};
+  BIT_ARRAY *arr, *cpy, *x, *y;
+  BIT_ARRAY stack_arr;
+  char str[1000];
+
+  ASSERT(bit_array_get_allocator() == NULL);
+
+  // Per array allocator
+  arr = bit_array_create_with(100, &a1);
+  ASSERT(st1.nallocs == 2 && st1.nbytes > 0);
+  bit_array_resize(arr, 100000);
+  ASSERT(st1.nbytes >= 100000/8);
+  bit_array_random(arr, 0.5f);
+
+  // Copies and temporaries use the array's allocator
+  cpy = bit_array_clone(arr);
+  ASSERT(st1.nallocs == 4);
+  ASSERT(bit_array_cmp(arr, cpy) == 0);
+  bit_array_free(cpy);
+
+  bit_array_resize(arr, 200);
+  long before = st1.nallocs;
+  bit_array_to_decimal(arr, str, sizeof(str));
+  ASSERT(st1.nallocs == before + 2);
+
+  // Threaded save and load bookkeeping
+  int fd = open(test_filename, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if(fd == -1) die("Couldn't open file: '%s'", test_filename);
+  before = st1.nallocs;
+  long nbytes = st1.nbytes;
+  ASSERT(bit_array_save_fd(arr, fd, 2) > 0);
+  ASSERT(st1.nallocs == before + 2 && st1.nbytes == nbytes);
+  ASSERT(bit_array_load_fd(arr, fd, 2));
+  ASSERT(st1.nallocs > before + 2 && st1.nbytes == nbytes);
+  close(fd);
+
+  bit_array_free(arr);
+  ASSERT(st1.nbytes == 0 && st1.nallocs == st1.nfrees);
+
+  // Global default
+  bit_array_set_allocator(&a2);
+  ASSERT(bit_array_get_allocator() == &a2);
+  x = bit_array_create(10);
+  y = bit_array_create(10);
+  bit_array_alloc(&stack_arr, 1000);
+  bit_array_set_allocator(NULL);
+  ASSERT(st2.nallocs == 5);
+
+  bit_array_from_decimal(x, "12345678901234567890");
+  bit_array_from_decimal(y, "98765432109876543210");
+  bit_array_multiply(x, x, y);
+  bit_array_to_decimal(x, str, sizeof(str));
+  ASSERT(strcmp(str, "1219326311370217952237463801111263526900") == 0);
+  bit_array_resize(&stack_arr, 100000);
+
+  bit_array_free(x);
+  bit_array_free(y);
+  bit_array_dealloc(&stack_arr);
+  ASSERT(st2.nbytes == 0 && st2.nallocs == st2.nfrees);
+
+  SUITE_END();
+}
+
+void test_stream_fill()
+{
+  SUITE_START("streaming fills");
+
+  bit_index_t n = 1000000, i, start, len;
+  BIT_ARRAY *arr = bit_array_create(n), *cmp = bit_array_create(n);
+  BIT_ARRAY_RNG rng;
+  size_t threshold = bit_array_get_stream_threshold();
+
+  ASSERT(threshold > 0);
+  bit_array_rng_seed(&rng, 7);
+
+  for(i = 0; i < 200; i++)
+  {
+    start = bit_array_rng_next(&rng) % n;
+    len = bit_array_rng_next(&rng) % (n - start);
+
+    // Same operation with and without streaming stores
+    bit_array_set_stream_threshold(i & 1 ? 64 : 1);
+    switch(i % 6) {
+      case 0: bit_array_set_region(arr, start, len); break;
+      case 1: bit_array_clear_region(arr, start, len); break;
+      case 2: bit_array_toggle_region(arr, start, len); break;
+      case 3: bit_array_toggle_all(arr); break;
+      case 4: bit_array_random_r(arr, 0.5f, &rng); break;
+      case 5: bit_array_set_all(arr); break;
+    }
+    bit_array_set_stream_threshold(0);
+    switch(i % 6) {
+      case 0: bit_array_set_region(cmp, start, len); break;
+      case 1: bit_array_clear_region(cmp, start, len); break;
+      case 2: bit_array_toggle_region(cmp, start, len); break;
+      case 3: bit_array_toggle_all(cmp); break;
+      case 4: bit_array_copy_all(cmp, arr); break;
+      case 5: bit_array_set_all(cmp); break;
+    }
+    ASSERT(bit_array_cmp(arr, cmp) == 0);
+  }
+
+  bit_array_set_stream_threshold(64);
+  bit_array_clear_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == 0);
+  bit_array_set_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == n);
+
+  bit_array_set_stream_threshold(threshold);
+  bit_array_free(arr);
+  bit_array_free(cmp);
+
+  SUITE_END();
+}
+
+void test_lazy_zero()
+{
+  SUITE_START("lazy zeroing of large arrays");
+
+  BIT_ARRAY *arr;
+  bit_index_t i, n = 40000000, idx;
+
+  ASSERT(bit_array_get_lazy_zero_threshold() == BIT_ARRAY_LAZY_ZERO_DEFAULT);
+  bit_array_set_lazy_zero_threshold(1<<20);
+
+  arr = bit_array_create(1000);
+  ASSERT(arr->storage == BIT_ARRAY_HEAP);
+  bit_array_set_all(arr);
+  bit_array_resize(arr, n);
+  ASSERT(arr->storage == BIT_ARRAY_ANON);
+  ASSERT(bit_array_num_bits_set(arr) == 1000);
+
+  // Clearing hands pages back, the edges are cleared with memset
+  bit_array_set_all(arr);
+  bit_array_clear_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == 0);
+  ASSERT(!bit_array_find_first_set_bit(arr, &idx));
+  for(i = 0; i < n; i += 1000003) bit_array_set(arr, i);
+  ASSERT(bit_array_num_bits_set(arr) == n / 1000003 + 1);
+  bit_array_clear_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == 0);
+
+  // Shrinking zeros the words dropped
+  bit_array_set_all(arr);
+  bit_array_resize(arr, 12345);
+  bit_array_resize(arr, n);
+  ASSERT(bit_array_num_bits_set(arr) == 12345);
+  ASSERT(bit_array_find_last_set_bit(arr, &idx) && idx == 12344);
+  bit_array_free(arr);
+
+  // Disabled
+  bit_array_set_lazy_zero_threshold(0);
+  arr = bit_array_create(n);
+  ASSERT(arr->storage == BIT_ARRAY_HEAP);
+  bit_array_set_all(arr);
+  bit_array_clear_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == 0);
+  bit_array_free(arr);
+
+  bit_array_set_lazy_zero_threshold(BIT_ARRAY_LAZY_ZERO_DEFAULT);
+
+  SUITE_END();
+}
+
+void test_capacity()
+{
+  SUITE_START("reserve, shrink_to_fit and growth policy");
+
+  BIT_ARRAY *arr = bit_array_create(100);
+  bit_index_t i;
+  word_addr_t cap;
+
+  // Reserve doesn't change the length
+  ASSERT(bit_array_reserve(arr, 64*1000));
+  ASSERT(arr->capacity_in_words == 1000);
+  ASSERT(bit_array_length(arr) == 100);
+  ASSERT(bit_array_reserve(arr, 10));
+  ASSERT(arr->capacity_in_words == 1000);
+  bit_array_set(arr, 99);
+  bit_array_resize(arr, 64*1000);
+  ASSERT(arr->capacity_in_words == 1000);
+  ASSERT(bit_array_num_bits_set(arr) == 1 && bit_array_get(arr, 99));
+
+  // Shrink keeps the data
+  bit_array_set_region(arr, 100, 200);
+  bit_array_resize(arr, 250);
+  ASSERT(arr->capacity_in_words == 1000);
+  ASSERT(bit_array_shrink_to_fit(arr));
+  ASSERT(arr->capacity_in_words == 4);
+  ASSERT(bit_array_num_bits_set(arr) == 151);
+  bit_array_resize(arr, 10000);
+  ASSERT(bit_array_num_bits_set(arr) == 151);
+
+  bit_array_resize(arr, 0);
+  ASSERT(bit_array_shrink_to_fit(arr));
+  ASSERT(arr->capacity_in_words == 1);
+
+  // Growth policies
+  bit_array_set_growth(arr, BIT_ARRAY_GROW_EXACT);
+  bit_array_resize(arr, 64*10+1);
+  ASSERT(arr->capacity_in_words == 11);
+
+  bit_array_set_growth(arr, BIT_ARRAY_GROW_1_5X);
+  bit_array_resize(arr, 64*12);
+  ASSERT(arr->capacity_in_words == 16);
+  bit_array_resize(arr, 64*17);
+  ASSERT(arr->capacity_in_words == 24);
+  bit_array_resize(arr, 64*100);
+  ASSERT(arr->capacity_in_words == 100);
+
+  bit_array_set_growth(arr, BIT_ARRAY_GROW_POW2);
+  bit_array_resize(arr, 64*101);
+  ASSERT(arr->capacity_in_words == 128);
+
+  // Auto-resizing functions follow the policy too
+  bit_array_set_growth(arr, BIT_ARRAY_GROW_EXACT);
+  bit_array_clear_all(arr);
+  for(i = 0; i < 20000; i++) bit_array_rset(arr, i);
+  ASSERT(arr->capacity_in_words == 20000/64+1);
+  ASSERT(bit_array_num_bits_set(arr) == 20000);
+  bit_array_free(arr);
+
+  // Huge page backed arrays shrink in place, then move back to the heap
+  bit_array_set_hugepage_threshold(1<<16);
+  arr = bit_array_create(50000000);
+  ASSERT(arr->storage == BIT_ARRAY_ANON);
+  bit_array_set_region(arr, 0, 100);
+  bit_array_resize(arr, 10000000);
+  ASSERT(bit_array_shrink_to_fit(arr));
+  cap = arr->capacity_in_words;
+  ASSERT(arr->storage == BIT_ARRAY_ANON && cap < 50000000/64);
+  bit_array_resize(arr, 1000);
+  ASSERT(bit_array_shrink_to_fit(arr));
+  ASSERT(arr->storage == BIT_ARRAY_HEAP && arr->capacity_in_words == 16);
+  ASSERT(bit_array_num_bits_set(arr) == 100);
+  bit_array_set_hugepage_threshold(0);
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
+void test_small_arrays()
+{
+  SUITE_START("compact and small buffer arrays");
+
+  AllocStats st = {0,0,0};
+  BIT_ARRAY_ALLOCATOR a = {_count_alloc, _count_realloc, _count_free, &st};
+  BIT_ARRAY_SMALL small1, small2;
+  BIT_ARRAY *arr, *x, *y;
+  bit_index_t i;
+  char str[200];
+
+  // One allocation for struct and words
+  bit_array_set_allocator(&a);
+  for(i = 0; i < 300; i += 37) {
+    arr = bit_array_create_compact(i);
+    ASSERT(st.nallocs == 1);
+    ASSERT(arr->storage == BIT_ARRAY_INLINE);
+    ASSERT((void*)arr->words == (void*)(arr + 1));
+    ASSERT(bit_array_num_bits_set(arr) == 0);
+    bit_array_set_all(arr);
+    ASSERT(bit_array_num_bits_set(arr) == i);
+    bit_array_free(arr);
+    ASSERT(st.nbytes == 0 && st.nfrees == 1);
+    st.nallocs = st.nfrees = 0;
+  }
+
+  // Words move to the heap when it grows
+  arr = bit_array_create_compact(100);
+  bit_array_set_region(arr, 10, 80);
+  bit_array_resize(arr, 10000);
+  ASSERT(arr->storage == BIT_ARRAY_HEAP);
+  ASSERT(bit_array_num_bits_set(arr) == 80);
+  bit_array_rset(arr, 20000);
+  ASSERT(bit_array_num_bits_set(arr) == 81);
+  bit_array_free(arr);
+  ASSERT(st.nbytes == 0 && st.nallocs == st.nfrees);
+  bit_array_set_allocator(NULL);
+
+  // Small buffer, no allocation
+  x = bit_array_alloc_small(&small1, 100);
+  y = bit_array_alloc_small(&small2, 128);
+  ASSERT(x->words == small1.buf && y->words == small2.buf);
+  ASSERT(x->storage == BIT_ARRAY_INLINE);
+  bit_array_from_str(x, "1011");
+  bit_array_copy(y, 64, x, 0, 100);
+  ASSERT(bit_array_num_bits_set(y) == 3);
+  bit_array_shift_left(y, 3, 0);
+  bit_array_xor(y, y, y);
+  ASSERT(bit_array_num_bits_set(y) == 0);
+  bit_array_resize(x, 4);
+  ASSERT(strcmp(bit_array_to_str(x, str), "1011") == 0);
+  bit_array_resize(x, 129);
+  ASSERT(x->storage == BIT_ARRAY_HEAP);
+  ASSERT(strncmp(bit_array_to_str(x, str), "1011000", 7) == 0);
+  bit_array_dealloc(x);
+  bit_array_dealloc(y);
+
+  // Too big for the buffer
+  x = bit_array_alloc_small(&small1, 200);
+  ASSERT(x->storage == BIT_ARRAY_HEAP && x->words != small1.buf);
+  bit_array_set_all(x);
+  ASSERT(bit_array_num_bits_set(x) == 200);
+  bit_array_dealloc(x);
+
+  SUITE_END();
+}
+
+void test_pool()
+{
+  SUITE_START("array pools");
+
+  AllocStats st = {0,0,0};
+  BIT_ARRAY_ALLOCATOR a = {_count_alloc, _count_realloc, _count_free, &st};
+  BIT_ARRAY_POOL *pool;
+  BIT_ARRAY *arrs[10], *arr;
+  size_t i;
+
+  bit_array_set_allocator(&a);
+  pool = bit_array_pool_create(100, 4);
+  bit_array_set_allocator(NULL);
+
+  for(i = 0; i < 10; i++) {
+    arrs[i] = bit_array_pool_get(pool);
+    ASSERT(bit_array_length(arrs[i]) == 100);
+    ASSERT(bit_array_num_bits_set(arrs[i]) == 0);
+    bit_array_set_region(arrs[i], 0, i+1);
+  }
+
+  // Arrays in the same slab are next to each other
+  ASSERT((char*)arrs[1] - (char*)arrs[0] == (char*)arrs[2] - (char*)arrs[1]);
+  ASSERT((void*)arrs[0]->words == (void*)(arrs[0] + 1));
+  ASSERT((void*)(arrs[0]->words + 2) == (void*)arrs[1]);
+  for(i = 0; i < 10; i++) ASSERT(bit_array_num_bits_set(arrs[i]) == i+1);
+
+  // Returned arrays are reused and come back zeroed
+  bit_array_pool_put(pool, arrs[3]);
+  bit_array_pool_put(pool, arrs[7]);
+  arr = bit_array_pool_get(pool);
+  ASSERT(arr == arrs[7] && bit_array_num_bits_set(arr) == 0);
+  arr = bit_array_pool_get(pool);
+  ASSERT(arr == arrs[3] && bit_array_num_bits_set(arr) == 0);
+
+  // Resized arrays move their words to the heap
+  bit_array_resize(arrs[5], 100000);
+  bit_array_set(arrs[5], 99999);
+  ASSERT(arrs[5]->storage == BIT_ARRAY_HEAP);
+  ASSERT(bit_array_num_bits_set(arrs[5]) == 7);
+  bit_array_resize(arrs[6], 1000);
+  bit_array_pool_put(pool, arrs[6]);
+  arr = bit_array_pool_get(pool);
+  ASSERT(arr == arrs[6] && arr->storage == BIT_ARRAY_INLINE);
+  ASSERT(bit_array_length(arr) == 100);
+
+  // Bulk reset reuses slabs from the start
+  bit_array_pool_reset(pool);
+  long nallocs = st.nallocs;
+  arr = bit_array_pool_get(pool);
+  ASSERT(arr == arrs[0] && bit_array_num_bits_set(arr) == 0);
+  ASSERT(st.nallocs == nallocs);
+
+  bit_array_resize(arr, 5000);
+  bit_array_pool_free(pool);
+  ASSERT(st.nbytes == 0 && st.nallocs == st.nfrees);
+
+  SUITE_END();
+}
+
+// Run an operation that needs to enlarge view in a child process. Returns 1
+// if the child aborted
+static char _enlarging_view_aborts(BIT_ARRAY *view, BIT_ARRAY *src, int op)
+{
+  pid_t pid = fork();
+  int status;
+  if(pid == 0) {
+    if(freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+    switch(op) {
+      case 0: bit_array_or(view, view, src); break;
+      case 1: bit_array_copy_all(view, src); break;
+      case 2: bit_array_rset(view, 99); break;
+      default: bit_array_add(view, view, src); break;
+    }
+    _exit(0);
+  }
+  return pid > 0 && waitpid(pid, &status, 0) == pid &&
+         WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+void test_wrap()
+{
+  SUITE_START("views of external buffers");
+
+  word_t buf[4] = {0x1, 0x0, 0xff, 0xffffffffffffffffULL}, other[2] = {0,0};
+  BIT_ARRAY view, ro, *arr, *cpy;
+  bit_index_t idx;
+  int i;
+
+  // Unused top bits are cleared
+  arr = bit_array_wrap(&view, buf, 200, 0);
+  ASSERT(arr == &view && arr->words == buf);
+  ASSERT(buf[3] == 0xff);
+  ASSERT(bit_array_num_bits_set(arr) == 17);
+
+  // Changes go straight to the buffer
+  bit_array_set(arr, 64);
+  ASSERT(buf[1] == 1);
+  bit_array_clear_region(arr, 128, 72);
+  ASSERT(buf[2] == 0 && buf[3] == 0);
+  bit_array_toggle_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == 198);
+  bit_array_shift_left(arr, 1, 0);
+  ASSERT(bit_array_find_first_set_bit(arr, &idx) && idx == 2);
+
+  cpy = bit_array_clone(arr);
+  ASSERT(cpy->storage == BIT_ARRAY_HEAP && bit_array_cmp(cpy, arr) == 0);
+  bit_array_resize(cpy, 1000);
+
+  // Can't resize, free or grow
+  errno = 0;
+  ASSERT(!bit_array_resize(arr, 300));
+  ASSERT(errno == EPERM && bit_array_length(arr) == 200);
+  ASSERT(!bit_array_reserve(arr, 300) && errno == EPERM);
+  ASSERT(bit_array_resize(arr, 200));
+  ASSERT(bit_array_shrink_to_fit(arr));
+  errno = 0;
+  bit_array_free(arr);
+  ASSERT(errno == EPERM && view.words == buf);
+  bit_array_free(cpy);
+
+  // Read only views need zeroed top bits
+  other[1] = 0x10;
+  errno = 0;
+  ASSERT(bit_array_wrap(&ro, other, 68, BIT_ARRAY_WRAP_RDONLY) == NULL);
+  ASSERT(errno == EINVAL);
+  arr = bit_array_wrap(&ro, other, 70, BIT_ARRAY_WRAP_RDONLY);
+  ASSERT(arr != NULL && bit_array_num_bits_set(arr) == 1);
+  ASSERT(!bit_array_resize(arr, 10) && errno == EPERM);
+
+  // Writing to a read only view aborts
+  pid_t pid = fork();
+  int status;
+  if(pid == 0) {
+    if(freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+    bit_array_set_bit(arr, 3);
+    _exit(0);
+  }
+  ASSERT(pid > 0 && waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  ASSERT(other[0] == 0);
+
+  // Used as the source of other operations
+  bit_array_wrap(&view, buf, 70, 0);
+  bit_array_and(&view, &view, arr);
+  ASSERT(bit_array_num_bits_set(&view) == 1 && bit_array_get(&view, 68));
+
+  // Operations that would enlarge a view abort
+  cpy = bit_array_create(100);
+  bit_array_set_all(cpy);
+  for(i = 0; i < 4; i++) ASSERT(_enlarging_view_aborts(&view, cpy, i));
+  ASSERT(bit_array_num_bits_set(&view) == 1);
+  bit_array_resize(cpy, 70);
+  bit_array_xor(&view, &view, cpy);
+  ASSERT(bit_array_num_bits_set(&view) == 69);
+  bit_array_free(cpy);
+
+  bit_array_dealloc(&view);
+  bit_array_dealloc(&ro);
+  ASSERT(buf[1] == 0x2f);
+
+  // An empty view does not touch its buffer
+  other[0] = 0xab;
+  arr = bit_array_wrap(&view, other, 0, 0);
+  ASSERT(arr != NULL && bit_array_length(arr) == 0);
+  bit_array_clear_all(arr);
+  bit_array_not(arr, arr);
+  ASSERT(other[0] == 0xab);
+  ASSERT(bit_array_wrap(&ro, other, 0, BIT_ARRAY_WRAP_RDONLY) != NULL);
+  ASSERT(bit_array_num_bits_set(&ro) == 0);
+
+  ASSERT(bit_array_wrap(&view, NULL, 10, 0) == NULL);
+
+  SUITE_END();
+}
+
+// Copy a slice into its own array
+static void _slice_copy(BIT_ARRAY *dst, BIT_ARRAY_SLICE s)
+{
+  bit_array_resize(dst, s.len);
+  bit_array_copy(dst, 0, s.arr, s.start, s.len);
+}
+
+void test_slices()
+{
+  SUITE_START("slices");
+
+  bit_index_t n = 3000, i, off, r1, r2;
+  BIT_ARRAY *arr = bit_array_create(n), *sparse = bit_array_create(n);
+  BIT_ARRAY *c1 = bit_array_create(0), *c2 = bit_array_create(0);
+  BIT_ARRAY *d1 = bit_array_create(0), *d2 = bit_array_create(0);
+  BIT_ARRAY_SLICE s1, s2;
+  BIT_ARRAY_RNG rng;
+  char str1[1000], str2[1000];
+  char f1, f2;
+
+  bit_array_rng_seed(&rng, 47);
+  bit_array_random_r(arr, 0.5f, &rng);
+  for(i = 0; i < n; i += 1 + bit_array_rng_next(&rng) % 200)
+    bit_array_set(sparse, i);
+
+  for(i = 0; i < 500; i++)
+  {
+    BIT_ARRAY *src = i & 1 ? sparse : arr;
+    bit_index_t start = bit_array_rng_next(&rng) % n;
+    bit_index_t len = bit_array_rng_next(&rng) % MIN(n - start, 900);
+    if(i % 50 == 0) { start &= ~(bit_index_t)63; len = MIN(n - start, 640); }
+
+    s1 = bit_array_slice(src, start, len);
+    _slice_copy(c1, s1);
+
+    ASSERT(bit_array_slice_num_bits_set(s1) == bit_array_num_bits_set(c1));
+    ASSERT(bit_array_slice_hash(s1, 5) == bit_array_hash(c1, 5));
+    if(len < 900) {
+      bit_array_slice_to_hex(s1, str1, 0);
+      bit_array_to_hex(c1, 0, len, str2, 0);
+      ASSERT(strcmp(str1, str2) == 0);
+    }
+
+    off = len ? bit_array_rng_next(&rng) % len : 0;
+    r1 = r2 = 7777;
+    if(len > 0) {
+      f1 = bit_array_slice_find_next_set_bit(s1, off, &r1);
+      f2 = bit_array_find_next_set_bit(c1, off, &r2);
+      ASSERT(f1 == f2 && r1 == r2);
+      f1 = bit_array_slice_find_next_clear_bit(s1, off, &r1);
+      f2 = bit_array_find_next_clear_bit(c1, off, &r2);
+      ASSERT(f1 == f2 && r1 == r2);
+      f1 = bit_array_slice_find_prev_set_bit(s1, off, &r1);
+      f2 = bit_array_find_prev_set_bit(c1, off, &r2);
+      ASSERT(f1 == f2 && r1 == r2);
+      f1 = bit_array_slice_find_prev_clear_bit(s1, off, &r1);
+      f2 = bit_array_find_prev_clear_bit(c1, off, &r2);
+      ASSERT(f1 == f2 && r1 == r2);
+    }
+
+    // Two slices
+    bit_index_t start2 = bit_array_rng_next(&rng) % n;
+    bit_index_t len2 = bit_array_rng_next(&rng) % (n - start2);
+    s2 = bit_array_slice(arr, start2, len2);
+    _slice_copy(c2, s2);
+
+    int cmp1 = bit_array_slice_cmp(s1, s2), cmp2 = bit_array_cmp(c1, c2);
+    // bit_array_cmp() only orders arrays with more words correctly when the
+    // longer one is first
+    if(bit_array_num_bits_set(c2) == 0 && bit_array_num_bits_set(c1) == 0) {
+      ASSERT(cmp1 == (len == len2 ? 0 : (len > len2 ? 1 : -1)));
+    }
+    else if(len2 <= len) {
+      ASSERT(cmp1 == cmp2);
+    }
+    ASSERT(bit_array_slice_cmp(s1, s1) == 0);
+    ASSERT(bit_array_slice_cmp(s2, s1) == -cmp1);
+
+    bit_array_resize(d1, 0);
+    bit_array_resize(d2, 0);
+    switch(i % 4) {
+      case 0: bit_array_slice_and(d1, s1, s2); bit_array_and(d2, c1, c2); break;
+      case 1: bit_array_slice_or(d1, s1, s2); bit_array_or(d2, c1, c2); break;
+      case 2: bit_array_slice_xor(d1, s1, s2); bit_array_xor(d2, c1, c2); break;
+      case 3: bit_array_slice_not(d1, s1); bit_array_not(d2, c1); break;
+    }
+    ASSERT(bit_array_length(d1) == bit_array_length(d2));
+    ASSERT(bit_array_cmp(d1, d2) == 0);
+  }
+
+  // Destination can be the source array
+  bit_array_copy_all(c1, arr);
+  _slice_copy(c2, bit_array_slice(arr, 100, 1000));
+  bit_array_slice_not(c1, bit_array_slice(c1, 100, 1000));
+  bit_array_not(c2, c2);
+  ASSERT(bit_array_cmp(c1, c2) == 0);
+  bit_array_copy_all(c1, arr);
+  _slice_copy(c2, bit_array_slice(arr, 30, 2000));
+  bit_array_slice_xor(c1, bit_array_slice(c1, 30, 2000),
+                      bit_array_slice(sparse, 0, 1500));
+  _slice_copy(d1, bit_array_slice(sparse, 0, 1500));
+  bit_array_xor(c2, c2, d1);
+  ASSERT(bit_array_length(c1) == n);
+  bit_array_resize(c1, 2000);
+  ASSERT(bit_array_cmp(c1, c2) == 0);
+
+  bit_array_free(arr);
+  bit_array_free(sparse);
+  bit_array_free(c1);
+  bit_array_free(c2);
+  bit_array_free(d1);
+  bit_array_free(d2);
+
+  SUITE_END();
+}
+
+// Number of memory mappings in this process, or 0 if unknown
+static long _count_maps()
+{
+  FILE *f = fopen("/proc/self/maps", "r");
+  long n = 0;
+  int c;
+  if(f == NULL) return 0;
+  while((c = fgetc(f)) != EOF) n += (c == '\n');
+  fclose(f);
+  return n;
+}
+
+typedef struct
+{
+  const BIT_ARRAY *snap;
+  bit_index_t nbits_set;
+  volatile int stop;
+  long nreads, nbad;
+} SnapReader;
+
+static void* _snap_reader(void *ptr)
+{
+  SnapReader *r = (SnapReader*)ptr;
+  do {
+    r->nbad += (bit_array_num_bits_set(r->snap) != r->nbits_set);
+    r->nreads++;
+  } while(!r->stop || r->nreads < 2);
+  return NULL;
+}
+
+void test_snapshots()
+{
+  SUITE_START("copy-on-write snapshots");
+
+  bit_index_t n = 3 * BIT_ARRAY_SNAPSHOT_CHUNK * 8 + 100;
+  BIT_ARRAY *arr = bit_array_create(n), *other = bit_array_create(n);
+  BIT_ARRAY *s1, *s2, *c1, *c2, view;
+  BIT_ARRAY_RNG rng;
+  word_t buf[2] = {0,0};
+  long i;
+
+  bit_array_rng_seed(&rng, 7);
+  bit_array_random_r(arr, 0.5, &rng);
+  bit_array_random_r(other, 0.5, &rng);
+  c1 = bit_array_clone(arr);
+
+  s1 = bit_array_snapshot(arr);
+  if(s1 == NULL) {
+    // Not supported on this system
+    ASSERT(errno == ENOTSUP);
+    bit_array_free(arr);
+    bit_array_free(other);
+    bit_array_free(c1);
+    SUITE_END();
+    return;
+  }
+
+  ASSERT(arr->storage == BIT_ARRAY_COW && s1->storage == BIT_ARRAY_SNAPSHOT);
+  ASSERT(bit_array_cmp(s1, c1) == 0 && bit_array_cmp(arr, c1) == 0);
+
+  // Changes to arr are not seen by the snapshot
+  bit_array_set_bit(arr, 5);
+  bit_array_toggle_bit(arr, n-1);
+  bit_array_clear_region(arr, 1000, 100000);
+  ASSERT(bit_array_cmp(s1, c1) == 0);
+  ASSERT(bit_array_get(arr, 5) && !bit_array_get(arr, 1000));
+
+  // Nor are changes made with the macros, in a chunk still shared
+  bit_array_toggle(arr, 2 * BIT_ARRAY_SNAPSHOT_CHUNK * 8 + 7);
+  bit_array_assign(arr, 2 * BIT_ARRAY_SNAPSHOT_CHUNK * 8 + 9, 1);
+  ASSERT(bit_array_cmp(s1, c1) == 0);
+  ASSERT(bit_array_get(arr, 2 * BIT_ARRAY_SNAPSHOT_CHUNK * 8 + 9));
+
+  c2 = bit_array_clone(arr);
+  s2 = bit_array_snapshot(arr);
+  ASSERT(bit_array_cmp(s2, c2) == 0);
+
+  bit_array_xor(arr, arr, other);
+  bit_array_resize(arr, 2 * n);
+  bit_array_set_all(arr);
+  ASSERT(bit_array_cmp(s1, c1) == 0 && bit_array_cmp(s2, c2) == 0);
+  ASSERT(bit_array_num_bits_set(arr) == 2 * n);
+
+  // Snapshots are read only
+  ASSERT(!bit_array_resize(s1, 10) && errno == EPERM);
+  ASSERT(bit_array_snapshot(s1) == NULL && errno == ENOTSUP);
+
+  // Free the array before its snapshots, then in either order
+  bit_array_free(arr);
+  ASSERT(bit_array_cmp(s1, c1) == 0 && bit_array_cmp(s2, c2) == 0);
+  bit_array_free(s1);
+  ASSERT(bit_array_cmp(s2, c2) == 0);
+  bit_array_free(s2);
+
+  arr = bit_array_clone(c1);
+  s1 = bit_array_snapshot(arr);
+  s2 = bit_array_snapshot(arr);
+  bit_array_free(s1);
+  bit_array_clear_all(arr);
+  ASSERT(bit_array_cmp(s2, c1) == 0);
+  bit_array_free(s2);
+  bit_array_set_bit(arr, 0);
+  ASSERT(bit_array_num_bits_set(arr) == 1);
+  bit_array_free(arr);
+
+  // Views can't be shared
+  bit_array_wrap(&view, buf, 100, 0);
+  ASSERT(bit_array_snapshot(&view) == NULL && errno == ENOTSUP);
+  ASSERT(!bit_array_prepare_snapshots(&view) && errno == ENOTSUP);
+
+  // Built in shared memory from the start. Copying chunks for a snapshot does
+  // not split its mapping
+  arr = bit_array_create(0);
+  ASSERT(bit_array_prepare_snapshots(arr) && arr->storage == BIT_ARRAY_COW);
+  bit_array_resize(arr, 256 * BIT_ARRAY_SNAPSHOT_CHUNK * 8);
+  bit_array_random_r(arr, 0.5, &rng);
+  bit_array_free(c2);
+  c2 = bit_array_clone(arr);
+  s1 = bit_array_snapshot(arr);
+  long nmaps = _count_maps();
+  for(i = 0; i < 256; i++)
+    bit_array_toggle_bit(arr, i * BIT_ARRAY_SNAPSHOT_CHUNK * 8 + 3);
+  ASSERT(_count_maps() <= nmaps + 2);
+  ASSERT(bit_array_cmp(s1, c2) == 0 && bit_array_cmp(arr, c2) != 0);
+  bit_array_free(s1);
+
+  // Another thread reads a snapshot while the array is changed
+  SnapReader reader = {NULL, 0, 0, 0, 0};
+  pthread_t thread;
+  bit_array_free(c2);
+  c2 = bit_array_clone(arr);
+  reader.snap = s1 = bit_array_snapshot(arr);
+  reader.nbits_set = bit_array_num_bits_set(arr);
+  ASSERT(pthread_create(&thread, NULL, _snap_reader, &reader) == 0);
+  for(i = 0; i < 4 * 256; i++) {
+    bit_array_toggle_bit(arr, (i % 256) * BIT_ARRAY_SNAPSHOT_CHUNK * 8 + i);
+    if(i % 256 == 0) bit_array_shift_left(arr, 1, 1);
+  }
+  reader.stop = 1;
+  ASSERT(pthread_join(thread, NULL) == 0);
+  ASSERT(reader.nbad == 0 && reader.nreads >= 2);
+  ASSERT(bit_array_cmp(s1, c2) == 0);
+
+  // Writing to a snapshot aborts
+  pid_t pid = fork();
+  int status;
+  if(pid == 0) {
+    if(freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+    bit_array_set_bit(s1, 3);
+    _exit(0);
+  }
+  ASSERT(pid > 0 && waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  bit_array_free(s1);
+  bit_array_free(arr);
+
+  // Running out of memory at each step frees what was allocated. Growing the
+  // array first means the chunk counts are reallocated
+  FailStats fs = {{0,0,0}, -1};
+  BIT_ARRAY_ALLOCATOR fa = {_fail_alloc, _fail_realloc, _fail_free, &fs};
+  long nbytes;
+  arr = bit_array_create_with(n, &fa);
+  bit_array_free(bit_array_snapshot(arr));
+  bit_array_resize(arr, 2 * n);
+  for(i = 0; ; i++) {
+    nbytes = fs.st.nbytes;
+    fs.fail_in = i;
+    s1 = bit_array_snapshot(arr);
+    fs.fail_in = -1;
+    if(s1 != NULL) break;
+    ASSERT(errno == ENOMEM && fs.st.nbytes == nbytes);
+  }
+  ASSERT(i == 4);
+  bit_array_free(s1);
+  bit_array_free(arr);
+  ASSERT(fs.st.nbytes == 0);
+
+  bit_array_free(other);
+  bit_array_free(c1);
+  bit_array_free(c2);
+
+  SUITE_END();
+}
+
+void test_hugepages()
+{
+  SUITE_START("aligned and huge page storage");
+
+  BIT_ARRAY *arr, *cpy;
+  bit_index_t i, n = 3000000;
+
+  // Default allocator gives cache line aligned words
+  for(i = 0; i < 200; i += 7) {
+    arr = bit_array_create(i);
+    ASSERT(((size_t)arr->words & (BIT_ARRAY_ALIGN-1)) == 0);
+    bit_array_resize(arr, i*1000);
+    ASSERT(((size_t)arr->words & (BIT_ARRAY_ALIGN-1)) == 0);
+    bit_array_free(arr);
+  }
+
+  ASSERT(bit_array_get_hugepage_threshold() == 0);
+  bit_array_set_hugepage_threshold(1<<16);
+
+  // Moved into an anonymous mapping when growing past the threshold
+  arr = bit_array_create(1000);
+  ASSERT(arr->storage == BIT_ARRAY_HEAP);
+  for(i = 0; i < 1000; i += 3) bit_array_set(arr, i);
+  bit_array_resize(arr, n);
+  ASSERT(arr->storage == BIT_ARRAY_ANON);
+  ASSERT(((size_t)arr->words & (BIT_ARRAY_ALIGN-1)) == 0);
+  ASSERT(bit_array_num_bits_set(arr) == 334);
+  ASSERT(bit_array_find_last_set_bit(arr, &i) && i == 999);
+
+  // Grown with mremap, new bits are zero
+  bit_array_set_region(arr, 0, n);
+  bit_array_resize(arr, 4*n);
+  ASSERT(arr->storage == BIT_ARRAY_ANON);
+  ASSERT(bit_array_num_bits_set(arr) == n);
+  bit_array_resize(arr, 10);
+  bit_array_resize(arr, 2*n);
+  ASSERT(bit_array_num_bits_set(arr) == 10);
+
+  cpy = bit_array_clone(arr);
+  ASSERT(cpy->storage == BIT_ARRAY_ANON);
+  ASSERT(bit_array_cmp(arr, cpy) == 0);
+
+  // Growing two mappings in turn moves them, they stay huge page aligned
+  for(i = 1; i <= 8; i++) {
+    bit_array_resize(arr, 2*n + i * (1<<24));
+    bit_array_resize(cpy, 2*n + i * (1<<24));
+    ASSERT(((size_t)arr->words & ((1<<21)-1)) == 0);
+    ASSERT(((size_t)cpy->words & ((1<<21)-1)) == 0);
+  }
+  ASSERT(bit_array_num_bits_set(arr) == 10 && bit_array_cmp(arr, cpy) == 0);
+  bit_array_free(cpy);
+  bit_array_free(arr);
+
+  // Created directly in a mapping
+  arr = bit_array_create(n);
+  ASSERT(arr->storage == BIT_ARRAY_ANON);
+  ASSERT(bit_array_num_bits_set(arr) == 0);
+  bit_array_set_all(arr);
+  ASSERT(bit_array_num_bits_set(arr) == n);
+  bit_array_free(arr);
+
+  bit_array_set_hugepage_threshold(0);
+  arr = bit_array_create(n);
+  ASSERT(arr->storage == BIT_ARRAY_HEAP);
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
 void test_bar_wrapper()
 {
   SUITE_START("testing bar wrapper");
@@ -2622,7 +4565,18 @@ int main(int argc, char* argv[])
   test_first_last_bit_set();
   test_next_prev_bit_set();
   test_hamming_weight();
+  test_hash();
+  test_rollhash();
   test_save_load();
+  test_save_load_v2();
+  test_save_load_compressed();
+  test_delta();
+  test_dirty();
+  test_save_load_fd();
+  test_save_load_range();
+  test_aio();
+  test_mmap_open();
+  test_mmap_shared();
 
   test_hex_functions();
   test_string_functions();
@@ -2644,15 +4598,26 @@ int main(int argc, char* argv[])
   test_small_products();
   test_product_divide();
 
+  test_allocator();
+  test_small_arrays();
+  test_pool();
+  test_wrap();
+  test_slices();
+  test_snapshots();
+  test_hugepages();
+  test_capacity();
+  test_lazy_zero();
+  test_stream_fill();
   test_bar_wrapper();
 
   // slooow
   test_next_permutation();
+  test_random();
+  test_random_seeded();
+  test_random_k();
+  test_shuffle_density();
   test_random_and_shuffle();
 
-  // Tests that need re-writing
-  // test_hash();
-
   // To do
   // test_crc();
   // test_multiple_actions();